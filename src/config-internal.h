@@ -64,6 +64,31 @@ struct config_context {
 
   /* current iteration item */
   struct config_server *current_iter;
+
+  /* most memory the queues can use together */
+  size_t memory_budget;
+
+  /* where queues are spilled to once they use spill_threshold bytes */
+  const char *spill_directory;
+  size_t spill_threshold;
+
+  /* values of at least compression_threshold bytes are compressed, 0 if
+     nothing is compressed */
+  size_t compression_threshold;
+  int compression_level;
+
+  /* where the write-ahead log is kept and how often it is synced */
+  const char *wal_path;
+  enum wal_sync wal_sync;
+  unsigned long long wal_interval;
+
+  /* where the snapshot is kept, and the milliseconds between snapshots
+     written in the background */
+  const char *snapshot_path;
+  unsigned long long snapshot_interval;
+
+  /* processes the queues are split between */
+  int shards;
 };
 
 int config_process_server_(struct json_object *server);
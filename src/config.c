@@ -35,11 +35,27 @@ struct config_context global_config_context_ = {0};
    even though fread returns size_t */
 #define CONFIG_BUF_SIZE 4096
 
+/* milliseconds between syncs of the log with the interval policy, unless
+   the configuration gives one */
+#define CONFIG_WAL_INTERVAL 1000
+
+/* zlib level values are compressed with, unless the configuration gives one */
+#define CONFIG_COMPRESSION_LEVEL 6
+
+/* most shards the server can be split into */
+#define CONFIG_SHARDS_MAX 256
+
 int config_load_file(const char *filename)
 {
   struct json_object *servers;
   struct json_object *server;
   struct json_object *authentications;
+  struct json_object *obj;
+  int64_t budget;
+  int64_t threshold;
+  int64_t interval;
+  int64_t level;
+  int64_t shards;
   size_t server_count;
   size_t index;
 
@@ -48,6 +64,120 @@ int config_load_file(const char *filename)
     return 0;
   }
 
+  if (!json_pointer_get(global_config_context_.object, "/memory/budget",
+                        &obj)) {
+    budget = json_object_get_int64(obj);
+    if (budget < 0) {
+      return 0;
+    }
+
+    global_config_context_.memory_budget = (size_t)budget;
+  }
+
+  if (!json_pointer_get(global_config_context_.object, "/spill/directory",
+                        &obj)) {
+    if (json_object_get_type(obj) != json_type_string) {
+      return 0;
+    }
+
+    global_config_context_.spill_directory = json_object_get_string(obj);
+
+    if (json_pointer_get(global_config_context_.object, "/spill/threshold",
+                         &obj)) {
+      return 0;
+    }
+
+    threshold = json_object_get_int64(obj);
+    if (threshold <= 0) {
+      return 0;
+    }
+
+    global_config_context_.spill_threshold = (size_t)threshold;
+  }
+
+  if (!json_pointer_get(global_config_context_.object,
+                        "/compression/threshold", &obj)) {
+    threshold = json_object_get_int64(obj);
+    if (threshold < 0) {
+      return 0;
+    }
+
+    global_config_context_.compression_threshold = (size_t)threshold;
+    global_config_context_.compression_level = CONFIG_COMPRESSION_LEVEL;
+
+    if (!json_pointer_get(global_config_context_.object,
+                          "/compression/level", &obj)) {
+      level = json_object_get_int64(obj);
+      if (level < 1 || level > 9) {
+        return 0;
+      }
+
+      global_config_context_.compression_level = (int)level;
+    }
+  }
+
+  if (!json_pointer_get(global_config_context_.object, "/wal/path", &obj)) {
+    if (json_object_get_type(obj) != json_type_string) {
+      return 0;
+    }
+
+    global_config_context_.wal_path = json_object_get_string(obj);
+    global_config_context_.wal_sync = wal_sync_always;
+    global_config_context_.wal_interval = CONFIG_WAL_INTERVAL;
+
+    if (!json_pointer_get(global_config_context_.object, "/wal/sync", &obj) &&
+        !wal_sync_from_string(json_object_get_string(obj),
+                              &global_config_context_.wal_sync)) {
+      return 0;
+    }
+
+    if (!json_pointer_get(global_config_context_.object, "/wal/interval",
+                          &obj)) {
+      interval = json_object_get_int64(obj);
+      if (interval <= 0) {
+        return 0;
+      }
+
+      global_config_context_.wal_interval = (unsigned long long)interval;
+    }
+  }
+
+  if (!json_pointer_get(global_config_context_.object, "/snapshot/path",
+                        &obj)) {
+    if (json_object_get_type(obj) != json_type_string) {
+      return 0;
+    }
+
+    global_config_context_.snapshot_path = json_object_get_string(obj);
+
+    if (!json_pointer_get(global_config_context_.object,
+                          "/snapshot/interval", &obj)) {
+      interval = json_object_get_int64(obj);
+      if (interval < 0) {
+        return 0;
+      }
+
+      global_config_context_.snapshot_interval = (unsigned long long)interval;
+    }
+  }
+
+  global_config_context_.shards = 1;
+  if (!json_pointer_get(global_config_context_.object, "/shards", &obj)) {
+    shards = json_object_get_int64(obj);
+    if (shards < 1 || shards > CONFIG_SHARDS_MAX) {
+      return 0;
+    }
+
+#ifdef _WIN32
+    /* shards are started with fork */
+    if (shards > 1) {
+      return 0;
+    }
+#endif
+
+    global_config_context_.shards = (int)shards;
+  }
+
   authentications = json_object_object_get(global_config_context_.object,
                                            "authentication");
   if (authentications) {
@@ -143,6 +273,61 @@ const char *config_server_get_realm(struct config_server *server)
   return server->authentication->name;
 }
 
+size_t config_get_memory_budget(void)
+{
+  return global_config_context_.memory_budget;
+}
+
+const char *config_get_spill_directory(void)
+{
+  return global_config_context_.spill_directory;
+}
+
+size_t config_get_spill_threshold(void)
+{
+  return global_config_context_.spill_threshold;
+}
+
+size_t config_get_compression_threshold(void)
+{
+  return global_config_context_.compression_threshold;
+}
+
+int config_get_compression_level(void)
+{
+  return global_config_context_.compression_level;
+}
+
+const char *config_get_wal_path(void)
+{
+  return global_config_context_.wal_path;
+}
+
+enum wal_sync config_get_wal_sync(void)
+{
+  return global_config_context_.wal_sync;
+}
+
+unsigned long long config_get_wal_interval(void)
+{
+  return global_config_context_.wal_interval;
+}
+
+const char *config_get_snapshot_path(void)
+{
+  return global_config_context_.snapshot_path;
+}
+
+unsigned long long config_get_snapshot_interval(void)
+{
+  return global_config_context_.snapshot_interval;
+}
+
+int config_get_shards(void)
+{
+  return global_config_context_.shards > 1 ? global_config_context_.shards : 1;
+}
+
 int config_process_server_(struct json_object *config)
 {
   struct json_object *obj;
@@ -23,7 +23,10 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
+#include <stddef.h>
+
 #include "auth.h"
+#include "wal.h"
 
 struct config_server;
 struct config_authentication;
@@ -47,4 +50,32 @@ const char *config_server_get_privatekey(struct config_server *server);
 struct auth *config_server_get_authentication(struct config_server *server);
 const char *config_server_get_realm(struct config_server *server);
 
+/* most memory the queues can use together, 0 if there is no limit */
+size_t config_get_memory_budget(void);
+
+/* directory queues are spilled to, NULL if spilling is disabled, and the
+   memory a queue can use before it is spilled */
+const char *config_get_spill_directory(void);
+size_t config_get_spill_threshold(void);
+
+/* size values must be to be compressed, 0 if nothing is compressed, and the
+   zlib level they are compressed with */
+size_t config_get_compression_threshold(void);
+int config_get_compression_level(void);
+
+/* path of the write-ahead log, NULL if nothing is logged, and when the log is
+   synced to disk */
+const char *config_get_wal_path(void);
+enum wal_sync config_get_wal_sync(void);
+unsigned long long config_get_wal_interval(void);
+
+/* path of the snapshot, NULL if no snapshot is written, and the
+   milliseconds between snapshots written in the background, 0 if the
+   snapshot is only written when the server stops */
+const char *config_get_snapshot_path(void);
+unsigned long long config_get_snapshot_interval(void);
+
+/* number of shards the server is split into, 1 if it is not split */
+int config_get_shards(void);
+
 #endif
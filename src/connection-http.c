@@ -20,7 +20,14 @@
   THE SOFTWARE.
 */
 
+#include <json-c/json_tokener.h>
 #include <event2/buffer.h>
+#include <event2/util.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "connection.h"
 #include "connection-internal.h"
 #include "protocol.h"
@@ -28,20 +35,34 @@
 #define BASIC_HEADER "Basic realm=\""
 #define BASIC_DEFAULT BASIC_HEADER "auth\""
 
-/* callback for the queue list operation, adds the name of each queue to the
+/* content type of a raw value */
+#define RAW_TYPE "application/octet-stream"
+#define DEFLATE_CODING "deflate"
+
+#define HTTP_CONFLICT 409
+#define HTTP_TOOMANYREQUESTS 429
+
+/* callback for the stats operation, adds the memory used by each queue to the
    list */
-int list_foreach_callback(struct manager_queue *queue, void *user)
+int stats_foreach_callback(struct manager_queue *queue, void *user)
 {
   struct json_object *list = (json_object *)user;
-  struct json_object *str;
+  struct json_object *memory;
+  struct queue_stats stats;
+
+  /* a queue still in the snapshot does not use any memory */
+  if (!manager_queue_is_loaded(queue)) {
+    return 1;
+  }
 
-  str = json_object_new_string(manager_queue_get_id(queue));
-  if (!str) {
+  queue_get_stats(manager_queue_get_queue(queue), &stats);
+  memory = protocol_encode_queue_memory(manager_queue_get_id(queue), &stats);
+  if (!memory) {
     return 0;
   }
 
-  if (json_object_array_add(list, str) != 0) {
-    json_object_put(str);
+  if (json_object_array_add(list, memory) != 0) {
+    json_object_put(memory);
     return 0;
   }
 
@@ -87,32 +108,49 @@ void connection_http_callback_take(struct evhttp_request *request,
 {
   struct evkeyvalq params = {0};
   struct queue_item *item;
-  struct json_object *object;
   struct manager_queue *queue;
   const char *key;
+  long long lease = 0;
+  long long raw = 0;
 
   if (connection_http_read_(request, &params) != 1 ||
-      (queue = connection_http_validate_(request, 0, &params)) == NULL) {
+      (queue = connection_http_validate_(request, 0, &params)) == NULL ||
+      !connection_http_integer_(request, &params, "lease", 1,
+                                QUEUE_LEASE_MAX, &lease) ||
+      !connection_http_integer_(request, &params, "raw", 0, 1, &raw)) {
+    return;
+  }
+
+  /* items are never taken out of a stream, a consumer reads past them */
+  if (queue_get_type(manager_queue_get_queue(queue)) == queue_type_stream) {
+    if (lease > 0) {
+      connection_http_error_(request, &params, HTTP_BADREQUEST,
+                             "streams do not support leases");
+      return;
+    }
+
+    connection_http_read_stream_(request, &params,
+                                 manager_queue_get_queue(queue), 1, (int)raw);
     return;
   }
 
   key = evhttp_find_header(&params, "key");
-  item = queue_take(manager_queue_get_queue(queue), key);
+  if (lease > 0) {
+    /* a leased item still belongs to the queue */
+    item = queue_lease(manager_queue_get_queue(queue), key,
+                       (unsigned long long)lease);
+  } else {
+    item = queue_take(manager_queue_get_queue(queue), key);
+  }
+
   if (!item) {
     connection_http_error_(request, &params, HTTP_NOTFOUND, "no item to take");
     return;
   }
 
-  object = protocol_encode_item(item);
-  if (!object) {
-    connection_http_error_(request, &params, 0, "failed to encode item");
-    goto cleanup;
-  }
-
-  connection_http_payload_(request, &params, object);
+  connection_http_item_(request, &params, item, lease > 0, (int)raw);
 
-cleanup:
-  if (item) {
+  if (lease == 0) {
     queue_item_free(item);
   }
 }
@@ -122,12 +160,19 @@ void connection_http_callback_peek(struct evhttp_request *request,
 {
   struct evkeyvalq params = {0};
   struct queue_item *item;
-  struct json_object *object;
   struct manager_queue *queue;
   const char *key;
+  long long raw = 0;
 
   if (connection_http_read_(request, &params) != 1 ||
-      (queue = connection_http_validate_(request, 0, &params)) == NULL) {
+      (queue = connection_http_validate_(request, 0, &params)) == NULL ||
+      !connection_http_integer_(request, &params, "raw", 0, 1, &raw)) {
+    return;
+  }
+
+  if (queue_get_type(manager_queue_get_queue(queue)) == queue_type_stream) {
+    connection_http_read_stream_(request, &params,
+                                 manager_queue_get_queue(queue), 0, (int)raw);
     return;
   }
 
@@ -139,19 +184,8 @@ void connection_http_callback_peek(struct evhttp_request *request,
   }
 
   queue_item_lock(item);
-
-  object = protocol_encode_item(item);
-  if (!object) {
-    connection_http_error_(request, &params, 0, "failed to encode item");
-    goto cleanup;
-  }
-
-  connection_http_payload_(request, &params, object);
-
-cleanup:
-  if (item) {
-    queue_item_unlock(item);
-  }
+  connection_http_item_(request, &params, item, 0, (int)raw);
+  queue_item_unlock(item);
 }
 
 void connection_http_callback_put(struct evhttp_request *request,
@@ -159,8 +193,18 @@ void connection_http_callback_put(struct evhttp_request *request,
 {
   struct evkeyvalq params = {0};
   struct manager_queue *queue;
+  struct evbuffer *inbuffer;
   const char *key;
   const char *value;
+  size_t length = 0;
+  long long priority = QUEUE_PRIORITY_DEFAULT;
+  long long delay = 0;
+  long long not_before = -1;
+  long long ttl = 0;
+  struct timeval now;
+  struct queue_stats stats;
+  struct queue *q;
+  int result;
 
   if (connection_http_read_(request, &params) != 1 ||
       (queue = connection_http_validate_(request, 0, &params)) == NULL) {
@@ -168,14 +212,88 @@ void connection_http_callback_put(struct evhttp_request *request,
   }
 
   key = evhttp_find_header(&params, "key");
-  value = evhttp_find_header(&params, "value");
-  if (!value) {
+  if (connection_http_is_raw_(request)) {
+    /* the body is used in place, it is only copied into the item */
+    inbuffer = evhttp_request_get_input_buffer(request);
+    length = evbuffer_get_length(inbuffer);
+    value = length > 0 ? (const char *)evbuffer_pullup(inbuffer, -1) : "";
+    if (!value) {
+      connection_http_error_(request, &params, 0, "failed to read post body");
+      return;
+    }
+  } else {
+    value = evhttp_find_header(&params, "value");
+    if (!value) {
+      connection_http_error_(request, &params, HTTP_BADREQUEST,
+                             "missing parameter 'value'");
+      return;
+    }
+
+    length = strlen(value);
+  }
+
+  if (!connection_http_integer_(request, &params, "priority", 0,
+                                QUEUE_PRIORITY_LEVELS - 1, &priority) ||
+      !connection_http_integer_(request, &params, "delay", 0,
+                                QUEUE_DELAY_MAX, &delay) ||
+      !connection_http_integer_(request, &params, "not_before", 0,
+                                LLONG_MAX, &not_before) ||
+      !connection_http_integer_(request, &params, "ttl", 0, QUEUE_TTL_MAX,
+                                &ttl)) {
+    return;
+  }
+
+  /* not_before is a unix time in milliseconds, anything already in the past
+     is put immediately */
+  if (not_before >= 0) {
+    evutil_gettimeofday(&now, NULL);
+    delay = not_before - ((long long)now.tv_sec * 1000 + now.tv_usec / 1000);
+    if (delay < 0) {
+      delay = 0;
+    } else if (delay > QUEUE_DELAY_MAX) {
+      connection_http_error_(request, &params, HTTP_BADREQUEST,
+                             "invalid parameter 'not_before'");
+      return;
+    }
+  }
+
+  q = manager_queue_get_queue(queue);
+  if (delay > 0 && queue_get_type(q) == queue_type_stream) {
     connection_http_error_(request, &params, HTTP_BADREQUEST,
-                           "missing parameter 'value'");
+                           "streams do not support delays");
+    return;
+  }
+
+  result = queue_put(q, key, value, length, (int)priority,
+                     (unsigned long long)delay, (unsigned long long)ttl);
+  if (result == -2) {
+    queue_get_stats(q, &stats);
+    if (stats.policy == queue_policy_block) {
+      connection_http_put_wait_(request, &params, q, value, length,
+                                (int)priority, (unsigned long long)delay,
+                                (unsigned long long)ttl);
+      return;
+    }
+
+    connection_http_error_(request, &params, HTTP_TOOMANYREQUESTS,
+                           "queue is full");
     return;
   }
 
-  if (queue_put(manager_queue_get_queue(queue), key, value) < 0) {
+  if (result == -3) {
+    connection_http_error_(request, &params, HTTP_SERVUNAVAIL,
+                           "memory budget exceeded");
+    return;
+  }
+
+  /* waiting for room would never end, whatever the policy */
+  if (result == -4) {
+    connection_http_error_(request, &params, HTTP_ENTITYTOOLARGE,
+                           "item is larger than the queue");
+    return;
+  }
+
+  if (result < 0) {
     connection_http_error_(request, &params, 0, "failed to put item");
     return;
   }
@@ -183,6 +301,195 @@ void connection_http_callback_put(struct evhttp_request *request,
   connection_http_payload_(request, &params, NULL);
 }
 
+void connection_http_callback_ack(struct evhttp_request *request,
+                                  void *user)
+{
+  connection_http_callback_finish_(request, 1);
+}
+
+void connection_http_callback_nack(struct evhttp_request *request,
+                                   void *user)
+{
+  connection_http_callback_finish_(request, 0);
+}
+
+void connection_http_callback_stats(struct evhttp_request *request,
+                                    void *user)
+{
+  struct pool_stats pools[QUEUE_POOL_CLASSES + 1];
+  struct queue_memory_stats memory;
+  struct queue_spill_stats spill;
+  struct queue_compression_stats compression;
+  struct manager_gc_stats gc;
+  struct wal_stats wal;
+  struct snapshot_stats snapshot;
+  struct json_object *detail = NULL;
+  struct json_object *queues = NULL;
+  struct json_object *stats = NULL;
+  struct evkeyvalq params = {0};
+  long long shard;
+
+  if (evhttp_request_get_command(request) != EVHTTP_REQ_GET) {
+    connection_http_error_(request, NULL, HTTP_BADMETHOD,
+                           "method not supported");
+    return;
+  }
+
+  shard = shard_get_index();
+  if (connection_http_read_(request, &params) != 1 ||
+      !connection_http_integer_(request, &params, "shard", 0,
+                                shard_get_count() - 1, &shard)) {
+    return;
+  }
+
+  /* each shard has stats of its own, the one asked for answers */
+  if (shard != shard_get_index() && !shard_is_internal(request)) {
+    evhttp_clear_headers(&params);
+    connection_http_forward_(request, (int)shard);
+    return;
+  }
+
+  detail = protocol_encode_shard(shard_get_index(), shard_get_count());
+  if (!detail) {
+    goto cleanup;
+  }
+
+  stats = json_object_new_object();
+  if (!stats) {
+    goto cleanup;
+  }
+
+  if (json_object_object_add_ex(stats, "shard", detail,
+                                JSON_C_OBJECT_ADD_KEY_IS_NEW |
+                                JSON_C_OBJECT_KEY_IS_CONSTANT) != 0) {
+    goto cleanup;
+  }
+  detail = NULL;
+
+  queue_get_pool_stats(pools);
+  detail = protocol_encode_pool_stats(pools);
+  if (!detail) {
+    goto cleanup;
+  }
+
+  if (json_object_object_add_ex(stats, "pools", detail,
+                                JSON_C_OBJECT_ADD_KEY_IS_NEW |
+                                JSON_C_OBJECT_KEY_IS_CONSTANT) != 0) {
+    goto cleanup;
+  }
+  detail = NULL;
+
+  queue_get_memory_stats(&memory);
+  detail = protocol_encode_memory_stats(&memory);
+  if (!detail) {
+    goto cleanup;
+  }
+
+  queues = json_object_new_array();
+  if (!queues || manager_queue_foreach(stats_foreach_callback, queues) != 1) {
+    goto cleanup;
+  }
+
+  if (json_object_object_add_ex(detail, "queues", queues,
+                                JSON_C_OBJECT_ADD_KEY_IS_NEW |
+                                JSON_C_OBJECT_KEY_IS_CONSTANT) != 0) {
+    goto cleanup;
+  }
+  queues = NULL;
+
+  if (json_object_object_add_ex(stats, "memory", detail,
+                                JSON_C_OBJECT_ADD_KEY_IS_NEW |
+                                JSON_C_OBJECT_KEY_IS_CONSTANT) != 0) {
+    goto cleanup;
+  }
+  detail = NULL;
+
+  queue_get_spill_stats(&spill);
+  detail = protocol_encode_spill_stats(&spill);
+  if (!detail) {
+    goto cleanup;
+  }
+
+  if (json_object_object_add_ex(stats, "spill", detail,
+                                JSON_C_OBJECT_ADD_KEY_IS_NEW |
+                                JSON_C_OBJECT_KEY_IS_CONSTANT) != 0) {
+    goto cleanup;
+  }
+  detail = NULL;
+
+  queue_get_compression_stats(&compression);
+  detail = protocol_encode_compression_stats(&compression);
+  if (!detail) {
+    goto cleanup;
+  }
+
+  if (json_object_object_add_ex(stats, "compression", detail,
+                                JSON_C_OBJECT_ADD_KEY_IS_NEW |
+                                JSON_C_OBJECT_KEY_IS_CONSTANT) != 0) {
+    goto cleanup;
+  }
+  detail = NULL;
+
+  manager_get_gc_stats(&gc);
+  detail = protocol_encode_gc_stats(&gc);
+  if (!detail) {
+    goto cleanup;
+  }
+
+  if (json_object_object_add_ex(stats, "gc", detail,
+                                JSON_C_OBJECT_ADD_KEY_IS_NEW |
+                                JSON_C_OBJECT_KEY_IS_CONSTANT) != 0) {
+    goto cleanup;
+  }
+  detail = NULL;
+
+  /* the log section is null while nothing is being logged */
+  if (wal_is_enabled()) {
+    wal_get_stats(&wal);
+    detail = protocol_encode_wal_stats(&wal);
+    if (!detail) {
+      goto cleanup;
+    }
+  }
+
+  if (json_object_object_add_ex(stats, "wal", detail,
+                                JSON_C_OBJECT_ADD_KEY_IS_NEW |
+                                JSON_C_OBJECT_KEY_IS_CONSTANT) != 0) {
+    goto cleanup;
+  }
+  detail = NULL;
+
+  snapshot_get_stats(&snapshot);
+  detail = protocol_encode_snapshot_stats(&snapshot);
+  if (!detail) {
+    goto cleanup;
+  }
+
+  if (json_object_object_add_ex(stats, "snapshot", detail,
+                                JSON_C_OBJECT_ADD_KEY_IS_NEW |
+                                JSON_C_OBJECT_KEY_IS_CONSTANT) != 0) {
+    goto cleanup;
+  }
+
+  connection_http_payload_(request, &params, stats);
+  return;
+
+cleanup:
+  if (stats) {
+    json_object_put(stats);
+  }
+
+  if (queues) {
+    json_object_put(queues);
+  }
+
+  if (detail) {
+    json_object_put(detail);
+  }
+
+  connection_http_error_(request, &params, 0, "failed to encode stats");
+}
+
 void connection_http_authenticated(struct evhttp_request *request, void *user)
 {
   struct connection_params *params = (struct connection_params *)user;
@@ -205,6 +512,19 @@ void connection_http_authenticated(struct evhttp_request *request, void *user)
   params->cb(request, params->cb_arg);
 }
 
+void connection_http_shard(struct evhttp_request *request, void *user)
+{
+  struct connection_params *params = (struct connection_params *)user;
+
+  if (!shard_verify(request)) {
+    connection_http_error_(request, NULL, 403/*HTTP_FORBIDDEN*/,
+                           "not a shard");
+    return;
+  }
+
+  params->cb(request, params->cb_arg);
+}
+
 void *connection_http_auth_callback(struct auth *auth, const char *realm,
                                     void (*cb)(struct evhttp_request *, void *),
                                     void *cb_arg)
@@ -230,6 +550,7 @@ struct manager_queue *connection_http_validate_(struct evhttp_request *request,
 {
   const char *name;
   struct manager_queue *queue;
+  int owner;
 
   name = evhttp_find_header(params, "name");
   if (name && strlen(name) != QUEUE_UUID_STR_LEN) {
@@ -238,6 +559,17 @@ struct manager_queue *connection_http_validate_(struct evhttp_request *request,
     return NULL;
   }
 
+  /* a queue another shard owns is left to that shard, which answers the
+     request. one passed on from another shard is always answered here */
+  if (name && !shard_is_internal(request)) {
+    owner = manager_queue_owner(name);
+    if (owner >= 0 && owner != shard_get_index()) {
+      evhttp_clear_headers(params);
+      connection_http_forward_(request, owner);
+      return NULL;
+    }
+  }
+
   queue = manager_queue_get(name, create_new);
   if (!queue) {
     if (create_new) {
@@ -252,13 +584,50 @@ struct manager_queue *connection_http_validate_(struct evhttp_request *request,
   return queue;
 }
 
+int connection_http_integer_(struct evhttp_request *request,
+                             struct evkeyvalq *params, const char *name,
+                             long long min, long long max, long long *value)
+{
+  char message[64];
+  const char *text;
+  char *end;
+  long long parsed;
+
+  text = evhttp_find_header(params, name);
+  if (!text) {
+    return 1;
+  }
+
+  parsed = strtoll(text, &end, 10);
+  if (end == text || *end != '\0' || parsed < min || parsed > max) {
+    snprintf(message, sizeof(message), "invalid parameter '%s'", name);
+    connection_http_error_(request, params, HTTP_BADREQUEST, message);
+    return 0;
+  }
+
+  *value = parsed;
+  return 1;
+}
+
 int connection_http_read_(struct evhttp_request *request,
                           struct evkeyvalq *params)
 {
   struct evbuffer *inbuffer;
-  char *body;
+  const char *query;
+  char *body = NULL;
   size_t bodylength;
 
+  /* a raw value leaves the parameters to the query string, as does a get */
+  if (connection_http_is_raw_(request) ||
+      evhttp_request_get_command(request) == EVHTTP_REQ_GET) {
+    query = evhttp_uri_get_query(evhttp_request_get_evhttp_uri(request));
+    if (query && evhttp_parse_query_str(query, params) != 0) {
+      goto error;
+    }
+
+    return 1;
+  }
+
   inbuffer = evhttp_request_get_input_buffer(request);
   bodylength = evbuffer_get_length(inbuffer);
   body = calloc(1, bodylength + 1/*NULL*/);
@@ -286,6 +655,51 @@ error:
   return 0;
 }
 
+int connection_http_is_raw_(struct evhttp_request *request)
+{
+  const char *type;
+
+  type = evhttp_find_header(evhttp_request_get_input_headers(request),
+                            "Content-Type");
+  return type && evutil_ascii_strncasecmp(type, RAW_TYPE,
+                                          strlen(RAW_TYPE)) == 0;
+}
+
+int connection_http_accepts_deflate_(struct evhttp_request *request)
+{
+  const char *accept;
+  const char *end;
+  size_t length;
+
+  accept = evhttp_find_header(evhttp_request_get_input_headers(request),
+                              "Accept-Encoding");
+  if (!accept) {
+    return 0;
+  }
+
+  /* each coding is a name followed by optional parameters, one with a
+     weight of 0 is not acceptable */
+  while (*accept) {
+    accept += strspn(accept, " \t,");
+    end = accept + strcspn(accept, ",");
+    length = strcspn(accept, " \t;,");
+
+    if (length == strlen(DEFLATE_CODING) &&
+        evutil_ascii_strncasecmp(accept, DEFLATE_CODING, length) == 0) {
+      accept += length;
+      accept += strspn(accept, " \t;");
+
+      return !(accept + 3 <= end &&
+               evutil_ascii_strncasecmp(accept, "q=0", 3) == 0 &&
+               strspn(accept + 3, ".0") == (size_t)(end - accept - 3));
+    }
+
+    accept = end;
+  }
+
+  return 0;
+}
+
 void connection_http_json_(struct evhttp_request *request,
                            struct evkeyvalq *params,
                            int code, struct json_object *object)
@@ -312,7 +726,7 @@ void connection_http_json_(struct evhttp_request *request,
   /* nothing can be done if these fail, so no point checking */
   evhttp_add_header(headers, "Content-Type", "application/json");
   evbuffer_add(buffer, repr, length);
-  evhttp_send_reply(request, code, NULL, NULL);
+  connection_http_send_(request, code);
 
   if (object) {
     json_object_put(object);
@@ -351,51 +765,563 @@ void connection_http_payload_(struct evhttp_request *request,
   connection_http_json_(request, params, HTTP_OK, object);
 }
 
-void connection_http_auth_required_(struct evhttp_request *request,
-                                    const char *realm)
+void connection_http_item_(struct evhttp_request *request,
+                           struct evkeyvalq *params, struct queue_item *item,
+                           int receipt, int raw)
 {
-  char *header;
-  struct evkeyvalq *headers = evhttp_request_get_output_headers(request);
+  char buffer[QUEUE_RECEIPT_STR_LEN + 1/*NULL*/];
+  struct json_object *object;
+  struct queue_value *value;
+  struct evkeyvalq *headers;
+  struct evbuffer *output;
+  const char *repr;
+  size_t length;
+  struct evbuffer_iovec vector;
 
-  header = calloc(1, strlen(realm) + strlen(BASIC_HEADER) + 2/*NULL, quote*/);
-  if (!header) {
-    goto error;
+  headers = evhttp_request_get_output_headers(request);
+  output = evhttp_request_get_output_buffer(request);
+
+  /* a compressed item is not kept encoded, so it is encoded for each reply */
+  if (!raw && queue_item_is_compressed(item)) {
+    object = protocol_encode_item(item);
+    if (!object || (receipt && !protocol_add_receipt(object, item))) {
+      if (object) {
+        json_object_put(object);
+      }
+
+      connection_http_error_(request, params, 0, "failed to encode item");
+      return;
+    }
+
+    connection_http_payload_(request, params, object);
+    return;
   }
 
-  strcpy(header, BASIC_HEADER);
-  strcat(header, realm);
-  strcat(header, "\"");
-  evhttp_add_header(headers, "WWW-Authenticate", header);
-  free(header);
-  return;
+  if (!raw) {
+    repr = protocol_item_fragment(item, &length);
+    if (!repr) {
+      connection_http_error_(request, params, 0, "failed to encode item");
+      return;
+    }
 
-error:
-  evhttp_add_header(headers, "WWW-Authenticate", BASIC_DEFAULT);
-}
+    /* the reply is put together around the encoding kept with the item, which
+       is referenced like a raw value */
+    value = queue_value_get(item);
+    if (evbuffer_add_reference(output, PROTOCOL_SUCCESS_PREFIX,
+                               strlen(PROTOCOL_SUCCESS_PREFIX), NULL,
+                               NULL) != 0 ||
+        evbuffer_add_reference(output, repr, length,
+                               connection_value_cleanup_, value) != 0) {
+      queue_value_release(value);
+      evbuffer_drain(output, evbuffer_get_length(output));
+      connection_http_error_(request, params, 0, "failed to send item");
+      return;
+    }
 
-void connection_http_callback_list_(struct evhttp_request *request,
-                                    void *user)
-{
-  struct json_object *list;
-  struct evkeyvalq params = {0};
+    if (receipt) {
+      queue_item_get_receipt(item, buffer);
+      evbuffer_add_printf(output, ",\"receipt\":\"%s\"", buffer);
+    }
+
+    evbuffer_add(output, "}}", 2);
+    evhttp_add_header(headers, "Content-Type", "application/json");
+    connection_http_send_(request, HTTP_OK);
+
+    if (params) {
+      evhttp_clear_headers(params);
+    }
 
-  if (connection_http_read_(request, &params) != 1) {
     return;
   }
 
-  list = json_object_new_array();
-  if (!list) {
-    connection_http_error_(request, &params, 0, "failed to create list");
+  object = protocol_encode_item_header(item);
+  if (!object || (receipt && !protocol_add_receipt(object, item))) {
+    if (object) {
+      json_object_put(object);
+    }
+
+    connection_http_error_(request, params, 0, "failed to encode item");
     return;
   }
 
-  if (manager_queue_foreach(list_foreach_callback, list) != 1) {
-    json_object_put(list);
+  /* json escapes any line breaks, so the item fits in a header */
+  repr = json_object_to_json_string_ext(object, JSON_C_TO_STRING_PLAIN);
+  if (!repr || evhttp_add_header(headers, "X-Item", repr) != 0) {
+    json_object_put(object);
+    connection_http_error_(request, params, 0, "failed to encode item");
+    return;
+  }
+
+  json_object_put(object);
+
+  /* a compressed value the client cannot take is expanded into the reply */
+  if (queue_item_is_compressed(item) &&
+      !connection_http_accepts_deflate_(request)) {
+    length = queue_item_get_length(item);
+    if (evbuffer_reserve_space(output, (ev_ssize_t)length + 1/*NULL*/,
+                               &vector, 1) != 1 ||
+        !queue_item_copy_value(item, vector.iov_base)) {
+      evhttp_remove_header(headers, "X-Item");
+      connection_http_error_(request, params, 0, "failed to send item");
+      return;
+    }
+
+    vector.iov_len = length;
+    evbuffer_commit_space(output, &vector, 1);
+    evhttp_add_header(headers, "Content-Type", RAW_TYPE);
+    connection_http_send_(request, HTTP_OK);
+
+    if (params) {
+      evhttp_clear_headers(params);
+    }
+
+    return;
+  }
+
+  /* the body references the value where it is stored, the reference is
+     dropped once the reply has been written. a compressed value is already
+     in the zlib format http calls deflate */
+  value = queue_value_get(item);
+  repr = queue_value_get_stored(value, &length);
+  if (evbuffer_add_reference(output, repr, length,
+                             connection_value_cleanup_, value) != 0) {
+    queue_value_release(value);
+    evhttp_remove_header(headers, "X-Item");
+    connection_http_error_(request, params, 0, "failed to send item");
+    return;
+  }
+
+  if (queue_value_is_compressed(value)) {
+    evhttp_add_header(headers, "Content-Encoding", DEFLATE_CODING);
+  }
+
+  evhttp_add_header(headers, "Content-Type", RAW_TYPE);
+  connection_http_send_(request, HTTP_OK);
+
+  if (params) {
+    evhttp_clear_headers(params);
+  }
+}
+
+void connection_value_cleanup_(const void *data, size_t length, void *arg)
+{
+  queue_value_release((struct queue_value *)arg);
+}
+
+void connection_http_auth_required_(struct evhttp_request *request,
+                                    const char *realm)
+{
+  char *header;
+  struct evkeyvalq *headers = evhttp_request_get_output_headers(request);
+
+  header = calloc(1, strlen(realm) + strlen(BASIC_HEADER) + 2/*NULL, quote*/);
+  if (!header) {
+    goto error;
+  }
+
+  strcpy(header, BASIC_HEADER);
+  strcat(header, realm);
+  strcat(header, "\"");
+  evhttp_add_header(headers, "WWW-Authenticate", header);
+  free(header);
+  return;
+
+error:
+  evhttp_add_header(headers, "WWW-Authenticate", BASIC_DEFAULT);
+}
+
+void connection_http_callback_list_(struct evhttp_request *request,
+                                    void *user)
+{
+  struct connection_list *list;
+  struct manager_queue *after = NULL;
+  struct evkeyvalq params = {0};
+  const char *name;
+  long long stream = 0;
+  int owner;
+
+  if (connection_http_read_(request, &params) != 1) {
+    return;
+  }
+
+  list = calloc(1, sizeof(struct connection_list));
+  if (!list) {
+    connection_http_error_(request, &params, 0, "failed to create list");
+    return;
+  }
+
+  list->request = request;
+  list->max_items = LLONG_MAX;
+  list->limit = LLONG_MAX;
+  timer_entry_init(&list->timer, connection_http_list_due_, list);
+
+  /* the queues of every shard are listed in turn, unless the list was asked
+     for by another shard that is listing them */
+  list->shard = 0;
+  list->end = shard_get_count();
+  if (shard_is_internal(request)) {
+    list->shard = shard_get_index();
+    list->end = list->shard + 1;
+  }
+
+  if (!connection_http_integer_(request, &params, "limit", 1, LLONG_MAX,
+                                &list->limit) ||
+      !connection_http_integer_(request, &params, "min_items", 0, LLONG_MAX,
+                                &list->min_items) ||
+      !connection_http_integer_(request, &params, "max_items", 0, LLONG_MAX,
+                                &list->max_items) ||
+      !connection_http_integer_(request, &params, "min_age", 0, LLONG_MAX,
+                                &list->min_age) ||
+      !connection_http_integer_(request, &params, "stream", 0, 1, &stream)) {
+    free(list);
+    return;
+  }
+
+  /* the list carries on from the queue after the last one listed, starting
+   with the shard that owns it. shards are listed in order, so the queues
+   of the shards before it were already listed */
+  name = evhttp_find_header(&params, "after");
+  if (name) {
+    if (strlen(name) != QUEUE_UUID_STR_LEN) {
+      free(list);
+      connection_http_error_(request, &params, HTTP_BADREQUEST,
+                             "invalid queue id");
+      return;
+    }
+
+    owner = manager_queue_owner(name);
+    if (owner > list->shard && owner < list->end) {
+      list->shard = owner;
+    }
+
+    if (list->shard == shard_get_index()) {
+      after = manager_queue_find(name);
+      if (!after) {
+        free(list);
+        connection_http_error_(request, &params, HTTP_NOTFOUND,
+                               "queue does not exist");
+        return;
+      }
+    } else {
+      strcpy(list->after, name);
+    }
+  }
+
+  list->cursor = manager_cursor_new(after);
+  if (!list->cursor) {
+    free(list);
+    connection_http_error_(request, &params, 0, "failed to list queues");
+    return;
+  }
+
+  /* a streamed list is sent a chunk at a time, so a long list is never held
+     in memory and the server carries on between chunks */
+  list->stream = (int)stream;
+  list->output = stream ? evbuffer_new() :
+                          evhttp_request_get_output_buffer(request);
+  if (!list->output ||
+      evbuffer_add_printf(list->output, "%s[", PROTOCOL_SUCCESS_PREFIX) < 0) {
+    connection_http_list_free_(list);
     connection_http_error_(request, &params, 0, "failed to list queues");
     return;
   }
 
-  connection_http_payload_(request, &params, list);
+  evhttp_clear_headers(&params);
+  evhttp_add_header(evhttp_request_get_output_headers(request),
+                    "Content-Type", "application/json");
+  evhttp_connection_set_closecb(evhttp_request_get_connection(request),
+                                connection_http_list_close_, list);
+  connection_http_list_run_(list);
+}
+
+int connection_http_list_write_(struct connection_list *list,
+                                struct evbuffer *buffer, size_t count)
+{
+  struct manager_queue *queue;
+
+  while (list->listed < list->limit) {
+    if (count-- == 0) {
+      return 0;
+    }
+
+    queue = manager_cursor_next(list->cursor);
+    if (!queue) {
+      return 1;
+    }
+
+    if (!connection_http_list_match_(list, queue)) {
+      continue;
+    }
+
+    /* ids are only ever hex digits and dashes, so they need no escaping */
+    if (evbuffer_add_printf(buffer, list->listed ? ",\"%s\"" : "\"%s\"",
+                            manager_queue_get_id(queue)) < 0) {
+      return -1;
+    }
+
+    list->listed++;
+  }
+
+  return 1;
+}
+
+int connection_http_list_match_(struct connection_list *list,
+                                struct manager_queue *queue)
+{
+  struct queue_stats stats;
+
+  if (manager_queue_get_age(queue) < (unsigned long long)list->min_age) {
+    return 0;
+  }
+
+  if (list->min_items == 0 && list->max_items == LLONG_MAX) {
+    return 1;
+  }
+
+  /* the items in a queue still in the snapshot are only known once it has
+     been read */
+  if (!manager_queue_is_loaded(queue) &&
+      !manager_queue_get(manager_queue_get_id(queue), 0)) {
+    return 0;
+  }
+
+  queue_get_stats(manager_queue_get_queue(queue), &stats);
+  return stats.items >= (unsigned long long)list->min_items &&
+         stats.items <= (unsigned long long)list->max_items;
+}
+
+void connection_http_list_run_(struct connection_list *list)
+{
+  int result;
+
+  while (list->listed < list->limit && list->shard < list->end) {
+    if (list->shard != shard_get_index()) {
+      if (!connection_http_list_remote_(list)) {
+        connection_http_list_fail_(list);
+        return;
+      }
+
+      /* what was listed so far is sent while the shard is waited on */
+      if (list->stream && evbuffer_get_length(list->output) > 0) {
+        if (!list->started) {
+          evhttp_send_reply_start(list->request, HTTP_OK, "OK");
+          list->started = 1;
+        }
+
+        evhttp_send_reply_chunk(list->request, list->output);
+      }
+
+      return;
+    }
+
+    result = connection_http_list_write_(list, list->output,
+                                         list->stream ? CONNECTION_LIST_CHUNK :
+                                                        SIZE_MAX);
+    if (result < 0) {
+      connection_http_list_fail_(list);
+      return;
+    }
+
+    if (result == 0) {
+      if (evbuffer_get_length(list->output) > 0) {
+        if (!list->started) {
+          evhttp_send_reply_start(list->request, HTTP_OK, "OK");
+          list->started = 1;
+        }
+
+        /* the next chunk is written once this one has been sent */
+        evhttp_send_reply_chunk_with_cb(list->request, list->output,
+                                        connection_http_list_sent_, list);
+        return;
+      }
+
+      /* nothing passed the filters, so nothing is waiting to be sent */
+      if (timer_schedule(&list->timer, 0) != 0) {
+        connection_http_list_fail_(list);
+      }
+
+      return;
+    }
+
+    list->shard++;
+  }
+
+  if (evbuffer_add(list->output, "]}", 2) != 0) {
+    connection_http_list_fail_(list);
+    return;
+  }
+
+  evhttp_connection_set_closecb(
+    evhttp_request_get_connection(list->request), NULL, NULL);
+
+  if (!list->stream) {
+    connection_http_send_(list->request, HTTP_OK);
+    connection_http_list_free_(list);
+    return;
+  }
+
+  if (!list->started) {
+    evhttp_send_reply_start(list->request, HTTP_OK, "OK");
+  }
+
+  evhttp_send_reply_chunk(list->request, list->output);
+  evhttp_send_reply_end(list->request);
+  connection_http_list_free_(list);
+}
+
+int connection_http_list_remote_(struct connection_list *list)
+{
+  struct evbuffer *uri;
+  int result = 0;
+
+  uri = evbuffer_new();
+  if (!uri) {
+    return 0;
+  }
+
+  /* the shard lists its own queues, as many as are still wanted */
+  if (evbuffer_add_printf(uri, "/queues?limit=%lld&min_items=%lld&"
+                          "max_items=%lld&min_age=%lld",
+                          list->limit - list->listed, list->min_items,
+                          list->max_items, list->min_age) < 0 ||
+      (list->after[0] && evbuffer_add_printf(uri, "&after=%s",
+                                             list->after) < 0) ||
+      evbuffer_add(uri, "", 1) != 0) {
+    goto cleanup;
+  }
+
+  list->after[0] = '\0';
+  list->forward = shard_forward(list->shard, EVHTTP_REQ_GET,
+                                (const char *)evbuffer_pullup(uri, -1), NULL,
+                                NULL, connection_http_list_done_, list);
+  result = list->forward != NULL;
+
+cleanup:
+  evbuffer_free(uri);
+  return result;
+}
+
+void connection_http_list_fail_(struct connection_list *list)
+{
+  evhttp_connection_set_closecb(
+    evhttp_request_get_connection(list->request), NULL, NULL);
+
+  /* a list that was already started is cut short, which the client sees as
+     invalid json */
+  if (list->started) {
+    evhttp_send_reply_end(list->request);
+    connection_http_list_free_(list);
+    return;
+  }
+
+  evbuffer_drain(list->output, evbuffer_get_length(list->output));
+  evhttp_remove_header(evhttp_request_get_output_headers(list->request),
+                       "Content-Type");
+  connection_http_error_(list->request, NULL, 0, "failed to list queues");
+  connection_http_list_free_(list);
+}
+
+void connection_http_list_free_(struct connection_list *list)
+{
+  timer_cancel(&list->timer);
+  manager_cursor_free(list->cursor);
+
+  if (list->forward) {
+    shard_forward_cancel(list->forward);
+  }
+
+  if (list->stream && list->output) {
+    evbuffer_free(list->output);
+  }
+
+  free(list);
+}
+
+void connection_http_list_sent_(struct evhttp_connection *connection,
+                                void *arg)
+{
+  connection_http_list_run_((struct connection_list *)arg);
+}
+
+void connection_http_list_due_(struct timer_entry *entry, void *arg)
+{
+  connection_http_list_run_((struct connection_list *)arg);
+}
+
+void connection_http_list_close_(struct evhttp_connection *connection,
+                                 void *arg)
+{
+  struct connection_list *list = (struct connection_list *)arg;
+
+  /* a list already being streamed is detached on close just like one that
+     was not started */
+  connection_http_request_gone_(list->request);
+  connection_http_list_free_(list);
+}
+
+void connection_http_list_done_(struct evhttp_request *response, void *arg)
+{
+  struct connection_list *list = (struct connection_list *)arg;
+  struct evbuffer *body;
+  const char *ids;
+  size_t prefix = strlen(PROTOCOL_SUCCESS_PREFIX) + 1/*[*/;
+  size_t length;
+  size_t index;
+  long long quotes = 0;
+
+  list->forward = NULL;
+  if (!response) {
+    connection_http_list_fail_(list);
+    return;
+  }
+
+  body = evhttp_request_get_input_buffer(response);
+
+  /* the shard turned the list down, such as for a queue to carry on after
+     that it does not have, which is passed on if nothing has been sent */
+  if (evhttp_request_get_response_code(response) != HTTP_OK) {
+    if (list->started) {
+      connection_http_list_fail_(list);
+      return;
+    }
+
+    evhttp_connection_set_closecb(
+      evhttp_request_get_connection(list->request), NULL, NULL);
+    evbuffer_drain(list->output, evbuffer_get_length(list->output));
+    evbuffer_add_buffer(evhttp_request_get_output_buffer(list->request), body);
+    evhttp_send_reply(list->request,
+                      evhttp_request_get_response_code(response),
+                      evhttp_request_get_response_code_line(response), NULL);
+    connection_http_list_free_(list);
+    return;
+  }
+
+  /* the ids the shard listed are taken from between the brackets of its
+     list, each of them is quoted */
+  length = evbuffer_get_length(body);
+  ids = (const char *)evbuffer_pullup(body, -1);
+  if (length < prefix + 2 || !ids ||
+      strncmp(ids, PROTOCOL_SUCCESS_PREFIX "[", prefix) != 0) {
+    connection_http_list_fail_(list);
+    return;
+  }
+
+  ids += prefix;
+  length -= prefix + 2/*]}*/;
+  for (index = 0; index < length; index++) {
+    quotes += ids[index] == '"';
+  }
+
+  if (length > 0 &&
+      ((list->listed > 0 && evbuffer_add(list->output, ",", 1) != 0) ||
+       evbuffer_add(list->output, ids, length) != 0)) {
+    connection_http_list_fail_(list);
+    return;
+  }
+
+  list->listed += quotes / 2;
+  list->shard++;
+  connection_http_list_run_(list);
 }
 
 void connection_http_callback_new_(struct evhttp_request *request,
@@ -404,12 +1330,63 @@ void connection_http_callback_new_(struct evhttp_request *request,
   struct json_object *name;
   struct evkeyvalq params = {0};
   struct manager_queue *queue;
+  enum queue_policy policy = queue_policy_reject;
+  enum queue_type type = queue_type_queue;
+  const char *policy_name;
+  const char *type_name;
+  long long ttl = 0;
+  long long idle = 0;
+  long long max_items = 0;
+  long long max_bytes = 0;
 
   if (connection_http_read_(request, &params) != 1 ||
-      (queue = connection_http_validate_(request, 1, &params)) == NULL) {
+      !connection_http_integer_(request, &params, "ttl", 0, QUEUE_TTL_MAX,
+                                &ttl) ||
+      !connection_http_integer_(request, &params, "idle", 0, QUEUE_TTL_MAX,
+                                &idle) ||
+      !connection_http_integer_(request, &params, "max_items", 0, LLONG_MAX,
+                                &max_items) ||
+      !connection_http_integer_(request, &params, "max_bytes", 0, LLONG_MAX,
+                                &max_bytes)) {
+    return;
+  }
+
+  type_name = evhttp_find_header(&params, "type");
+  if (type_name && !queue_type_from_string(type_name, &type)) {
+    connection_http_error_(request, &params, HTTP_BADREQUEST,
+                           "invalid parameter 'type'");
+    return;
+  }
+
+  /* the limits of a stream are how much of it is kept, so by default the
+     oldest items make room for new ones */
+  if (type == queue_type_stream) {
+    policy = queue_policy_drop_oldest;
+  }
+
+  policy_name = evhttp_find_header(&params, "policy");
+  if (policy_name && !queue_policy_from_string(policy_name, &policy)) {
+    connection_http_error_(request, &params, HTTP_BADREQUEST,
+                           "invalid parameter 'policy'");
+    return;
+  }
+
+  if ((queue = connection_http_validate_(request, 1, &params)) == NULL) {
     return;
   }
 
+  /* an existing queue that already holds items keeps its type */
+  if (!queue_set_type(manager_queue_get_queue(queue), type)) {
+    connection_http_error_(request, &params, HTTP_CONFLICT,
+                           "queue is not empty");
+    return;
+  }
+
+  queue_set_ttl(manager_queue_get_queue(queue), (unsigned long long)ttl);
+  queue_set_idle(manager_queue_get_queue(queue), (unsigned long long)idle);
+  queue_set_limits(manager_queue_get_queue(queue), (size_t)max_items,
+                   (size_t)max_bytes, policy);
+
   name = json_object_new_string(manager_queue_get_id(queue));
   if (!name) {
     manager_queue_free(queue);
@@ -427,6 +1404,7 @@ void connection_http_callback_info_(struct evhttp_request *request,
   struct json_object *info = NULL;
   struct evkeyvalq params = {0};
   struct manager_queue *queue;
+  struct queue_stats stats;
 
   if (connection_http_read_(request, &params) != 1 ||
       (queue = connection_http_validate_(request, 0, &params)) == NULL) {
@@ -448,6 +1426,12 @@ void connection_http_callback_info_(struct evhttp_request *request,
                                 JSON_C_OBJECT_KEY_IS_CONSTANT) != 0) {
     goto cleanup;
   }
+  detail = NULL;
+
+  queue_get_stats(manager_queue_get_queue(queue), &stats);
+  if (!protocol_add_queue_stats(info, &stats)) {
+    goto cleanup;
+  }
 
   connection_http_payload_(request, &params, info);
   return;
@@ -464,6 +1448,264 @@ cleanup:
   connection_http_error_(request, &params, 0, "failed to encode queue info");
 }
 
+void connection_http_put_wait_(struct evhttp_request *request,
+                               struct evkeyvalq *params, struct queue *q,
+                               const char *value, size_t length, int priority,
+                               unsigned long long delay,
+                               unsigned long long ttl)
+{
+  struct connection_put *put;
+  struct evkeyval *param;
+
+  put = calloc(1, sizeof(struct connection_put));
+  if (!put) {
+    connection_http_error_(request, params, 0, "failed to wait for space");
+    return;
+  }
+
+  put->request = request;
+  put->q = q;
+  put->value = value;
+  put->length = length;
+  put->priority = priority;
+  put->delay = delay;
+  put->ttl = ttl;
+
+  put->wait = queue_wait_space(q, connection_http_put_space_, put);
+  if (!put->wait) {
+    free(put);
+    connection_http_error_(request, params, 0, "failed to wait for space");
+    return;
+  }
+
+  /* the parameters have to outlive the callback */
+  TAILQ_INIT(&put->params);
+  while ((param = TAILQ_FIRST(params)) != NULL) {
+    TAILQ_REMOVE(params, param, next);
+    TAILQ_INSERT_TAIL(&put->params, param, next);
+  }
+
+  /* a shard passing the put on is answered before its request times out */
+  if (shard_is_internal(request)) {
+    timer_entry_init(&put->hold, connection_http_put_due_, put);
+    timer_schedule(&put->hold, SHARD_HOLD_TIMEOUT);
+  }
+
+  /* the client may give up waiting */
+  evhttp_connection_set_closecb(evhttp_request_get_connection(request),
+                                connection_http_put_close_, put);
+}
+
+void connection_http_send_(struct evhttp_request *request, int code)
+{
+  struct connection_durable *durable;
+
+  if (wal_is_durable()) {
+    evhttp_send_reply(request, code, NULL, NULL);
+    return;
+  }
+
+  durable = malloc(sizeof(struct connection_durable));
+  if (!durable) {
+    evhttp_send_reply(request, code, NULL, NULL);
+    return;
+  }
+
+  durable->request = request;
+  durable->code = code;
+  durable->waiter = wal_wait(connection_http_durable_, durable);
+  if (!durable->waiter) {
+    free(durable);
+    evhttp_send_reply(request, code, NULL, NULL);
+    return;
+  }
+
+  /* the client may give up waiting */
+  evhttp_connection_set_closecb(evhttp_request_get_connection(request),
+                                connection_http_durable_close_, durable);
+}
+
+void connection_http_durable_(void *arg)
+{
+  struct connection_durable *durable = (struct connection_durable *)arg;
+
+  evhttp_connection_set_closecb(
+    evhttp_request_get_connection(durable->request), NULL, NULL);
+  evhttp_send_reply(durable->request, durable->code, NULL, NULL);
+
+  free(durable);
+}
+
+void connection_http_durable_close_(struct evhttp_connection *connection,
+                                    void *arg)
+{
+  struct connection_durable *durable = (struct connection_durable *)arg;
+
+  wal_wait_cancel(durable->waiter);
+  connection_http_request_gone_(durable->request);
+  free(durable);
+}
+
+void connection_http_put_reply_(struct connection_put *put, int result)
+{
+  timer_cancel(&put->hold);
+  evhttp_connection_set_closecb(evhttp_request_get_connection(put->request),
+                                NULL, NULL);
+
+  if (result == -2) {
+    connection_http_error_(put->request, &put->params, HTTP_NOTFOUND,
+                           "queue was deleted");
+  } else if (result == -3) {
+    connection_http_error_(put->request, &put->params, HTTP_SERVUNAVAIL,
+                           "memory budget exceeded");
+  } else if (result == -4) {
+    connection_http_error_(put->request, &put->params, HTTP_ENTITYTOOLARGE,
+                           "item is larger than the queue");
+  } else if (result < 0) {
+    connection_http_error_(put->request, &put->params, 0,
+                           "failed to put item");
+  } else {
+    connection_http_payload_(put->request, &put->params, NULL);
+  }
+
+  free(put);
+}
+
+void connection_http_put_space_(void *arg, int available)
+{
+  struct connection_put *put = (struct connection_put *)arg;
+  int result;
+
+  put->wait = NULL;
+  if (!available) {
+    connection_http_put_reply_(put, -2);
+    return;
+  }
+
+  result = queue_put(put->q, evhttp_find_header(&put->params, "key"),
+                     put->value, put->length, put->priority, put->delay,
+                     put->ttl);
+  if (result == -2) {
+    /* someone else took the space first */
+    put->wait = queue_wait_space(put->q, connection_http_put_space_, put);
+    if (put->wait) {
+      return;
+    }
+
+    result = -1;
+  }
+
+  connection_http_put_reply_(put, result);
+}
+
+void connection_http_put_due_(struct timer_entry *entry, void *arg)
+{
+  struct connection_put *put = (struct connection_put *)arg;
+
+  /* the shard puts it again, behind any puts that came since */
+  if (put->wait) {
+    queue_space_wait_cancel(put->wait);
+  }
+
+  evhttp_connection_set_closecb(evhttp_request_get_connection(put->request),
+                                NULL, NULL);
+  shard_retry(put->request);
+  evhttp_clear_headers(&put->params);
+  free(put);
+}
+
+void connection_http_put_close_(struct evhttp_connection *connection,
+                                void *arg)
+{
+  struct connection_put *put = (struct connection_put *)arg;
+
+  timer_cancel(&put->hold);
+  if (put->wait) {
+    queue_space_wait_cancel(put->wait);
+  }
+
+  connection_http_request_gone_(put->request);
+  evhttp_clear_headers(&put->params);
+  free(put);
+}
+
+void connection_http_request_gone_(struct evhttp_request *request)
+{
+  /* when the client goes away the unanswered request is detached from the
+     connection instead of being freed with it. a request still attached, as
+     when the server is freed, is freed by the connection */
+  if (!evhttp_request_get_connection(request)) {
+    evhttp_request_free(request);
+  }
+}
+
+void connection_http_callback_finish_(struct evhttp_request *request,
+                                      int acknowledge)
+{
+  struct evkeyvalq params = {0};
+  struct manager_queue *queue;
+  struct queue *q;
+  const char *receipt;
+  int found;
+
+  if (connection_http_read_(request, &params) != 1 ||
+      (queue = connection_http_validate_(request, 0, &params)) == NULL) {
+    return;
+  }
+
+  receipt = evhttp_find_header(&params, "receipt");
+  if (!receipt) {
+    connection_http_error_(request, &params, HTTP_BADREQUEST,
+                           "missing parameter 'receipt'");
+    return;
+  }
+
+  q = manager_queue_get_queue(queue);
+  found = acknowledge ? queue_ack(q, receipt) : queue_nack(q, receipt);
+  if (!found) {
+    connection_http_error_(request, &params, HTTP_NOTFOUND, "no such lease");
+    return;
+  }
+
+  connection_http_payload_(request, &params, NULL);
+}
+
+void connection_http_read_stream_(struct evhttp_request *request,
+                                  struct evkeyvalq *params, struct queue *q,
+                                  int advance, int raw)
+{
+  struct queue_item *item;
+  const char *consumer;
+  long long offset = -1;
+
+  consumer = evhttp_find_header(params, "consumer");
+  if (!consumer) {
+    connection_http_error_(request, params, HTTP_BADREQUEST,
+                           "missing parameter 'consumer'");
+    return;
+  }
+
+  if (!connection_http_integer_(request, params, "offset", 0, LLONG_MAX,
+                                &offset)) {
+    return;
+  }
+
+  if (offset >= 0 && !queue_seek(q, consumer, (unsigned long long)offset)) {
+    connection_http_error_(request, params, 0, "failed to move consumer");
+    return;
+  }
+
+  item = queue_read(q, consumer, evhttp_find_header(params, "key"), advance);
+  if (!item) {
+    connection_http_error_(request, params, HTTP_NOTFOUND,
+                           advance ? "no item to take" : "no item to peek");
+    return;
+  }
+
+  connection_http_item_(request, params, item, 0, raw);
+  queue_item_unlock(item);
+}
+
 void connection_http_callback_delete_(struct evhttp_request *request,
                                       void *user)
 {
@@ -475,8 +1717,217 @@ void connection_http_callback_delete_(struct evhttp_request *request,
     return;
   }
 
-  manager_queue_want_remove(queue);
   manager_queue_free(queue);
 
   connection_http_payload_(request, &params, NULL);
 }
+
+void connection_http_forward_(struct evhttp_request *request, int shard)
+{
+  struct connection_forward *forward;
+
+  forward = calloc(1, sizeof(struct connection_forward));
+  if (!forward) {
+    connection_http_error_(request, NULL, 0, "failed to reach shard");
+    return;
+  }
+
+  /* the request is passed on as it came, the shard reads it again */
+  forward->request = request;
+  forward->forward = shard_forward(shard, evhttp_request_get_command(request),
+                                   evhttp_request_get_uri(request),
+                                   evhttp_request_get_input_headers(request),
+                                   evhttp_request_get_input_buffer(request),
+                                   connection_http_forward_done_, forward);
+  if (!forward->forward) {
+    free(forward);
+    connection_http_error_(request, NULL, HTTP_SERVUNAVAIL,
+                           "failed to reach shard");
+    return;
+  }
+
+  /* the client may give up waiting */
+  evhttp_connection_set_closecb(evhttp_request_get_connection(request),
+                                connection_http_forward_close_, forward);
+}
+
+void connection_http_forward_done_(struct evhttp_request *response,
+                                   void *arg)
+{
+  struct connection_forward *forward = (struct connection_forward *)arg;
+  struct evhttp_request *request = forward->request;
+
+  evhttp_connection_set_closecb(evhttp_request_get_connection(request), NULL,
+                                NULL);
+  free(forward);
+
+  if (!response) {
+    connection_http_error_(request, NULL, HTTP_SERVUNAVAIL,
+                           "failed to reach shard");
+    return;
+  }
+
+  /* the shard already held its reply until it was on disk */
+  shard_copy_headers(evhttp_request_get_input_headers(response),
+                     evhttp_request_get_output_headers(request));
+  evbuffer_add_buffer(evhttp_request_get_output_buffer(request),
+                      evhttp_request_get_input_buffer(response));
+  evhttp_send_reply(request, evhttp_request_get_response_code(response),
+                    evhttp_request_get_response_code_line(response), NULL);
+}
+
+void connection_http_forward_close_(struct evhttp_connection *connection,
+                                    void *arg)
+{
+  struct connection_forward *forward = (struct connection_forward *)arg;
+
+  shard_forward_cancel(forward->forward);
+  connection_http_request_gone_(forward->request);
+  free(forward);
+}
+
+void connection_http_callback_want(struct evhttp_request *request, void *user)
+{
+  struct json_object *message;
+  struct evbuffer *inbuffer;
+  const char *error;
+  char *body;
+  size_t bodylength;
+
+  if (evhttp_request_get_command(request) != EVHTTP_REQ_POST) {
+    connection_http_error_(request, NULL, HTTP_BADMETHOD,
+                           "method not supported");
+    return;
+  }
+
+  inbuffer = evhttp_request_get_input_buffer(request);
+  bodylength = evbuffer_get_length(inbuffer);
+  body = calloc(1, bodylength + 1/*NULL*/);
+  if (!body || evbuffer_copyout(inbuffer, body, bodylength) != bodylength) {
+    free(body);
+    connection_http_error_(request, NULL, 0, "failed to read post body");
+    return;
+  }
+
+  message = json_tokener_parse(body);
+  free(body);
+  if (!message) {
+    connection_http_error_(request, NULL, HTTP_BADREQUEST,
+                           "failed to read message");
+    return;
+  }
+
+  /* the reply is held until the want calls back */
+  error = connection_want_start_(message, NULL, request);
+  if (error) {
+    connection_http_error_(request, NULL, HTTP_BADREQUEST, error);
+  }
+
+  json_object_put(message);
+}
+
+void connection_http_want_gone(struct evhttp_request *request)
+{
+  evhttp_connection_set_closecb(evhttp_request_get_connection(request), NULL,
+                                NULL);
+  connection_http_error_(request, NULL, HTTP_NOTFOUND, "queue was deleted");
+}
+
+void connection_http_want_retry(struct evhttp_request *request)
+{
+  evhttp_connection_set_closecb(evhttp_request_get_connection(request), NULL,
+                                NULL);
+  shard_retry(request);
+}
+
+void connection_http_want_item_(struct manager_queue_want *want,
+                                struct queue_item *item)
+{
+  struct evhttp_request *request = manager_queue_want_get_request(want);
+  struct json_object *identifier;
+  struct json_object *detail;
+  struct evbuffer *output;
+  struct evbuffer_iovec vector;
+  struct queue_value *value;
+  const char *id = NULL;
+  const char *repr = NULL;
+  char text[24];
+  size_t length;
+  int raw = manager_queue_want_is_raw(want);
+
+  /* the request is answered here, so freeing the want leaves it alone */
+  manager_queue_want_set_request(want, NULL);
+  evhttp_connection_set_closecb(evhttp_request_get_connection(request), NULL,
+                                NULL);
+
+  identifier = json_object_new_string(manager_queue_want_get_identifier(want));
+  if (identifier) {
+    id = json_object_to_json_string_ext(identifier, JSON_C_TO_STRING_PLAIN);
+  }
+
+  detail = raw ? protocol_encode_item_header(item) : protocol_encode_item(item);
+  if (detail) {
+    repr = json_object_to_json_string_ext(detail, JSON_C_TO_STRING_PLAIN);
+  }
+
+  output = evhttp_request_get_output_buffer(request);
+  if (!id || !repr ||
+      evbuffer_add_printf(output, "%s{\"id\":%s,\"item\":%s}}",
+                          PROTOCOL_SUCCESS_PREFIX, id, repr) < 0) {
+    evbuffer_drain(output, evbuffer_get_length(output));
+    connection_http_error_(request, NULL, 0, "failed to encode item");
+    goto cleanup;
+  }
+
+  /* the message is followed by the value of a raw item, expanded if it is
+     compressed since the client is sent it as it is */
+  sprintf(text, "%lu", (unsigned long)evbuffer_get_length(output));
+  if (raw && queue_item_is_compressed(item)) {
+    length = queue_item_get_length(item);
+    if (evbuffer_reserve_space(output, (ev_ssize_t)length + 1/*NULL*/,
+                               &vector, 1) != 1 ||
+        !queue_item_copy_value(item, vector.iov_base)) {
+      evbuffer_drain(output, evbuffer_get_length(output));
+      connection_http_error_(request, NULL, 0, "failed to expand item");
+      goto cleanup;
+    }
+
+    vector.iov_len = length;
+    evbuffer_commit_space(output, &vector, 1);
+  } else if (raw) {
+    value = queue_value_get(item);
+    if (evbuffer_add_reference(output, queue_value_get_data(value),
+                               queue_value_get_length(value),
+                               connection_value_cleanup_, value) != 0) {
+      queue_value_release(value);
+      evbuffer_drain(output, evbuffer_get_length(output));
+      connection_http_error_(request, NULL, 0, "failed to send item");
+      goto cleanup;
+    }
+  }
+
+  evhttp_add_header(evhttp_request_get_output_headers(request),
+                    "X-Text-Length", text);
+  evhttp_send_reply(request, HTTP_OK, "OK", NULL);
+
+cleanup:
+  if (identifier) {
+    json_object_put(identifier);
+  }
+
+  if (detail) {
+    json_object_put(detail);
+  }
+}
+
+void connection_http_want_close_(struct evhttp_connection *connection,
+                                 void *arg)
+{
+  struct manager_queue_want *want = (struct manager_queue_want *)arg;
+  struct evhttp_request *request = manager_queue_want_get_request(want);
+
+  /* the want is freed without answering the request */
+  manager_queue_want_set_request(want, NULL);
+  manager_queue_want_free(want);
+  connection_http_request_gone_(request);
+}
@@ -27,6 +27,83 @@
 #include <event2/keyvalq_struct.h>
 #include "manager.h"
 #include "ws.h"
+#include "wal.h"
+#include "timer.h"
+#include "shard.h"
+
+/* queues visited for each chunk of a streamed list of queues */
+#define CONNECTION_LIST_CHUNK 1024
+
+/* a put on a full queue waiting for space, see queue_policy_block */
+struct connection_put {
+  struct evhttp_request *request;
+
+  /* parameters of the request, holding the key and value */
+  struct evkeyvalq params;
+
+  /* value to put, held in the parameters or in the body of the request */
+  const char *value;
+  size_t length;
+
+  struct queue *q;
+  struct queue_space_wait *wait;
+
+  /* runs out once a put from another shard has been held for
+     SHARD_HOLD_TIMEOUT */
+  struct timer_entry hold;
+
+  int priority;
+  unsigned long long delay;
+  unsigned long long ttl;
+};
+
+/* a request passed on to the shard that owns its queue */
+struct connection_forward {
+  struct evhttp_request *request;
+  struct shard_forward *forward;
+};
+
+/* a list of queues being written, see connection_http_callback_list_ */
+struct connection_list {
+  struct evhttp_request *request;
+  struct manager_cursor *cursor;
+
+  /* where the list is written, the output of the request unless it is
+     streamed */
+  struct evbuffer *output;
+  int stream;
+
+  /* runs the next chunk of a streamed list that had nothing to send */
+  struct timer_entry timer;
+
+  /* the shard being listed and the one the list stops before. the queues of
+     other shards are asked for with forward, carrying on after the queue
+     named in after on the first shard */
+  int shard;
+  int end;
+  struct shard_forward *forward;
+  char after[QUEUE_UUID_STR_LEN + 1/*NULL*/];
+
+  /* only queues holding between min_items and max_items items, and at least
+     min_age milliseconds old, are listed */
+  long long min_items;
+  long long max_items;
+  long long min_age;
+
+  /* most queues to list, and queues listed so far */
+  long long limit;
+  long long listed;
+
+  /* has a streamed reply been started */
+  int started;
+};
+
+/* a reply held until the changes it made are on disk */
+struct connection_durable {
+  struct evhttp_request *request;
+  struct wal_waiter *waiter;
+  int code;
+};
 
 struct connection_params {
   /* authentication for this callback */
@@ -47,11 +124,36 @@ struct manager_queue *connection_http_validate_(struct evhttp_request *request,
                                                 int create_new,
                                                 struct evkeyvalq *params);
 
-/* read requests */
+/* read an optional integer parameter between min and max. value is left
+   unchanged if the parameter is not present. if the parameter is invalid the
+   function will return 0 and send an error describing the problem */
+int connection_http_integer_(struct evhttp_request *request,
+                             struct evkeyvalq *params, const char *name,
+                             long long min, long long max, long long *value);
+
+/* read requests. the parameters are read from the body, or from the query
+   string when the body is a raw value or the request has no body */
 int connection_http_read_(struct evhttp_request *request,
                           struct evkeyvalq *params);
 struct json_object *connection_ws_read_(struct evws_message *message);
 
+/* does the request have a raw value as its body rather than parameters */
+int connection_http_is_raw_(struct evhttp_request *request);
+
+/* does the request list deflate in its Accept-Encoding, so a compressed
+   value can be sent as it is stored */
+int connection_http_accepts_deflate_(struct evhttp_request *request);
+
+/* send an item. a raw item has its value sent as the body of the reply
+   without copying it, and everything else about the item in a header.
+   otherwise the reply is put together around the encoding kept with the item
+   so it is only encoded once. a compressed value is sent still compressed if
+   the client accepts deflate, otherwise it is expanded into the reply. the
+   receipt is included for a leased item */
+void connection_http_item_(struct evhttp_request *request,
+                           struct evkeyvalq *params, struct queue_item *item,
+                           int receipt, int raw);
+
 /* create responses. releases `payload` parameter. */
 void connection_http_json_(struct evhttp_request *request,
                            struct evkeyvalq *params,
@@ -79,7 +181,124 @@ void connection_http_callback_new_(struct evhttp_request *request, void *);
 void connection_http_callback_info_(struct evhttp_request *request, void *);
 void connection_http_callback_delete_(struct evhttp_request *request, void *);
 
+/* write the next queues of a list as a comma separated run of quoted ids,
+   visiting at most count queues. returns 1 once the list is finished, 0 if
+   there are queues left and -1 on failure */
+int connection_http_list_write_(struct connection_list *list,
+                                struct evbuffer *buffer, size_t count);
+
+/* does a queue pass the filters of a list */
+int connection_http_list_match_(struct connection_list *list,
+                                struct manager_queue *queue);
+
+/* carry on with a list until it has to wait, for a chunk to be sent or for
+   another shard. the reply is sent, or ended, once the list is finished */
+void connection_http_list_run_(struct connection_list *list);
+
+/* ask the shard being listed for its part of the list. returns 0 on
+   failure */
+int connection_http_list_remote_(struct connection_list *list);
+
+/* give up on a list, sending an error if nothing has been sent yet and
+   cutting the reply short otherwise */
+void connection_http_list_fail_(struct connection_list *list);
+void connection_http_list_free_(struct connection_list *list);
+
+/* connection, timer and shard callbacks for a list */
+void connection_http_list_sent_(struct evhttp_connection *connection,
+                                void *arg);
+void connection_http_list_due_(struct timer_entry *entry, void *arg);
+void connection_http_list_close_(struct evhttp_connection *connection,
+                                 void *arg);
+void connection_http_list_done_(struct evhttp_request *response, void *arg);
+
+/* pass a request on to a shard, sending its reply back as it is */
+void connection_http_forward_(struct evhttp_request *request, int shard);
+
+/* shard and connection callbacks for a forwarded request */
+void connection_http_forward_done_(struct evhttp_request *response,
+                                   void *arg);
+void connection_http_forward_close_(struct evhttp_connection *connection,
+                                    void *arg);
+
+/* start a want from a message in the format of the websocket protocol, for
+   a websocket connection or a request from another shard. a want on a queue
+   another shard owns is passed on to it. returns NULL on success, or a
+   message describing the problem */
+const char *connection_want_start_(struct json_object *message,
+                                   struct evws_connection *connection,
+                                   struct evhttp_request *request);
+
+/* send an item to the shard a want was made on. the reply holds the message
+   the client is sent, followed by a raw value, with the length of the message
+   in the X-Text-Length header */
+void connection_http_want_item_(struct manager_queue_want *want,
+                                struct queue_item *item);
+
+/* connection callback for a want held for another shard */
+void connection_http_want_close_(struct evhttp_connection *connection,
+                                 void *arg);
+
+/* shard callback for a want passed on to the shard that owns its queue,
+   sending the reply on to the client as websocket frames */
+void connection_ws_want_done_(struct evhttp_request *response, void *arg);
+
+/* hold a put on a full queue until there is space. takes over the request
+   parameters */
+void connection_http_put_wait_(struct evhttp_request *request,
+                               struct evkeyvalq *params, struct queue *q,
+                               const char *value, size_t length, int priority,
+                               unsigned long long delay,
+                               unsigned long long ttl);
+
+/* finish a held put, sending the response for the result of queue_put. a
+   result of -2 means the queue was deleted while waiting */
+void connection_http_put_reply_(struct connection_put *put, int result);
+
+/* send a reply that is ready, holding it until the log has reached disk if
+   it has to be */
+void connection_http_send_(struct evhttp_request *request, int code);
+
+/* log and connection callbacks for a held reply */
+void connection_http_durable_(void *arg);
+void connection_http_durable_close_(struct evhttp_connection *connection,
+                                    void *arg);
+
+/* queue, timer and connection callbacks for a held put */
+void connection_http_put_space_(void *arg, int available);
+void connection_http_put_due_(struct timer_entry *entry, void *arg);
+void connection_http_put_close_(struct evhttp_connection *connection,
+                                void *arg);
+
+/* free a request left unanswered when its connection closed, from a close
+   callback */
+void connection_http_request_gone_(struct evhttp_request *request);
+
+/* finish a lease for the ack and nack callbacks */
+void connection_http_callback_finish_(struct evhttp_request *request,
+                                      int acknowledge);
+
+/* read a stream for the take and peek callbacks from the consumer named in
+   the request, after moving it to the offset in the request if there is one.
+   the consumer is moved past the item if advance is set */
+void connection_http_read_stream_(struct evhttp_request *request,
+                                  struct evkeyvalq *params, struct queue *q,
+                                  int advance, int raw);
+
+/* release a value once the output buffer it was added to is done with it */
+void connection_value_cleanup_(const void *data, size_t length, void *arg);
+
+/* send an item to the client that made a want */
+void connection_ws_item_(struct manager_queue_want *want,
+                         struct queue_item *item);
+
+/* send an item that is not raw, put together around the encoding kept with
+   the item */
+void connection_ws_fragment_(struct manager_queue_want *want,
+                             struct queue_item *item);
+
 /* queue callbacks */
 void connection_queue_callback_wait_(struct queue_item *item, void *user);
+int connection_queue_callback_read_(struct queue_item *item, void *user);
 
 #endif
@@ -22,6 +22,8 @@
 
 #include <json-c/json_tokener.h>
 #include <event2/buffer.h>
+#include <stdlib.h>
+#include <string.h>
 #include "connection.h"
 #include "connection-internal.h"
 #include "manager.h"
@@ -65,11 +67,7 @@ int connection_ws_authenticated(struct evhttp_request *request, void *user)
 void connection_ws_callback_wait(struct evws_message *message, void *user)
 {
   struct json_object *request;
-  struct manager_queue *queue;
-  struct manager_queue_want *want;
-  const char *identifier;
-  const char *queue_name;
-  const char *key;
+  const char *error;
 
   request = connection_ws_read_(message);
   if (!request) {
@@ -78,57 +76,158 @@ void connection_ws_callback_wait(struct evws_message *message, void *user)
     return;
   }
 
-  identifier = json_get_string(request, "identifier");
-  if (!identifier) {
-    connection_ws_error_(evws_message_get_connection(message),
-                         "no identifier");
-    goto cleanup;
+  error = connection_want_start_(request,
+                                 evws_message_get_connection(message), NULL);
+  if (error) {
+    connection_ws_error_(evws_message_get_connection(message), error);
   }
 
-  queue_name = json_get_string(request, "queue");
+  json_object_put(request);
+}
+
+void connection_ws_callback_close(struct evws_connection *connection,
+                                  void *user)
+{
+  manager_queue_want_close(connection);
+}
+
+void connection_ws_callback_error(struct evws_connection *connection,
+                                  void *user)
+{
+  manager_queue_want_close(connection);
+}
+
+const char *connection_want_start_(struct json_object *message,
+                                   struct evws_connection *connection,
+                                   struct evhttp_request *request)
+{
+  struct manager_queue *queue;
+  struct manager_queue_want *want;
+  struct shard_forward *forward;
+  struct json_object *offset;
+  struct json_object *raw;
+  struct queue_callback *wait;
+  struct queue_reader *read;
+  struct queue *q;
+  struct evbuffer *body;
+  const char *identifier;
+  const char *queue_name;
+  const char *key;
+  const char *consumer = NULL;
+  const char *repr;
+  int owner;
+  int result;
+
+  identifier = json_get_string(message, "identifier");
   if (!identifier) {
-    connection_ws_error_(evws_message_get_connection(message),
-                         "no queue");
-    goto cleanup;
+    return "no identifier";
+  }
+
+  queue_name = json_get_string(message, "queue");
+  if (!queue_name) {
+    return "no queue";
+  }
+
+  /* a want on a queue another shard owns is passed on to that shard, and
+     the item it gets is sent on from here */
+  owner = manager_queue_owner(queue_name);
+  if (connection && owner >= 0 && owner != shard_get_index()) {
+    want = manager_queue_want_new(identifier, connection, NULL, NULL);
+    if (!want) {
+      return "failed to create want";
+    }
+
+    body = evbuffer_new();
+    repr = json_object_to_json_string_ext(message, JSON_C_TO_STRING_PLAIN);
+    if (!body || !repr || evbuffer_add(body, repr, strlen(repr)) != 0 ||
+        (forward = shard_forward(owner, EVHTTP_REQ_POST, "/shard/want", NULL,
+                                 body, connection_ws_want_done_,
+                                 want)) == NULL) {
+      if (body) {
+        evbuffer_free(body);
+      }
+
+      manager_queue_want_free(want);
+      return "failed to reach shard";
+    }
+
+    evbuffer_free(body);
+    manager_queue_want_set_forward(want, forward);
+    return NULL;
   }
 
   queue = manager_queue_get(queue_name, 0);
   if (!queue) {
-    connection_ws_error_(evws_message_get_connection(message),
-                         "queue not found");
-    goto cleanup;
+    return "queue not found";
   }
 
-  key = json_get_string(request, "key");
-  want = manager_queue_want_new(identifier,
-                                evws_message_get_connection(message), queue);
+  /* a stream is read from a consumer, which can be moved first */
+  q = manager_queue_get_queue(queue);
+  if (queue_get_type(q) == queue_type_stream) {
+    consumer = json_get_string(message, "consumer");
+    if (!consumer) {
+      return "no consumer";
+    }
+
+    if (json_object_object_get_ex(message, "offset", &offset)) {
+      if (!json_object_is_type(offset, json_type_int) ||
+          json_object_get_int64(offset) < 0) {
+        return "invalid offset";
+      }
+
+      if (!queue_seek(q, consumer,
+                      (unsigned long long)json_object_get_int64(offset))) {
+        return "failed to move consumer";
+      }
+    }
+  }
+
+  key = json_get_string(message, "key");
+  want = manager_queue_want_new(identifier, connection, queue, key);
   if (!want) {
-    connection_ws_error_(evws_message_get_connection(message),
-                         "failed to create want");
-    goto cleanup;
+    return "failed to create want";
   }
 
-  if (queue_wait(manager_queue_get_queue(queue), key,
-                 connection_queue_callback_wait_, want) < 0) {
-    manager_queue_want_free(want);
-    connection_ws_error_(evws_message_get_connection(message),
-                         "failed to wait for want");
+  if (json_object_object_get_ex(message, "raw", &raw)) {
+    manager_queue_want_set_raw(want, json_object_get_boolean(raw));
   }
 
-cleanup:
-  json_object_put(request);
-}
+  /* a want for another shard is held on its request, which that shard
+     closes if its client goes away */
+  if (request) {
+    manager_queue_want_set_request(want, request);
+    evhttp_connection_set_closecb(evhttp_request_get_connection(request),
+                                  connection_http_want_close_, want);
+  }
 
-void connection_ws_callback_close(struct evws_connection *connection,
-                                  void *user)
-{
-  manager_queue_want_close(connection);
-}
+  /* a want that is called back straight away has already been freed */
+  if (consumer) {
+    result = queue_read_wait(q, consumer, manager_queue_want_get_key(want),
+                             connection_queue_callback_read_, want, &read);
+    if (result == 0) {
+      manager_queue_want_set_read(want, read);
+    }
+  } else {
+    result = queue_wait(q, manager_queue_want_get_key(want),
+                        connection_queue_callback_wait_, want, &wait);
+    if (result == 0) {
+      manager_queue_want_set_wait(want, wait);
+    }
+  }
 
-void connection_ws_callback_error(struct evws_connection *connection,
-                                  void *user)
-{
-  manager_queue_want_close(connection);
+  if (result < 0) {
+    /* the request is answered by the caller */
+    if (request) {
+      manager_queue_want_set_request(want, NULL);
+      evhttp_connection_set_closecb(evhttp_request_get_connection(request),
+                                    NULL, NULL);
+    }
+
+    manager_queue_want_free(want);
+    return "failed to wait for want";
+  }
+
+  return NULL;
 }
 
 struct json_object *connection_ws_read_(struct evws_message *message)
@@ -199,14 +298,20 @@ void connection_ws_payload_(struct evws_connection *connection,
   connection_ws_json_(connection, object);
 }
 
-void connection_queue_callback_wait_(struct queue_item *item, void *user)
+void connection_ws_item_(struct manager_queue_want *want,
+                         struct queue_item *item)
 {
-  struct manager_queue_want *want = (struct manager_queue_want *)user;
   struct json_object *response = NULL;
   struct json_object *detail = NULL;
+  struct json_object *object;
+  struct queue_value *value;
+  int raw = manager_queue_want_is_raw(want);
+  char *plain = NULL;
 
-  if (manager_queue_want_is_cancelled(want)) {
-    goto cleanup;
+  /* a compressed item is not kept encoded, so it is encoded for each reply */
+  if (!raw && !queue_item_is_compressed(item)) {
+    connection_ws_fragment_(want, item);
+    return;
   }
 
   response = json_object_new_object();
@@ -231,7 +336,9 @@ void connection_queue_callback_wait_(struct queue_item *item, void *user)
     goto cleanup;
   }
 
-  detail = protocol_encode_item(item);
+  /* a raw value follows the item in a binary frame, straight from the item
+     storage */
+  detail = raw ? protocol_encode_item_header(item) : protocol_encode_item(item);
   if (!detail) {
     connection_ws_error_(manager_queue_want_get_connection(want),
                          "failed to add item");
@@ -246,14 +353,46 @@ void connection_queue_callback_wait_(struct queue_item *item, void *user)
     goto cleanup;
   }
 
-  connection_ws_payload_(manager_queue_want_get_connection(want), response);
-  /* both already released by sending the payload */
-  response = NULL;
   detail = NULL;
 
+  object = protocol_create_success(response);
+  response = NULL;
+  if (!object) {
+    connection_ws_error_(manager_queue_want_get_connection(want),
+                         "failed to encode payload");
+    goto cleanup;
+  }
+
+  connection_ws_json_(manager_queue_want_get_connection(want), object);
+
+  if (!raw) {
+    goto cleanup;
+  }
+
+  /* there is no way to mark a frame as compressed, so the value is expanded
+     into a copy */
+  if (queue_item_is_compressed(item)) {
+    plain = malloc(queue_item_get_length(item) + 1/*NULL*/);
+    if (!plain || !queue_item_copy_value(item, plain)) {
+      connection_ws_error_(manager_queue_want_get_connection(want),
+                           "failed to expand item");
+      goto cleanup;
+    }
+
+    evws_connection_send_binary(manager_queue_want_get_connection(want),
+                                (const unsigned char *)plain,
+                                queue_item_get_length(item));
+    goto cleanup;
+  }
+
+  value = queue_value_get(item);
+  evws_connection_send_reference(manager_queue_want_get_connection(want),
+                                 queue_value_get_data(value),
+                                 queue_value_get_length(value),
+                                 connection_value_cleanup_, value);
+
 cleanup:
-  manager_queue_want_free(want);
-  queue_item_free(item);
+  free(plain);
 
   if (response) {
     json_object_put(response);
@@ -263,3 +402,137 @@ cleanup:
     json_object_put(detail);
   }
 }
+
+void connection_ws_fragment_(struct manager_queue_want *want,
+                             struct queue_item *item)
+{
+  struct json_object *identifier;
+  struct evbuffer *message = NULL;
+  const char *fragment;
+  const char *repr;
+  size_t length;
+
+  identifier = json_object_new_string(manager_queue_want_get_identifier(want));
+  if (!identifier) {
+    connection_ws_error_(manager_queue_want_get_connection(want),
+                         "failed to add identifier");
+    return;
+  }
+
+  fragment = protocol_item_fragment(item, &length);
+  if (!fragment) {
+    connection_ws_error_(manager_queue_want_get_connection(want),
+                         "failed to add item");
+    goto cleanup;
+  }
+
+  /* only the identifier is encoded here, the item comes from the encoding
+     kept with it */
+  message = evbuffer_new();
+  repr = json_object_to_json_string_ext(identifier, JSON_C_TO_STRING_PLAIN);
+  if (!message || !repr ||
+      evbuffer_add_printf(message, "%s{\"id\":%s,\"item\":",
+                          PROTOCOL_SUCCESS_PREFIX, repr) < 0 ||
+      evbuffer_add(message, fragment, length) != 0 ||
+      evbuffer_add(message, "}}}", 3 + 1/*NULL*/) != 0) {
+    connection_ws_error_(manager_queue_want_get_connection(want),
+                         "failed to encode payload");
+    goto cleanup;
+  }
+
+  evws_connection_send(manager_queue_want_get_connection(want),
+                       (const char *)evbuffer_pullup(message, -1));
+
+cleanup:
+  if (message) {
+    evbuffer_free(message);
+  }
+
+  json_object_put(identifier);
+}
+
+void connection_queue_callback_wait_(struct queue_item *item, void *user)
+{
+  struct manager_queue_want *want = (struct manager_queue_want *)user;
+
+  manager_queue_want_finish(want);
+  if (manager_queue_want_get_request(want)) {
+    connection_http_want_item_(want, item);
+  } else {
+    connection_ws_item_(want, item);
+  }
+
+  /* the item is released by the queue once this callback returns */
+  manager_queue_want_free(want);
+}
+
+int connection_queue_callback_read_(struct queue_item *item, void *user)
+{
+  struct manager_queue_want *want = (struct manager_queue_want *)user;
+  int used;
+
+  manager_queue_want_finish(want);
+
+  /* the consumer stays where it was if nobody is left to send the item to.
+     a request from another shard is still there until it is closed */
+  if (manager_queue_want_get_request(want)) {
+    used = 1;
+    connection_http_want_item_(want, item);
+  } else {
+    used = evws_connection_is_active(manager_queue_want_get_connection(want));
+    if (used) {
+      connection_ws_item_(want, item);
+    }
+  }
+
+  manager_queue_want_free(want);
+  return used;
+}
+
+void connection_ws_want_done_(struct evhttp_request *response, void *arg)
+{
+  struct manager_queue_want *want = (struct manager_queue_want *)arg;
+  struct evws_connection *connection;
+  struct evbuffer *body;
+  const char *header;
+  char *text = NULL;
+  size_t length;
+  size_t size;
+
+  /* the shard has answered, so there is nothing left to cancel */
+  manager_queue_want_finish(want);
+  connection = manager_queue_want_get_connection(want);
+  if (!response) {
+    connection_ws_error_(connection, "failed to reach shard");
+    goto cleanup;
+  }
+
+  /* the reply is the message for the client, followed by the value of a raw
+     item. a failure is only a message */
+  body = evhttp_request_get_input_buffer(response);
+  size = evbuffer_get_length(body);
+  header = evhttp_find_header(evhttp_request_get_input_headers(response),
+                              "X-Text-Length");
+  length = header ? (size_t)strtoul(header, NULL, 10) : size;
+  if (length > size) {
+    length = size;
+  }
+
+  text = malloc(length + 1/*NULL*/);
+  if (!text || evbuffer_remove(body, text, length) != (int)length) {
+    connection_ws_error_(connection, "failed to read item");
+    goto cleanup;
+  }
+
+  text[length] = '\0';
+  evws_connection_send(connection, text);
+
+  if (length < size) {
+    evws_connection_send_binary(connection, evbuffer_pullup(body, -1),
+                                size - length);
+  }
+
+cleanup:
+  free(text);
+  manager_queue_want_free(want);
+}
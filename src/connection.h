@@ -33,6 +33,20 @@ void connection_http_callback_queue(struct evhttp_request *request, void *);
 void connection_http_callback_take(struct evhttp_request *request, void *);
 void connection_http_callback_peek(struct evhttp_request *request, void *);
 void connection_http_callback_put(struct evhttp_request *request, void *);
+void connection_http_callback_ack(struct evhttp_request *request, void *);
+void connection_http_callback_nack(struct evhttp_request *request, void *);
+void connection_http_callback_stats(struct evhttp_request *request, void *);
+
+/* wait for an item for a websocket client of another shard, see
+   connection_want_start_ */
+void connection_http_callback_want(struct evhttp_request *request, void *);
+
+/* answer a request from another shard for a want whose queue was deleted */
+void connection_http_want_gone(struct evhttp_request *request);
+
+/* answer a request from another shard for a want that was held too long, so
+   the shard makes it again */
+void connection_http_want_retry(struct evhttp_request *request);
 
 /* authentication callback */
 void connection_http_authenticated(struct evhttp_request *request, void *user);
@@ -41,6 +55,10 @@ void *connection_http_auth_callback(struct auth *auth, const char *realm,
                                     void *cb_arg);
 int connection_ws_authenticated(struct evhttp_request *request, void *user);
 
+/* callback for requests from other shards, which carry their secret in place
+   of authentication */
+void connection_http_shard(struct evhttp_request *request, void *user);
+
 /* websocket callbacks */
 void connection_ws_callback_wait(struct evws_message *message, void *);
 void connection_ws_callback_close(struct evws_connection *connection, void *);
@@ -0,0 +1,181 @@
+/*
+  Copyright (c) 2021 Matthew (fkfv).
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "hash.h"
+
+#define HASH_MIN_SIZE 16
+
+/* FNV-1a parameters for the size of size_t */
+#if SIZE_MAX > 0xffffffff
+#define HASH_FNV_OFFSET ((size_t)0xcbf29ce484222325ULL)
+#define HASH_FNV_PRIME ((size_t)0x100000001b3ULL)
+#else
+#define HASH_FNV_OFFSET ((size_t)0x811c9dc5UL)
+#define HASH_FNV_PRIME ((size_t)0x01000193UL)
+#endif
+
+int hash_table_init(struct hash_table *table, size_t size)
+{
+  size_t actual = HASH_MIN_SIZE;
+
+  while (actual < size) {
+    actual <<= 1;
+  }
+
+  table->buckets = calloc(actual, sizeof(struct hash_entry *));
+  if (!table->buckets) {
+    return 0;
+  }
+
+  table->size = actual;
+  table->count = 0;
+
+  return 1;
+}
+
+void hash_table_destroy(struct hash_table *table)
+{
+  free(table->buckets);
+  table->buckets = NULL;
+  table->size = 0;
+  table->count = 0;
+}
+
+/* double the number of buckets, moving every entry to its new chain */
+int hash_table_grow_(struct hash_table *table)
+{
+  struct hash_entry **buckets;
+  struct hash_entry *entry;
+  struct hash_entry *next;
+  size_t size = table->size << 1;
+  size_t index;
+
+  buckets = calloc(size, sizeof(struct hash_entry *));
+  if (!buckets) {
+    return 0;
+  }
+
+  for (index = 0; index < table->size; index++) {
+    entry = table->buckets[index];
+    while (entry != NULL) {
+      next = entry->next;
+      entry->next = buckets[entry->hash & (size - 1)];
+      buckets[entry->hash & (size - 1)] = entry;
+      entry = next;
+    }
+  }
+
+  free(table->buckets);
+  table->buckets = buckets;
+  table->size = size;
+
+  return 1;
+}
+
+int hash_table_insert(struct hash_table *table, struct hash_entry *entry,
+                      size_t hash)
+{
+  struct hash_entry **bucket;
+
+  entry->hash = hash;
+  bucket = &table->buckets[hash & (table->size - 1)];
+  entry->next = *bucket;
+  *bucket = entry;
+  table->count++;
+
+  /* a failed grow only makes the chains longer, the table is still valid */
+  if (table->count > table->size) {
+    return hash_table_grow_(table);
+  }
+
+  return 1;
+}
+
+void hash_table_remove(struct hash_table *table, struct hash_entry *entry)
+{
+  struct hash_entry **link;
+
+  link = &table->buckets[entry->hash & (table->size - 1)];
+  while (*link != NULL) {
+    if (*link == entry) {
+      *link = entry->next;
+      entry->next = NULL;
+      table->count--;
+      return;
+    }
+
+    link = &(*link)->next;
+  }
+}
+
+struct hash_entry *hash_table_find(struct hash_table *table, size_t hash)
+{
+  struct hash_entry *entry;
+
+  entry = table->buckets[hash & (table->size - 1)];
+  while (entry != NULL && entry->hash != hash) {
+    entry = entry->next;
+  }
+
+  return entry;
+}
+
+struct hash_entry *hash_table_next(struct hash_entry *entry)
+{
+  size_t hash = entry->hash;
+
+  entry = entry->next;
+  while (entry != NULL && entry->hash != hash) {
+    entry = entry->next;
+  }
+
+  return entry;
+}
+
+size_t hash_string_case(const char *str)
+{
+  size_t hash = HASH_FNV_OFFSET;
+
+  while (*str) {
+    hash ^= (unsigned char)tolower((unsigned char)*str++);
+    hash *= HASH_FNV_PRIME;
+  }
+
+  return hash;
+}
+
+size_t hash_bytes(const void *data, size_t length)
+{
+  const unsigned char *bytes = data;
+  size_t hash = HASH_FNV_OFFSET;
+
+  while (length--) {
+    hash ^= *bytes++;
+    hash *= HASH_FNV_PRIME;
+  }
+
+  return hash;
+}
@@ -0,0 +1,77 @@
+/*
+  Copyright (c) 2021 Matthew (fkfv).
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+
+/* get the structure containing an embedded hash_entry */
+#define HASH_ENTRY(ptr, type, field)                                     \
+  ((type *)((char *)(ptr) - offsetof(type, field)))
+
+/* an entry in a hash table. this should be embedded in the structure being
+   stored, and the structure found again using HASH_ENTRY */
+struct hash_entry {
+  struct hash_entry *next;
+
+  /* full hash of the entry, kept so the table can grow without rehashing */
+  size_t hash;
+};
+
+/* chained hash table. the number of buckets is always a power of two and will
+   double whenever the table becomes more than full */
+struct hash_table {
+  struct hash_entry **buckets;
+
+  /* number of buckets */
+  size_t size;
+
+  /* number of entries */
+  size_t count;
+};
+
+/* initialise a table with at least size buckets. returns 0 on failure */
+int hash_table_init(struct hash_table *table, size_t size);
+
+/* release the buckets of a table. entries are owned by the caller and will not
+   be touched */
+void hash_table_destroy(struct hash_table *table);
+
+/* add an entry to the table. returns 0 if the table could not grow, but the
+   entry will still have been added */
+int hash_table_insert(struct hash_table *table, struct hash_entry *entry,
+                      size_t hash);
+void hash_table_remove(struct hash_table *table, struct hash_entry *entry);
+
+/* find the first entry matching hash. use hash_table_next to check any other
+   entries with the same hash */
+struct hash_entry *hash_table_find(struct hash_table *table, size_t hash);
+struct hash_entry *hash_table_next(struct hash_entry *entry);
+
+/* case insensitive string hash */
+size_t hash_string_case(const char *str);
+
+/* hash of length bytes of data */
+size_t hash_bytes(const void *data, size_t length);
+
+#endif
@@ -0,0 +1,55 @@
+/*
+  Copyright (c) 2021 Matthew (fkfv).
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#ifndef KEY_INTERNAL_H
+#define KEY_INTERNAL_H
+
+#include "hash.h"
+#include "key.h"
+
+/* number of buckets in the key table when it is first used */
+#define KEY_TABLE_SIZE 256
+
+struct key {
+  struct hash_entry entry;
+
+  /* number of items, callbacks and wants using this key */
+  size_t refcount;
+
+  size_t length;
+
+  /* lower case copy of the key */
+  char string[];
+};
+
+struct key_context {
+  /* every key in use - struct key */
+  struct hash_table keys;
+};
+
+/* the global context instance */
+extern struct key_context key_context_;
+
+/* look up a key in the table, hash must be hash_string_case(string) */
+struct key *key_lookup_(const char *string, size_t hash);
+
+#endif
@@ -0,0 +1,128 @@
+/*
+  Copyright (c) 2021 Matthew (fkfv).
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#include <ctype.h>
+#include <stdlib.h>
+
+#include "key.h"
+#include "key-internal.h"
+#include "strcase.h"
+
+struct key_context key_context_;
+
+struct key *key_intern(const char *string)
+{
+  struct key *key;
+  size_t hash;
+  size_t length;
+  size_t index;
+
+  if (!key_context_.keys.buckets &&
+      !hash_table_init(&key_context_.keys, KEY_TABLE_SIZE)) {
+    return NULL;
+  }
+
+  hash = hash_string_case(string);
+  key = key_lookup_(string, hash);
+  if (key) {
+    return key_ref(key);
+  }
+
+  length = strlen(string);
+  key = malloc(sizeof(struct key) + length + 1/*NULL*/);
+  if (!key) {
+    return NULL;
+  }
+
+  for (index = 0; index <= length; index++) {
+    key->string[index] = (char)tolower((unsigned char)string[index]);
+  }
+
+  key->length = length;
+  key->refcount = 1;
+
+  /* failing to grow the table leaves it usable, so it is not an error */
+  hash_table_insert(&key_context_.keys, &key->entry, hash);
+
+  return key;
+}
+
+struct key *key_find(const char *string)
+{
+  if (!key_context_.keys.buckets) {
+    return NULL;
+  }
+
+  return key_lookup_(string, hash_string_case(string));
+}
+
+struct key *key_ref(struct key *key)
+{
+  key->refcount++;
+  return key;
+}
+
+void key_release(struct key *key)
+{
+  if (--key->refcount != 0) {
+    return;
+  }
+
+  hash_table_remove(&key_context_.keys, &key->entry);
+  free(key);
+}
+
+const char *key_get_string(struct key *key)
+{
+  return key->string;
+}
+
+size_t key_get_length(struct key *key)
+{
+  return key->length;
+}
+
+size_t key_get_hash(struct key *key)
+{
+  return key->entry.hash;
+}
+
+size_t key_get_count(void)
+{
+  return key_context_.keys.count;
+}
+
+struct key *key_lookup_(const char *string, size_t hash)
+{
+  struct hash_entry *entry;
+  struct key *key;
+
+  for (entry = hash_table_find(&key_context_.keys, hash); entry != NULL;
+       entry = hash_table_next(entry)) {
+    key = HASH_ENTRY(entry, struct key, entry);
+    if (!strcasecmp(key->string, string)) {
+      return key;
+    }
+  }
+
+  return NULL;
+}
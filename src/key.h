@@ -0,0 +1,53 @@
+/*
+  Copyright (c) 2021 Matthew (fkfv).
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#ifndef KEY_H
+#define KEY_H
+
+#include <stddef.h>
+
+struct key;
+
+/* get the shared copy of a key, creating it if this is the first use. keys are
+   compared case insensitively, so the stored string is folded to lower case.
+   the returned reference must be released with key_release. returns NULL on
+   failure */
+struct key *key_intern(const char *string);
+
+/* find the shared copy of a key without creating it. the returned pointer is
+   not a new reference, and NULL means no one is using the key */
+struct key *key_find(const char *string);
+
+/* take another reference to a key */
+struct key *key_ref(struct key *key);
+void key_release(struct key *key);
+
+const char *key_get_string(struct key *key);
+size_t key_get_length(struct key *key);
+
+/* case insensitive hash of the key, calculated once when it is interned */
+size_t key_get_hash(struct key *key);
+
+/* number of distinct keys currently interned */
+size_t key_get_count(void);
+
+#endif
@@ -20,20 +20,93 @@
   THE SOFTWARE.
 */
 
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <event2/event.h>
 #include <event2/http.h>
+#include <event2/listener.h>
 
 #include "config.h"
 #include "ws.h"
 #include "manager.h"
 #include "getopt.h"
 #include "ssl.h"
+#include "timer.h"
+#include "spill.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "queue.h"
+#include "shard.h"
 
 #define options "c:h"
 
+/* write a snapshot in the background on each interval. one still being
+   written is left to finish */
+void snapshot_timer(evutil_socket_t fd, short events, void *arg)
+{
+  if (!snapshot_is_running()) {
+    manager_snapshot_background(timer_get_base(), arg);
+  }
+}
+
+/* leave the event loop on SIGINT and SIGTERM, so the server is shut down
+   properly and its queues are written to the snapshot */
+void stop_signal(evutil_socket_t fd, short events, void *arg)
+{
+  event_base_loopexit((struct event_base *)arg, NULL);
+}
+
+/* bind the server to its address. when there are shards, each of them binds
+   a socket of its own to the same port, and the connections are shared out
+   between them by the system */
+int bind_server(struct event_base *base, struct evhttp *http,
+                struct config_server *server)
+{
+  struct evutil_addrinfo hints;
+  struct evutil_addrinfo *addresses = NULL;
+  struct evconnlistener *listener = NULL;
+  char port[8];
+
+  if (shard_get_count() == 1) {
+    return evhttp_bind_socket(http,
+                              config_server_get_hostname(server),
+                              config_server_get_port(server)) == 0;
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = EVUTIL_AI_PASSIVE;
+
+  sprintf(port, "%u", (unsigned int)config_server_get_port(server));
+  if (evutil_getaddrinfo(config_server_get_hostname(server), port, &hints,
+                         &addresses) != 0) {
+    return 0;
+  }
+
+  listener = evconnlistener_new_bind(base, NULL, NULL,
+                                     LEV_OPT_REUSEABLE |
+                                     LEV_OPT_REUSEABLE_PORT |
+                                     LEV_OPT_CLOSE_ON_FREE |
+                                     LEV_OPT_CLOSE_ON_EXEC, -1,
+                                     addresses->ai_addr,
+                                     (int)addresses->ai_addrlen);
+  evutil_freeaddrinfo(addresses);
+  if (!listener) {
+    return 0;
+  }
+
+  if (!evhttp_bind_listener(http, listener)) {
+    evconnlistener_free(listener);
+    return 0;
+  }
+
+  return 1;
+}
+
 int create_server(struct event_base *base, struct config_server *server)
 {
   struct evhttp *http = NULL;
@@ -46,9 +119,7 @@ int create_server(struct event_base *base, struct config_server *server)
     goto error;
   }
 
-  if (evhttp_bind_socket(http,
-                         config_server_get_hostname(server),
-                         config_server_get_port(server)) != 0) {
+  if (!bind_server(base, http, server)) {
     goto error;
   }
 
@@ -148,8 +219,16 @@ int command_line(int argc, char *argv[])
 int main(int argc, char *argv[])
 {
   int c;
+  int result = 0;
   struct config_server *server;
   struct event_base *base;
+  struct event *snapshots = NULL;
+  struct event *interrupt = NULL;
+  struct event *terminate = NULL;
+  struct evhttp *shards = NULL;
+  char *wal_path = NULL;
+  char *snapshot_path = NULL;
+  struct timeval tv;
 #ifdef _WIN32
   WSADATA wsa;
 
@@ -165,13 +244,71 @@ int main(int argc, char *argv[])
     return 1;
   }
 
+  /* the shards are started before anything else, so each of them sets up
+     the rest for itself */
+  if (config_get_shards() > 1 &&
+      (!shard_prepare(config_get_shards()) || shard_spawn() == -1)) {
+    fprintf(stderr, "failed to start shards\n");
+    return 1;
+  }
+
+  /* each shard keeps a snapshot and log of its own queues */
+  if ((config_get_snapshot_path() &&
+       !(snapshot_path = shard_path(config_get_snapshot_path()))) ||
+      (config_get_wal_path() &&
+       !(wal_path = shard_path(config_get_wal_path())))) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+
   base = event_base_new();
   if (!base) {
     fprintf(stderr, "failed to start libevent\n");
     return 1;
   }
 
+  if (!timer_startup(base)) {
+    fprintf(stderr, "failed to start timers\n");
+    return 1;
+  }
+
+  if (config_get_spill_directory() &&
+      !spill_startup(config_get_spill_directory())) {
+    fprintf(stderr, "failed to start spilling\n");
+    return 1;
+  }
+
   manager_startup();
+  /* the budget is shared evenly between the shards */
+  queue_set_memory_budget(config_get_memory_budget() / shard_get_count());
+  queue_set_spill_threshold(config_get_spill_threshold());
+  queue_set_compression(config_get_compression_threshold(),
+                        config_get_compression_level());
+
+  /* queues in the snapshot are only read once they are used */
+  if (snapshot_path && !manager_restore(snapshot_path)) {
+    fprintf(stderr, "failed to read the snapshot\n");
+    return 1;
+  }
+
+  /* the log is started over from the state it was replayed into */
+  if (wal_path) {
+    if (!manager_replay(wal_path)) {
+      fprintf(stderr, "failed to replay the log\n");
+      return 1;
+    }
+
+    if (!wal_startup(base, wal_path, snapshot_get_epoch(),
+                     config_get_wal_sync(), config_get_wal_interval())) {
+      fprintf(stderr, "failed to start the log\n");
+      return 1;
+    }
+
+    if (!manager_log() || !wal_replace()) {
+      fprintf(stderr, "failed to start the log\n");
+      return 1;
+    }
+  }
 
   while ((server = config_iter_server_next()) != NULL) {
     if (!create_server(base, server)) {
@@ -180,16 +317,81 @@ int main(int argc, char *argv[])
     }
   }
 
+  if (shard_get_count() > 1) {
+    shards = evhttp_new(base);
+    if (!shards || !shard_startup(base, shards) ||
+        !manager_add_shard_server(shards)) {
+      fprintf(stderr, "failed to listen for the other shards\n");
+      return 1;
+    }
+  }
+
+  if (snapshot_path && config_get_snapshot_interval() > 0) {
+    tv.tv_sec = (long)(config_get_snapshot_interval() / 1000);
+    tv.tv_usec = (long)(config_get_snapshot_interval() % 1000) * 1000;
+
+    snapshots = event_new(base, -1, EV_PERSIST, snapshot_timer,
+                          snapshot_path);
+    if (!snapshots || evtimer_add(snapshots, &tv) != 0) {
+      fprintf(stderr, "failed to start snapshots\n");
+      return 1;
+    }
+  }
+
+  interrupt = evsignal_new(base, SIGINT, stop_signal, base);
+  terminate = evsignal_new(base, SIGTERM, stop_signal, base);
+  if (!interrupt || !terminate || evsignal_add(interrupt, NULL) != 0 ||
+      evsignal_add(terminate, NULL) != 0) {
+    fprintf(stderr, "failed to handle signals\n");
+    return 1;
+  }
+
   if (event_base_dispatch(base) == -1) {
     fprintf(stderr, "failed to run libevent loop\n");
     return 1;
   }
 
+  /* the rest are stopped when one shard stops, and the queues of each are
+     kept as if it had been told to */
+  if (shard_has_failed()) {
+    fprintf(stderr, "stopping with another shard\n");
+    result = 1;
+  }
+
+  event_free(interrupt);
+  event_free(terminate);
+  if (snapshots) {
+    event_free(snapshots);
+  }
+
+  /* queues are freed on shutdown, not deleted. the snapshot takes over from
+     the log, which is skipped from then on. a snapshot still being written
+     in the background is stopped first, so its branch of the log is not
+     lost if it was already written */
+  snapshot_cancel();
+  wal_shutdown();
+  if (snapshot_path && !manager_snapshot(snapshot_path)) {
+    fprintf(stderr, "failed to write the snapshot\n");
+    result = 1;
+  }
+
   manager_shutdown();
+  snapshot_close();
+  spill_shutdown();
+
+  if (shards) {
+    evhttp_free(shards);
+  }
+
+  /* the shards that were started here are stopped along with it */
+  shard_shutdown();
+  timer_shutdown();
+  free(snapshot_path);
+  free(wal_path);
 
 #ifdef _WIN32
   WSACleanup();
 #endif
 
-  return 0;
+  return result;
 }
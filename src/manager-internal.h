@@ -27,32 +27,94 @@
 #include "ws.h"
 #include "queue-compat.h"
 #include "queue.h"
+#include "hash.h"
+#include "key.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "timer.h"
+
+/* number of buckets in the queue table when it is first used */
+#define MANAGER_QUEUE_TABLE_SIZE 256
+
+/* idle queues are swept for every this many milliseconds, looking at this
+   many queues each time */
+#define MANAGER_SWEEP_INTERVAL 100
+#define MANAGER_SWEEP_BATCH 64
 
 struct manager_queue {
   TAILQ_ENTRY(manager_queue) next;
 
-  /* queue being managed */
+  /* wants waiting on the queue */
+  LIST_HEAD(mqwhead, manager_queue_want) wants;
+
+  /* entry in the table of queues, hashed on uuid */
+  struct hash_entry entry;
+
+  /* queue being managed, NULL until a queue from the snapshot is first used */
   struct queue *q;
 
-  /* cached pretty print id of queue */
+  /* the queue in the snapshot it was restored from, or NULL */
+  const struct snapshot_queue *snapshot;
+
+  /* cached pretty print id of queue, and the bytes of the uuid it is for */
   char id[QUEUE_UUID_STR_LEN + 1/*NULL*/];
+  unsigned char uuid[QUEUE_UUID_LEN];
+
+  /* time the queue was created or restored, and last used, from timer_now */
+  unsigned long long created;
+  unsigned long long used;
+};
+
+/* a position in the queues, moved on when the queue it is at is freed */
+struct manager_cursor {
+  LIST_ENTRY(manager_cursor) next;
+
+  /* the next queue to visit, NULL once every queue has been visited */
+  struct manager_queue *queue;
 };
 
 /* details of a waiting event */
 struct manager_queue_want {
-  TAILQ_ENTRY(manager_queue_want) next;
+  /* position in the wants of its queue, and of its connection */
+  LIST_ENTRY(manager_queue_want) queuenext;
+  LIST_ENTRY(manager_queue_want) clientnext;
+
+  /* is the want in the lists of its queue and connection */
+  int linked;
+
+  /* the wait in the queue until it calls back, one of these is set while
+     the want is waiting */
+  struct queue_callback *wait;
+  struct queue_reader *read;
 
   /* an identifier so the client can identify this response */
   char *identifier;
 
-  /* if the want is cancelled */
-  int cancelled;
+  /* is the value sent as a binary frame of its own */
+  int raw;
 
   /* the queue a want is waiting on */
   struct manager_queue *queue;
 
+  /* interned key the want is waiting on, NULL for any item */
+  struct key *key;
+
   /* websocket connection to the client */
   struct evws_connection *client;
+
+  /* request from another shard the want is held for, and the request passing
+     it on to the shard that owns its queue */
+  struct evhttp_request *request;
+  struct shard_forward *forward;
+
+  /* runs out once the request has been held for SHARD_HOLD_TIMEOUT */
+  struct timer_entry hold;
+};
+
+/* the wants of a websocket connection, kept as the data of the connection
+   from its first want until it closes */
+struct manager_client {
+  LIST_HEAD(mcwhead, manager_queue_want) wants;
 };
 
 struct manager_server {
@@ -65,14 +127,88 @@ struct manager_server {
 struct manager_context {
   LIST_HEAD(mshead, manager_server) servers;
 
-  /* queues being managed */
+  /* queues being managed, in the order they were added, and by uuid */
   TAILQ_HEAD(mqhead, manager_queue) queues;
+  struct hash_table table;
+
+  /* cursors open on the queues */
+  LIST_HEAD(mchead, manager_cursor) cursors;
 
-  /* all queue items being waited on */
-  TAILQ_HEAD(mqwhead, manager_queue_want) wants;
+  /* the sweep for idle queues, which carries on from its cursor each time
+     and starts over once it reaches the end */
+  struct timer_entry sweep_timer;
+  struct manager_cursor sweep;
+  struct manager_gc_stats gc;
+
+  /* is the log being replayed. queues loaded from the snapshot meanwhile are
+     only finished once the log has been read */
+  int replaying;
 };
 
 /* the global context instance */
 extern struct manager_context manager_context_;
 
+/* free the next batch of idle queues, see queue_set_idle */
+void manager_sweep_(struct timer_entry *entry, void *arg);
+
+/* has the queue gone unused for longer than it is kept idle */
+int manager_queue_is_idle_(struct manager_queue *queue, unsigned long long now);
+
+/* take a want out of the lists of its queue and connection */
+void manager_queue_want_unlink_(struct manager_queue_want *want);
+
+/* give up on a want held for another shard, which asks for it again */
+void manager_queue_want_due_(struct timer_entry *entry, void *arg);
+
+/* find a queue by uuid without loading it from the snapshot */
+struct manager_queue *manager_queue_find_(
+  const unsigned char r[QUEUE_UUID_LEN]);
+
+/* add a queue with its id set to the list and the table of queues. returns 0
+   on failure */
+int manager_queue_add_(struct manager_queue *queue);
+
+/* convert an id into the bytes of a uuid, in the order they are written.
+   returns 0 if the id is invalid */
+int manager_queue_parse_id_(const char *id, unsigned char r[QUEUE_UUID_LEN]);
+
+/* value of a hex digit, -1 if c is not one */
+int manager_hex_digit_(int c);
+
+/* read a queue from the snapshot the first time it is used. returns 0 on
+   failure */
+int manager_queue_load_(struct manager_queue *queue);
+
+/* callback for each record of a queue loaded from the snapshot */
+int manager_queue_load_record_(int type, const void *data, size_t length,
+                               void *arg);
+
+/* callback for each queue in the snapshot, adding it without loading it */
+int manager_restore_(const char *id, const struct snapshot_queue *snapshot,
+                     void *arg);
+
+/* write every queue to the snapshot being written. returns 0 on failure */
+int manager_snapshot_write_(void *arg);
+
+/* open the snapshot just written at path and point the queues at where they
+   are in it. returns 0 on failure */
+int manager_snapshot_reopen_(const char *path);
+
+/* callback for a snapshot written in the background, swapping in the branch
+   of the log and the new snapshot if it was written */
+void manager_snapshot_done_(const char *path, int committed, void *arg);
+
+/* callback for each queue in a snapshot that was just written, pointing the
+   queues at where they are in it. queues deleted since the snapshot was
+   started are skipped */
+int manager_snapshot_rebind_(const char *id,
+                             const struct snapshot_queue *snapshot, void *arg);
+
+/* write a record that only holds the id of the queue to the log */
+void manager_log_queue_(enum wal_record type, struct manager_queue *queue);
+
+/* callback for each record replayed from the log */
+int manager_replay_(enum wal_record type, const void *data, size_t length,
+                    void *arg);
+
 #endif
@@ -24,15 +24,16 @@
 #include <json-c/json_tokener.h>
 #include <event2/buffer.h>
 #include <event2/keyvalq_struct.h>
-#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "manager.h"
 #include "manager-internal.h"
-#include "hostnet.h"
-#include "strcase.h"
 #include "protocol.h"
 #include "connection.h"
+#include "spill.h"
+#include "timer.h"
+#include "shard.h"
 
 struct manager_context manager_context_;
 
@@ -40,7 +41,13 @@ void manager_startup(void)
 {
   LIST_INIT(&manager_context_.servers);
   TAILQ_INIT(&manager_context_.queues);
-  TAILQ_INIT(&manager_context_.wants);
+  LIST_INIT(&manager_context_.cursors);
+
+  /* the sweep only finds queues once the server is running */
+  manager_context_.sweep.queue = NULL;
+  LIST_INSERT_HEAD(&manager_context_.cursors, &manager_context_.sweep, next);
+  timer_entry_init(&manager_context_.sweep_timer, manager_sweep_, NULL);
+  timer_schedule(&manager_context_.sweep_timer, MANAGER_SWEEP_INTERVAL);
 }
 
 int manager_add_server(struct evhttp *http, struct evws *ws, struct auth *auth,
@@ -72,6 +79,15 @@ int manager_add_server(struct evhttp *http, struct evws *ws, struct auth *auth,
     evhttp_set_cb(http, "/put", connection_http_authenticated,
                   connection_http_auth_callback(auth, auth_realm,
                   connection_http_callback_put, NULL));
+    evhttp_set_cb(http, "/ack", connection_http_authenticated,
+                  connection_http_auth_callback(auth, auth_realm,
+                  connection_http_callback_ack, NULL));
+    evhttp_set_cb(http, "/nack", connection_http_authenticated,
+                  connection_http_auth_callback(auth, auth_realm,
+                  connection_http_callback_nack, NULL));
+    evhttp_set_cb(http, "/stats", connection_http_authenticated,
+                  connection_http_auth_callback(auth, auth_realm,
+                  connection_http_callback_stats, NULL));
 
     evws_set_upgrade_cb(ws, connection_ws_authenticated,
                         connection_http_auth_callback(auth, auth_realm,
@@ -83,6 +99,9 @@ int manager_add_server(struct evhttp *http, struct evws *ws, struct auth *auth,
     evhttp_set_cb(http, "/take", connection_http_callback_take, NULL);
     evhttp_set_cb(http, "/peek", connection_http_callback_peek, NULL);
     evhttp_set_cb(http, "/put", connection_http_callback_put, NULL);
+    evhttp_set_cb(http, "/ack", connection_http_callback_ack, NULL);
+    evhttp_set_cb(http, "/nack", connection_http_callback_nack, NULL);
+    evhttp_set_cb(http, "/stats", connection_http_callback_stats, NULL);
   }
 
   /* create ws callbacks */
@@ -95,9 +114,66 @@ int manager_add_server(struct evhttp *http, struct evws *ws, struct auth *auth,
   return 1;
 }
 
+int manager_add_shard_server(struct evhttp *http)
+{
+  void *queues;
+  void *queue;
+  void *take;
+  void *peek;
+  void *put;
+  void *ack;
+  void *nack;
+  void *stats;
+  void *want;
+
+  /* requests from the other shards were already authenticated by the shard
+     they came to, they only have to show the secret the shards share */
+  queues = connection_http_auth_callback(NULL, NULL,
+                                         connection_http_callback_queues, NULL);
+  queue = connection_http_auth_callback(NULL, NULL,
+                                        connection_http_callback_queue, NULL);
+  take = connection_http_auth_callback(NULL, NULL,
+                                       connection_http_callback_take, NULL);
+  peek = connection_http_auth_callback(NULL, NULL,
+                                       connection_http_callback_peek, NULL);
+  put = connection_http_auth_callback(NULL, NULL,
+                                      connection_http_callback_put, NULL);
+  ack = connection_http_auth_callback(NULL, NULL,
+                                      connection_http_callback_ack, NULL);
+  nack = connection_http_auth_callback(NULL, NULL,
+                                       connection_http_callback_nack, NULL);
+  stats = connection_http_auth_callback(NULL, NULL,
+                                        connection_http_callback_stats, NULL);
+  want = connection_http_auth_callback(NULL, NULL,
+                                       connection_http_callback_want, NULL);
+  if (!queues || !queue || !take || !peek || !put || !ack || !nack ||
+      !stats || !want) {
+    free(queues);
+    free(queue);
+    free(take);
+    free(peek);
+    free(put);
+    free(ack);
+    free(nack);
+    free(stats);
+    free(want);
+    return 0;
+  }
+
+  evhttp_set_cb(http, "/queues", connection_http_shard, queues);
+  evhttp_set_cb(http, "/queue", connection_http_shard, queue);
+  evhttp_set_cb(http, "/take", connection_http_shard, take);
+  evhttp_set_cb(http, "/peek", connection_http_shard, peek);
+  evhttp_set_cb(http, "/put", connection_http_shard, put);
+  evhttp_set_cb(http, "/ack", connection_http_shard, ack);
+  evhttp_set_cb(http, "/nack", connection_http_shard, nack);
+  evhttp_set_cb(http, "/stats", connection_http_shard, stats);
+  evhttp_set_cb(http, "/shard/want", connection_http_shard, want);
+  return 1;
+}
+
 void manager_shutdown(void)
 {
-  struct manager_queue_want *want;
   struct manager_queue *queue;
   struct manager_server *server;
 
@@ -107,75 +183,161 @@ void manager_shutdown(void)
     evhttp_del_cb(server->http, "/take");
     evhttp_del_cb(server->http, "/peek");
     evhttp_del_cb(server->http, "/put");
+    evhttp_del_cb(server->http, "/ack");
+    evhttp_del_cb(server->http, "/nack");
+    evhttp_del_cb(server->http, "/stats");
 
     evws_unbind_path(server->ws, "/take/ws");
-  }
 
-  while ((want = TAILQ_FIRST(&manager_context_.wants)) != NULL) {
-    /* removes self from queue */
-    manager_queue_want_free(want);
+    LIST_REMOVE(server, next);
+    free(server);
   }
 
   while ((queue = TAILQ_FIRST(&manager_context_.queues)) != NULL) {
-    /* removes self from queue */
+    /* removes self from queue, along with its wants */
     manager_queue_free(queue);
   }
+
+  timer_cancel(&manager_context_.sweep_timer);
+  LIST_REMOVE(&manager_context_.sweep, next);
+  hash_table_destroy(&manager_context_.table);
+}
+
+int manager_restore(const char *path)
+{
+  return snapshot_open(path) && snapshot_foreach(manager_restore_, NULL);
+}
+
+int manager_replay(const char *path)
+{
+  struct manager_queue *queue;
+  int result;
+
+  /* a log started before the current snapshot is already part of it */
+  manager_context_.replaying = 1;
+  result = wal_replay(path, snapshot_get_epoch(), manager_replay_, NULL);
+  manager_context_.replaying = 0;
+
+  TAILQ_FOREACH(queue, &manager_context_.queues, next) {
+    if (queue->q) {
+      queue_replay_finish(queue->q);
+    }
+  }
+
+  return result;
+}
+
+int manager_log(void)
+{
+  struct manager_queue *queue;
+
+  /* queues that were never loaded are still the same as in the snapshot. any
+     other queue replaces the one in the snapshot once its new record is
+     replayed */
+  TAILQ_FOREACH(queue, &manager_context_.queues, next) {
+    if (!queue->q) {
+      continue;
+    }
+
+    manager_log_queue_(wal_record_queue_new, queue);
+    if (!queue_log(queue->q, wal_reserve_callback, NULL)) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+int manager_snapshot(const char *path)
+{
+  /* a snapshot being written in the background would be replaced anyway */
+  snapshot_cancel();
+
+  if (!snapshot_begin(path, snapshot_get_epoch() + 1)) {
+    return 0;
+  }
+
+  if (!manager_snapshot_write_(NULL)) {
+    snapshot_abort();
+    return 0;
+  }
+
+  return snapshot_commit() && manager_snapshot_reopen_(path);
+}
+
+int manager_snapshot_background(struct event_base *base, const char *path)
+{
+  unsigned long long epoch = snapshot_get_epoch() + 1;
+  struct manager_queue *queue;
+  size_t count = 0;
+
+  if (snapshot_is_running()) {
+    return 0;
+  }
+
+  TAILQ_FOREACH(queue, &manager_context_.queues, next) {
+    count++;
+  }
+
+  /* the branch is started at the same point the copy of the queues is made,
+     so it holds exactly what the snapshot does not */
+  if (wal_is_enabled() && !wal_branch(epoch)) {
+    return 0;
+  }
+
+  spill_hold(1);
+
+  if (!snapshot_background(base, path, epoch, count, manager_snapshot_write_,
+                           manager_snapshot_done_, NULL)) {
+    spill_hold(0);
+    wal_branch_abort();
+    return 0;
+  }
+
+  return 1;
 }
 
 struct manager_queue *manager_queue_get(const char name[QUEUE_UUID_STR_LEN],
                                         int create_new)
 {
   unsigned char r[QUEUE_UUID_LEN];
-  unsigned char *used_r = r;
   struct manager_queue *q;
 
   if (name) {
     /* always fail if an invalid ID was given */
-    if (strlen(name) != QUEUE_UUID_STR_LEN) {
+    if (!manager_queue_parse_id_(name, r)) {
       return NULL;
     }
 
-    /* see if an existing queue is found */
-    TAILQ_FOREACH(q, &manager_context_.queues, next) {
-      if (!strcasecmp(q->id, name)) {
-        return q;
+    /* see if an existing queue is found, reading it from the snapshot if this
+       is the first time it is used */
+    q = manager_queue_find_(r);
+    if (q) {
+      if (!q->q && !manager_queue_load_(q)) {
+        return NULL;
       }
+
+      q->used = timer_now();
+      return q;
     }
 
     /* name wasn't found and not creating new - fail */
     if (!create_new) {
       return NULL;
     }
-
-    /* the name will be in string format, it needs to be converted into byte
-     format. since some of the bytes are read as integers, they need to be
-     swapped to network byte order */
-    if (sscanf(name, "%8llx-%4lx-%4lx-%4lx-%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx",
-               (unsigned long long *)&r[0],
-               (unsigned long *)&r[4],
-               (unsigned long *)&r[6],
-               (unsigned long *)&r[8],
-               &r[10],
-               &r[11],
-               &r[12],
-               &r[13],
-               &r[14],
-               &r[15]) != 10) {
-      return NULL;
-    }
-
-    *(unsigned long *)&r[0] = htonl(*(unsigned long *)&r[0]);
-    *(unsigned short *)&r[4] = htons(*(unsigned short *)&r[4]);
-    *(unsigned short *)&r[6] = htons(*(unsigned short *)&r[6]);
-    *(unsigned short *)&r[8] = htons(*(unsigned short *)&r[8]);
   } else {
     /* no name and create new not specified - always fails */
     if (!create_new) {
       return NULL;
     }
 
-    /* set r null so a random id is generated for this queue */
-    used_r = NULL;
+    /* a random id is generated for this queue, one that this shard owns so
+       requests for it are sent here */
+    do {
+      if (!queue_generate_uuid(r)) {
+        return NULL;
+      }
+    } while (shard_get_owner(r) != shard_get_index());
   }
 
   /* try to create a new manager queue */
@@ -185,7 +347,7 @@ struct manager_queue *manager_queue_get(const char name[QUEUE_UUID_STR_LEN],
   }
 
   /* create the queue object */
-  q->q = queue_new(used_r);
+  q->q = queue_new(r);
   if (!q->q) {
     free(q);
     return NULL;
@@ -194,22 +356,92 @@ struct manager_queue *manager_queue_get(const char name[QUEUE_UUID_STR_LEN],
   /* cache the id of the new queue */
   queue_get_uuid(q->q, q->id);
 
-  TAILQ_INSERT_TAIL(&manager_context_.queues, q, next);
+  if (!manager_queue_add_(q)) {
+    queue_free(q->q);
+    free(q);
+    return NULL;
+  }
+
+  if (wal_is_enabled()) {
+    manager_log_queue_(wal_record_queue_new, q);
+  }
+
   return q;
 }
 
 void manager_queue_free(struct manager_queue *queue)
 {
+  struct manager_cursor *cursor;
+
+  /* the wants are cancelled while the queue is still there to cancel them
+     in */
+  manager_queue_want_remove(queue);
+
+  LIST_FOREACH(cursor, &manager_context_.cursors, next) {
+    if (cursor->queue == queue) {
+      cursor->queue = TAILQ_NEXT(queue, next);
+    }
+  }
+
+  if (wal_is_enabled()) {
+    manager_log_queue_(wal_record_queue_free, queue);
+  }
+
   TAILQ_REMOVE(&manager_context_.queues, queue, next);
-  queue_free(queue->q);
+  hash_table_remove(&manager_context_.table, &queue->entry);
+  if (queue->q) {
+    queue_free(queue->q);
+  }
   free(queue);
 }
 
+void manager_get_gc_stats(struct manager_gc_stats *stats)
+{
+  *stats = manager_context_.gc;
+}
+
+struct manager_queue *manager_queue_find(const char name[QUEUE_UUID_STR_LEN])
+{
+  unsigned char r[QUEUE_UUID_LEN];
+
+  if (!manager_queue_parse_id_(name, r)) {
+    return NULL;
+  }
+
+  return manager_queue_find_(r);
+}
+
+int manager_queue_owner(const char *name)
+{
+  unsigned char r[QUEUE_UUID_LEN];
+
+  if (!manager_queue_parse_id_(name, r)) {
+    return -1;
+  }
+
+  return shard_get_owner(r);
+}
+
 struct manager_queue_want *manager_queue_want_new(const char *id,
                                                   struct evws_connection *con,
-                                                  struct manager_queue *queue)
+                                                  struct manager_queue *queue,
+                                                  const char *key)
 {
   struct manager_queue_want *want;
+  struct manager_client *client = NULL;
+
+  if (con) {
+    client = evws_connection_get_data(con);
+    if (!client) {
+      client = calloc(1, sizeof(struct manager_client));
+      if (!client) {
+        return NULL;
+      }
+
+      LIST_INIT(&client->wants);
+      evws_connection_set_data(con, client);
+    }
+  }
 
   want = calloc(1, sizeof(struct manager_queue_want));
   if (!want) {
@@ -222,24 +454,124 @@ struct manager_queue_want *manager_queue_want_new(const char *id,
     return NULL;
   }
 
+  if (key) {
+    want->key = key_intern(key);
+    if (!want->key) {
+      free(want->identifier);
+      free(want);
+      return NULL;
+    }
+  }
+
   want->client = con;
   want->queue = queue;
 
-  TAILQ_INSERT_TAIL(&manager_context_.wants, want, next);
+  if (queue) {
+    LIST_INSERT_HEAD(&queue->wants, want, queuenext);
+  }
+
+  if (client) {
+    LIST_INSERT_HEAD(&client->wants, want, clientnext);
+  }
 
+  want->linked = 1;
   return want;
 }
 
 void manager_queue_want_free(struct manager_queue_want *want)
 {
-  TAILQ_REMOVE(&manager_context_.wants, want, next);
+  manager_queue_want_unlink_(want);
+
+  /* a want freed before its wait called back is cancelled, so no item is
+     given to it */
+  if (want->wait) {
+    queue_wait_cancel(want->wait);
+  }
+
+  if (want->read) {
+    queue_read_wait_cancel(want->read);
+  }
+
+  if (want->forward) {
+    shard_forward_cancel(want->forward);
+  }
+
+  /* the shard the want came from is told its queue went away */
+  timer_cancel(&want->hold);
+  if (want->request) {
+    connection_http_want_gone(want->request);
+  }
+
+  if (want->key) {
+    key_release(want->key);
+  }
   free(want->identifier);
   free(want);
 }
 
-int manager_queue_want_is_cancelled(struct manager_queue_want *want)
+void manager_queue_want_set_wait(struct manager_queue_want *want,
+                                 struct queue_callback *wait)
+{
+  want->wait = wait;
+}
+
+void manager_queue_want_set_read(struct manager_queue_want *want,
+                                 struct queue_reader *read)
 {
-  return want->cancelled;
+  want->read = read;
+}
+
+void manager_queue_want_finish(struct manager_queue_want *want)
+{
+  want->wait = NULL;
+  want->read = NULL;
+  want->forward = NULL;
+  manager_queue_want_unlink_(want);
+}
+
+void manager_queue_want_set_request(struct manager_queue_want *want,
+                                    struct evhttp_request *request)
+{
+  want->request = request;
+
+  /* the shard is answered before its request to this one times out */
+  timer_cancel(&want->hold);
+  if (request) {
+    timer_entry_init(&want->hold, manager_queue_want_due_, want);
+    timer_schedule(&want->hold, SHARD_HOLD_TIMEOUT);
+  }
+}
+
+void manager_queue_want_due_(struct timer_entry *entry, void *arg)
+{
+  struct manager_queue_want *want = (struct manager_queue_want *)arg;
+  struct evhttp_request *request = want->request;
+
+  want->request = NULL;
+  manager_queue_want_free(want);
+  connection_http_want_retry(request);
+}
+
+struct evhttp_request *manager_queue_want_get_request(
+  struct manager_queue_want *want)
+{
+  return want->request;
+}
+
+void manager_queue_want_set_forward(struct manager_queue_want *want,
+                                    struct shard_forward *forward)
+{
+  want->forward = forward;
+}
+
+void manager_queue_want_set_raw(struct manager_queue_want *want, int raw)
+{
+  want->raw = raw;
+}
+
+int manager_queue_want_is_raw(struct manager_queue_want *want)
+{
+  return want->raw;
 }
 
 struct evws_connection *manager_queue_want_get_connection(
@@ -253,16 +585,31 @@ const char *manager_queue_want_get_identifier(struct manager_queue_want *want)
   return want->identifier;
 }
 
+const char *manager_queue_want_get_key(struct manager_queue_want *want)
+{
+  return want->key ? key_get_string(want->key) : NULL;
+}
+
 struct queue *manager_queue_get_queue(struct manager_queue *queue)
 {
   return queue->q;
 }
 
+int manager_queue_is_loaded(struct manager_queue *queue)
+{
+  return queue->q != NULL;
+}
+
 const char *manager_queue_get_id(struct manager_queue *queue)
 {
   return queue->id;
 }
 
+unsigned long long manager_queue_get_age(struct manager_queue *queue)
+{
+  return timer_now() - queue->created;
+}
+
 int manager_queue_foreach(int(*cb)(struct manager_queue *, void *), void *arg)
 {
   struct manager_queue *queue;
@@ -279,34 +626,402 @@ int manager_queue_foreach(int(*cb)(struct manager_queue *, void *), void *arg)
   return 1;
 }
 
-void manager_queue_want_remove(struct manager_queue *queue)
+struct manager_cursor *manager_cursor_new(struct manager_queue *after)
 {
-  struct manager_queue_want *want;
-  struct manager_queue_want *next;
+  struct manager_cursor *cursor;
+
+  cursor = malloc(sizeof(struct manager_cursor));
+  if (!cursor) {
+    return NULL;
+  }
 
-  want = TAILQ_FIRST(&manager_context_.wants);
-  while (want != NULL) {
-    next = TAILQ_NEXT(want, next);
-    if (want->queue == queue) {
-      want->cancelled = 1;
+  if (after) {
+    cursor->queue = TAILQ_NEXT(after, next);
+  } else {
+    cursor->queue = TAILQ_FIRST(&manager_context_.queues);
+  }
+
+  LIST_INSERT_HEAD(&manager_context_.cursors, cursor, next);
+  return cursor;
+}
+
+struct manager_queue *manager_cursor_next(struct manager_cursor *cursor)
+{
+  struct manager_queue *queue;
+
+  queue = cursor->queue;
+  if (queue) {
+    cursor->queue = TAILQ_NEXT(queue, next);
+  }
+
+  return queue;
+}
+
+void manager_cursor_free(struct manager_cursor *cursor)
+{
+  LIST_REMOVE(cursor, next);
+  free(cursor);
+}
+
+void manager_sweep_(struct timer_entry *entry, void *arg)
+{
+  struct manager_queue *queue;
+  unsigned long long now;
+  int count;
+
+  if (!manager_context_.sweep.queue) {
+    manager_context_.sweep.queue = TAILQ_FIRST(&manager_context_.queues);
+  }
+
+  now = timer_now();
+  for (count = 0; count < MANAGER_SWEEP_BATCH; count++) {
+    queue = manager_cursor_next(&manager_context_.sweep);
+    if (!queue) {
+      break;
+    }
+
+    if (manager_queue_is_idle_(queue, now)) {
+      manager_context_.gc.queues++;
+      manager_context_.gc.bytes += sizeof(struct manager_queue) +
+                                   queue_get_footprint(queue->q);
+      manager_queue_free(queue);
     }
+  }
+
+  timer_schedule(&manager_context_.sweep_timer, MANAGER_SWEEP_INTERVAL);
+}
 
-    want = next;
+int manager_queue_is_idle_(struct manager_queue *queue, unsigned long long now)
+{
+  unsigned long long idle;
+
+  /* a queue still in the snapshot is left alone until it is used */
+  if (!queue->q) {
+    return 0;
+  }
+
+  idle = queue_get_idle(queue->q);
+  return idle != 0 && now - queue->used >= idle &&
+         LIST_EMPTY(&queue->wants) && queue_is_unused(queue->q);
+}
+
+struct manager_queue *manager_queue_find_(
+  const unsigned char r[QUEUE_UUID_LEN])
+{
+  struct hash_entry *entry;
+  struct manager_queue *q;
+
+  if (!manager_context_.table.buckets) {
+    return NULL;
+  }
+
+  for (entry = hash_table_find(&manager_context_.table,
+                               hash_bytes(r, QUEUE_UUID_LEN));
+       entry != NULL; entry = hash_table_next(entry)) {
+    q = HASH_ENTRY(entry, struct manager_queue, entry);
+    if (memcmp(q->uuid, r, QUEUE_UUID_LEN) == 0) {
+      return q;
+    }
+  }
+
+  return NULL;
+}
+
+int manager_queue_add_(struct manager_queue *queue)
+{
+  if (!manager_context_.table.buckets &&
+      !hash_table_init(&manager_context_.table, MANAGER_QUEUE_TABLE_SIZE)) {
+    return 0;
+  }
+
+  if (!manager_queue_parse_id_(queue->id, queue->uuid)) {
+    return 0;
+  }
+
+  /* failing to grow the table leaves it usable, so it is not an error */
+  hash_table_insert(&manager_context_.table, &queue->entry,
+                    hash_bytes(queue->uuid, QUEUE_UUID_LEN));
+  TAILQ_INSERT_TAIL(&manager_context_.queues, queue, next);
+  queue->created = timer_now();
+  queue->used = queue->created;
+
+  return 1;
+}
+
+int manager_queue_parse_id_(const char *id, unsigned char r[QUEUE_UUID_LEN])
+{
+  size_t index;
+  int high;
+  int low;
+
+  /* the id is written as 8-4-4-4-12 hex digits, two to each byte of the uuid
+     in order. either case is accepted */
+  for (index = 0; index < QUEUE_UUID_LEN; index++) {
+    if ((index == 4 || index == 6 || index == 8 || index == 10) &&
+        *id++ != '-') {
+      return 0;
+    }
+
+    high = manager_hex_digit_((unsigned char)id[0]);
+    if (high < 0) {
+      return 0;
+    }
+
+    low = manager_hex_digit_((unsigned char)id[1]);
+    if (low < 0) {
+      return 0;
+    }
+
+    r[index] = (unsigned char)(high << 4 | low);
+    id += 2;
+  }
+
+  return *id == '\0';
+}
+
+int manager_hex_digit_(int c)
+{
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+
+  return -1;
+}
+
+int manager_queue_load_(struct manager_queue *queue)
+{
+  unsigned char r[QUEUE_UUID_LEN];
+
+  if (!queue->snapshot || !manager_queue_parse_id_(queue->id, r)) {
+    return 0;
+  }
+
+  queue->q = queue_new(r);
+  if (!queue->q) {
+    return 0;
+  }
+
+  if (!snapshot_load(queue->snapshot, manager_queue_load_record_, queue->q)) {
+    queue_free(queue->q);
+    queue->q = NULL;
+    return 0;
+  }
+
+  /* records for the queue may still be to come from the log */
+  if (!manager_context_.replaying) {
+    queue_replay_finish(queue->q);
+  }
+
+  return 1;
+}
+
+int manager_queue_load_record_(int type, const void *data, size_t length,
+                               void *arg)
+{
+  return queue_replay((struct queue *)arg, type, data, length);
+}
+
+int manager_restore_(const char *id, const struct snapshot_queue *snapshot,
+                     void *arg)
+{
+  struct manager_queue *q;
+
+  q = calloc(1, sizeof(struct manager_queue));
+  if (!q) {
+    return 0;
+  }
+
+  strcpy(q->id, id);
+  q->snapshot = snapshot;
+
+  if (!manager_queue_add_(q)) {
+    free(q);
+    return 0;
+  }
+
+  return 1;
+}
+
+int manager_snapshot_write_(void *arg)
+{
+  struct manager_queue *queue;
+
+  TAILQ_FOREACH(queue, &manager_context_.queues, next) {
+    if (!snapshot_add_queue(queue->id)) {
+      return 0;
+    }
+
+    if (queue->q) {
+      if (!queue_log(queue->q, snapshot_reserve, NULL)) {
+        return 0;
+      }
+    } else if (!snapshot_copy(queue->snapshot)) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+int manager_snapshot_reopen_(const char *path)
+{
+  struct manager_queue *queue;
+
+  /* the old snapshot has been closed, the queues are found again in the new
+     one in the same order they were written */
+  TAILQ_FOREACH(queue, &manager_context_.queues, next) {
+    queue->snapshot = NULL;
+  }
+
+  queue = TAILQ_FIRST(&manager_context_.queues);
+  return snapshot_open(path) &&
+         snapshot_foreach(manager_snapshot_rebind_, &queue);
+}
+
+void manager_snapshot_done_(const char *path, int committed, void *arg)
+{
+  spill_hold(0);
+
+  if (!committed) {
+    wal_branch_abort();
+    return;
+  }
+
+  /* queues that were never loaded still point into the old snapshot until
+     the new one is opened */
+  snapshot_close();
+  manager_snapshot_reopen_(path);
+
+  if (!wal_is_enabled() || wal_branch_commit()) {
+    return;
+  }
+
+  /* the log follows on from the old snapshot, which is gone. it is started
+     over from the current state instead */
+  if (wal_restart(snapshot_get_epoch()) && manager_log()) {
+    wal_replace();
+  }
+}
+
+int manager_snapshot_rebind_(const char *id,
+                             const struct snapshot_queue *snapshot, void *arg)
+{
+  struct manager_queue **queue = arg;
+
+  /* queues are never reordered, only deleted or added at the end, so a
+     queue in the snapshot that is not the next one has been deleted */
+  if (*queue && strcmp((*queue)->id, id) == 0) {
+    (*queue)->snapshot = snapshot;
+    *queue = TAILQ_NEXT(*queue, next);
+  }
+
+  return 1;
+}
+
+void manager_log_queue_(enum wal_record type, struct manager_queue *queue)
+{
+  void *record;
+
+  record = wal_reserve(type, QUEUE_UUID_STR_LEN);
+  if (record) {
+    memcpy(record, queue->id, QUEUE_UUID_STR_LEN);
+  }
+}
+
+int manager_replay_(enum wal_record type, const void *data, size_t length,
+                    void *arg)
+{
+  char id[QUEUE_UUID_STR_LEN + 1/*NULL*/];
+  unsigned char r[QUEUE_UUID_LEN];
+  struct manager_queue *queue;
+
+  /* every record starts with the id of the queue it belongs to */
+  if (length < QUEUE_UUID_STR_LEN) {
+    return 0;
+  }
+
+  memcpy(id, data, QUEUE_UUID_STR_LEN);
+  id[QUEUE_UUID_STR_LEN] = '\0';
+
+  if (!manager_queue_parse_id_(id, r)) {
+    return 0;
+  }
+
+  switch (type) {
+  case wal_record_queue_new:
+    /* a queue written out again replaces the one in the snapshot */
+    queue = manager_queue_find_(r);
+    if (queue) {
+      manager_queue_free(queue);
+    }
+
+    return manager_queue_get(id, 1) != NULL;
+  case wal_record_queue_free:
+    queue = manager_queue_find_(r);
+    if (queue) {
+      manager_queue_free(queue);
+    }
+
+    return 1;
+  default:
+    queue = manager_queue_get(id, 0);
+    if (!queue) {
+      return 0;
+    }
+
+    return queue_replay(queue->q, type, data, length);
+  }
+}
+
+void manager_queue_want_remove(struct manager_queue *queue)
+{
+  struct manager_queue_want *want;
+
+  while ((want = LIST_FIRST(&queue->wants)) != NULL) {
+    /* removes self from queue */
+    manager_queue_want_free(want);
   }
 }
 
 void manager_queue_want_close(struct evws_connection *connection)
 {
+  struct manager_client *client = evws_connection_get_data(connection);
   struct manager_queue_want *want;
-  struct manager_queue_want *next;
 
-  want = TAILQ_FIRST(&manager_context_.wants);
-  while (want != NULL) {
-    next = TAILQ_NEXT(want, next);
-    if (want->client == connection) {
-      want->cancelled = 1;
-    }
+  if (!client) {
+    return;
+  }
 
-    want = next;
+  while ((want = LIST_FIRST(&client->wants)) != NULL) {
+    /* removes self from connection */
+    manager_queue_want_free(want);
+  }
+
+  evws_connection_set_data(connection, NULL);
+  free(client);
+}
+
+void manager_queue_want_unlink_(struct manager_queue_want *want)
+{
+  if (!want->linked) {
+    return;
   }
+
+  if (want->queue) {
+    LIST_REMOVE(want, queuenext);
+  }
+
+  if (want->client) {
+    LIST_REMOVE(want, clientnext);
+  }
+
+  want->linked = 0;
 }
@@ -23,6 +23,7 @@
 #ifndef MANAGER_H
 #define MANAGER_H
 
+#include <event2/event.h>
 #include <event2/http.h>
 #include "ws.h"
 #include "queue.h"
@@ -30,24 +31,84 @@
 
 struct manager_queue;
 struct manager_queue_want;
+struct manager_cursor;
+struct shard_forward;
+
+/* queues freed for going unused for longer than their idle time, and the
+   memory given back by freeing them */
+struct manager_gc_stats {
+  unsigned long long queues;
+  unsigned long long bytes;
+};
 
 void manager_startup(void);
 int manager_add_server(struct evhttp *http, struct evws *ws, struct auth *auth,
                        const char *realm);
+
+/* serve the requests other shards pass on to this one with http, see
+   shard_startup */
+int manager_add_shard_server(struct evhttp *http);
 void manager_shutdown(void);
 
+/* add every queue in the snapshot at path. the queues are only read from the
+   snapshot once they are first used, so this takes about as long as reading
+   the list of queues. returns 0 on failure */
+int manager_restore(const char *path);
+
+/* rebuild the queues from the log at path, on top of any restored from the
+   snapshot. this must be done before the log is started. returns 0 on
+   failure */
+int manager_replay(const char *path);
+
+/* write every queue that has been changed since the snapshot and its items to
+   the log, so a new log can be started from the current state. returns 0 on
+   failure */
+int manager_log(void);
+
+/* write every queue to a new snapshot at path, which replaces the mapped
+   snapshot. queues that were never loaded are copied straight from the old
+   snapshot. returns 0 on failure */
+int manager_snapshot(const char *path);
+
+/* start writing a new snapshot at path in the background, like
+   manager_snapshot. the server carries on meanwhile, and anything logged
+   since the snapshot started is kept in a branch of the log that replaces the
+   log once the snapshot is written. returns 0 on failure or if a snapshot is
+   already being written */
+int manager_snapshot_background(struct event_base *base, const char *path);
+
 struct manager_queue *manager_queue_get(const char name[QUEUE_UUID_STR_LEN],
                                         int create_new);
 void manager_queue_free(struct manager_queue *queue);
 
+void manager_get_gc_stats(struct manager_gc_stats *stats);
+
+/* find a queue without reading it from the snapshot. returns NULL if the name
+   is invalid or the queue does not exist */
+struct manager_queue *manager_queue_find(const char name[QUEUE_UUID_STR_LEN]);
+
+/* the shard that owns the queue with a name, -1 if the name is invalid */
+int manager_queue_owner(const char *name);
+
 /* get the queue being managed. the returned queue MUST NOT be destroyed */
 struct queue *manager_queue_get_queue(struct manager_queue *queue);
 
+/* has the queue been read from the snapshot yet. a queue returned by
+   manager_queue_get always has been */
+int manager_queue_is_loaded(struct manager_queue *queue);
+
 const char *manager_queue_get_id(struct manager_queue *queue);
 
+/* milliseconds since the queue was created, or restored when the server
+   started */
+unsigned long long manager_queue_get_age(struct manager_queue *queue);
+
+/* a want made on another shard has no connection, and one passed on to the
+   shard that owns its queue has no queue */
 struct manager_queue_want *manager_queue_want_new(const char *id,
                                                   struct evws_connection *con,
-                                                  struct manager_queue *queue);
+                                                  struct manager_queue *queue,
+                                                  const char *key);
 void manager_queue_want_free(struct manager_queue_want *want);
 
 /* iterate each queue, calling cb with the item. if one of the callbacks return
@@ -55,15 +116,55 @@ void manager_queue_want_free(struct manager_queue_want *want);
    returns 1 */
 int manager_queue_foreach(int(*cb)(struct manager_queue *, void *), void *arg);
 
-/* remove all wants for this queue */
+/* open a cursor on the queues, for visiting them over more than one callback.
+   the cursor starts at the first queue, or the queue after `after` if it is
+   not NULL. a queue freed while the cursor is at it is skipped, and queues
+   added meanwhile are visited if the cursor has not reached the end */
+struct manager_cursor *manager_cursor_new(struct manager_queue *after);
+
+/* the next queue of the cursor, NULL once every queue has been visited */
+struct manager_queue *manager_cursor_next(struct manager_cursor *cursor);
+void manager_cursor_free(struct manager_cursor *cursor);
+
+/* cancel and free all wants for this queue. this is done by
+   manager_queue_free as well */
 void manager_queue_want_remove(struct manager_queue *queue);
 
-/* remove all wants for a closed connection */
+/* cancel and free all wants for a closed connection */
 void manager_queue_want_close(struct evws_connection *connection);
 
-int manager_queue_want_is_cancelled(struct manager_queue_want *want);
+/* set the wait in the queue a want is waiting on, which is cancelled if the
+   want is freed before it calls back */
+void manager_queue_want_set_wait(struct manager_queue_want *want,
+                                 struct queue_callback *wait);
+void manager_queue_want_set_read(struct manager_queue_want *want,
+                                 struct queue_reader *read);
+
+/* called once the wait of a want has called back. the want is taken out of
+   its queue and connection, so closing either while the item is sent leaves
+   it alone. it still has to be freed */
+void manager_queue_want_finish(struct manager_queue_want *want);
+
+/* the request from another shard a want is held for, which is answered if the
+   want is freed before it calls back. the want is freed and the shard asked
+   to make the request again once it has been held for SHARD_HOLD_TIMEOUT */
+void manager_queue_want_set_request(struct manager_queue_want *want,
+                                    struct evhttp_request *request);
+struct evhttp_request *manager_queue_want_get_request(
+  struct manager_queue_want *want);
+
+/* the request passing a want on to the shard that owns its queue, which is
+   cancelled if the want is freed before it calls back */
+void manager_queue_want_set_forward(struct manager_queue_want *want,
+                                    struct shard_forward *forward);
 struct evws_connection *manager_queue_want_get_connection(
   struct manager_queue_want *want);
 const char *manager_queue_want_get_identifier(struct manager_queue_want *want);
+const char *manager_queue_want_get_key(struct manager_queue_want *want);
+
+/* should the value of the item be sent as a binary frame of its own, after
+   the rest of the item, rather than inside it */
+void manager_queue_want_set_raw(struct manager_queue_want *want, int raw);
+int manager_queue_want_is_raw(struct manager_queue_want *want);
 
 #endif
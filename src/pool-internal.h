@@ -0,0 +1,74 @@
+/*
+  Copyright (c) 2021 Matthew (fkfv).
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#ifndef POOL_INTERNAL_H
+#define POOL_INTERNAL_H
+
+#include "queue-compat.h"
+#include "pool.h"
+
+/* size and alignment of a slab. objects find their slab by masking their
+   address, so this must be a power of two */
+#define POOL_SLAB_SIZE 65536
+
+/* initialise a pool for objects of the given size */
+#define POOL_INITIALIZER(size) { (size), 0, { NULL }, { NULL }, 0, 0, 0, 0 }
+
+/* a block of memory holding objects of a single size */
+struct pool_slab {
+  LIST_ENTRY(pool_slab) next;
+
+  /* pool the slab belongs to */
+  struct pool *pool;
+
+  /* objects that have been released back to this slab */
+  void *free;
+
+  /* number of objects handed out, and number ever carved from the slab */
+  size_t used;
+  size_t carved;
+};
+
+struct pool {
+  /* size of each object, rounded up to keep objects aligned */
+  size_t size;
+
+  /* number of objects that fit in one slab, calculated on first use */
+  size_t per_slab;
+
+  /* slabs with space available, and slabs that are full */
+  LIST_HEAD(pshead, pool_slab) partial;
+  LIST_HEAD(pfhead, pool_slab) full;
+
+  size_t slab_count;
+  size_t used_count;
+  unsigned long long allocations;
+  unsigned long long releases;
+};
+
+struct pool_slab *pool_slab_new_(struct pool *pool);
+void pool_slab_free_(struct pool_slab *slab);
+
+/* the first object in a slab, objects start after the aligned header */
+char *pool_slab_objects_(struct pool_slab *slab);
+
+#endif
@@ -0,0 +1,157 @@
+/*
+  Copyright (c) 2021 Matthew (fkfv).
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "pool.h"
+#include "pool-internal.h"
+
+/* alignment of every object handed out */
+#define POOL_ALIGN 16
+#define POOL_ROUND(size) (((size) + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1))
+
+void *pool_alloc(struct pool *pool)
+{
+  struct pool_slab *slab;
+  void *object;
+
+  if (pool->per_slab == 0) {
+    pool->size = POOL_ROUND(pool->size < sizeof(void *) ? sizeof(void *) :
+                            pool->size);
+    pool->per_slab = (POOL_SLAB_SIZE - POOL_ROUND(sizeof(struct pool_slab))) /
+                     pool->size;
+    if (pool->per_slab == 0) {
+      return NULL;
+    }
+  }
+
+  slab = LIST_FIRST(&pool->partial);
+  if (!slab) {
+    slab = pool_slab_new_(pool);
+    if (!slab) {
+      return NULL;
+    }
+  }
+
+  /* prefer reusing released objects, they are more likely to be cached */
+  if (slab->free) {
+    object = slab->free;
+    slab->free = *(void **)object;
+  } else {
+    object = pool_slab_objects_(slab) + slab->carved * pool->size;
+    slab->carved++;
+  }
+
+  slab->used++;
+  if (slab->used == pool->per_slab) {
+    LIST_REMOVE(slab, next);
+    LIST_INSERT_HEAD(&pool->full, slab, next);
+  }
+
+  pool->used_count++;
+  pool->allocations++;
+
+  return object;
+}
+
+void pool_free(void *object)
+{
+  struct pool_slab *slab;
+  struct pool *pool;
+
+  slab = (struct pool_slab *)((uintptr_t)object &
+                              ~(uintptr_t)(POOL_SLAB_SIZE - 1));
+  pool = slab->pool;
+
+  *(void **)object = slab->free;
+  slab->free = object;
+
+  if (slab->used == pool->per_slab) {
+    LIST_REMOVE(slab, next);
+    LIST_INSERT_HEAD(&pool->partial, slab, next);
+  }
+
+  slab->used--;
+  pool->used_count--;
+  pool->releases++;
+
+  /* give empty slabs back, but keep one around so a queue that is repeatedly
+     emptied and filled does not allocate a slab every time */
+  if (slab->used == 0 &&
+      (LIST_NEXT(slab, next) != NULL || LIST_FIRST(&pool->partial) != slab)) {
+    LIST_REMOVE(slab, next);
+    pool_slab_free_(slab);
+  }
+}
+
+void pool_get_stats(struct pool *pool, struct pool_stats *stats)
+{
+  stats->object_size = pool->size;
+  stats->slab_count = pool->slab_count;
+  stats->object_count = pool->slab_count * pool->per_slab;
+  stats->used_count = pool->used_count;
+  stats->allocations = pool->allocations;
+  stats->releases = pool->releases;
+}
+
+struct pool_slab *pool_slab_new_(struct pool *pool)
+{
+  struct pool_slab *slab;
+
+#ifdef _WIN32
+  slab = _aligned_malloc(POOL_SLAB_SIZE, POOL_SLAB_SIZE);
+  if (!slab) {
+    return NULL;
+  }
+#else
+  if (posix_memalign((void **)&slab, POOL_SLAB_SIZE, POOL_SLAB_SIZE) != 0) {
+    return NULL;
+  }
+#endif
+
+  slab->pool = pool;
+  slab->free = NULL;
+  slab->used = 0;
+  slab->carved = 0;
+
+  pool->slab_count++;
+  LIST_INSERT_HEAD(&pool->partial, slab, next);
+
+  return slab;
+}
+
+void pool_slab_free_(struct pool_slab *slab)
+{
+  slab->pool->slab_count--;
+
+#ifdef _WIN32
+  _aligned_free(slab);
+#else
+  free(slab);
+#endif
+}
+
+char *pool_slab_objects_(struct pool_slab *slab)
+{
+  return (char *)slab + POOL_ROUND(sizeof(struct pool_slab));
+}
@@ -0,0 +1,56 @@
+/*
+  Copyright (c) 2021 Matthew (fkfv).
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+struct pool;
+
+/* usage of a pool. for allocations that were too large for any pool the
+   object_size is 0 and there are no slabs */
+struct pool_stats {
+  /* size of each object in the pool */
+  size_t object_size;
+
+  /* number of slabs currently allocated, and objects they can hold */
+  size_t slab_count;
+  size_t object_count;
+
+  /* objects currently handed out */
+  size_t used_count;
+
+  /* lifetime number of allocations and releases */
+  unsigned long long allocations;
+  unsigned long long releases;
+};
+
+/* allocate an object from the pool. the memory is not cleared */
+void *pool_alloc(struct pool *pool);
+
+/* return an object to the pool it was allocated from */
+void pool_free(void *object);
+
+void pool_get_stats(struct pool *pool, struct pool_stats *stats);
+
+#endif
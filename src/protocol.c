@@ -20,7 +20,10 @@
   THE SOFTWARE.
 */
 
+#include <stdlib.h>
+
 #include "protocol.h"
+#include "manager.h"
 
 struct json_object *protocol_create_success(json_object *payload)
 {
@@ -108,11 +111,110 @@ const char *protocol_failure_message(void)
   return "cannot describe error";
 }
 
+/* add an integer attribute to an object, returning 0 on failure */
+int protocol_add_integer_(struct json_object *object, const char *key,
+                          long long value)
+{
+  struct json_object *integer;
+
+  integer = json_object_new_int64(value);
+  if (!integer) {
+    return 0;
+  }
+
+  if (json_object_object_add_ex(object, key, integer,
+                                JSON_C_OBJECT_ADD_KEY_IS_NEW |
+                                JSON_C_OBJECT_KEY_IS_CONSTANT) != 0) {
+    json_object_put(integer);
+    return 0;
+  }
+
+  return 1;
+}
+
 struct json_object *protocol_encode_item(struct queue_item *item)
+{
+  struct json_object *base;
+  struct json_object *value = NULL;
+  char *plain = NULL;
+
+  base = protocol_encode_item_header(item);
+  if (!base) {
+    return NULL;
+  }
+
+  /* a compressed value is expanded just for the encoding */
+  if (queue_item_is_compressed(item)) {
+    plain = malloc(queue_item_get_length(item) + 1/*NULL*/);
+    if (!plain || !queue_item_copy_value(item, plain)) {
+      goto error;
+    }
+  }
+
+  /* json-c escapes any NULLs in the value */
+  value = json_object_new_string_len(plain ? plain : queue_item_get_value(item),
+                                     (int)queue_item_get_length(item));
+  free(plain);
+  plain = NULL;
+
+  if (!value || json_object_object_add_ex(base, "value", value,
+                                          JSON_C_OBJECT_ADD_KEY_IS_NEW |
+                                          JSON_C_OBJECT_KEY_IS_CONSTANT) != 0) {
+    goto error;
+  }
+
+  return base;
+
+error:
+  json_object_put(base);
+
+  if (value) {
+    json_object_put(value);
+  }
+
+  free(plain);
+  return NULL;
+}
+
+const char *protocol_item_fragment(struct queue_item *item, size_t *length)
+{
+  struct json_object *object;
+  const char *fragment;
+  const char *repr;
+  size_t repr_length;
+
+  /* keeping the encoding would keep the value uncompressed as well */
+  if (queue_item_is_compressed(item)) {
+    return NULL;
+  }
+
+  fragment = queue_item_get_encoded(item, length);
+  if (fragment) {
+    return fragment;
+  }
+
+  object = protocol_encode_item(item);
+  if (!object) {
+    return NULL;
+  }
+
+  /* the closing brace is left off */
+  repr = json_object_to_json_string_length(object, JSON_C_TO_STRING_PLAIN,
+                                           &repr_length);
+  if (!repr || repr_length < 2 ||
+      !queue_item_set_encoded(item, repr, repr_length - 1)) {
+    json_object_put(object);
+    return NULL;
+  }
+
+  json_object_put(object);
+  return queue_item_get_encoded(item, length);
+}
+
+struct json_object *protocol_encode_item_header(struct queue_item *item)
 {
   struct json_object *base = NULL;
   struct json_object *key = NULL;
-  struct json_object *value = NULL;
   const char *item_key;
 
   base = json_object_new_object();
@@ -136,9 +238,17 @@ struct json_object *protocol_encode_item(struct queue_item *item)
   }
   key = NULL;
 
-  value = json_object_new_string(queue_item_get_value(item));
-  if (!value || json_object_object_add_ex(base, "value", value,
-                                          JSON_C_OBJECT_ADD_KEY_IS_NEW) != 0) {
+  if (!protocol_add_integer_(base, "length",
+                             (long long)queue_item_get_length(item)) ||
+      !protocol_add_integer_(base, "priority",
+                             queue_item_get_priority(item))) {
+    goto error;
+  }
+
+  /* only items read from a stream have an offset */
+  if (queue_item_get_offset(item) != 0 &&
+      !protocol_add_integer_(base, "offset",
+                             (long long)queue_item_get_offset(item))) {
     goto error;
   }
 
@@ -149,10 +259,6 @@ error:
     json_object_put(base);
   }
 
-  if (value) {
-    json_object_put(value);
-  }
-
   if (key) {
     json_object_put(key);
   }
@@ -160,3 +266,429 @@ error:
   return NULL;
 }
 
+int protocol_add_receipt(struct json_object *object, struct queue_item *item)
+{
+  char buffer[QUEUE_RECEIPT_STR_LEN + 1/*NULL*/];
+  struct json_object *receipt;
+
+  queue_item_get_receipt(item, buffer);
+
+  receipt = json_object_new_string(buffer);
+  if (!receipt) {
+    return 0;
+  }
+
+  if (json_object_object_add_ex(object, "receipt", receipt,
+                                JSON_C_OBJECT_ADD_KEY_IS_NEW |
+                                JSON_C_OBJECT_KEY_IS_CONSTANT) != 0) {
+    json_object_put(receipt);
+    return 0;
+  }
+
+  return 1;
+}
+
+int protocol_add_queue_stats(struct json_object *object,
+                             struct queue_stats *stats)
+{
+  struct json_object *compression;
+  struct json_object *policy;
+  struct json_object *type;
+
+  if (!protocol_add_integer_(object, "items", (long long)stats->items) ||
+      !protocol_add_integer_(object, "delayed", (long long)stats->delayed) ||
+      !protocol_add_integer_(object, "leased", (long long)stats->leased) ||
+      !protocol_add_integer_(object, "ttl", (long long)stats->ttl) ||
+      !protocol_add_integer_(object, "idle", (long long)stats->idle) ||
+      !protocol_add_integer_(object, "expired", (long long)stats->expired) ||
+      !protocol_add_integer_(object, "bytes", (long long)stats->bytes) ||
+      !protocol_add_integer_(object, "max_items",
+                             (long long)stats->max_items) ||
+      !protocol_add_integer_(object, "max_bytes",
+                             (long long)stats->max_bytes) ||
+      !protocol_add_integer_(object, "dropped", (long long)stats->dropped) ||
+      !protocol_add_integer_(object, "memory", (long long)stats->memory) ||
+      !protocol_add_integer_(object, "spilled", (long long)stats->spilled)) {
+    return 0;
+  }
+
+  compression = protocol_encode_compression_stats(&stats->compression);
+  if (!compression) {
+    return 0;
+  }
+
+  if (json_object_object_add_ex(object, "compression", compression,
+                                JSON_C_OBJECT_ADD_KEY_IS_NEW |
+                                JSON_C_OBJECT_KEY_IS_CONSTANT) != 0) {
+    json_object_put(compression);
+    return 0;
+  }
+
+  policy = json_object_new_string(queue_policy_to_string(stats->policy));
+  if (!policy) {
+    return 0;
+  }
+
+  if (json_object_object_add_ex(object, "policy", policy,
+                                JSON_C_OBJECT_ADD_KEY_IS_NEW |
+                                JSON_C_OBJECT_KEY_IS_CONSTANT) != 0) {
+    json_object_put(policy);
+    return 0;
+  }
+
+  type = json_object_new_string(queue_type_to_string(stats->type));
+  if (!type) {
+    return 0;
+  }
+
+  if (json_object_object_add_ex(object, "type", type,
+                                JSON_C_OBJECT_ADD_KEY_IS_NEW |
+                                JSON_C_OBJECT_KEY_IS_CONSTANT) != 0) {
+    json_object_put(type);
+    return 0;
+  }
+
+  if (stats->type == queue_type_stream &&
+      (!protocol_add_integer_(object, "first", (long long)stats->first) ||
+       !protocol_add_integer_(object, "next", (long long)stats->next) ||
+       !protocol_add_integer_(object, "consumers",
+                              (long long)stats->consumers))) {
+    return 0;
+  }
+
+  return 1;
+}
+
+/* add latency percentiles as an object attribute, returning 0 on failure */
+int protocol_add_latency_(struct json_object *object, const char *key,
+                          struct wal_latency *latency)
+{
+  struct json_object *percentiles;
+
+  percentiles = json_object_new_object();
+  if (!percentiles) {
+    return 0;
+  }
+
+  if (!protocol_add_integer_(percentiles, "count",
+                             (long long)latency->count) ||
+      !protocol_add_integer_(percentiles, "p50", (long long)latency->p50) ||
+      !protocol_add_integer_(percentiles, "p99", (long long)latency->p99) ||
+      !protocol_add_integer_(percentiles, "p999", (long long)latency->p999) ||
+      !protocol_add_integer_(percentiles, "max", (long long)latency->max) ||
+      json_object_object_add_ex(object, key, percentiles,
+                                JSON_C_OBJECT_ADD_KEY_IS_NEW |
+                                JSON_C_OBJECT_KEY_IS_CONSTANT) != 0) {
+    json_object_put(percentiles);
+    return 0;
+  }
+
+  return 1;
+}
+
+struct json_object *protocol_encode_wal_stats(struct wal_stats *stats)
+{
+  struct json_object *wal;
+  struct json_object *sync = NULL;
+
+  wal = json_object_new_object();
+  if (!wal) {
+    return NULL;
+  }
+
+  if (!protocol_add_integer_(wal, "batches", (long long)stats->batches) ||
+      !protocol_add_integer_(wal, "records", (long long)stats->records) ||
+      !protocol_add_integer_(wal, "bytes", (long long)stats->bytes) ||
+      !protocol_add_integer_(wal, "syncs", (long long)stats->syncs) ||
+      !protocol_add_integer_(wal, "failures", (long long)stats->failures) ||
+      !protocol_add_latency_(wal, "submit", &stats->submit) ||
+      !protocol_add_latency_(wal, "commit", &stats->commit)) {
+    goto error;
+  }
+
+  sync = json_object_new_string(wal_sync_to_string(stats->sync));
+  if (!sync || json_object_object_add_ex(wal, "sync", sync,
+                                         JSON_C_OBJECT_ADD_KEY_IS_NEW |
+                                         JSON_C_OBJECT_KEY_IS_CONSTANT) != 0) {
+    goto error;
+  }
+
+  return wal;
+
+error:
+  json_object_put(wal);
+
+  if (sync) {
+    json_object_put(sync);
+  }
+
+  return NULL;
+}
+
+struct json_object *protocol_encode_snapshot_stats(
+  struct snapshot_stats *stats)
+{
+  struct json_object *snapshot;
+  struct json_object *running;
+
+  snapshot = json_object_new_object();
+  if (!snapshot) {
+    return NULL;
+  }
+
+  running = json_object_new_boolean(stats->running);
+  if (!running || json_object_object_add_ex(snapshot, "running", running,
+                                            JSON_C_OBJECT_ADD_KEY_IS_NEW |
+                                            JSON_C_OBJECT_KEY_IS_CONSTANT) !=
+                  0) {
+    if (running) {
+      json_object_put(running);
+    }
+
+    json_object_put(snapshot);
+    return NULL;
+  }
+
+  if (!protocol_add_integer_(snapshot, "total", (long long)stats->total) ||
+      !protocol_add_integer_(snapshot, "queues", (long long)stats->queues) ||
+      !protocol_add_integer_(snapshot, "bytes", (long long)stats->bytes) ||
+      !protocol_add_integer_(snapshot, "cow", (long long)stats->cow) ||
+      !protocol_add_integer_(snapshot, "completed",
+                             (long long)stats->completed) ||
+      !protocol_add_integer_(snapshot, "failed", (long long)stats->failed) ||
+      !protocol_add_integer_(snapshot, "last_fork",
+                             (long long)stats->last_fork) ||
+      !protocol_add_integer_(snapshot, "last_duration",
+                             (long long)stats->last_duration) ||
+      !protocol_add_integer_(snapshot, "last_bytes",
+                             (long long)stats->last_bytes) ||
+      !protocol_add_integer_(snapshot, "last_cow",
+                             (long long)stats->last_cow)) {
+    json_object_put(snapshot);
+    return NULL;
+  }
+
+  return snapshot;
+}
+
+struct json_object *protocol_encode_spill_stats(
+  struct queue_spill_stats *stats)
+{
+  struct json_object *spill;
+
+  spill = json_object_new_object();
+  if (!spill) {
+    return NULL;
+  }
+
+  if (!protocol_add_integer_(spill, "threshold", (long long)stats->threshold) ||
+      !protocol_add_integer_(spill, "items", (long long)stats->items) ||
+      !protocol_add_integer_(spill, "files", (long long)stats->files) ||
+      !protocol_add_integer_(spill, "bytes", (long long)stats->bytes) ||
+      !protocol_add_integer_(spill, "spilled", (long long)stats->spilled) ||
+      !protocol_add_integer_(spill, "spilled_bytes",
+                             (long long)stats->spilled_bytes) ||
+      !protocol_add_integer_(spill, "filled", (long long)stats->filled) ||
+      !protocol_add_integer_(spill, "filled_bytes",
+                             (long long)stats->filled_bytes) ||
+      !protocol_add_integer_(spill, "lost", (long long)stats->lost)) {
+    json_object_put(spill);
+    return NULL;
+  }
+
+  return spill;
+}
+
+struct json_object *protocol_encode_gc_stats(struct manager_gc_stats *stats)
+{
+  struct json_object *gc;
+
+  gc = json_object_new_object();
+  if (!gc) {
+    return NULL;
+  }
+
+  if (!protocol_add_integer_(gc, "queues", (long long)stats->queues) ||
+      !protocol_add_integer_(gc, "bytes", (long long)stats->bytes)) {
+    json_object_put(gc);
+    return NULL;
+  }
+
+  return gc;
+}
+
+struct json_object *protocol_encode_shard(int index, int count)
+{
+  struct json_object *shard;
+
+  shard = json_object_new_object();
+  if (!shard) {
+    return NULL;
+  }
+
+  if (!protocol_add_integer_(shard, "index", index) ||
+      !protocol_add_integer_(shard, "count", count)) {
+    json_object_put(shard);
+    return NULL;
+  }
+
+  return shard;
+}
+
+struct json_object *protocol_encode_compression_stats(
+  struct queue_compression_stats *stats)
+{
+  struct json_object *compression;
+  struct json_object *ratio;
+
+  compression = json_object_new_object();
+  if (!compression) {
+    return NULL;
+  }
+
+  if (!protocol_add_integer_(compression, "threshold",
+                             (long long)stats->threshold) ||
+      !protocol_add_integer_(compression, "level", stats->level) ||
+      !protocol_add_integer_(compression, "items", (long long)stats->items) ||
+      !protocol_add_integer_(compression, "bytes_in",
+                             (long long)stats->bytes_in) ||
+      !protocol_add_integer_(compression, "bytes_out",
+                             (long long)stats->bytes_out) ||
+      !protocol_add_integer_(compression, "decompressed",
+                             (long long)stats->decompressed) ||
+      !protocol_add_integer_(compression, "compress_time",
+                             (long long)stats->compress_time) ||
+      !protocol_add_integer_(compression, "decompress_time",
+                             (long long)stats->decompress_time)) {
+    json_object_put(compression);
+    return NULL;
+  }
+
+  /* how many times smaller the compressed values are, 0 if there are none */
+  ratio = json_object_new_double(stats->bytes_out ?
+                                   (double)stats->bytes_in /
+                                   (double)stats->bytes_out : 0.0);
+  if (!ratio) {
+    json_object_put(compression);
+    return NULL;
+  }
+
+  if (json_object_object_add_ex(compression, "ratio", ratio,
+                                JSON_C_OBJECT_ADD_KEY_IS_NEW |
+                                JSON_C_OBJECT_KEY_IS_CONSTANT) != 0) {
+    json_object_put(ratio);
+    json_object_put(compression);
+    return NULL;
+  }
+
+  return compression;
+}
+
+struct json_object *protocol_encode_memory_stats(
+  struct queue_memory_stats *stats)
+{
+  struct json_object *memory;
+
+  memory = json_object_new_object();
+  if (!memory) {
+    return NULL;
+  }
+
+  if (!protocol_add_integer_(memory, "used", (long long)stats->used) ||
+      !protocol_add_integer_(memory, "held", (long long)stats->held) ||
+      !protocol_add_integer_(memory, "budget", (long long)stats->budget) ||
+      !protocol_add_integer_(memory, "rejected", (long long)stats->rejected) ||
+      !protocol_add_integer_(memory, "evicted", (long long)stats->evicted)) {
+    json_object_put(memory);
+    return NULL;
+  }
+
+  return memory;
+}
+
+struct json_object *protocol_encode_queue_memory(const char *name,
+                                                 struct queue_stats *stats)
+{
+  struct json_object *memory = NULL;
+  struct json_object *id = NULL;
+
+  memory = json_object_new_object();
+  if (!memory) {
+    goto error;
+  }
+
+  id = json_object_new_string(name);
+  if (!id || json_object_object_add_ex(memory, "name", id,
+                                       JSON_C_OBJECT_ADD_KEY_IS_NEW |
+                                       JSON_C_OBJECT_KEY_IS_CONSTANT) != 0) {
+    goto error;
+  }
+  id = NULL;
+
+  if (!protocol_add_integer_(memory, "memory", (long long)stats->memory) ||
+      !protocol_add_integer_(memory, "items", (long long)stats->items) ||
+      !protocol_add_integer_(memory, "bytes", (long long)stats->bytes)) {
+    goto error;
+  }
+
+  return memory;
+
+error:
+  if (memory) {
+    json_object_put(memory);
+  }
+
+  if (id) {
+    json_object_put(id);
+  }
+
+  return NULL;
+}
+
+struct json_object *protocol_encode_pool_stats(
+  struct pool_stats stats[QUEUE_POOL_CLASSES + 1])
+{
+  struct json_object *list = NULL;
+  struct json_object *pool = NULL;
+  size_t index;
+
+  list = json_object_new_array();
+  if (!list) {
+    goto error;
+  }
+
+  for (index = 0; index <= QUEUE_POOL_CLASSES; index++) {
+    pool = json_object_new_object();
+    if (!pool) {
+      goto error;
+    }
+
+    if (!protocol_add_integer_(pool, "size", stats[index].object_size) ||
+        !protocol_add_integer_(pool, "slabs", stats[index].slab_count) ||
+        !protocol_add_integer_(pool, "capacity", stats[index].object_count) ||
+        !protocol_add_integer_(pool, "used", stats[index].used_count) ||
+        !protocol_add_integer_(pool, "allocations",
+                               stats[index].allocations) ||
+        !protocol_add_integer_(pool, "releases", stats[index].releases)) {
+      goto error;
+    }
+
+    if (json_object_array_add(list, pool) != 0) {
+      goto error;
+    }
+    pool = NULL;
+  }
+
+  return list;
+
+error:
+  if (pool) {
+    json_object_put(pool);
+  }
+
+  if (list) {
+    json_object_put(list);
+  }
+
+  return NULL;
+}
@@ -25,6 +25,10 @@
 
 #include <json-c/json_object.h>
 #include "queue.h"
+#include "wal.h"
+#include "snapshot.h"
+
+struct manager_gc_stats;
 
 /**
  * JSON protocol. json_object returns must be freed using json_object_put if
@@ -33,6 +37,10 @@
  * function fails / the function does not return a json_object.
  */
 
+/* the start of a success message, which is followed by the payload and a
+   closing brace. this is what protocol_create_success encodes to */
+#define PROTOCOL_SUCCESS_PREFIX "{\"message\":null,\"success\":true,\"payload\":"
+
 /* create success/failure messages */
 struct json_object *protocol_create_success(json_object *payload);
 struct json_object *protocol_create_failure(const char *error_message);
@@ -47,4 +55,55 @@ const char *protocol_failure_message(void);
 
 struct json_object *protocol_encode_item(struct queue_item *item);
 
+/* get the encoded item, without the closing brace so more fields can be
+   added after it. the item is encoded the first time and the encoding is kept
+   with its value, see queue_item_set_encoded. compressed items are never
+   kept encoded, use protocol_encode_item for them. returns NULL on failure
+   or if the item is compressed */
+const char *protocol_item_fragment(struct queue_item *item, size_t *length);
+
+/* encode everything about an item apart from its value, which is sent on its
+   own. the length of the value is always included */
+struct json_object *protocol_encode_item_header(struct queue_item *item);
+
+/* add the receipt of a leased item to an encoded item, returns 0 on failure */
+int protocol_add_receipt(struct json_object *object, struct queue_item *item);
+
+/* add the queue statistics to a queue information object, returns 0 on
+   failure */
+int protocol_add_queue_stats(struct json_object *object,
+                             struct queue_stats *stats);
+
+/* encode the write-ahead log activity */
+struct json_object *protocol_encode_wal_stats(struct wal_stats *stats);
+
+/* encode the progress of snapshots written in the background */
+struct json_object *protocol_encode_snapshot_stats(
+  struct snapshot_stats *stats);
+
+/* encode the items spilled to disk by every queue */
+struct json_object *protocol_encode_spill_stats(
+  struct queue_spill_stats *stats);
+
+/* encode the compression of large values, for every queue or for one queue.
+   times are in microseconds of cpu time */
+struct json_object *protocol_encode_compression_stats(
+  struct queue_compression_stats *stats);
+
+/* encode the queues freed for going unused */
+struct json_object *protocol_encode_gc_stats(struct manager_gc_stats *stats);
+
+/* encode the shard that answered and the number of shards */
+struct json_object *protocol_encode_shard(int index, int count);
+
+/* encode the memory used by every queue, and the memory used by one queue */
+struct json_object *protocol_encode_memory_stats(
+  struct queue_memory_stats *stats);
+struct json_object *protocol_encode_queue_memory(const char *name,
+                                                 struct queue_stats *stats);
+
+/* encode the queue pool usage as a list, see queue_get_pool_stats */
+struct json_object *protocol_encode_pool_stats(
+  struct pool_stats stats[QUEUE_POOL_CLASSES + 1]);
+
 #endif
@@ -26,48 +26,438 @@
 struct queue;
 struct queue_item;
 
+#include <limits.h>
+
 #include "queue-compat.h"
+#include "hash.h"
+#include "key.h"
+#include "pool-internal.h"
+#include "timer.h"
+#include "spill.h"
+#include "wal.h"
 
 #ifndef QUEUE_UUID_LEN
 #define QUEUE_UUID_LEN 16
 #endif
 
+/* number of key buckets a queue starts with */
+#define QUEUE_KEY_TABLE_SIZE 16
+
+/* number of lease buckets a queue starts with */
+#define QUEUE_LEASE_TABLE_SIZE 16
+
+/* smallest object size served by the queue pools. each following pool serves
+   objects twice the size of the previous one */
+#define QUEUE_POOL_MIN_SIZE 64
+
+/* pool class used for allocations too large for any pool */
+#define QUEUE_POOL_LARGE QUEUE_POOL_CLASSES
+
+/* number of item slots in each ring segment. chosen so a segment fits exactly
+   in one of the queue pools */
+#define QUEUE_SEGMENT_SLOTS 254
+
+/* number of item slots in each block of a stream. chosen so a block with the
+   offsets of its items fits in one of the queue pools */
+#define QUEUE_STREAM_SLOTS 254
+
+/* number of consumer buckets a stream starts with */
+#define QUEUE_CONSUMER_TABLE_SIZE 16
+
+/* number of segments kept in memory ahead of the spilled segments of a ring,
+   so the head can keep draining while the next spilled segment is read */
+#define QUEUE_SPILL_READAHEAD 2
+
+/* serial above every item, for a level without keyed items */
+#define QUEUE_SERIAL_NONE ULLONG_MAX
+
+/* get the item a value is stored in */
+#define QUEUE_VALUE_ITEM(ptr)                                            \
+  ((struct queue_item *)((char *)(ptr) - offsetof(struct queue_item, value)))
+
+/* the value of an item. the value can be held after the item has been freed
+   so it can be handed to a socket without being copied, the storage of the
+   item is only released once the last reference is dropped */
+struct queue_value {
+  /* references held outside of the queue */
+  int refs;
+
+  /* has the item been freed while the value was still referenced */
+  unsigned char orphaned;
+
+  /* pool the encoding was allocated from */
+  unsigned char encoded_class;
+
+  /* is the value compressed */
+  unsigned char compressed;
+
+  /* length of the value, and of what is stored in the data of the item which
+     is less if the value is compressed. the stored value is followed by a NULL
+     that is not counted in stored, but the value can hold NULLs of its own */
+  size_t length;
+  size_t stored;
+
+  /* the item as it is sent to clients, NULL until it is first read. it is
+     allocated from the pools and released along with the value. the fields
+     are kept small since every item carries them */
+  char *encoded;
+  size_t encoded_length;
+};
+
 struct queue_item {
+  /* position in the list of keyed items, or in the delayed or leased items
+     while the item is not visible */
   TAILQ_ENTRY(queue_item) next;
 
-  char *key;
-  char *value;
+  /* slot holding an unkeyed item in the queue ring, or any item in a
+     stream */
+  struct queue_item **slot;
+
+  /* order the item was inserted in, used to find the oldest item between the
+     ring and the keyed items */
+  unsigned long long serial;
+
+  /* identifies the item in the log, 0 until the item is first stored. this
+     is also the offset of an item in a stream */
+  unsigned long long id;
+
+  /* priority level the item is stored in */
+  unsigned char priority;
+
+  /* position in the list of items sharing this key */
+  TAILQ_ENTRY(queue_item) keynext;
+
+  /* index entry for the key, NULL if the item is not keyed or not inserted */
+  struct queue_key *keyed;
+
+  /* interned key, NULL if the item has none */
+  struct key *key;
+
+  /* value, stored in data */
+  struct queue_value value;
+
+  /* is the item counted in the size of the queue */
+  int charged;
+
+  /* pool the item was allocated from */
+  unsigned char pool_class;
 
   /* has the item actually been inserted into the queue item list */
   int inserted;
 
+  /* is the item waiting on its timer before it is put in the queue */
+  int delayed;
+
+  /* has the item been taken under a lease. the item is found by its receipt
+     through the queue lease table */
+  int leased;
+  struct hash_entry lease;
+  unsigned long long receipt;
+
+  /* time the item expires at, 0 if it does not expire. see timer_now */
+  unsigned long long expires;
+
+  /* timer for the delay while the item is delayed, for the expiry once it is
+     inserted and for the lease while it is leased */
+  struct timer_entry timer;
+
   /* which queue this item belongs to */
   struct queue *owner;
 
   /* the lock for this item. while the item is locked, it guarantees that it
      will not be deleted. TODO: should this lock be atomic?*/
   int lockcount;
+
+  /* storage for the value */
+  char data[];
+};
+
+/* a fixed size block of item slots in a queue ring */
+struct queue_segment {
+  TAILQ_ENTRY(queue_segment) next;
+
+  struct queue_item *slots[QUEUE_SEGMENT_SLOTS];
+};
+
+/* a ring segment that has been written out to a spill file. only this index
+   is kept in memory until the segment is read back */
+struct queue_spill {
+  TAILQ_ENTRY(queue_spill) next;
+
+  struct spill_extent extent;
+
+  /* items in the segment and the size of their values */
+  size_t count;
+  size_t bytes;
+
+  /* pool the index was allocated from */
+  unsigned char pool_class;
+};
+
+/* an item as written to a spill file, followed by its value */
+struct queue_spill_record {
+  unsigned long long serial;
+  unsigned long long id;
+  unsigned long long expires;
+  size_t length;
+
+  /* bytes of the value that follow, and whether they are compressed */
+  size_t stored;
+  int compressed;
+};
+
+/* a fixed size block of slots in a stream, with the offset of each item
+   alongside so an offset can be found with a binary search */
+struct queue_block {
+  TAILQ_ENTRY(queue_block) next;
+
+  /* slots used so far */
+  size_t count;
+
+  unsigned long long offsets[QUEUE_STREAM_SLOTS];
+  struct queue_item *slots[QUEUE_STREAM_SLOTS];
+};
+
+/* a named reader of a stream. looked up case insensitively through the
+   stream consumer table */
+struct queue_consumer {
+  struct hash_entry entry;
+
+  /* interned name of the consumer */
+  struct key *name;
+
+  /* offset of the next item the consumer reads */
+  unsigned long long offset;
+
+  /* pool the consumer was allocated from */
+  unsigned char pool_class;
+};
+
+/* a consumer waiting for an item to be appended to a stream */
+struct queue_reader {
+  TAILQ_ENTRY(queue_reader) next;
+
+  /* stream the reader is waiting on */
+  struct queue *owner;
+
+  struct queue_consumer *consumer;
+
+  /* interned key that is being waited on, NULL for any item */
+  struct key *key;
+
+  /* pool the reader was allocated from */
+  unsigned char pool_class;
+
+  /* NULL once the reader has been given an item or cancelled while the
+     readers are being woken */
+  int (*cb)(struct queue_item *, void *);
+  void *cbarg;
+};
+
+/* items of a stream in the order they were appended. items removed from the
+   middle leave an empty slot behind that is skipped once it reaches the
+   head */
+struct queue_stream {
+  TAILQ_HEAD(qbhead, queue_block) blocks;
+
+  /* first slot in the first block that can still hold an item */
+  size_t head;
+
+  /* pool the blocks are allocated from */
+  unsigned char pool_class;
+
+  /* consumers indexed by name, created on first use */
+  struct hash_table consumers;
+  size_t consumer_count;
+
+  /* reads waiting for an item, in the order they were made */
+  TAILQ_HEAD(qrhead, queue_reader) readers;
+
+  /* depth of queue_stream_wake_ calls, and the readers that finished during
+     them. readers are only freed once the outermost wake is done, since a
+     callback can cancel or add readers */
+  int waking;
+  size_t finished;
+};
+
+/* records written to the log by a queue. times are unix times in
+   milliseconds, so they still mean the same thing after a restart */
+struct queue_log_settings {
+  char id[QUEUE_UUID_STR_LEN];
+  unsigned long long ttl;
+  unsigned long long max_items;
+  unsigned long long max_bytes;
+  int policy;
+  int type;
+
+  /* last id given to an item, so a stream that is empty when it is written
+     out keeps counting offsets from where it was */
+  unsigned long long item;
+
+  /* time the queue is kept unused for, see queue_set_idle. older records
+     end before it */
+  unsigned long long idle;
+};
+
+/* followed by the key and value, each with their NULL */
+struct queue_log_put {
+  char id[QUEUE_UUID_STR_LEN];
+  unsigned long long item;
+
+  /* time the item is delayed until and expires at, 0 if it is not */
+  unsigned long long due;
+  unsigned long long expires;
+
+  size_t key_length;
+  size_t value_length;
+  unsigned char priority;
+  unsigned char keyed;
+
+  /* a compressed value takes stored_length bytes of the record instead of
+     value_length. these were padding before, so older records are read as
+     uncompressed */
+  unsigned char compressed;
+  unsigned int stored_length;
+};
+
+struct queue_log_remove {
+  char id[QUEUE_UUID_STR_LEN];
+  unsigned long long item;
+};
+
+/* followed by the name with its NULL */
+struct queue_log_consumer {
+  char id[QUEUE_UUID_STR_LEN];
+  unsigned long long offset;
+  size_t name_length;
+};
+
+/* an item restored from the log, so a later record can remove it again */
+struct queue_restored {
+  struct hash_entry entry;
+  struct queue_item *item;
+};
+
+/* unkeyed items are stored in a ring made up of segments, so draining them
+   reads item pointers from contiguous memory instead of following links. items
+   removed from the middle of the ring leave an empty slot behind that is
+   skipped once it reaches the head */
+struct queue_ring {
+  TAILQ_HEAD(qshead, queue_segment) segments;
+
+  /* segments written out to disk. in ring order they come after the first
+     front segments, the last of which is front_last, and before the rest of
+     the segments */
+  TAILQ_HEAD(qsphead, queue_spill) spills;
+  struct queue_segment *front_last;
+  size_t front;
+
+  /* next slot to read in the first segment, and next slot to write in the last
+     segment */
+  size_t head;
+  size_t tail;
+
+  /* number of items in the ring, including spilled items but not empty
+     slots */
+  size_t count;
+
+  /* a drained segment kept to avoid reallocating when the ring is refilled */
+  struct queue_segment *spare;
+
+  /* pool the segments are allocated from */
+  unsigned char pool_class;
+
+  /* queue the segment memory is counted against, and the priority level the
+     ring belongs to */
+  struct queue *owner;
+  int priority;
+};
+
+/* items in a queue with the same priority */
+struct queue_level {
+  /* unkeyed items */
+  struct queue_ring ring;
+
+  /* keyed items, in the order they were added */
+  TAILQ_HEAD(qihead, queue_item) items;
+
+  /* serial of the first keyed item, QUEUE_SERIAL_NONE when there are none, so
+     taking from the ring only has to compare against the level */
+  unsigned long long keyed_serial;
+
+  /* number of items in the ring and list */
+  size_t count;
+};
+
+/* all of the items and callbacks in a queue with the same key, in the order
+   they were added. looked up case insensitively through the queue key table */
+struct queue_key {
+  struct hash_entry entry;
+
+  /* key shared by every item and callback in the lists */
+  struct key *key;
+
+  /* items for each priority level, and a bit set for each level that is not
+     empty */
+  TAILQ_HEAD(qkihead, queue_item) items[QUEUE_PRIORITY_LEVELS];
+  unsigned int level_mask;
+
+  TAILQ_HEAD(qkchead, queue_callback) callbacks;
+};
+
+/* someone waiting for space in a full queue */
+struct queue_space_wait {
+  TAILQ_ENTRY(queue_space_wait) next;
+
+  struct queue *owner;
+
+  /* pool the wait was allocated from */
+  unsigned char pool_class;
+
+  void (*cb)(void *, int);
+  void *cbarg;
 };
 
 /* callback for someone waiting to see items added to the queue */
 struct queue_callback {
   TAILQ_ENTRY(queue_callback) next;
 
-  /* key that is being waited on */
-  char *key;
+  /* position in the list of callbacks waiting on the same key, or in the
+     wildcard list if there is no key */
+  TAILQ_ENTRY(queue_callback) keynext;
+
+  /* index entry for the key, NULL if the callback is a wildcard */
+  struct queue_key *keyed;
+
+  /* order the callback was added in, used to pick between a keyed and a
+     wildcard callback that both match an item */
+  unsigned long long serial;
+
+  /* interned key that is being waited on */
+  struct key *key;
+
+  /* pool the callback was allocated from */
+  unsigned char pool_class;
 
   /* callback + user data for when the matching item is added */
   void (*addcb)(struct queue_item *, void *);
   void *addcbarg;
 
-  /* queue that the item belongs to */
+  /* queue that the callback belongs to, and whether it has been added to the
+     queue lists */
   struct queue *owner;
+  int inserted;
 };
 
 struct queue {
   /* queue uuid as bytes */
   unsigned char uuid[QUEUE_UUID_LEN];
 
+  /* how the queue holds its items. the levels are only used by queues and
+     the stream only by streams */
+  enum queue_type type;
+  struct queue_stream stream;
+
   /* number of keyed entries/callbacks - will allow the item check to be easily
      skipped if no keyed entries are present */
   size_t keyed_count;
@@ -79,18 +469,395 @@ struct queue {
   /* number of callbacks */
   size_t callback_count;
 
-  /* queue items */
-  TAILQ_HEAD(qihead, queue_item) items;
+  /* queue items for each priority level, and a bit set for each level that is
+     not empty */
+  struct queue_level levels[QUEUE_PRIORITY_LEVELS];
+  unsigned int level_mask;
+
+  /* serial given to the next item */
+  unsigned long long item_serial;
+
+  /* items that will be put in the queue once their delay has passed */
+  TAILQ_HEAD(qdhead, queue_item) delayed;
+  size_t delayed_count;
+
+  /* items taken under a lease, and the same items indexed by receipt */
+  TAILQ_HEAD(qlhead, queue_item) leased;
+  size_t leased_count;
+  struct hash_table leases;
+
+  /* receipts are made by scrambling a counter with a random salt, so they
+     are unique within the queue but cannot be guessed from each other */
+  unsigned long long lease_salt;
+  unsigned long long lease_serial;
+
+  /* default time to live of items, and the number of items that expired */
+  unsigned long long ttl;
+  unsigned long long expired_count;
+
+  /* time the queue can go unused before it is freed, 0 if it is kept */
+  unsigned long long idle;
+
+  /* items held by the queue in any state and the size of their keys and
+     values, checked against the limits on every put */
+  size_t stored_count;
+  size_t stored_bytes;
+  size_t max_items;
+  size_t max_bytes;
+  enum queue_policy policy;
+  unsigned long long dropped_count;
+
+  /* puts waiting for space, woken from a timer once items are removed so
+     they never run in the middle of another queue operation */
+  TAILQ_HEAD(qswhead, queue_space_wait) space_waits;
+  size_t space_wait_count;
+  struct timer_entry space_timer;
+
+  /* keyed queue items indexed by key - struct queue_key */
+  struct hash_table keys;
 
   /* queue callbacks */
   TAILQ_HEAD(qchead, queue_callback) callbacks;
+
+  /* callbacks without a key, which match any item */
+  TAILQ_HEAD(qcwhead, queue_callback) wildcards;
+
+  /* serial given to the next callback */
+  unsigned long long callback_serial;
+
+  /* memory allocated for the items, keys and callbacks of the queue */
+  size_t memory;
+
+  /* memory of the items in memory that could be taken, which is all that
+     dropping the oldest items can give back */
+  size_t ready_memory;
+
+  /* values compressed by the queue */
+  struct queue_compression_stats compression;
+
+  /* last id given to an item. items are written to the log once they are
+     stored and again once they leave, except while the queue is being freed
+     since the queue itself is logged as deleted, and while it is being
+     restored from records that are already written */
+  unsigned long long item_id;
+  int unlogged;
+
+  /* items restored while the log is replayed, indexed by id */
+  struct hash_table restored;
+
+  /* files the cold parts of the rings are spilled to, created on first use,
+     and the number of items currently spilled. spilling runs from a timer so
+     puts never wait on the disk */
+  struct spill *spill;
+  size_t spilled_count;
+  struct timer_entry spill_timer;
 };
 
-struct queue_item *queue_item_new_(const char *key, const char *value);
+/* memory shared by every queue */
+struct queue_context {
+  struct pool pools[QUEUE_POOL_CLASSES];
+
+  /* allocations too large for the pools */
+  struct pool_stats large;
+
+  /* memory allocated by every queue, and the most that should be allocated
+     before puts are refused. a budget of 0 means no limit */
+  size_t memory;
+  size_t memory_budget;
+
+  /* memory of freed items whose values are still referenced. this stays in
+     memory but is no longer counted against any queue */
+  size_t memory_held;
+  unsigned long long memory_rejected;
+  unsigned long long memory_evicted;
+
+  /* queues using more memory than the threshold spill their rings to disk, a
+     threshold of 0 disables spilling. the counters track items currently
+     spilled, items and bytes written out and read back, and items lost to
+     failed reads */
+  size_t spill_threshold;
+  size_t spilled;
+  unsigned long long spill_items;
+  unsigned long long spill_bytes;
+  unsigned long long fill_items;
+  unsigned long long fill_bytes;
+  unsigned long long spill_lost;
+
+  /* values compressed by every queue, along with the settings. values are
+     compressed into scratch, which grows to fit the largest value */
+  struct queue_compression_stats compression;
+  unsigned char *scratch;
+  size_t scratch_size;
+};
+
+/* the global context instance */
+extern struct queue_context queue_context_;
+
+/* allocate from the smallest pool that fits size, storing which pool was used
+   in pool_class. the memory is counted against q. the same size has to be
+   given when the object is released */
+void *queue_alloc_(struct queue *q, size_t size, unsigned char *pool_class);
+void queue_release_(struct queue *q, void *object, size_t size,
+                    unsigned char pool_class);
+
+/* the memory actually taken by an allocation of size from pool_class, and
+   return the allocation to its pool without counting it against a queue */
+size_t queue_allocation_(size_t size, unsigned char pool_class);
+void queue_free_(void *object, unsigned char pool_class);
+
+/* count memory allocated outside the pools against a queue */
+void queue_memory_charge_(struct queue *q, size_t size);
+void queue_memory_release_(struct queue *q, size_t size);
+
+/* is more memory in use than the budget allows */
+int queue_memory_exceeded_(void);
+
+/* allocate an item for a queue with length bytes of value copied into the
+   same allocation, compressing the value if it is large enough. the item
+   takes over the reference to key */
+struct queue_item *queue_item_new_(struct queue *q, struct key *key,
+                                   const char *value, size_t length);
+
+/* allocate an item for a value as it is stored, which is stored bytes of data
+   for a value length bytes long */
+struct queue_item *queue_item_store_(struct queue *q, struct key *key,
+                                     const char *data, size_t stored,
+                                     size_t length, int compressed);
+
+/* compress a value into the scratch buffer. returns 0 if the value could not
+   be compressed or did not get any smaller */
+int queue_compress_(struct queue *q, const char *value, size_t length,
+                    const char **stored, size_t *stored_length);
+
+/* cpu time used by the calling thread, in microseconds */
+unsigned long long queue_cpu_time_(void);
+
+/* release the storage of an item that has been taken out of the queue. if its
+   value is still referenced the storage is kept until it is released */
+void queue_item_release_(struct queue *q, struct queue_item *item);
+
+/* memory used by the storage of a value, including its encoding, and free
+   that storage without counting it against a queue */
+size_t queue_value_size_(struct queue_value *value);
+void queue_value_free_(struct queue_value *value);
+
+/* memory an item was allocated with, without the encoding of its value */
+size_t queue_item_storage_(struct queue_item *item);
 /* this free function will ignore the lock count and delete anyway */
 void queue_item_free_(struct queue_item *item);
 
-struct queue_callback *queue_callback_new_(const char *key);
+/* hold an item back for delay milliseconds before it is put in the queue.
+   returns -1 on failure, the item is not freed */
+int queue_item_delay_(struct queue *q, struct queue_item *item,
+                      unsigned long long delay);
+
+/* hand an item to a waiting callback or insert it. the item is freed if it
+   was consumed or could not be inserted. returns the same as queue_put */
+int queue_put_item_(struct queue *q, struct queue_item *item);
+
+/* timer callback moving a delayed item into the queue */
+void queue_item_due_(struct timer_entry *entry, void *arg);
+
+/* timer callback removing an item that has expired. also used to remove
+   expired items found at the head of the queue before the timer runs */
+void queue_item_expire_(struct timer_entry *entry, void *arg);
+
+/* timer callback putting an item back in the queue once its lease expires */
+void queue_item_lease_expired_(struct timer_entry *entry, void *arg);
+
+/* take an item out of the lease list and table */
+void queue_item_unlease_(struct queue *q, struct queue_item *item);
+
+/* make the receipt for the next lease */
+unsigned long long queue_receipt_next_(struct queue *q);
+
+/* find a leased item by its receipt */
+struct queue_item *queue_lease_find_(struct queue *q, const char *receipt);
+
+/* count an item in the size of the queue, or stop counting it once it is no
+   longer held by the queue. both can be called more than once */
+void queue_item_charge_(struct queue *q, struct queue_item *item);
+void queue_item_discharge_(struct queue *q, struct queue_item *item);
+size_t queue_item_size_(struct queue_item *item);
+
+/* convert a time from the timer clock into a unix time */
+unsigned long long queue_unix_time_(unsigned long long when);
+
+/* write the settings of a queue, an item being stored and an item leaving to
+   the log. settings and puts can be written anywhere through reserve, and
+   return 0 if reserve failed */
+int queue_log_settings_(struct queue *q,
+                        void *(*reserve)(int, size_t, void *), void *arg);
+int queue_log_put_(struct queue *q, struct queue_item *item,
+                   void *(*reserve)(int, size_t, void *), void *arg);
+void queue_log_remove_(struct queue *q, struct queue_item *item);
+
+/* write a put record with the rest of its fields already filled in */
+int queue_log_value_(struct queue *q, struct queue_log_put *put,
+                     const char *key, const char *value,
+                     void *(*reserve)(int, size_t, void *), void *arg);
+
+/* write the spilled items of a ring, along with any keyed items that come
+   before them. keyed is moved past the keyed items written */
+int queue_log_spills_(struct queue *q, struct queue_ring *ring,
+                      struct queue_item **keyed,
+                      void *(*reserve)(int, size_t, void *), void *arg);
+
+/* apply one record to the queue, called by queue_replay */
+int queue_replay_record_(struct queue *q, int type, const void *data,
+                         size_t length);
+
+/* apply a put, remove or consumer record while the log is replayed. returns
+   0 if the record is not valid */
+int queue_replay_put_(struct queue *q, const struct queue_log_put *put,
+                      const char *key, const char *value);
+int queue_replay_remove_(struct queue *q,
+                         const struct queue_log_remove *remove);
+int queue_replay_consumer_(struct queue *q,
+                           const struct queue_log_consumer *consumer,
+                           const char *name);
+
+/* write the items of a stream in order followed by where each consumer is */
+int queue_log_stream_(struct queue *q,
+                      void *(*reserve)(int, size_t, void *), void *arg);
+
+/* write the offset of a consumer to the log */
+int queue_log_consumer_(struct queue *q, struct queue_consumer *consumer,
+                        void *(*reserve)(int, size_t, void *), void *arg);
+
+/* check the queue has room for another item of the given size, dropping old
+   items if the policy allows it. returns 0 if the item does not fit in the
+   queue limits, -1 if the memory budget has been used up, -2 if the item is
+   larger than the queue can ever hold and 1 if there is room */
+int queue_make_room_(struct queue *q, size_t size);
+int queue_has_room_(struct queue *q, size_t size);
+
+/* timer callback waking the puts waiting for space */
+void queue_space_due_(struct timer_entry *entry, void *arg);
+
+/* get the oldest item of a priority level that is not empty */
+struct queue_item *queue_level_first_(struct queue *q, int level);
+
+/* find the item queue_peek should return, without checking if it expired */
+struct queue_item *queue_item_first_(struct queue *q, const char *key);
+
+/* find the index entry for a key, optionally creating it if it does not exist.
+   returns NULL if the key was not found or could not be created */
+struct queue_key *queue_key_get_(struct queue *q, struct key *key,
+                                 int create_new);
+/* free the index entry if no items or callbacks are using it */
+void queue_key_release_(struct queue *q, struct queue_key *qk);
+
+/* get the highest/lowest priority set in a level mask. the mask must not be
+   0 */
+int queue_level_highest_(unsigned int level_mask);
+int queue_level_lowest_(unsigned int level_mask);
+
+/* add/remove an inserted item to the queue lists and key index */
+int queue_item_insert_(struct queue *q, struct queue_item *item);
+void queue_item_remove_(struct queue *q, struct queue_item *item);
+
+/* add an item to the tail of the ring. returns -1 if a segment could not be
+   allocated */
+int queue_ring_push_(struct queue_ring *ring, struct queue_item *item);
+
+/* get the oldest item in the ring, dropping any empty slots in front of it */
+struct queue_item *queue_ring_first_(struct queue_ring *ring);
+void queue_ring_remove_(struct queue_ring *ring, struct queue_item *item);
+
+/* release every segment. the ring must be empty */
+void queue_ring_clear_(struct queue_ring *ring);
+
+/* drop the segments of a ring once its last item has been removed */
+void queue_ring_reset_(struct queue_ring *ring);
+
+/* write out the coldest ring segments, lowest priority first, until the queue
+   uses no more than target bytes of memory or nothing else can be spilled.
+   returns the number of segments spilled */
+int queue_spill_(struct queue *q, size_t target);
+
+/* timer callback spilling a queue that has passed the threshold */
+void queue_spill_due_(struct timer_entry *entry, void *arg);
+
+/* get the next segment of a ring that can be spilled, or NULL if there is
+   none. the first segments and the segment being written are never spilled,
+   and neither are segments holding locked items */
+struct queue_segment *queue_ring_spillable_(struct queue_ring *ring);
+
+/* write a segment to disk and free its items. returns 0 on failure, in which
+   case the segment is left as it was */
+int queue_ring_spill_(struct queue_ring *ring, struct queue_segment *segment);
+
+/* read spilled segments back until there are QUEUE_SPILL_READAHEAD segments
+   in memory ahead of them */
+void queue_ring_fill_(struct queue_ring *ring);
+
+/* read a spilled segment back into a new segment and free the index. returns
+   NULL if the segment could not be read, in which case its items are lost */
+struct queue_segment *queue_ring_load_(struct queue_ring *ring,
+                                       struct queue_spill *spill);
+
+/* stop counting items that were spilled but could not be read back */
+void queue_ring_lose_(struct queue_ring *ring, size_t count, size_t bytes);
+
+/* give up every spilled segment without reading it back */
+void queue_ring_discard_(struct queue_ring *ring);
+
+/* append an item to a stream, giving it the next offset unless it already
+   has one. returns -1 if a block could not be allocated or the item would not
+   come after the last item */
+int queue_stream_push_(struct queue *q, struct queue_item *item);
+
+/* take an item out of its slot, freeing blocks at the head once they are
+   empty */
+void queue_stream_remove_(struct queue *q, struct queue_item *item);
+
+/* get the oldest item in a stream */
+struct queue_item *queue_stream_first_(struct queue *q);
+
+/* find the first item at or after offset, skipping items that do not have
+   the key or have expired. a key of NULL matches any item */
+struct queue_item *queue_stream_find_(struct queue *q,
+                                      unsigned long long offset,
+                                      struct key *key);
+
+/* hand an item that was just appended to the readers waiting for it. readers
+   only wait while there is nothing for them to read, so only the new item has
+   to be checked. if item is NULL every reader is checked again, which is
+   needed once a consumer has been moved */
+void queue_stream_wake_(struct queue *q, struct queue_item *item);
+
+/* release every block, reader and consumer. the stream must be empty */
+void queue_stream_clear_(struct queue *q);
+
+/* find a consumer by name, optionally creating it if it does not exist.
+   returns NULL if the consumer was not found or could not be created */
+struct queue_consumer *queue_consumer_get_(struct queue *q, const char *name,
+                                           int create_new);
+
+/* set the offset of the next item a consumer reads */
+void queue_consumer_move_(struct queue *q, struct queue_consumer *consumer,
+                          unsigned long long offset);
+
+/* hand an item to a reader, moving the consumer past it if the callback used
+   it */
+void queue_consumer_give_(struct queue *q, struct queue_consumer *consumer,
+                          struct queue_item *item,
+                          int (*cb)(struct queue_item *, void *), void *arg);
+
+void queue_reader_free_(struct queue *q, struct queue_reader *reader);
+
+/* allocate a callback for a queue. the callback takes over the reference to
+   key */
+struct queue_callback *queue_callback_new_(struct queue *q, struct key *key);
 void queue_callback_free_(struct queue_callback *cb);
 
+/* add a callback to the queue lists and key index */
+int queue_callback_insert_(struct queue *q, struct queue_callback *cb);
+
+/* find the callback that should receive an item with the given key. this is
+   the oldest callback either waiting on the key or waiting on any item */
+struct queue_callback *queue_callback_match_(struct queue *q,
+                                             struct key *key);
+
 #endif
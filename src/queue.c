@@ -21,16 +21,38 @@
 */
 
 #include <openssl/rand.h>
+#include <zlib.h>
+#include <ctype.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
 
 #include "queue.h"
 #include "queue-internal.h"
 #include "strcase.h"
 #include "hostnet.h"
 
+struct queue_context queue_context_ = {
+  {
+    POOL_INITIALIZER(QUEUE_POOL_MIN_SIZE),
+    POOL_INITIALIZER(QUEUE_POOL_MIN_SIZE << 1),
+    POOL_INITIALIZER(QUEUE_POOL_MIN_SIZE << 2),
+    POOL_INITIALIZER(QUEUE_POOL_MIN_SIZE << 3),
+    POOL_INITIALIZER(QUEUE_POOL_MIN_SIZE << 4),
+    POOL_INITIALIZER(QUEUE_POOL_MIN_SIZE << 5),
+    POOL_INITIALIZER(QUEUE_POOL_MIN_SIZE << 6),
+    POOL_INITIALIZER(QUEUE_POOL_MIN_SIZE << 7)
+  },
+  {0}
+};
+
 struct queue *queue_new(const unsigned char id[QUEUE_UUID_LEN])
 {
   struct queue *q;
+  int level;
 
   q = calloc(1, sizeof(struct queue));
   if (!q) {
@@ -40,166 +62,432 @@ struct queue *queue_new(const unsigned char id[QUEUE_UUID_LEN])
   /* create new ID if one was not provided */
   if (id != NULL) {
     memcpy(q->uuid, id, QUEUE_UUID_LEN);
-  } else {
-    if (RAND_bytes(q->uuid, QUEUE_UUID_LEN) != 1) {
-      free(q);
-      return NULL;
-    }
+  } else if (!queue_generate_uuid(q->uuid)) {
+    free(q);
+    return NULL;
+  }
+
+  if (!hash_table_init(&q->keys, QUEUE_KEY_TABLE_SIZE)) {
+    free(q);
+    return NULL;
+  }
+
+  if (!hash_table_init(&q->leases, QUEUE_LEASE_TABLE_SIZE)) {
+    hash_table_destroy(&q->keys);
+    free(q);
+    return NULL;
+  }
 
-    /* make id a valid uuid4 */
-    q->uuid[6] = q->uuid[6] & 0x0f | 0x40; /* version = 4 */
-    q->uuid[8] = q->uuid[8] & 0x3f | 0x80; /* variant = dce */
+  if (RAND_bytes((unsigned char *)&q->lease_salt,
+                 sizeof(q->lease_salt)) != 1) {
+    hash_table_destroy(&q->leases);
+    hash_table_destroy(&q->keys);
+    free(q);
+    return NULL;
+  }
+
+  for (level = 0; level < QUEUE_PRIORITY_LEVELS; level++) {
+    TAILQ_INIT(&q->levels[level].ring.segments);
+    TAILQ_INIT(&q->levels[level].ring.spills);
+    TAILQ_INIT(&q->levels[level].items);
+    q->levels[level].keyed_serial = QUEUE_SERIAL_NONE;
+    q->levels[level].ring.owner = q;
+    q->levels[level].ring.priority = level;
   }
 
-  TAILQ_INIT(&q->items);
+  TAILQ_INIT(&q->delayed);
+  TAILQ_INIT(&q->leased);
+  TAILQ_INIT(&q->space_waits);
+  timer_entry_init(&q->space_timer, queue_space_due_, q);
+  timer_entry_init(&q->spill_timer, queue_spill_due_, q);
   TAILQ_INIT(&q->callbacks);
+  TAILQ_INIT(&q->wildcards);
+  TAILQ_INIT(&q->stream.blocks);
+  TAILQ_INIT(&q->stream.readers);
 
   return q;
 }
 
 void queue_free(struct queue *q)
 {
+  struct queue_space_wait *wait;
   struct queue_callback *callback;
   struct queue_item *item;
+  void (*cb)(void *, int);
+  void *cbarg;
+  int level;
+
+  /* the queue is logged as deleted, not each of its items */
+  q->unlogged = 1;
+  queue_replay_finish(q);
+
+  /* let anyone waiting for space know there will never be any */
+  timer_cancel(&q->space_timer);
+  while ((wait = TAILQ_FIRST(&q->space_waits)) != NULL) {
+    cb = wait->cb;
+    cbarg = wait->cbarg;
+    queue_space_wait_cancel(wait);
+
+    cb(cbarg, 0);
+  }
 
   /* cancel any callbacks */
   while ((callback = TAILQ_FIRST(&q->callbacks)) != NULL) {
     queue_callback_free_(callback);
   }
 
-  /* clean up the remaining items */
-  while ((item = TAILQ_FIRST(&q->items)) != NULL) {
+  timer_cancel(&q->spill_timer);
+
+  /* clean up the remaining items. spilled items are dropped without being
+     read back */
+  for (level = 0; level < QUEUE_PRIORITY_LEVELS; level++) {
+    queue_ring_discard_(&q->levels[level].ring);
+
+    while ((item = queue_ring_first_(&q->levels[level].ring)) != NULL) {
+      queue_item_free_(item);
+    }
+
+    while ((item = TAILQ_FIRST(&q->levels[level].items)) != NULL) {
+      queue_item_free_(item);
+    }
+
+    queue_ring_clear_(&q->levels[level].ring);
+  }
+
+  while ((item = TAILQ_FIRST(&q->delayed)) != NULL) {
+    queue_item_free_(item);
+  }
+
+  while ((item = TAILQ_FIRST(&q->leased)) != NULL) {
+    queue_item_free_(item);
+  }
+
+  while ((item = queue_stream_first_(q)) != NULL) {
     queue_item_free_(item);
   }
 
+  queue_stream_clear_(q);
+
+  if (q->spill) {
+    spill_free(q->spill);
+  }
+
+  hash_table_destroy(&q->leases);
+  hash_table_destroy(&q->keys);
   free(q);
 }
 
-int queue_put(struct queue *q, const char *key, const char *value)
+int queue_generate_uuid(unsigned char id[QUEUE_UUID_LEN])
+{
+  if (RAND_bytes(id, QUEUE_UUID_LEN) != 1) {
+    return 0;
+  }
+
+  /* make id a valid uuid4 */
+  id[6] = id[6] & 0x0f | 0x40; /* version = 4 */
+  id[8] = id[8] & 0x3f | 0x80; /* variant = dce */
+  return 1;
+}
+
+int queue_put(struct queue *q, const char *key, const char *value,
+              size_t length, int priority, unsigned long long delay,
+              unsigned long long ttl)
 {
   struct queue_item *item;
-  struct queue_callback *callback;
-  void (*cb)(struct queue_item *, void *);
-  void *cbarg;
+  struct key *interned = NULL;
+  int room;
 
-  item = calloc(1, sizeof(struct queue_item));
-  if (!item) {
+  if (priority < 0 || priority >= QUEUE_PRIORITY_LEVELS) {
+    return -1;
+  }
+
+  /* items are read from a stream in the order they were appended */
+  if (q->type == queue_type_stream && delay > 0) {
     return -1;
   }
 
-  /* add the item key */
   if (key) {
-    item->key = strdup(key);
-    if (!item->key) {
-      goto error;
+    interned = key_intern(key);
+    if (!interned) {
+      return -1;
     }
   }
 
-  item->owner = q;
-  item->value = strdup(value);
-  if (!item->value) {
-    goto error;
+  item = queue_item_new_(q, interned, value, length);
+  if (!item) {
+    if (interned) {
+      key_release(interned);
+    }
+
+    return -1;
   }
 
-  /* check if we can immediately consume the item */
-  if (q->callback_count > 0) {
-    if ((!key && q->keyed_callback_count != q->callback_count) || key) {
-      TAILQ_FOREACH(callback, &q->callbacks, next) {
-        /* check if we want all items in the callback, or if the callback key
-           matches the item key */
-        if (!callback->key || (key && !strcasecmp(callback->key, key))) {
-          /* take the callback out as soon as possible. */
-          cb = callback->addcb;
-          cbarg = callback->addcbarg;
-          queue_callback_free_(callback);
-
-          if (cb) {
-            cb(item, cbarg);
-          }
+  item->priority = (unsigned char)priority;
 
-          queue_item_free(item);
-          return 1;
-        }
+  /* an item handed straight to a callback never takes up any space */
+  if (delay > 0 || !queue_callback_match_(q, interned)) {
+    room = queue_make_room_(q, queue_item_size_(item));
+    if (room <= 0) {
+      queue_item_free_(item);
+      if (room == -1) {
+        return -3;
       }
+
+      return room == 0 ? -2 : -4;
     }
   }
 
-  item->inserted = 1;
-  q->item_count++;
-  if (key) {
-    q->keyed_count++;
+  /* the time to live starts once any delay is over */
+  if (ttl == 0) {
+    ttl = q->ttl;
   }
 
-  TAILQ_INSERT_TAIL(&q->items, item, next);
+  if (ttl > 0) {
+    item->expires = timer_now() + delay + ttl;
+  }
+
+  if (delay > 0) {
+    if (queue_item_delay_(q, item, delay) < 0) {
+      queue_item_free_(item);
+      return -1;
+    }
+
+    return 0;
+  }
+
+  return queue_put_item_(q, item);
+}
+
+int queue_item_delay_(struct queue *q, struct queue_item *item,
+                      unsigned long long delay)
+{
+  /* hold the item back until the timer moves it into the queue */
+  timer_entry_init(&item->timer, queue_item_due_, item);
+  if (timer_schedule(&item->timer, delay) < 0) {
+    return -1;
+  }
+
+  item->delayed = 1;
+  TAILQ_INSERT_TAIL(&q->delayed, item, next);
+  q->delayed_count++;
+  queue_item_charge_(q, item);
 
   return 0;
-error:
-  /* cleanup after an error */
-  if (item->key) {
-    free(item->key);
+}
+
+int queue_put_item_(struct queue *q, struct queue_item *item)
+{
+  struct queue_callback *callback;
+  void (*cb)(struct queue_item *, void *);
+  void *cbarg;
+  unsigned long long now;
+
+  /* check if we can immediately consume the item */
+  callback = queue_callback_match_(q, item->key);
+  if (callback) {
+    /* take the callback out as soon as possible. */
+    cb = callback->addcb;
+    cbarg = callback->addcbarg;
+    queue_callback_free_(callback);
+
+    if (cb) {
+      cb(item, cbarg);
+    }
+
+    queue_item_free(item);
+    return 1;
+  }
+
+  if (queue_item_insert_(q, item) < 0) {
+    queue_item_free_(item);
+    return -1;
   }
 
-  if (item->value) {
-    free(item->value);
+  queue_item_charge_(q, item);
+
+  /* the queue is spilled once control is back in the event loop */
+  if (queue_context_.spill_threshold != 0 &&
+      q->memory > queue_context_.spill_threshold &&
+      !timer_is_scheduled(&q->spill_timer)) {
+    timer_schedule(&q->spill_timer, 0);
+  }
+
+  /* if the timer cannot be started the item still expires when it reaches
+     the head of the queue */
+  if (item->expires) {
+    now = timer_now();
+    timer_entry_init(&item->timer, queue_item_expire_, item);
+    timer_schedule(&item->timer, item->expires > now ? item->expires - now : 0);
+  }
+
+  if (!TAILQ_EMPTY(&q->stream.readers)) {
+    queue_stream_wake_(q, item);
   }
 
-  free(item);
-  return -1;
+  return 0;
 }
 
 struct queue_item *queue_take(struct queue *q, const char *key)
 {
   struct queue_item *item;
 
-  if (q->item_count == 0) {
+  item = queue_peek(q, key);
+  if (item) {
+    /* take the item out as soon as possible */
+    queue_item_remove_(q, item);
+    queue_item_discharge_(q, item);
+  }
+
+  return item;
+}
+
+struct queue_item *queue_peek(struct queue *q, const char *key)
+{
+  struct queue_item *item;
+  unsigned long long now = 0;
+
+  /* streams are only read through a consumer */
+  if (q->type == queue_type_stream) {
     return NULL;
   }
 
-  if (!key || (key && q->keyed_count > 0)) {
-    TAILQ_FOREACH(item, &q->items, next) {
-      /* check if the item matches the key */
-      if (!key || (item->key && !strcasecmp(item->key, key))) {
-        /* take the item out as soon as possible */
-        TAILQ_REMOVE(&q->items, item, next);
-        item->inserted = 0;
-        q->item_count--;
-        if (item->key) {
-          q->keyed_count--;
-        }
+  /* expired items are normally removed by their timer, but the timer can run
+     late. drop any that made it to the head first */
+  while ((item = queue_item_first_(q, key)) != NULL && item->expires) {
+    if (now == 0) {
+      now = timer_now();
+    }
 
-        return item;
-      }
+    if (item->expires > now) {
+      break;
     }
+
+    queue_item_expire_(&item->timer, item);
   }
 
-  return NULL;
+  return item;
 }
 
-struct queue_item *queue_peek(struct queue *q, const char *key)
+struct queue_item *queue_level_first_(struct queue *q, int level)
 {
-  struct queue_item *item;
+  struct queue_level *ql = &q->levels[level];
+  struct queue_item *unkeyed;
+
+  /* the oldest item is at the head of either the ring or the keyed items */
+  unkeyed = queue_ring_first_(&ql->ring);
+  if (unkeyed && unkeyed->serial < ql->keyed_serial) {
+    return unkeyed;
+  }
+
+  return TAILQ_FIRST(&ql->items);
+}
+
+struct queue_item *queue_item_first_(struct queue *q, const char *key)
+{
+  struct queue_key *qk;
+  struct key *interned;
 
   if (q->item_count == 0) {
     return NULL;
   }
 
-  if (!key || (key && q->keyed_count > 0)) {
-    TAILQ_FOREACH(item, &q->items, next) {
-      /* check if the item matches the key */
-      if (!key || (item->key && !strcasecmp(item->key, key))) {
-        return item;
-      }
-    }
+  if (!key) {
+    return queue_level_first_(q, queue_level_highest_(q->level_mask));
   }
 
-  return NULL;
+  if (q->keyed_count == 0) {
+    return NULL;
+  }
+
+  /* a key that is not interned cannot be on any item */
+  interned = key_find(key);
+  if (!interned) {
+    return NULL;
+  }
+
+  /* the key list only exists while it has items or callbacks */
+  qk = queue_key_get_(q, interned, 0);
+  if (!qk || qk->level_mask == 0) {
+    return NULL;
+  }
+
+  return TAILQ_FIRST(&qk->items[queue_level_highest_(qk->level_mask)]);
+}
+
+struct queue_item *queue_lease(struct queue *q, const char *key,
+                               unsigned long long lease)
+{
+  struct queue_item *item;
+
+  /* without the timer the item would never come back */
+  if (!timer_get_base()) {
+    return NULL;
+  }
+
+  /* the item is still held by the queue, so it stays counted in its size */
+  item = queue_peek(q, key);
+  if (!item) {
+    return NULL;
+  }
+
+  queue_item_remove_(q, item);
+
+  timer_entry_init(&item->timer, queue_item_lease_expired_, item);
+  timer_schedule(&item->timer, lease);
+
+  item->leased = 1;
+  item->receipt = queue_receipt_next_(q);
+  hash_table_insert(&q->leases, &item->lease, (size_t)item->receipt);
+  TAILQ_INSERT_TAIL(&q->leased, item, next);
+  q->leased_count++;
+
+  return item;
+}
+
+int queue_ack(struct queue *q, const char *receipt)
+{
+  struct queue_item *item;
+
+  item = queue_lease_find_(q, receipt);
+  if (!item) {
+    return 0;
+  }
+
+  timer_cancel(&item->timer);
+  queue_item_unlease_(q, item);
+  queue_item_discharge_(q, item);
+  queue_item_free(item);
+
+  return 1;
+}
+
+int queue_nack(struct queue *q, const char *receipt)
+{
+  struct queue_item *item;
+
+  item = queue_lease_find_(q, receipt);
+  if (!item) {
+    return 0;
+  }
+
+  /* same as the lease running out */
+  timer_cancel(&item->timer);
+  queue_item_lease_expired_(&item->timer, item);
+
+  return 1;
 }
 
 int queue_wait(struct queue *q, const char *key,
-               void(*cb)(struct queue_item *, void *), void *arg)
+               void(*cb)(struct queue_item *, void *), void *arg,
+               struct queue_callback **wait)
 {
   struct queue_item *item;
   struct queue_callback *callback;
+  struct key *interned = NULL;
+
+  if (q->type == queue_type_stream) {
+    return -1;
+  }
 
   /* try to take the item - we might not need to set the callback up in the
      table */
@@ -210,146 +498,2684 @@ int queue_wait(struct queue *q, const char *key,
     return 1;
   }
 
-  callback = queue_callback_new_(key);
+  if (key) {
+    interned = key_intern(key);
+    if (!interned) {
+      return -1;
+    }
+  }
+
+  callback = queue_callback_new_(q, interned);
   if (!callback) {
+    if (interned) {
+      key_release(interned);
+    }
+
     return -1;
   }
 
   /* add the callback */
-  callback->owner = q;
   callback->addcb = cb;
   callback->addcbarg = arg;
-  q->callback_count++;
-  if (key) {
-    q->keyed_callback_count++;
+  if (queue_callback_insert_(q, callback) < 0) {
+    queue_callback_free_(callback);
+    return -1;
   }
-  TAILQ_INSERT_TAIL(&q->callbacks, callback, next);
 
-  return 0;
-}
+  if (wait) {
+    *wait = callback;
+  }
 
-void queue_get_uuid(struct queue *q, char uuid[QUEUE_UUID_STR_LEN + 1/*NULL*/])
-{
-  /* uuid is network byte order numbers - this matters since the version and
-     variant are in octet 6 and 8 */
-  sprintf(uuid, "%08x-%04x-%04x-%04x-%02x%02x%02x%02x%02x%02x",
-          htonl(*(unsigned long *)&q->uuid[0]),
-          htons(*(unsigned short *)&q->uuid[4]),
-          htons(*(unsigned short *)&q->uuid[6]),
-          htons(*(unsigned short *)&q->uuid[8]),
-          q->uuid[10],
-          q->uuid[11],
-          q->uuid[12],
-          q->uuid[13],
-          q->uuid[14],
-          q->uuid[15]);
+  return 0;
 }
 
-const char *queue_item_get_key(struct queue_item *item)
+void queue_wait_cancel(struct queue_callback *wait)
 {
-  return item->key;
+  queue_callback_free_(wait);
 }
 
-const char *queue_item_get_value(struct queue_item *item)
+struct queue_item *queue_read(struct queue *q, const char *consumer,
+                              const char *key, int advance)
 {
-  return item->value;
-}
+  struct queue_consumer *qc;
+  struct queue_item *item;
+  struct key *interned = NULL;
 
-int queue_item_lock(struct queue_item *item)
-{
-  /* TODO: how do we guarantee the item is still valid? */
-  item->lockcount++;
+  if (q->type != queue_type_stream) {
+    return NULL;
+  }
 
-  return 0;
-}
+  /* a key that is not interned cannot be on any item */
+  if (key && (interned = key_find(key)) == NULL) {
+    return NULL;
+  }
 
-void queue_item_unlock(struct queue_item *item)
-{
-  item->lockcount--;
+  qc = queue_consumer_get_(q, consumer, 1);
+  if (!qc) {
+    return NULL;
+  }
 
-  /* handle if this item is now ready to be freed */
-  if (item->lockcount == 0 && !item->inserted) {
-    queue_item_free(item);
+  item = queue_stream_find_(q, qc->offset, interned);
+  if (!item) {
+    return NULL;
   }
-}
 
-void queue_item_free(struct queue_item *item)
-{
-  if (item->lockcount != 0) {
-    return;
+  if (advance) {
+    queue_consumer_move_(q, qc, item->id + 1);
   }
 
-  queue_item_free_(item);
+  queue_item_lock(item);
+  return item;
 }
 
-struct queue_item *queue_item_new_(const char *key, const char *value)
+int queue_seek(struct queue *q, const char *consumer,
+               unsigned long long offset)
 {
-  struct queue_item *item;
+  struct queue_consumer *qc;
 
-  item = calloc(1, sizeof(struct queue_item));
-  if (!item) {
-    return NULL;
+  if (q->type != queue_type_stream) {
+    return 0;
   }
 
-  item->value = strdup(value);
-  if (!item->value) {
-    free(item);
-    return NULL;
+  qc = queue_consumer_get_(q, consumer, 1);
+  if (!qc) {
+    return 0;
   }
 
-  if (key) {
-    item->key = strdup(key);
-    if (!item->key) {
-      free(item->value);
-      free(item);
-      return NULL;
-    }
+  queue_consumer_move_(q, qc, offset);
+
+  /* a consumer that was rewound may have items for its readers */
+  if (!TAILQ_EMPTY(&q->stream.readers)) {
+    queue_stream_wake_(q, NULL);
   }
 
-  return item;
+  return 1;
 }
 
-void queue_item_free_(struct queue_item *item)
+int queue_read_wait(struct queue *q, const char *consumer, const char *key,
+                    int (*cb)(struct queue_item *, void *), void *arg,
+                    struct queue_reader **wait)
 {
-  if (item->inserted) {
-    TAILQ_REMOVE(&item->owner->items, item, next);
+  struct queue_consumer *qc;
+  struct queue_reader *reader;
+  struct queue_item *item;
+  struct key *interned = NULL;
+  unsigned char pool_class;
+
+  if (q->type != queue_type_stream) {
+    return -1;
   }
 
-  if (item->key) {
-    free(item->key);
+  qc = queue_consumer_get_(q, consumer, 1);
+  if (!qc) {
+    return -1;
   }
-  free(item->value);
-  free(item);
-}
 
-struct queue_callback *queue_callback_new_(const char *key)
-{
-  struct queue_callback *callback;
+  if (key) {
+    interned = key_intern(key);
+    if (!interned) {
+      return -1;
+    }
+  }
+
+  /* the consumer may not have to wait at all */
+  item = queue_stream_find_(q, qc->offset, interned);
+  if (item) {
+    if (interned) {
+      key_release(interned);
+    }
+
+    queue_consumer_give_(q, qc, item, cb, arg);
+    return 1;
+  }
+
+  reader = queue_alloc_(q, sizeof(struct queue_reader), &pool_class);
+  if (!reader) {
+    if (interned) {
+      key_release(interned);
+    }
+
+    return -1;
+  }
+
+  memset(reader, 0, sizeof(struct queue_reader));
+  reader->pool_class = pool_class;
+  reader->owner = q;
+  reader->consumer = qc;
+  reader->key = interned;
+  reader->cb = cb;
+  reader->cbarg = arg;
+  TAILQ_INSERT_TAIL(&q->stream.readers, reader, next);
+
+  if (wait) {
+    *wait = reader;
+  }
+
+  return 0;
+}
+
+void queue_read_wait_cancel(struct queue_reader *wait)
+{
+  struct queue *q = wait->owner;
+
+  /* the readers are being walked, so it is only freed once that is done */
+  if (q->stream.waking > 0) {
+    wait->cb = NULL;
+    q->stream.finished++;
+    return;
+  }
+
+  queue_reader_free_(q, wait);
+}
+
+void queue_item_get_receipt(struct queue_item *item,
+                            char receipt[QUEUE_RECEIPT_STR_LEN + 1/*NULL*/])
+{
+  sprintf(receipt, "%016llx", item->receipt);
+}
+
+void queue_set_ttl(struct queue *q, unsigned long long ttl)
+{
+  q->ttl = ttl;
+
+  if (wal_is_enabled() && !q->unlogged) {
+    queue_log_settings_(q, wal_reserve_callback, NULL);
+  }
+}
+
+void queue_set_idle(struct queue *q, unsigned long long idle)
+{
+  q->idle = idle;
+
+  if (wal_is_enabled() && !q->unlogged) {
+    queue_log_settings_(q, wal_reserve_callback, NULL);
+  }
+}
+
+unsigned long long queue_get_idle(struct queue *q)
+{
+  return q->idle;
+}
+
+int queue_is_unused(struct queue *q)
+{
+  return q->stored_count == 0 && q->callback_count == 0 &&
+         q->space_wait_count == 0 && TAILQ_EMPTY(&q->stream.readers);
+}
+
+size_t queue_get_footprint(struct queue *q)
+{
+  return sizeof(struct queue) + q->memory +
+         (q->keys.size + q->leases.size + q->restored.size +
+          q->stream.consumers.size) * sizeof(struct hash_entry *);
+}
+
+void queue_set_limits(struct queue *q, size_t max_items, size_t max_bytes,
+                      enum queue_policy policy)
+{
+  q->max_items = max_items;
+  q->max_bytes = max_bytes;
+  q->policy = policy;
+
+  if (wal_is_enabled() && !q->unlogged) {
+    queue_log_settings_(q, wal_reserve_callback, NULL);
+  }
+}
+
+int queue_policy_from_string(const char *name, enum queue_policy *policy)
+{
+  if (!strcasecmp(name, "reject")) {
+    *policy = queue_policy_reject;
+  } else if (!strcasecmp(name, "drop_oldest")) {
+    *policy = queue_policy_drop_oldest;
+  } else if (!strcasecmp(name, "block")) {
+    *policy = queue_policy_block;
+  } else {
+    return 0;
+  }
+
+  return 1;
+}
+
+const char *queue_policy_to_string(enum queue_policy policy)
+{
+  switch (policy) {
+  case queue_policy_drop_oldest:
+    return "drop_oldest";
+  case queue_policy_block:
+    return "block";
+  default:
+    return "reject";
+  }
+}
+
+int queue_set_type(struct queue *q, enum queue_type type)
+{
+  if (q->type == type) {
+    return 1;
+  }
+
+  /* items and waits are held differently by each type */
+  if (q->stored_count > 0 || q->item_count > 0 || q->callback_count > 0 ||
+      q->stream.consumer_count > 0) {
+    return 0;
+  }
+
+  q->type = type;
+
+  if (wal_is_enabled() && !q->unlogged) {
+    queue_log_settings_(q, wal_reserve_callback, NULL);
+  }
+
+  return 1;
+}
+
+enum queue_type queue_get_type(struct queue *q)
+{
+  return q->type;
+}
+
+int queue_type_from_string(const char *name, enum queue_type *type)
+{
+  if (!strcasecmp(name, "queue")) {
+    *type = queue_type_queue;
+  } else if (!strcasecmp(name, "stream")) {
+    *type = queue_type_stream;
+  } else {
+    return 0;
+  }
+
+  return 1;
+}
+
+const char *queue_type_to_string(enum queue_type type)
+{
+  switch (type) {
+  case queue_type_stream:
+    return "stream";
+  default:
+    return "queue";
+  }
+}
+
+struct queue_space_wait *queue_wait_space(struct queue *q,
+                                          void (*cb)(void *, int), void *arg)
+{
+  struct queue_space_wait *wait;
+  unsigned char pool_class;
+
+  wait = queue_alloc_(q, sizeof(struct queue_space_wait), &pool_class);
+  if (!wait) {
+    return NULL;
+  }
+
+  wait->owner = q;
+  wait->pool_class = pool_class;
+  wait->cb = cb;
+  wait->cbarg = arg;
+
+  TAILQ_INSERT_TAIL(&q->space_waits, wait, next);
+  q->space_wait_count++;
+
+  return wait;
+}
+
+void queue_space_wait_cancel(struct queue_space_wait *wait)
+{
+  TAILQ_REMOVE(&wait->owner->space_waits, wait, next);
+  wait->owner->space_wait_count--;
+  queue_release_(wait->owner, wait, sizeof(struct queue_space_wait),
+                 wait->pool_class);
+}
+
+void queue_get_stats(struct queue *q, struct queue_stats *stats)
+{
+  struct queue_item *first;
+
+  stats->items = q->item_count;
+  stats->delayed = q->delayed_count;
+  stats->leased = q->leased_count;
+  stats->ttl = q->ttl;
+  stats->idle = q->idle;
+  stats->expired = q->expired_count;
+  stats->bytes = q->stored_bytes;
+  stats->max_items = q->max_items;
+  stats->max_bytes = q->max_bytes;
+  stats->policy = q->policy;
+  stats->dropped = q->dropped_count;
+  stats->memory = q->memory;
+  stats->spilled = q->spilled_count;
+  stats->compression = q->compression;
+  stats->compression.threshold = queue_context_.compression.threshold;
+  stats->compression.level = queue_context_.compression.level;
+  stats->type = q->type;
+  stats->next = q->item_id + 1;
+  first = queue_stream_first_(q);
+  stats->first = first ? first->id : stats->next;
+  stats->consumers = q->stream.consumer_count;
+}
+
+int queue_log(struct queue *q, void *(*reserve)(int, size_t, void *),
+              void *arg)
+{
+  struct queue_segment *segment;
+  struct queue_level *level;
+  struct queue_item *keyed;
+  struct queue_item *item;
+  size_t index;
+  size_t limit;
+  int priority;
+
+  if (!queue_log_settings_(q, reserve, arg)) {
+    return 0;
+  }
+
+  if (q->type == queue_type_stream) {
+    return queue_log_stream_(q, reserve, arg);
+  }
+
+  /* items are logged in the order they are in the queue, so they are put
+     back in the same order */
+  for (priority = 0; priority < QUEUE_PRIORITY_LEVELS; priority++) {
+    level = &q->levels[priority];
+    keyed = TAILQ_FIRST(&level->items);
+
+    if (level->ring.front == 0 &&
+        !queue_log_spills_(q, &level->ring, &keyed, reserve, arg)) {
+      return 0;
+    }
+
+    index = level->ring.head;
+    TAILQ_FOREACH(segment, &level->ring.segments, next) {
+      limit = segment == TAILQ_LAST(&level->ring.segments, qshead) ?
+              level->ring.tail : QUEUE_SEGMENT_SLOTS;
+
+      for (; index < limit; index++) {
+        item = segment->slots[index];
+        if (!item) {
+          continue;
+        }
+
+        for (; keyed && keyed->serial < item->serial;
+             keyed = TAILQ_NEXT(keyed, next)) {
+          if (!queue_log_put_(q, keyed, reserve, arg)) {
+            return 0;
+          }
+        }
+
+        if (!queue_log_put_(q, item, reserve, arg)) {
+          return 0;
+        }
+      }
+
+      /* spilled items come between the front segments and the rest */
+      if (level->ring.front > 0 && segment == level->ring.front_last &&
+          !queue_log_spills_(q, &level->ring, &keyed, reserve, arg)) {
+        return 0;
+      }
+
+      index = 0;
+    }
+
+    for (; keyed; keyed = TAILQ_NEXT(keyed, next)) {
+      if (!queue_log_put_(q, keyed, reserve, arg)) {
+        return 0;
+      }
+    }
+  }
+
+  TAILQ_FOREACH(item, &q->delayed, next) {
+    if (!queue_log_put_(q, item, reserve, arg)) {
+      return 0;
+    }
+  }
+
+  /* a lease does not survive a restart, the item is put back instead */
+  TAILQ_FOREACH(item, &q->leased, next) {
+    if (!queue_log_put_(q, item, reserve, arg)) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+int queue_replay(struct queue *q, int type, const void *data, size_t length)
+{
+  int unlogged = q->unlogged;
+  int result;
+
+  /* the records are already in the log or snapshot they are read from */
+  q->unlogged = 1;
+  result = queue_replay_record_(q, type, data, length);
+  q->unlogged = unlogged;
+
+  return result;
+}
+
+int queue_replay_record_(struct queue *q, int type, const void *data,
+                         size_t length)
+{
+  const struct queue_log_settings *settings = data;
+  const struct queue_log_put *put = data;
+  const struct queue_log_consumer *consumer = data;
+  const char *key;
+  const char *value;
+  size_t stored;
+
+  switch (type) {
+  case wal_record_settings:
+    /* records written before queues had an idle time end where it starts,
+       and replay with none */
+    if ((length != sizeof(struct queue_log_settings) &&
+         length != offsetof(struct queue_log_settings, idle)) ||
+        settings->policy < queue_policy_reject ||
+        settings->policy > queue_policy_block ||
+        settings->type < queue_type_queue ||
+        settings->type > queue_type_stream ||
+        !queue_set_type(q, (enum queue_type)settings->type)) {
+      return 0;
+    }
+
+    /* new items must never reuse an id that is already in the log */
+    if (settings->item > q->item_id) {
+      q->item_id = settings->item;
+    }
+
+    queue_set_ttl(q, settings->ttl);
+    queue_set_idle(q, length == sizeof(struct queue_log_settings) ?
+                      settings->idle : 0);
+    queue_set_limits(q, (size_t)settings->max_items,
+                     (size_t)settings->max_bytes,
+                     (enum queue_policy)settings->policy);
+    return 1;
+  case wal_record_put:
+    if (length < sizeof(struct queue_log_put)) {
+      return 0;
+    }
+
+    stored = put->compressed ? put->stored_length : put->value_length;
+    if (length - sizeof(struct queue_log_put) !=
+          put->key_length + 1/*NULL*/ + stored + 1/*NULL*/) {
+      return 0;
+    }
+
+    key = (const char *)data + sizeof(struct queue_log_put);
+    value = key + put->key_length + 1/*NULL*/;
+    if (key[put->key_length] != '\0' || value[stored] != '\0') {
+      return 0;
+    }
+
+    return queue_replay_put_(q, put, put->keyed ? key : NULL, value);
+  case wal_record_remove:
+    if (length != sizeof(struct queue_log_remove)) {
+      return 0;
+    }
+
+    return queue_replay_remove_(q, data);
+  case wal_record_consumer:
+    if (length < sizeof(struct queue_log_consumer) ||
+        length - sizeof(struct queue_log_consumer) !=
+          consumer->name_length + 1/*NULL*/) {
+      return 0;
+    }
+
+    key = (const char *)data + sizeof(struct queue_log_consumer);
+    if (key[consumer->name_length] != '\0') {
+      return 0;
+    }
+
+    return queue_replay_consumer_(q, consumer, key);
+  default:
+    return 0;
+  }
+}
+
+void queue_replay_finish(struct queue *q)
+{
+  struct hash_entry *entry;
+  size_t index;
+
+  if (!q->restored.buckets) {
+    return;
+  }
+
+  for (index = 0; index < q->restored.size; index++) {
+    while ((entry = q->restored.buckets[index]) != NULL) {
+      q->restored.buckets[index] = entry->next;
+      free(HASH_ENTRY(entry, struct queue_restored, entry));
+    }
+  }
+
+  hash_table_destroy(&q->restored);
+}
+
+void queue_get_uuid(struct queue *q, char uuid[QUEUE_UUID_STR_LEN + 1/*NULL*/])
+{
+  /* uuid is network byte order numbers - this matters since the version and
+     variant are in octet 6 and 8 */
+  sprintf(uuid, "%08x-%04x-%04x-%04x-%02x%02x%02x%02x%02x%02x",
+          htonl(*(unsigned long *)&q->uuid[0]),
+          htons(*(unsigned short *)&q->uuid[4]),
+          htons(*(unsigned short *)&q->uuid[6]),
+          htons(*(unsigned short *)&q->uuid[8]),
+          q->uuid[10],
+          q->uuid[11],
+          q->uuid[12],
+          q->uuid[13],
+          q->uuid[14],
+          q->uuid[15]);
+}
+
+const char *queue_item_get_key(struct queue_item *item)
+{
+  return item->key ? key_get_string(item->key) : NULL;
+}
+
+const char *queue_item_get_value(struct queue_item *item)
+{
+  return item->value.compressed ? NULL : item->data;
+}
+
+size_t queue_item_get_length(struct queue_item *item)
+{
+  return item->value.length;
+}
+
+int queue_item_is_compressed(struct queue_item *item)
+{
+  return item->value.compressed;
+}
+
+int queue_item_copy_value(struct queue_item *item, char *buffer)
+{
+  return queue_value_copy(&item->value, buffer);
+}
+
+int queue_item_get_priority(struct queue_item *item)
+{
+  return item->priority;
+}
+
+unsigned long long queue_item_get_offset(struct queue_item *item)
+{
+  return item->owner->type == queue_type_stream ? item->id : 0;
+}
+
+int queue_item_lock(struct queue_item *item)
+{
+  /* TODO: how do we guarantee the item is still valid? */
+  item->lockcount++;
+
+  return 0;
+}
+
+void queue_item_unlock(struct queue_item *item)
+{
+  item->lockcount--;
+
+  /* handle if this item is now ready to be freed */
+  if (item->lockcount == 0 && !item->inserted) {
+    queue_item_free(item);
+  }
+}
+
+void queue_item_free(struct queue_item *item)
+{
+  if (item->lockcount != 0) {
+    return;
+  }
+
+  queue_item_free_(item);
+}
+
+struct queue_value *queue_value_get(struct queue_item *item)
+{
+  item->value.refs++;
+
+  return &item->value;
+}
+
+void queue_value_release(struct queue_value *value)
+{
+  size_t size;
+
+  value->refs--;
+  if (value->refs > 0 || !value->orphaned) {
+    return;
+  }
+
+  size = queue_value_size_(value);
+  queue_context_.memory -= size;
+  queue_context_.memory_held -= size;
+  queue_value_free_(value);
+}
+
+const char *queue_value_get_data(struct queue_value *value)
+{
+  return value->compressed ? NULL : QUEUE_VALUE_ITEM(value)->data;
+}
+
+size_t queue_value_get_length(struct queue_value *value)
+{
+  return value->length;
+}
+
+int queue_value_is_compressed(struct queue_value *value)
+{
+  return value->compressed;
+}
+
+const char *queue_value_get_stored(struct queue_value *value, size_t *length)
+{
+  *length = value->stored;
+
+  return QUEUE_VALUE_ITEM(value)->data;
+}
+
+int queue_value_copy(struct queue_value *value, char *buffer)
+{
+  struct queue_item *item = QUEUE_VALUE_ITEM(value);
+  unsigned long long start;
+  unsigned long long elapsed;
+  uLongf length = (uLongf)value->length;
+  int result;
+
+  if (!value->compressed) {
+    memcpy(buffer, item->data, value->length);
+    return 1;
+  }
+
+  start = queue_cpu_time_();
+  result = uncompress((Bytef *)buffer, &length, (const Bytef *)item->data,
+                      (uLong)value->stored);
+  elapsed = queue_cpu_time_() - start;
+
+  queue_context_.compression.decompressed++;
+  queue_context_.compression.decompress_time += elapsed;
+
+  /* a value that is no longer in a queue only counts towards the total */
+  if (item->owner) {
+    item->owner->compression.decompressed++;
+    item->owner->compression.decompress_time += elapsed;
+  }
+
+  return result == Z_OK && length == value->length;
+}
+
+const char *queue_value_get_encoded(struct queue_value *value, size_t *length)
+{
+  *length = value->encoded_length;
+
+  return value->encoded;
+}
+
+const char *queue_item_get_encoded(struct queue_item *item, size_t *length)
+{
+  return queue_value_get_encoded(&item->value, length);
+}
+
+int queue_item_set_encoded(struct queue_item *item, const char *data,
+                           size_t length)
+{
+  struct queue_value *value = &item->value;
+  unsigned char pool_class;
+  char *encoded;
+
+  /* the encoding never changes, so the first one is kept */
+  if (value->encoded) {
+    return 1;
+  }
+
+  encoded = queue_alloc_(item->owner, length, &pool_class);
+  if (!encoded) {
+    return 0;
+  }
+
+  memcpy(encoded, data, length);
+  value->encoded = encoded;
+  value->encoded_length = length;
+  value->encoded_class = pool_class;
+
+  return 1;
+}
+
+void queue_get_pool_stats(struct pool_stats stats[QUEUE_POOL_CLASSES + 1])
+{
+  size_t index;
+
+  for (index = 0; index < QUEUE_POOL_CLASSES; index++) {
+    pool_get_stats(&queue_context_.pools[index], &stats[index]);
+  }
+
+  stats[QUEUE_POOL_CLASSES] = queue_context_.large;
+}
+
+void queue_set_memory_budget(size_t budget)
+{
+  queue_context_.memory_budget = budget;
+}
+
+void queue_get_memory_stats(struct queue_memory_stats *stats)
+{
+  stats->used = queue_context_.memory;
+  stats->held = queue_context_.memory_held;
+  stats->budget = queue_context_.memory_budget;
+  stats->rejected = queue_context_.memory_rejected;
+  stats->evicted = queue_context_.memory_evicted;
+}
+
+void queue_set_compression(size_t threshold, int level)
+{
+  queue_context_.compression.threshold = threshold;
+  queue_context_.compression.level = level;
+}
+
+void queue_get_compression_stats(struct queue_compression_stats *stats)
+{
+  *stats = queue_context_.compression;
+}
+
+void queue_set_spill_threshold(size_t threshold)
+{
+  queue_context_.spill_threshold = threshold;
+}
+
+void queue_get_spill_stats(struct queue_spill_stats *stats)
+{
+  stats->threshold = spill_is_enabled() ? queue_context_.spill_threshold : 0;
+  stats->items = queue_context_.spilled;
+  stats->files = spill_get_files();
+  stats->bytes = spill_get_bytes();
+  stats->spilled = queue_context_.spill_items;
+  stats->spilled_bytes = queue_context_.spill_bytes;
+  stats->filled = queue_context_.fill_items;
+  stats->filled_bytes = queue_context_.fill_bytes;
+  stats->lost = queue_context_.spill_lost;
+}
+
+void *queue_alloc_(struct queue *q, size_t size, unsigned char *pool_class)
+{
+  unsigned char index;
+  void *object;
+
+  for (index = 0; index < QUEUE_POOL_CLASSES; index++) {
+    if (size <= ((size_t)QUEUE_POOL_MIN_SIZE << index)) {
+      object = pool_alloc(&queue_context_.pools[index]);
+      if (object) {
+        *pool_class = index;
+        queue_memory_charge_(q, (size_t)QUEUE_POOL_MIN_SIZE << index);
+      }
+
+      return object;
+    }
+  }
+
+  object = malloc(size);
+  if (object) {
+    *pool_class = QUEUE_POOL_LARGE;
+    queue_context_.large.used_count++;
+    queue_context_.large.allocations++;
+    queue_memory_charge_(q, size);
+  }
+
+  return object;
+}
+
+void queue_release_(struct queue *q, void *object, size_t size,
+                    unsigned char pool_class)
+{
+  queue_memory_release_(q, queue_allocation_(size, pool_class));
+  queue_free_(object, pool_class);
+}
+
+size_t queue_allocation_(size_t size, unsigned char pool_class)
+{
+  if (pool_class == QUEUE_POOL_LARGE) {
+    return size;
+  }
+
+  return (size_t)QUEUE_POOL_MIN_SIZE << pool_class;
+}
+
+void queue_free_(void *object, unsigned char pool_class)
+{
+  if (pool_class == QUEUE_POOL_LARGE) {
+    queue_context_.large.used_count--;
+    queue_context_.large.releases++;
+    free(object);
+    return;
+  }
+
+  pool_free(object);
+}
+
+void queue_memory_charge_(struct queue *q, size_t size)
+{
+  q->memory += size;
+  queue_context_.memory += size;
+}
+
+void queue_memory_release_(struct queue *q, size_t size)
+{
+  q->memory -= size;
+  queue_context_.memory -= size;
+}
+
+int queue_memory_exceeded_(void)
+{
+  return queue_context_.memory_budget != 0 &&
+         queue_context_.memory > queue_context_.memory_budget;
+}
+
+struct queue_item *queue_item_new_(struct queue *q, struct key *key,
+                                   const char *value, size_t length)
+{
+  const char *stored = value;
+  size_t stored_length = length;
+  int compressed = 0;
+
+  if (queue_context_.compression.threshold != 0 &&
+      length >= queue_context_.compression.threshold) {
+    compressed = queue_compress_(q, value, length, &stored, &stored_length);
+  }
+
+  return queue_item_store_(q, key, compressed ? stored : value,
+                           compressed ? stored_length : length, length,
+                           compressed);
+}
+
+struct queue_item *queue_item_store_(struct queue *q, struct key *key,
+                                     const char *data, size_t stored,
+                                     size_t length, int compressed)
+{
+  struct queue_item *item;
+  unsigned char pool_class;
+
+  item = queue_alloc_(q, sizeof(struct queue_item) + stored + 1/*NULL*/,
+                      &pool_class);
+  if (!item) {
+    return NULL;
+  }
+
+  memset(item, 0, sizeof(struct queue_item));
+  item->pool_class = pool_class;
+  item->owner = q;
+  item->key = key;
+
+  item->value.length = length;
+  item->value.stored = stored;
+  item->value.compressed = (unsigned char)compressed;
+  memcpy(item->data, data, stored);
+  item->data[stored] = '\0';
+
+  return item;
+}
+
+int queue_compress_(struct queue *q, const char *value, size_t length,
+                    const char **stored, size_t *stored_length)
+{
+  struct queue_compression_stats *global = &queue_context_.compression;
+  unsigned long long start;
+  unsigned long long elapsed;
+  unsigned char *scratch;
+  uLongf bound;
+  int result;
+
+  if ((uLong)length != length) {
+    return 0;
+  }
+
+  bound = compressBound((uLong)length);
+  if (bound > queue_context_.scratch_size) {
+    scratch = realloc(queue_context_.scratch, bound);
+    if (!scratch) {
+      return 0;
+    }
+
+    queue_context_.scratch = scratch;
+    queue_context_.scratch_size = bound;
+  }
+
+  start = queue_cpu_time_();
+  result = compress2(queue_context_.scratch, &bound, (const Bytef *)value,
+                     (uLong)length, global->level);
+  elapsed = queue_cpu_time_() - start;
+
+  global->compress_time += elapsed;
+  q->compression.compress_time += elapsed;
+
+  /* the log only has room for the compressed length as an unsigned int */
+  if (result != Z_OK || bound >= length || bound > UINT_MAX) {
+    return 0;
+  }
+
+  global->items++;
+  global->bytes_in += length;
+  global->bytes_out += bound;
+  q->compression.items++;
+  q->compression.bytes_in += length;
+  q->compression.bytes_out += bound;
+
+  *stored = (const char *)queue_context_.scratch;
+  *stored_length = bound;
+  return 1;
+}
+
+unsigned long long queue_cpu_time_(void)
+{
+#ifdef _WIN32
+  FILETIME creation;
+  FILETIME exit;
+  FILETIME kernel;
+  FILETIME user;
+  ULARGE_INTEGER total;
+
+  if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user)) {
+    return 0;
+  }
+
+  total.LowPart = user.dwLowDateTime;
+  total.HighPart = user.dwHighDateTime;
+
+  /* counted in 100 nanosecond intervals */
+  return total.QuadPart / 10;
+#else
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+    return 0;
+  }
+
+  return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+void queue_item_release_(struct queue *q, struct queue_item *item)
+{
+  size_t size = queue_value_size_(&item->value);
+
+  /* the storage stays counted against the memory budget while the value is
+     still being sent, but it no longer belongs to the queue */
+  if (item->value.refs > 0) {
+    q->memory -= size;
+    queue_context_.memory_held += size;
+    item->value.orphaned = 1;
+    item->owner = NULL;
+    return;
+  }
+
+  queue_memory_release_(q, size);
+  queue_value_free_(&item->value);
+}
+
+size_t queue_item_storage_(struct queue_item *item)
+{
+  return queue_allocation_(sizeof(struct queue_item) + item->value.stored +
+                             1/*NULL*/, item->pool_class);
+}
+
+size_t queue_value_size_(struct queue_value *value)
+{
+  struct queue_item *item = QUEUE_VALUE_ITEM(value);
+  size_t size;
+
+  size = queue_allocation_(sizeof(struct queue_item) + value->stored +
+                             1/*NULL*/, item->pool_class);
+  if (value->encoded) {
+    size += queue_allocation_(value->encoded_length, value->encoded_class);
+  }
+
+  return size;
+}
+
+void queue_value_free_(struct queue_value *value)
+{
+  struct queue_item *item = QUEUE_VALUE_ITEM(value);
+
+  if (value->encoded) {
+    queue_free_(value->encoded, value->encoded_class);
+  }
+
+  queue_free_(item, item->pool_class);
+}
+
+void queue_item_due_(struct timer_entry *entry, void *arg)
+{
+  struct queue_item *item = arg;
+  struct queue *q = item->owner;
+
+  TAILQ_REMOVE(&q->delayed, item, next);
+  q->delayed_count--;
+  item->delayed = 0;
+
+  /* there is nobody to report a failure to, the item is already freed */
+  queue_put_item_(q, item);
+}
+
+void queue_item_expire_(struct timer_entry *entry, void *arg)
+{
+  struct queue_item *item = arg;
+  struct queue *q = item->owner;
+
+  q->expired_count++;
+
+  /* someone may still have the item locked from a peek */
+  queue_item_remove_(q, item);
+  queue_item_discharge_(q, item);
+  queue_item_free(item);
+}
+
+void queue_item_lease_expired_(struct timer_entry *entry, void *arg)
+{
+  struct queue_item *item = arg;
+  struct queue *q = item->owner;
+
+  queue_item_unlease_(q, item);
+
+  /* the time to live kept running while the item was leased */
+  if (item->expires && item->expires <= timer_now()) {
+    q->expired_count++;
+    queue_item_discharge_(q, item);
+    queue_item_free(item);
+    return;
+  }
+
+  /* there is nobody to report a failure to, the item is already freed */
+  queue_put_item_(q, item);
+}
+
+void queue_item_charge_(struct queue *q, struct queue_item *item)
+{
+  if (item->charged) {
+    return;
+  }
+
+  item->charged = 1;
+  q->stored_count++;
+  q->stored_bytes += queue_item_size_(item);
+
+  /* restored items keep the id they were logged with */
+  if (item->id == 0) {
+    item->id = ++q->item_id;
+  }
+
+  if (wal_is_enabled() && !q->unlogged) {
+    queue_log_put_(q, item, wal_reserve_callback, NULL);
+  }
+}
+
+void queue_item_discharge_(struct queue *q, struct queue_item *item)
+{
+  if (!item->charged) {
+    return;
+  }
+
+  item->charged = 0;
+  q->stored_count--;
+  q->stored_bytes -= queue_item_size_(item);
+
+  if (wal_is_enabled() && !q->unlogged) {
+    queue_log_remove_(q, item);
+  }
+
+  if (q->space_wait_count > 0 && queue_has_room_(q, 0)) {
+    timer_schedule(&q->space_timer, 0);
+  }
+}
+
+size_t queue_item_size_(struct queue_item *item)
+{
+  return item->value.length + (item->key ? key_get_length(item->key) : 0);
+}
+
+unsigned long long queue_unix_time_(unsigned long long when)
+{
+  unsigned long long now = timer_now();
+
+  return timer_unix_now() + (when > now ? when - now : 0);
+}
+
+int queue_log_settings_(struct queue *q,
+                        void *(*reserve)(int, size_t, void *), void *arg)
+{
+  struct queue_log_settings settings;
+  char uuid[QUEUE_UUID_STR_LEN + 1/*NULL*/];
+  void *record;
+
+  record = reserve(wal_record_settings, sizeof(struct queue_log_settings),
+                   arg);
+  if (!record) {
+    return 0;
+  }
+
+  queue_get_uuid(q, uuid);
+
+  memset(&settings, 0, sizeof(struct queue_log_settings));
+  memcpy(settings.id, uuid, QUEUE_UUID_STR_LEN);
+  settings.ttl = q->ttl;
+  settings.max_items = q->max_items;
+  settings.max_bytes = q->max_bytes;
+  settings.policy = (int)q->policy;
+  settings.type = (int)q->type;
+  settings.item = q->item_id;
+  settings.idle = q->idle;
+
+  memcpy(record, &settings, sizeof(struct queue_log_settings));
+  return 1;
+}
+
+int queue_log_put_(struct queue *q, struct queue_item *item,
+                   void *(*reserve)(int, size_t, void *), void *arg)
+{
+  struct queue_log_put put;
+
+  memset(&put, 0, sizeof(struct queue_log_put));
+  put.item = item->id;
+  put.priority = item->priority;
+  put.keyed = item->key != NULL;
+  put.key_length = item->key ? key_get_length(item->key) : 0;
+  put.value_length = item->value.length;
+  put.compressed = item->value.compressed;
+  put.stored_length = item->value.compressed ?
+                        (unsigned int)item->value.stored : 0;
+
+  /* times are logged as unix times so they survive a restart */
+  if (item->delayed) {
+    put.due = timer_unix_now() + timer_get_remaining(&item->timer);
+  }
+
+  if (item->expires) {
+    put.expires = queue_unix_time_(item->expires);
+  }
+
+  return queue_log_value_(q, &put,
+                          item->key ? key_get_string(item->key) : NULL,
+                          item->data, reserve, arg);
+}
+
+int queue_log_value_(struct queue *q, struct queue_log_put *put,
+                     const char *key, const char *value,
+                     void *(*reserve)(int, size_t, void *), void *arg)
+{
+  char uuid[QUEUE_UUID_STR_LEN + 1/*NULL*/];
+  size_t stored = put->compressed ? put->stored_length : put->value_length;
+  char *record;
+
+  record = reserve(wal_record_put, sizeof(struct queue_log_put) +
+                                   put->key_length + 1/*NULL*/ +
+                                   stored + 1/*NULL*/, arg);
+  if (!record) {
+    return 0;
+  }
+
+  queue_get_uuid(q, uuid);
+  memcpy(put->id, uuid, QUEUE_UUID_STR_LEN);
+
+  memcpy(record, put, sizeof(struct queue_log_put));
+  record += sizeof(struct queue_log_put);
+
+  if (key) {
+    memcpy(record, key, put->key_length);
+  }
+
+  record[put->key_length] = '\0';
+  record += put->key_length + 1/*NULL*/;
+
+  memcpy(record, value, stored + 1/*NULL*/);
+  return 1;
+}
+
+int queue_log_spills_(struct queue *q, struct queue_ring *ring,
+                      struct queue_item **keyed,
+                      void *(*reserve)(int, size_t, void *), void *arg)
+{
+  struct queue_spill_record record;
+  struct queue_log_put put;
+  struct queue_spill *spill;
+  size_t offset;
+  size_t index;
+  char *buffer;
+
+  TAILQ_FOREACH(spill, &ring->spills, next) {
+    buffer = malloc(spill->extent.length);
+    if (!buffer) {
+      return 0;
+    }
+
+    /* the spilled items are read without loading them back into the ring */
+    if (!spill_peek(&spill->extent, buffer)) {
+      free(buffer);
+      return 0;
+    }
+
+    for (index = 0, offset = 0; index < spill->count; index++) {
+      memcpy(&record, buffer + offset, sizeof(struct queue_spill_record));
+      offset += sizeof(struct queue_spill_record);
+
+      for (; *keyed && (*keyed)->serial < record.serial;
+           *keyed = TAILQ_NEXT(*keyed, next)) {
+        if (!queue_log_put_(q, *keyed, reserve, arg)) {
+          free(buffer);
+          return 0;
+        }
+      }
+
+      memset(&put, 0, sizeof(struct queue_log_put));
+      put.item = record.id;
+      put.priority = (unsigned char)ring->priority;
+      put.value_length = record.length;
+      put.compressed = (unsigned char)record.compressed;
+      put.stored_length = record.compressed ? (unsigned int)record.stored : 0;
+
+      if (record.expires) {
+        put.expires = queue_unix_time_(record.expires);
+      }
+
+      if (!queue_log_value_(q, &put, NULL, buffer + offset, reserve, arg)) {
+        free(buffer);
+        return 0;
+      }
+
+      offset += record.stored + 1/*NULL*/;
+    }
+
+    free(buffer);
+  }
+
+  return 1;
+}
+
+void queue_log_remove_(struct queue *q, struct queue_item *item)
+{
+  struct queue_log_remove remove;
+  char uuid[QUEUE_UUID_STR_LEN + 1/*NULL*/];
+  void *record;
+
+  record = wal_reserve(wal_record_remove, sizeof(struct queue_log_remove));
+  if (!record) {
+    return;
+  }
+
+  queue_get_uuid(q, uuid);
+
+  memset(&remove, 0, sizeof(struct queue_log_remove));
+  memcpy(remove.id, uuid, QUEUE_UUID_STR_LEN);
+  remove.item = item->id;
+
+  memcpy(record, &remove, sizeof(struct queue_log_remove));
+}
+
+int queue_replay_put_(struct queue *q, const struct queue_log_put *put,
+                      const char *key, const char *value)
+{
+  struct queue_restored *restored;
+  struct queue_item *item;
+  struct key *interned = NULL;
+  unsigned long long unix_now;
+  int result;
+
+  if (put->priority >= QUEUE_PRIORITY_LEVELS || put->item == 0) {
+    return 0;
+  }
+
+  if (!q->restored.buckets &&
+      !hash_table_init(&q->restored, QUEUE_KEY_TABLE_SIZE)) {
+    return 0;
+  }
+
+  /* new items must never reuse an id that is already in the log */
+  if (put->item > q->item_id) {
+    q->item_id = put->item;
+  }
+
+  /* an item that expired while the server was down is not put back */
+  unix_now = timer_unix_now();
+  if (put->expires && put->expires <= unix_now) {
+    return 1;
+  }
+
+  restored = malloc(sizeof(struct queue_restored));
+  if (!restored) {
+    return 0;
+  }
+
+  if (key) {
+    interned = key_intern(key);
+    if (!interned) {
+      free(restored);
+      return 0;
+    }
+  }
+
+  if (put->compressed) {
+    item = queue_item_store_(q, interned, value, put->stored_length,
+                             put->value_length, 1);
+  } else {
+    item = queue_item_new_(q, interned, value, put->value_length);
+  }
+
+  if (!item) {
+    if (interned) {
+      key_release(interned);
+    }
+
+    free(restored);
+    return 0;
+  }
+
+  item->priority = put->priority;
+  item->id = put->item;
+
+  if (put->expires) {
+    item->expires = timer_now() + (put->expires - unix_now);
+  }
+
+  /* nothing is waiting on the queue yet, so the item is always inserted */
+  if (put->due > unix_now) {
+    if (queue_item_delay_(q, item, put->due - unix_now) < 0) {
+      queue_item_free_(item);
+      free(restored);
+      return 0;
+    }
+  } else if ((result = queue_put_item_(q, item)) != 0) {
+    free(restored);
+    return result > 0;
+  }
+
+  restored->item = item;
+  hash_table_insert(&q->restored, &restored->entry, (size_t)put->item);
+
+  return 1;
+}
+
+int queue_replay_remove_(struct queue *q,
+                         const struct queue_log_remove *remove)
+{
+  struct queue_restored *restored;
+  struct hash_entry *entry;
+
+  if (!q->restored.buckets) {
+    return 1;
+  }
+
+  /* the item may have expired before it was restored */
+  for (entry = hash_table_find(&q->restored, (size_t)remove->item); entry;
+       entry = hash_table_next(entry)) {
+    restored = HASH_ENTRY(entry, struct queue_restored, entry);
+    if (restored->item->id == remove->item) {
+      hash_table_remove(&q->restored, entry);
+      queue_item_free_(restored->item);
+      free(restored);
+      break;
+    }
+  }
+
+  return 1;
+}
+
+int queue_replay_consumer_(struct queue *q,
+                           const struct queue_log_consumer *consumer,
+                           const char *name)
+{
+  struct queue_consumer *qc;
+
+  qc = queue_consumer_get_(q, name, 1);
+  if (!qc) {
+    return 0;
+  }
+
+  queue_consumer_move_(q, qc, consumer->offset);
+  return 1;
+}
+
+int queue_log_stream_(struct queue *q,
+                      void *(*reserve)(int, size_t, void *), void *arg)
+{
+  struct queue_block *block;
+  struct hash_entry *entry;
+  size_t index;
+
+  /* items are logged in the order they were appended, so they get the same
+     offsets back */
+  index = q->stream.head;
+  TAILQ_FOREACH(block, &q->stream.blocks, next) {
+    for (; index < block->count; index++) {
+      if (block->slots[index] &&
+          !queue_log_put_(q, block->slots[index], reserve, arg)) {
+        return 0;
+      }
+    }
+
+    index = 0;
+  }
+
+  if (!q->stream.consumers.buckets) {
+    return 1;
+  }
+
+  for (index = 0; index < q->stream.consumers.size; index++) {
+    for (entry = q->stream.consumers.buckets[index]; entry != NULL;
+         entry = entry->next) {
+      if (!queue_log_consumer_(q, HASH_ENTRY(entry, struct queue_consumer,
+                                             entry), reserve, arg)) {
+        return 0;
+      }
+    }
+  }
+
+  return 1;
+}
+
+int queue_log_consumer_(struct queue *q, struct queue_consumer *consumer,
+                        void *(*reserve)(int, size_t, void *), void *arg)
+{
+  struct queue_log_consumer log;
+  char uuid[QUEUE_UUID_STR_LEN + 1/*NULL*/];
+  char *record;
+
+  record = reserve(wal_record_consumer, sizeof(struct queue_log_consumer) +
+                                        key_get_length(consumer->name) +
+                                        1/*NULL*/, arg);
+  if (!record) {
+    return 0;
+  }
+
+  queue_get_uuid(q, uuid);
+
+  memset(&log, 0, sizeof(struct queue_log_consumer));
+  memcpy(log.id, uuid, QUEUE_UUID_STR_LEN);
+  log.offset = consumer->offset;
+  log.name_length = key_get_length(consumer->name);
+
+  memcpy(record, &log, sizeof(struct queue_log_consumer));
+  memcpy(record + sizeof(struct queue_log_consumer),
+         key_get_string(consumer->name), log.name_length + 1/*NULL*/);
+  return 1;
+}
+
+int queue_has_room_(struct queue *q, size_t size)
+{
+  return (q->max_items == 0 || q->stored_count < q->max_items) &&
+         (q->max_bytes == 0 || (q->stored_bytes < q->max_bytes &&
+                                size <= q->max_bytes - q->stored_bytes));
+}
+
+int queue_make_room_(struct queue *q, size_t size)
+{
+  struct queue_item *item;
+  int reason;
+
+  /* dropping every item would still not be enough */
+  if (q->max_bytes != 0 && size > q->max_bytes) {
+    return -2;
+  }
+
+  for (;;) {
+    if (!queue_has_room_(q, size)) {
+      reason = 0;
+    } else if (queue_memory_exceeded_()) {
+      /* moving items to disk is better than dropping or refusing them */
+      if (queue_spill_(q, q->memory - 1) > 0) {
+        continue;
+      }
+
+      reason = -1;
+    } else {
+      return 1;
+    }
+
+    /* only items that could be taken are dropped, delayed and leased items
+       keep their space */
+    if (q->policy != queue_policy_drop_oldest || q->item_count == 0) {
+      if (reason < 0) {
+        queue_context_.memory_rejected++;
+      }
+
+      return reason;
+    }
+
+    /* the rest of the budget can be held by other queues, in which case
+       dropping every item here would still not make room */
+    if (reason < 0) {
+      if (q->ready_memory <
+          queue_context_.memory - queue_context_.memory_budget) {
+        queue_context_.memory_rejected++;
+        return -1;
+      }
+
+      queue_context_.memory_evicted++;
+    }
+
+    /* the head of the level can turn out to be lost while it is read back.
+       streams drop their oldest items whatever their priority */
+    if (q->type == queue_type_stream) {
+      item = queue_stream_first_(q);
+    } else {
+      item = queue_level_first_(q, queue_level_lowest_(q->level_mask));
+    }
+
+    if (!item) {
+      continue;
+    }
+
+    q->dropped_count++;
+
+    queue_item_remove_(q, item);
+    queue_item_discharge_(q, item);
+    queue_item_free(item);
+  }
+}
+
+void queue_space_due_(struct timer_entry *entry, void *arg)
+{
+  struct queue *q = arg;
+  struct queue_space_wait *wait;
+  void (*cb)(void *, int);
+  void *cbarg;
+  size_t count;
+
+  /* only wake the waits that were already here, a put that still does not
+     fit will wait again at the back */
+  count = q->space_wait_count;
+  while (count-- > 0 && queue_has_room_(q, 0)) {
+    wait = TAILQ_FIRST(&q->space_waits);
+    cb = wait->cb;
+    cbarg = wait->cbarg;
+    queue_space_wait_cancel(wait);
+
+    cb(cbarg, 1);
+  }
+}
+
+void queue_item_unlease_(struct queue *q, struct queue_item *item)
+{
+  hash_table_remove(&q->leases, &item->lease);
+  TAILQ_REMOVE(&q->leased, item, next);
+  q->leased_count--;
+  item->leased = 0;
+}
+
+unsigned long long queue_receipt_next_(struct queue *q)
+{
+  unsigned long long receipt;
+
+  /* splitmix64, which gives a different result for every counter value */
+  receipt = q->lease_salt + ++q->lease_serial * 0x9e3779b97f4a7c15ULL;
+  receipt = (receipt ^ (receipt >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  receipt = (receipt ^ (receipt >> 27)) * 0x94d049bb133111ebULL;
+
+  return receipt ^ (receipt >> 31);
+}
+
+struct queue_item *queue_lease_find_(struct queue *q, const char *receipt)
+{
+  struct hash_entry *entry;
+  struct queue_item *item;
+  unsigned long long value;
+  char *end;
+
+  if (!receipt || strlen(receipt) != QUEUE_RECEIPT_STR_LEN ||
+      !isxdigit((unsigned char)receipt[0])) {
+    return NULL;
+  }
+
+  value = strtoull(receipt, &end, 16);
+  if (*end != '\0') {
+    return NULL;
+  }
+
+  for (entry = hash_table_find(&q->leases, (size_t)value); entry != NULL;
+       entry = hash_table_next(entry)) {
+    item = HASH_ENTRY(entry, struct queue_item, lease);
+    if (item->receipt == value) {
+      return item;
+    }
+  }
+
+  return NULL;
+}
+
+void queue_item_free_(struct queue_item *item)
+{
+  if (item->inserted) {
+    queue_item_remove_(item->owner, item);
+  }
+
+  if (item->delayed) {
+    timer_cancel(&item->timer);
+    TAILQ_REMOVE(&item->owner->delayed, item, next);
+    item->owner->delayed_count--;
+  }
+
+  if (item->leased) {
+    timer_cancel(&item->timer);
+    queue_item_unlease_(item->owner, item);
+  }
+
+  queue_item_discharge_(item->owner, item);
+
+  if (item->key) {
+    key_release(item->key);
+  }
+
+  queue_item_release_(item->owner, item);
+}
+
+struct queue_key *queue_key_get_(struct queue *q, struct key *key,
+                                 int create_new)
+{
+  struct hash_entry *entry;
+  struct queue_key *qk;
+  int level;
+
+  /* interned keys are shared, so they can be compared by pointer */
+  for (entry = hash_table_find(&q->keys, key_get_hash(key)); entry != NULL;
+       entry = hash_table_next(entry)) {
+    qk = HASH_ENTRY(entry, struct queue_key, entry);
+    if (qk->key == key) {
+      return qk;
+    }
+  }
+
+  if (!create_new) {
+    return NULL;
+  }
+
+  qk = calloc(1, sizeof(struct queue_key));
+  if (!qk) {
+    return NULL;
+  }
+
+  /* the key string is shared, but each queue using it is counted */
+  queue_memory_charge_(q, sizeof(struct queue_key) + key_get_length(key));
+
+  qk->key = key_ref(key);
+  for (level = 0; level < QUEUE_PRIORITY_LEVELS; level++) {
+    TAILQ_INIT(&qk->items[level]);
+  }
+  TAILQ_INIT(&qk->callbacks);
+
+  /* failing to grow the table leaves it usable, so it is not an error */
+  hash_table_insert(&q->keys, &qk->entry, key_get_hash(key));
+
+  return qk;
+}
+
+void queue_key_release_(struct queue *q, struct queue_key *qk)
+{
+  if (qk->level_mask != 0 || !TAILQ_EMPTY(&qk->callbacks)) {
+    return;
+  }
+
+  hash_table_remove(&q->keys, &qk->entry);
+  queue_memory_release_(q, sizeof(struct queue_key) +
+                           key_get_length(qk->key));
+  key_release(qk->key);
+  free(qk);
+}
+
+int queue_level_highest_(unsigned int level_mask)
+{
+  int level = QUEUE_PRIORITY_LEVELS - 1;
+
+  while (!(level_mask & (1u << level))) {
+    level--;
+  }
+
+  return level;
+}
+
+int queue_level_lowest_(unsigned int level_mask)
+{
+  int level = 0;
+
+  while (!(level_mask & (1u << level))) {
+    level++;
+  }
+
+  return level;
+}
+
+int queue_item_insert_(struct queue *q, struct queue_item *item)
+{
+  struct queue_level *level = &q->levels[item->priority];
+
+  /* streams keep every item in the order it was appended, keys are only
+     matched as the stream is read */
+  if (q->type == queue_type_stream) {
+    if (queue_stream_push_(q, item) < 0) {
+      return -1;
+    }
+
+    item->serial = q->item_serial++;
+    item->inserted = 1;
+    q->item_count++;
+    q->ready_memory += queue_item_storage_(item);
+
+    return 0;
+  }
+
+  if (item->key) {
+    item->keyed = queue_key_get_(q, item->key, 1);
+    if (!item->keyed) {
+      return -1;
+    }
+
+    TAILQ_INSERT_TAIL(&item->keyed->items[item->priority], item, keynext);
+    item->keyed->level_mask |= 1u << item->priority;
+    TAILQ_INSERT_TAIL(&level->items, item, next);
+    q->keyed_count++;
+
+    /* the item takes the next serial below */
+    if (TAILQ_FIRST(&level->items) == item) {
+      level->keyed_serial = q->item_serial;
+    }
+  } else if (queue_ring_push_(&level->ring, item) < 0) {
+    return -1;
+  }
+
+  item->serial = q->item_serial++;
+  item->inserted = 1;
+  level->count++;
+  q->level_mask |= 1u << item->priority;
+  q->item_count++;
+  q->ready_memory += queue_item_storage_(item);
+
+  return 0;
+}
+
+void queue_item_remove_(struct queue *q, struct queue_item *item)
+{
+  struct queue_level *level = &q->levels[item->priority];
+
+  if (q->type == queue_type_stream) {
+    queue_stream_remove_(q, item);
+  } else if (item->keyed) {
+    TAILQ_REMOVE(&item->keyed->items[item->priority], item, keynext);
+    if (TAILQ_EMPTY(&item->keyed->items[item->priority])) {
+      item->keyed->level_mask &= ~(1u << item->priority);
+    }
+
+    TAILQ_REMOVE(&level->items, item, next);
+    q->keyed_count--;
+
+    level->keyed_serial = TAILQ_EMPTY(&level->items) ?
+      QUEUE_SERIAL_NONE : TAILQ_FIRST(&level->items)->serial;
+
+    /* drop the key from the index once nothing is using it */
+    queue_key_release_(q, item->keyed);
+    item->keyed = NULL;
+  } else {
+    queue_ring_remove_(&level->ring, item);
+  }
+
+  if (q->type != queue_type_stream && --level->count == 0) {
+    q->level_mask &= ~(1u << item->priority);
+  }
+
+  /* stop the expiry timer */
+  timer_cancel(&item->timer);
+
+  item->inserted = 0;
+  q->item_count--;
+  q->ready_memory -= queue_item_storage_(item);
+}
+
+int queue_ring_push_(struct queue_ring *ring, struct queue_item *item)
+{
+  struct queue_segment *segment;
+
+  segment = TAILQ_LAST(&ring->segments, qshead);
+  if (!segment || ring->tail == QUEUE_SEGMENT_SLOTS) {
+    if (ring->spare) {
+      segment = ring->spare;
+      ring->spare = NULL;
+    } else {
+      segment = queue_alloc_(ring->owner, sizeof(struct queue_segment),
+                             &ring->pool_class);
+      if (!segment) {
+        return -1;
+      }
+    }
+
+    if (TAILQ_EMPTY(&ring->segments)) {
+      ring->head = 0;
+    }
+
+    TAILQ_INSERT_TAIL(&ring->segments, segment, next);
+    ring->tail = 0;
+  }
+
+  segment->slots[ring->tail] = item;
+  item->slot = &segment->slots[ring->tail];
+  ring->tail++;
+  ring->count++;
+
+  return 0;
+}
+
+struct queue_item *queue_ring_first_(struct queue_ring *ring)
+{
+  struct queue_segment *segment;
+  struct queue_item *item;
+
+  if (ring->count == 0) {
+    return NULL;
+  }
+
+  /* a non-empty ring always has a live slot before the tail */
+  for (;;) {
+    segment = TAILQ_FIRST(&ring->segments);
+    if (ring->head == QUEUE_SEGMENT_SLOTS) {
+      TAILQ_REMOVE(&ring->segments, segment, next);
+      if (ring->spare) {
+        queue_release_(ring->owner, segment, sizeof(struct queue_segment),
+                       ring->pool_class);
+      } else {
+        ring->spare = segment;
+      }
+
+      ring->head = 0;
+
+      /* keep the next spilled segments read in ahead of the head. segments
+         that could not be read may have taken the last items with them */
+      if (!TAILQ_EMPTY(&ring->spills)) {
+        ring->front--;
+        queue_ring_fill_(ring);
+
+        if (ring->count == 0) {
+          queue_ring_reset_(ring);
+          return NULL;
+        }
+      }
+
+      continue;
+    }
+
+    item = segment->slots[ring->head];
+    if (item) {
+      return item;
+    }
+
+    ring->head++;
+  }
+}
+
+void queue_ring_remove_(struct queue_ring *ring, struct queue_item *item)
+{
+  struct queue_segment *segment;
+
+  segment = TAILQ_FIRST(&ring->segments);
+  if (item->slot == &segment->slots[ring->head]) {
+    /* taking from the head, so there is no need to leave an empty slot */
+    ring->head++;
+  } else {
+    *item->slot = NULL;
+  }
+
+  item->slot = NULL;
+  ring->count--;
+
+  /* once the ring is empty the remaining empty slots are dropped in one go,
+     instead of being walked over by the next read */
+  if (ring->count == 0) {
+    queue_ring_reset_(ring);
+  }
+}
+
+void queue_ring_reset_(struct queue_ring *ring)
+{
+  struct queue_segment *segment;
+
+  while ((segment = TAILQ_FIRST(&ring->segments)) != NULL) {
+    TAILQ_REMOVE(&ring->segments, segment, next);
+    if (ring->spare) {
+      queue_release_(ring->owner, segment, sizeof(struct queue_segment),
+                     ring->pool_class);
+    } else {
+      ring->spare = segment;
+    }
+  }
+
+  ring->head = 0;
+  ring->tail = 0;
+}
+
+void queue_ring_clear_(struct queue_ring *ring)
+{
+  if (ring->spare) {
+    queue_release_(ring->owner, ring->spare, sizeof(struct queue_segment),
+                   ring->pool_class);
+    ring->spare = NULL;
+  }
+}
+
+int queue_spill_(struct queue *q, size_t target)
+{
+  struct queue_segment *segment;
+  struct queue_ring *ring;
+  int spilled = 0;
+  int level;
+
+  if (!spill_is_enabled()) {
+    return 0;
+  }
+
+  /* the lowest priority items are the last to be taken */
+  for (level = 0; level < QUEUE_PRIORITY_LEVELS; level++) {
+    ring = &q->levels[level].ring;
+
+    while (q->memory > target &&
+           (segment = queue_ring_spillable_(ring)) != NULL) {
+      if (!queue_ring_spill_(ring, segment)) {
+        return spilled;
+      }
+
+      spilled++;
+    }
+  }
+
+  return spilled;
+}
+
+void queue_spill_due_(struct timer_entry *entry, void *arg)
+{
+  struct queue *q = arg;
+
+  /* spill down to half the threshold so a busy queue is not spilled one
+     segment at a time on every put */
+  queue_spill_(q, queue_context_.spill_threshold / 2);
+}
+
+struct queue_segment *queue_ring_spillable_(struct queue_ring *ring)
+{
+  struct queue_segment *segment;
+  size_t index;
+
+  if (TAILQ_EMPTY(&ring->spills)) {
+    segment = TAILQ_FIRST(&ring->segments);
+  } else {
+    segment = ring->front_last;
+  }
+
+  /* the segment being written to stays in memory */
+  if (!segment || (segment = TAILQ_NEXT(segment, next)) == NULL ||
+      segment == TAILQ_LAST(&ring->segments, qshead)) {
+    return NULL;
+  }
+
+  /* someone holding a locked item expects it to stay where it is */
+  for (index = 0; index < QUEUE_SEGMENT_SLOTS; index++) {
+    if (segment->slots[index] && segment->slots[index]->lockcount > 0) {
+      return NULL;
+    }
+  }
+
+  return segment;
+}
+
+int queue_ring_spill_(struct queue_ring *ring, struct queue_segment *segment)
+{
+  struct queue *q = ring->owner;
+  struct queue_spill_record record;
+  struct queue_spill *spill;
+  struct queue_item *item;
+  char uuid[QUEUE_UUID_STR_LEN + 1/*NULL*/];
+  unsigned char pool_class;
+  char *buffer = NULL;
+  size_t length = 0;
+  size_t offset = 0;
+  size_t index;
+
+  if (!q->spill) {
+    queue_get_uuid(q, uuid);
+    q->spill = spill_new(uuid);
+    if (!q->spill) {
+      return 0;
+    }
+  }
+
+  spill = queue_alloc_(q, sizeof(struct queue_spill), &pool_class);
+  if (!spill) {
+    return 0;
+  }
+
+  memset(spill, 0, sizeof(struct queue_spill));
+  spill->pool_class = pool_class;
+
+  for (index = 0; index < QUEUE_SEGMENT_SLOTS; index++) {
+    item = segment->slots[index];
+    if (item) {
+      length += sizeof(struct queue_spill_record) + item->value.stored +
+                1/*NULL*/;
+    }
+  }
 
-  callback = calloc(1, sizeof(struct queue_callback));
-  if (!callback) {
+  buffer = malloc(length);
+  if (!buffer) {
+    goto error;
+  }
+
+  for (index = 0; index < QUEUE_SEGMENT_SLOTS; index++) {
+    item = segment->slots[index];
+    if (!item) {
+      continue;
+    }
+
+    record.serial = item->serial;
+    record.id = item->id;
+    record.expires = item->expires;
+    record.length = item->value.length;
+    record.stored = item->value.stored;
+    record.compressed = item->value.compressed;
+
+    memcpy(buffer + offset, &record, sizeof(struct queue_spill_record));
+    offset += sizeof(struct queue_spill_record);
+    memcpy(buffer + offset, item->data, item->value.stored + 1/*NULL*/);
+    offset += item->value.stored + 1/*NULL*/;
+
+    spill->count++;
+    spill->bytes += queue_item_size_(item);
+  }
+
+  if (!spill_write(q->spill, buffer, length, &spill->extent)) {
+    goto error;
+  }
+
+  free(buffer);
+
+  /* the items only exist on disk from here on, but they are still counted
+     in the queue */
+  for (index = 0; index < QUEUE_SEGMENT_SLOTS; index++) {
+    item = segment->slots[index];
+    if (item) {
+      timer_cancel(&item->timer);
+      q->ready_memory -= queue_item_storage_(item);
+      queue_item_release_(q, item);
+    }
+  }
+
+  if (TAILQ_EMPTY(&ring->spills)) {
+    ring->front_last = TAILQ_FIRST(&ring->segments);
+    ring->front = 1;
+  }
+
+  TAILQ_REMOVE(&ring->segments, segment, next);
+  queue_release_(q, segment, sizeof(struct queue_segment), ring->pool_class);
+  TAILQ_INSERT_TAIL(&ring->spills, spill, next);
+
+  q->spilled_count += spill->count;
+  queue_context_.spilled += spill->count;
+  queue_context_.spill_items += spill->count;
+  queue_context_.spill_bytes += length;
+
+  return 1;
+
+error:
+  free(buffer);
+  queue_release_(q, spill, sizeof(struct queue_spill), spill->pool_class);
+
+  return 0;
+}
+
+void queue_ring_fill_(struct queue_ring *ring)
+{
+  struct queue_segment *segment;
+  struct queue_spill *spill;
+
+  while (ring->front < QUEUE_SPILL_READAHEAD &&
+         (spill = TAILQ_FIRST(&ring->spills)) != NULL) {
+    TAILQ_REMOVE(&ring->spills, spill, next);
+
+    segment = queue_ring_load_(ring, spill);
+    if (!segment) {
+      continue;
+    }
+
+    if (ring->front == 0) {
+      TAILQ_INSERT_HEAD(&ring->segments, segment, next);
+    } else {
+      TAILQ_INSERT_AFTER(&ring->segments, ring->front_last, segment, next);
+    }
+
+    ring->front_last = segment;
+    ring->front++;
+  }
+}
+
+struct queue_segment *queue_ring_load_(struct queue_ring *ring,
+                                       struct queue_spill *spill)
+{
+  struct queue *q = ring->owner;
+  struct queue_segment *segment = NULL;
+  struct queue_spill_record record;
+  struct spill_extent extent = spill->extent;
+  struct queue_item *item;
+  unsigned long long now = 0;
+  size_t count = spill->count;
+  size_t bytes = spill->bytes;
+  size_t length = extent.length;
+  size_t offset = 0;
+  size_t index;
+  char *buffer;
+
+  q->spilled_count -= count;
+  queue_context_.spilled -= count;
+  queue_release_(q, spill, sizeof(struct queue_spill), spill->pool_class);
+
+  buffer = malloc(length);
+  if (!buffer) {
+    spill_release(&extent);
+    goto error;
+  }
+
+  if (!spill_read(&extent, buffer)) {
+    goto error;
+  }
+
+  if (ring->spare) {
+    segment = ring->spare;
+    ring->spare = NULL;
+  } else {
+    segment = queue_alloc_(q, sizeof(struct queue_segment), &ring->pool_class);
+    if (!segment) {
+      goto error;
+    }
+  }
+
+  memset(segment->slots, 0, sizeof(segment->slots));
+
+  /* the items go back in the same order, with their original serials so they
+     still sort against the keyed items */
+  for (index = 0; index < count; index++) {
+    memcpy(&record, buffer + offset, sizeof(struct queue_spill_record));
+    offset += sizeof(struct queue_spill_record);
+
+    /* the stored bytes go back as they are, already compressed or not */
+    item = queue_item_store_(q, NULL, buffer + offset, record.stored,
+                             record.length, record.compressed);
+    offset += record.stored + 1/*NULL*/;
+    if (!item) {
+      break;
+    }
+
+    item->priority = (unsigned char)ring->priority;
+    item->serial = record.serial;
+    item->id = record.id;
+    item->expires = record.expires;
+    item->charged = 1;
+    item->inserted = 1;
+    item->slot = &segment->slots[index];
+    segment->slots[index] = item;
+    bytes -= queue_item_size_(item);
+    q->ready_memory += queue_item_storage_(item);
+
+    if (item->expires) {
+      if (now == 0) {
+        now = timer_now();
+      }
+
+      timer_entry_init(&item->timer, queue_item_expire_, item);
+      timer_schedule(&item->timer,
+                     item->expires > now ? item->expires - now : 0);
+    }
+  }
+
+  free(buffer);
+
+  queue_context_.fill_items += index;
+  queue_context_.fill_bytes += length;
+
+  if (index < count) {
+    queue_ring_lose_(ring, count - index, bytes);
+  }
+
+  return segment;
+
+error:
+  free(buffer);
+  queue_ring_lose_(ring, count, bytes);
+
+  return NULL;
+}
+
+void queue_ring_lose_(struct queue_ring *ring, size_t count, size_t bytes)
+{
+  struct queue *q = ring->owner;
+  struct queue_level *level = &q->levels[ring->priority];
+
+  ring->count -= count;
+  level->count -= count;
+  if (level->count == 0) {
+    q->level_mask &= ~(1u << ring->priority);
+  }
+
+  q->item_count -= count;
+  q->stored_count -= count;
+  q->stored_bytes -= bytes;
+  queue_context_.spill_lost += count;
+
+  if (q->space_wait_count > 0 && queue_has_room_(q, 0)) {
+    timer_schedule(&q->space_timer, 0);
+  }
+}
+
+void queue_ring_discard_(struct queue_ring *ring)
+{
+  struct queue *q = ring->owner;
+  struct queue_spill *spill;
+
+  while ((spill = TAILQ_FIRST(&ring->spills)) != NULL) {
+    TAILQ_REMOVE(&ring->spills, spill, next);
+    spill_release(&spill->extent);
+
+    ring->count -= spill->count;
+    q->spilled_count -= spill->count;
+    queue_context_.spilled -= spill->count;
+
+    queue_release_(q, spill, sizeof(struct queue_spill), spill->pool_class);
+  }
+}
+
+int queue_stream_push_(struct queue *q, struct queue_item *item)
+{
+  struct queue_stream *stream = &q->stream;
+  struct queue_block *block;
+
+  /* offsets have to keep going up for them to be searched */
+  block = TAILQ_LAST(&stream->blocks, qbhead);
+  if (item->id == 0) {
+    item->id = ++q->item_id;
+  } else if (block && block->count > 0 &&
+             item->id <= block->offsets[block->count - 1]) {
+    return -1;
+  }
+
+  if (!block || block->count == QUEUE_STREAM_SLOTS) {
+    block = queue_alloc_(q, sizeof(struct queue_block), &stream->pool_class);
+    if (!block) {
+      return -1;
+    }
+
+    block->count = 0;
+    TAILQ_INSERT_TAIL(&stream->blocks, block, next);
+  }
+
+  block->offsets[block->count] = item->id;
+  block->slots[block->count] = item;
+  item->slot = &block->slots[block->count];
+  block->count++;
+
+  return 0;
+}
+
+void queue_stream_remove_(struct queue *q, struct queue_item *item)
+{
+  struct queue_stream *stream = &q->stream;
+  struct queue_block *block;
+
+  *item->slot = NULL;
+  item->slot = NULL;
+
+  /* move the head past empty slots, freeing blocks with no items left. the
+     block being written is kept until it is full */
+  while ((block = TAILQ_FIRST(&stream->blocks)) != NULL) {
+    while (stream->head < block->count && !block->slots[stream->head]) {
+      stream->head++;
+    }
+
+    if (stream->head < block->count ||
+        (block == TAILQ_LAST(&stream->blocks, qbhead) &&
+         block->count < QUEUE_STREAM_SLOTS)) {
+      break;
+    }
+
+    TAILQ_REMOVE(&stream->blocks, block, next);
+    queue_release_(q, block, sizeof(struct queue_block), stream->pool_class);
+    stream->head = 0;
+  }
+}
+
+struct queue_item *queue_stream_first_(struct queue *q)
+{
+  struct queue_block *block;
+
+  block = TAILQ_FIRST(&q->stream.blocks);
+  if (!block || q->stream.head == block->count) {
     return NULL;
   }
 
-  if (key) {
-    callback->key = strdup(key);
-    if (!callback->key) {
-      free(callback);
-      return NULL;
+  return block->slots[q->stream.head];
+}
+
+struct queue_item *queue_stream_find_(struct queue *q,
+                                      unsigned long long offset,
+                                      struct key *key)
+{
+  struct queue_block *block;
+  struct queue_item *item;
+  unsigned long long now = 0;
+  size_t index;
+  size_t low;
+  size_t high;
+
+  /* consumers are mostly reading close to the end of the stream, so the
+     block holding the offset is looked for from the back */
+  TAILQ_FOREACH_REVERSE(block, &q->stream.blocks, qbhead, next) {
+    if (block->count > 0 && block->offsets[0] <= offset) {
+      break;
+    }
+  }
+
+  if (!block) {
+    block = TAILQ_FIRST(&q->stream.blocks);
+  }
+
+  low = block == TAILQ_FIRST(&q->stream.blocks) ? q->stream.head : 0;
+  for (; block != NULL; block = TAILQ_NEXT(block, next), low = 0) {
+    high = block->count;
+    while (low < high) {
+      index = low + (high - low) / 2;
+      if (block->offsets[index] < offset) {
+        low = index + 1;
+      } else {
+        high = index;
+      }
+    }
+
+    /* expired items are left for their timer to remove */
+    for (index = low; index < block->count; index++) {
+      item = block->slots[index];
+      if (!item || (key && item->key != key)) {
+        continue;
+      }
+
+      if (item->expires) {
+        if (now == 0) {
+          now = timer_now();
+        }
+
+        if (item->expires <= now) {
+          continue;
+        }
+      }
+
+      return item;
+    }
+  }
+
+  return NULL;
+}
+
+void queue_stream_wake_(struct queue *q, struct queue_item *item)
+{
+  struct queue_reader *reader;
+  struct queue_reader *next;
+  struct queue_consumer *consumer;
+  struct queue_item *found;
+  int (*cb)(struct queue_item *, void *);
+  void *cbarg;
+
+  q->stream.waking++;
+
+  TAILQ_FOREACH(reader, &q->stream.readers, next) {
+    if (!reader->cb) {
+      continue;
+    }
+
+    consumer = reader->consumer;
+
+    if (item) {
+      found = consumer->offset <= item->id &&
+              (!reader->key || reader->key == item->key) ? item : NULL;
+    } else {
+      found = queue_stream_find_(q, consumer->offset, reader->key);
+    }
+
+    if (found) {
+      /* finish the reader before the callback, which may wait again */
+      cb = reader->cb;
+      cbarg = reader->cbarg;
+      reader->cb = NULL;
+      q->stream.finished++;
+
+      queue_consumer_give_(q, consumer, found, cb, cbarg);
+    }
+  }
+
+  if (--q->stream.waking > 0 || q->stream.finished == 0) {
+    return;
+  }
+
+  reader = TAILQ_FIRST(&q->stream.readers);
+  while (reader != NULL) {
+    next = TAILQ_NEXT(reader, next);
+    if (!reader->cb) {
+      queue_reader_free_(q, reader);
+    }
+
+    reader = next;
+  }
+
+  q->stream.finished = 0;
+}
+
+void queue_stream_clear_(struct queue *q)
+{
+  struct queue_reader *reader;
+  struct queue_block *block;
+  struct queue_consumer *qc;
+  struct hash_entry *entry;
+  size_t index;
+
+  while ((reader = TAILQ_FIRST(&q->stream.readers)) != NULL) {
+    queue_reader_free_(q, reader);
+  }
+
+  while ((block = TAILQ_FIRST(&q->stream.blocks)) != NULL) {
+    TAILQ_REMOVE(&q->stream.blocks, block, next);
+    queue_release_(q, block, sizeof(struct queue_block),
+                   q->stream.pool_class);
+  }
+
+  q->stream.head = 0;
+
+  if (!q->stream.consumers.buckets) {
+    return;
+  }
+
+  for (index = 0; index < q->stream.consumers.size; index++) {
+    while ((entry = q->stream.consumers.buckets[index]) != NULL) {
+      q->stream.consumers.buckets[index] = entry->next;
+
+      qc = HASH_ENTRY(entry, struct queue_consumer, entry);
+      key_release(qc->name);
+      queue_release_(q, qc, sizeof(struct queue_consumer), qc->pool_class);
+    }
+  }
+
+  hash_table_destroy(&q->stream.consumers);
+  q->stream.consumer_count = 0;
+}
+
+struct queue_consumer *queue_consumer_get_(struct queue *q, const char *name,
+                                           int create_new)
+{
+  struct queue_consumer *qc;
+  struct hash_entry *entry;
+  struct key *interned;
+  unsigned char pool_class;
+
+  /* names are interned like keys, so they can be compared by pointer */
+  interned = key_find(name);
+  if (interned && q->stream.consumers.buckets) {
+    for (entry = hash_table_find(&q->stream.consumers,
+                                 key_get_hash(interned));
+         entry != NULL; entry = hash_table_next(entry)) {
+      qc = HASH_ENTRY(entry, struct queue_consumer, entry);
+      if (qc->name == interned) {
+        return qc;
+      }
     }
   }
 
+  if (!create_new) {
+    return NULL;
+  }
+
+  if (!q->stream.consumers.buckets &&
+      !hash_table_init(&q->stream.consumers, QUEUE_CONSUMER_TABLE_SIZE)) {
+    return NULL;
+  }
+
+  qc = queue_alloc_(q, sizeof(struct queue_consumer), &pool_class);
+  if (!qc) {
+    return NULL;
+  }
+
+  memset(qc, 0, sizeof(struct queue_consumer));
+  qc->pool_class = pool_class;
+
+  qc->name = key_intern(name);
+  if (!qc->name) {
+    queue_release_(q, qc, sizeof(struct queue_consumer), pool_class);
+    return NULL;
+  }
+
+  /* failing to grow the table leaves it usable, so it is not an error */
+  hash_table_insert(&q->stream.consumers, &qc->entry, key_get_hash(qc->name));
+  q->stream.consumer_count++;
+
+  return qc;
+}
+
+void queue_consumer_move_(struct queue *q, struct queue_consumer *consumer,
+                          unsigned long long offset)
+{
+  consumer->offset = offset;
+
+  if (wal_is_enabled() && !q->unlogged) {
+    queue_log_consumer_(q, consumer, wal_reserve_callback, NULL);
+  }
+}
+
+void queue_consumer_give_(struct queue *q, struct queue_consumer *consumer,
+                          struct queue_item *item,
+                          int (*cb)(struct queue_item *, void *), void *arg)
+{
+  unsigned long long offset = item->id;
+
+  /* the item stays in the stream, but could be dropped by the callback */
+  queue_item_lock(item);
+  if (cb(item, arg)) {
+    queue_consumer_move_(q, consumer, offset + 1);
+  }
+  queue_item_unlock(item);
+}
+
+void queue_reader_free_(struct queue *q, struct queue_reader *reader)
+{
+  TAILQ_REMOVE(&q->stream.readers, reader, next);
+
+  if (reader->key) {
+    key_release(reader->key);
+  }
+
+  queue_release_(q, reader, sizeof(struct queue_reader), reader->pool_class);
+}
+
+struct queue_callback *queue_callback_new_(struct queue *q, struct key *key)
+{
+  struct queue_callback *callback;
+  unsigned char pool_class;
+
+  callback = queue_alloc_(q, sizeof(struct queue_callback), &pool_class);
+  if (!callback) {
+    return NULL;
+  }
+
+  memset(callback, 0, sizeof(struct queue_callback));
+  callback->pool_class = pool_class;
+  callback->owner = q;
+  callback->key = key;
+
   return callback;
 }
 
 void queue_callback_free_(struct queue_callback *cb)
+{
+  struct queue *q = cb->owner;
+
+  /* callbacks that failed to be added are not in any lists */
+  if (cb->inserted) {
+    if (cb->key) {
+      q->keyed_callback_count--;
+    }
+
+    if (cb->keyed) {
+      TAILQ_REMOVE(&cb->keyed->callbacks, cb, keynext);
+      queue_key_release_(q, cb->keyed);
+    } else {
+      TAILQ_REMOVE(&q->wildcards, cb, keynext);
+    }
+
+    q->callback_count--;
+    TAILQ_REMOVE(&q->callbacks, cb, next);
+  }
+
+  if (cb->key) {
+    key_release(cb->key);
+  }
+
+  queue_release_(q, cb, sizeof(struct queue_callback), cb->pool_class);
+}
+
+int queue_callback_insert_(struct queue *q, struct queue_callback *cb)
 {
   if (cb->key) {
-    free(cb->key);
-    cb->owner->keyed_callback_count--;
+    cb->keyed = queue_key_get_(q, cb->key, 1);
+    if (!cb->keyed) {
+      return -1;
+    }
+
+    TAILQ_INSERT_TAIL(&cb->keyed->callbacks, cb, keynext);
+    q->keyed_callback_count++;
+  } else {
+    TAILQ_INSERT_TAIL(&q->wildcards, cb, keynext);
+  }
+
+  cb->inserted = 1;
+  cb->serial = q->callback_serial++;
+  q->callback_count++;
+  TAILQ_INSERT_TAIL(&q->callbacks, cb, next);
+
+  return 0;
+}
+
+struct queue_callback *queue_callback_match_(struct queue *q,
+                                             struct key *key)
+{
+  struct queue_callback *wildcard;
+  struct queue_callback *keyed = NULL;
+  struct queue_key *qk;
+
+  if (q->callback_count == 0) {
+    return NULL;
+  }
+
+  wildcard = TAILQ_FIRST(&q->wildcards);
+  if (key && q->keyed_callback_count > 0) {
+    qk = queue_key_get_(q, key, 0);
+    if (qk) {
+      keyed = TAILQ_FIRST(&qk->callbacks);
+    }
+  }
+
+  /* both match the item, so the one waiting longest wins */
+  if (keyed && (!wildcard || keyed->serial < wildcard->serial)) {
+    return keyed;
   }
-  cb->owner->callback_count--;
-  TAILQ_REMOVE(&cb->owner->callbacks, cb, next);
 
-  free(cb);
+  return wildcard;
 }
@@ -24,22 +24,180 @@
 #define QUEUE_H
 
 #include "queue-compat.h"
+#include "pool.h"
 
 #define QUEUE_UUID_LEN 16
 #define QUEUE_UUID_STR_LEN (QUEUE_UUID_LEN * 2) + 4
 
+/* number of size classes items and callbacks are allocated from */
+#define QUEUE_POOL_CLASSES 8
+
+/* items can be given a priority from 0 up to QUEUE_PRIORITY_LEVELS - 1. items
+   with a higher priority are always taken before items with a lower one */
+#define QUEUE_PRIORITY_LEVELS 8
+#define QUEUE_PRIORITY_DEFAULT 0
+
+/* longest time in milliseconds an item can be delayed for or live for */
+#define QUEUE_DELAY_MAX (365LL * 24 * 60 * 60 * 1000)
+#define QUEUE_TTL_MAX QUEUE_DELAY_MAX
+#define QUEUE_LEASE_MAX QUEUE_DELAY_MAX
+
+/* length of a lease receipt as a printable string */
+#define QUEUE_RECEIPT_STR_LEN 16
+
+/* what happens to a put when the queue has reached its limits */
+enum queue_policy {
+  queue_policy_reject,      /* fail the put */
+  queue_policy_drop_oldest, /* remove the oldest items with the lowest
+                               priority until there is room */
+  queue_policy_block        /* fail the put, the caller should wait for
+                               space with queue_wait_space and try again */
+};
+
+/* how a queue holds its items */
+enum queue_type {
+  queue_type_queue, /* items are removed once they are taken */
+  queue_type_stream /* items are appended to a log and only removed once they
+                       expire or are dropped to make room. named consumers
+                       each read through the log from their own offset */
+};
+
+/* values compressed at rest by one queue, or by every queue */
+struct queue_compression_stats {
+  /* values at least threshold bytes long are compressed at level, a threshold
+     of 0 means nothing is compressed */
+  size_t threshold;
+  int level;
+
+  /* values compressed, and their total size before and after */
+  unsigned long long items;
+  unsigned long long bytes_in;
+  unsigned long long bytes_out;
+
+  /* values decompressed for a client that could not take them compressed */
+  unsigned long long decompressed;
+
+  /* cpu time spent compressing and decompressing values, in microseconds */
+  unsigned long long compress_time;
+  unsigned long long decompress_time;
+};
+
+struct queue_stats {
+  /* items that can currently be taken */
+  size_t items;
+
+  /* items waiting on a delay */
+  size_t delayed;
+
+  /* items taken under a lease that has not been acknowledged or expired */
+  size_t leased;
+
+  /* default time to live for new items, 0 if they do not expire */
+  unsigned long long ttl;
+
+  /* time the queue can go unused before it is freed, 0 if it is kept */
+  unsigned long long idle;
+
+  /* items that have been removed because they expired */
+  unsigned long long expired;
+
+  /* size of the keys and values of every item held by the queue, including
+     delayed and leased items */
+  size_t bytes;
+
+  /* limits on the items held and their size, 0 if there is no limit */
+  size_t max_items;
+  size_t max_bytes;
+  enum queue_policy policy;
+
+  /* items that have been removed to make room for new ones */
+  unsigned long long dropped;
+
+  /* memory allocated for the items, keys and callbacks of the queue */
+  size_t memory;
+
+  /* items written out to disk, included in items */
+  size_t spilled;
+
+  /* values compressed by the queue */
+  struct queue_compression_stats compression;
+
+  enum queue_type type;
+
+  /* for a stream, the offset of the oldest item still held, the offset the
+     next item will be given and the number of consumers */
+  unsigned long long first;
+  unsigned long long next;
+  size_t consumers;
+};
+
+/* memory used by every queue */
+struct queue_memory_stats {
+  size_t used;
+
+  /* part of used taken by items that have already been removed but whose
+     values are still being sent */
+  size_t held;
+
+  /* most memory that can be used before puts are refused, 0 for no limit */
+  size_t budget;
+
+  /* puts refused, and items dropped from queues with the drop_oldest policy,
+     because the budget was used up */
+  unsigned long long rejected;
+  unsigned long long evicted;
+};
+
+/* items spilled to disk by every queue */
+struct queue_spill_stats {
+  /* memory a queue can use before it is spilled, 0 if spilling is off */
+  size_t threshold;
+
+  /* items currently spilled, the files holding them and their size */
+  size_t items;
+  size_t files;
+  size_t bytes;
+
+  /* items and bytes written out and read back since startup */
+  unsigned long long spilled;
+  unsigned long long spilled_bytes;
+  unsigned long long filled;
+  unsigned long long filled_bytes;
+
+  /* spilled items that could not be read back */
+  unsigned long long lost;
+};
+
+struct queue_space_wait;
+struct queue_callback;
+struct queue_reader;
+
 struct queue;
 struct queue_item;
+struct queue_value;
 
 struct queue *queue_new(const unsigned char id[16]);
 void queue_free(struct queue *q);
 
-/* put an item in the queue. returns -1 on failure, 0 if the item was added to
-   the queue and 1 if the item was immediately consumed */
-int queue_put(struct queue *q, const char *key, const char *value);
+/* fill id with a random uuid4, like the one a queue created without an id is
+   given. returns 0 on failure */
+int queue_generate_uuid(unsigned char id[QUEUE_UUID_LEN]);
 
-/* take an item from the queue. if the item does not exist, this function will
-   fail by returning NULL
+/* put an item in the queue. an item with a delay is held back for that many
+   milliseconds before it is added, and goes to any callback waiting on it at
+   that point. an item that is not taken within ttl milliseconds of being added
+   is removed, a ttl of 0 uses the queue default. the value is length bytes
+   and may contain NULLs. returns -1 on failure, -2 if the queue is full, -3 if
+   the memory budget has been used up, -4 if the item is larger than the queue
+   can ever hold, 0 if the item was added to the queue or delayed and 1 if the
+   item was immediately consumed */
+int queue_put(struct queue *q, const char *key, const char *value,
+              size_t length, int priority, unsigned long long delay,
+              unsigned long long ttl);
+
+/* take an item from the queue. the oldest item with the highest priority is
+   taken first. if the item does not exist, this function will fail by
+   returning NULL
    @see queue_wait() */
 struct queue_item *queue_take(struct queue *q, const char *key);
 
@@ -49,12 +207,144 @@ struct queue_item *queue_take(struct queue *q, const char *key);
    actions on it */
 struct queue_item *queue_peek(struct queue *q, const char *key);
 
+/* take an item from the queue under a lease. the item is hidden from the queue
+   until it is acknowledged with queue_ack, or put back when the lease expires
+   after lease milliseconds or queue_nack is called. the item stays owned by
+   the queue and must not be freed, it is only valid until control returns to
+   the event loop. returns NULL if there is no item
+   @see queue_item_get_receipt() */
+struct queue_item *queue_lease(struct queue *q, const char *key,
+                               unsigned long long lease);
+
+/* finish a lease, either removing the item for good or putting it straight
+   back in the queue. returns 0 if the receipt does not match a lease */
+int queue_ack(struct queue *q, const char *receipt);
+int queue_nack(struct queue *q, const char *receipt);
+
 /* wait for an item to become available in the queue, and then invoke the
-   callback. the context argument will be provided to the callback. returns -1
-   on failure, 0 if the item is not yet present and 1 if the callback was
-   immediately triggered */
+   callback. the context argument will be provided to the callback, and the item
+   is freed once the callback returns. returns -1 on failure, 0 if the item is
+   not yet present and 1 if the callback was immediately triggered. when 0 is
+   returned wait is set, if it is not NULL, to the wait so it can be cancelled.
+   the wait is finished once the callback has been called */
 int queue_wait(struct queue *q, const char *key,
-               void(*cb)(struct queue_item *, void *), void *arg);
+               void(*cb)(struct queue_item *, void *), void *arg,
+               struct queue_callback **wait);
+void queue_wait_cancel(struct queue_callback *wait);
+
+/* change how a queue holds its items. only a queue without any items or
+   waits can change type. streams do not support delays, leases, queue_take,
+   queue_peek or queue_wait. returns 0 if the type could not be changed */
+int queue_set_type(struct queue *q, enum queue_type type);
+enum queue_type queue_get_type(struct queue *q);
+
+/* convert a type to and from its name. queue_type_from_string returns 0 if
+   the name is not a type */
+int queue_type_from_string(const char *name, enum queue_type *type);
+const char *queue_type_to_string(enum queue_type type);
+
+/* read the first item of a stream at or after the offset of a consumer. a
+   consumer is created the first time it is used, starting from the oldest
+   item. if advance is set the consumer is moved past the item, along with any
+   items before it that did not match the key. the item stays in the stream,
+   it is returned locked and has to be unlocked with queue_item_unlock. returns
+   NULL if there is no item or the queue is not a stream */
+struct queue_item *queue_read(struct queue *q, const char *consumer,
+                              const char *key, int advance);
+
+/* move a consumer of a stream so the next read starts from offset, either to
+   rewind it or to skip ahead. returns 0 on failure */
+int queue_seek(struct queue *q, const char *consumer,
+               unsigned long long offset);
+
+/* wait for an item a consumer of a stream can read, and then invoke the
+   callback. the callback returns 0 if it did not use the item, in which case
+   the consumer is left where it was, otherwise the consumer is moved past the
+   item. the item is only valid until the callback returns. returns -1 on
+   failure, 0 if there is no item yet and 1 if the callback was immediately
+   triggered. wait is set the same as with queue_wait */
+int queue_read_wait(struct queue *q, const char *consumer, const char *key,
+                    int (*cb)(struct queue_item *, void *), void *arg,
+                    struct queue_reader **wait);
+void queue_read_wait_cancel(struct queue_reader *wait);
+
+/* limit the memory used by every queue together. once the budget is used up
+   queues with the drop_oldest policy drop their oldest items to make room and
+   puts to any other queue fail. a budget of 0 means no limit */
+void queue_set_memory_budget(size_t budget);
+void queue_get_memory_stats(struct queue_memory_stats *stats);
+
+/* spill queues to disk once they use more than threshold bytes of memory.
+   spill_startup has to be called first for this to have any effect. the
+   oldest items are kept in memory and the rest of the unkeyed items are read
+   back in order as the queue drains. keyed items are never spilled. a
+   threshold of 0 turns spilling off */
+void queue_set_spill_threshold(size_t threshold);
+void queue_get_spill_stats(struct queue_spill_stats *stats);
+
+/* compress values of at least threshold bytes with zlib at level 1 to 9 when
+   they are put. values that do not get any smaller are kept as they are, and
+   items already stored are not changed. a threshold of 0 turns compression
+   off */
+void queue_set_compression(size_t threshold, int level);
+void queue_get_compression_stats(struct queue_compression_stats *stats);
+
+/* get the usage of the pools shared by every queue. the entry after the last
+   pool describes allocations that were too large to be pooled */
+void queue_get_pool_stats(struct pool_stats stats[QUEUE_POOL_CLASSES + 1]);
+
+/* set the time to live given to items put without one. 0 means items do not
+   expire */
+void queue_set_ttl(struct queue *q, unsigned long long ttl);
+
+/* set how many milliseconds the queue can go unused, while it holds no items
+   and nothing waits on it, before the manager frees it. 0 keeps the queue
+   until it is deleted */
+void queue_set_idle(struct queue *q, unsigned long long idle);
+unsigned long long queue_get_idle(struct queue *q);
+
+/* does the queue hold no items and have no waits or reads on it, so it can be
+   freed without anyone noticing */
+int queue_is_unused(struct queue *q);
+
+/* memory used by the queue itself as well as its items, which is given back
+   once it is freed */
+size_t queue_get_footprint(struct queue *q);
+
+/* limit the number of items and the size of their keys and values that the
+   queue can hold. a limit of 0 means no limit. the policy decides what happens
+   to puts once a limit is reached */
+void queue_set_limits(struct queue *q, size_t max_items, size_t max_bytes,
+                      enum queue_policy policy);
+
+/* convert a policy to and from its name. queue_policy_from_string returns 0
+   if the name is not a policy */
+int queue_policy_from_string(const char *name, enum queue_policy *policy);
+const char *queue_policy_to_string(enum queue_policy policy);
+
+/* wait for space to become available in a full queue. the callback is called
+   with 1 once an item has been removed, at which point the put should be
+   tried again, or with 0 if the queue is being freed. the wait is finished
+   once the callback has been called. returns NULL on failure */
+struct queue_space_wait *queue_wait_space(struct queue *q,
+                                          void (*cb)(void *, int), void *arg);
+void queue_space_wait_cancel(struct queue_space_wait *wait);
+
+void queue_get_stats(struct queue *q, struct queue_stats *stats);
+
+/* write the settings, every item and the consumers of a queue as log records,
+   so a new log or a snapshot can be started from the current state. space for each record
+   is asked for from reserve, which returns NULL on failure. returns 0 if
+   reserve failed or spilled items could not be read */
+int queue_log(struct queue *q, void *(*reserve)(int, size_t, void *),
+              void *arg);
+
+/* apply a settings, put, remove or consumer record for this queue read back
+   from the log or a snapshot. replayed records are not logged again, and
+   queue_replay_finish should be called once every record has been read.
+   returns 0 if the record is not valid */
+int queue_replay(struct queue *q, int type, const void *data, size_t length);
+void queue_replay_finish(struct queue *q);
 
 /* get the uuid of a queue as a printable string */
 void queue_get_uuid(struct queue *q, char uuid[QUEUE_UUID_STR_LEN + 1/*NULL*/]);
@@ -65,6 +355,43 @@ void queue_get_uuid(struct queue *q, char uuid[QUEUE_UUID_STR_LEN + 1/*NULL*/]);
      the callback the item was given to has not returned */
 const char *queue_item_get_key(struct queue_item *item);
 const char *queue_item_get_value(struct queue_item *item);
+size_t queue_item_get_length(struct queue_item *item);
+int queue_item_get_priority(struct queue_item *item);
+
+/* a compressed value has no value to get, it is copied out into a buffer of
+   queue_item_get_length bytes instead, or sent as it is stored. copying
+   returns 0 on failure */
+int queue_item_is_compressed(struct queue_item *item);
+int queue_item_copy_value(struct queue_item *item, char *buffer);
+
+/* take a reference to the value of an item, under the same conditions as
+   getting the value. the value stays valid until it is released, even if the
+   item or its queue is freed first, so it can be sent without copying it */
+struct queue_value *queue_value_get(struct queue_item *item);
+void queue_value_release(struct queue_value *value);
+const char *queue_value_get_data(struct queue_value *value);
+size_t queue_value_get_length(struct queue_value *value);
+
+/* the same as for items. the stored value is a zlib stream if it is
+   compressed, and the value itself otherwise */
+int queue_value_is_compressed(struct queue_value *value);
+const char *queue_value_get_stored(struct queue_value *value, size_t *length);
+int queue_value_copy(struct queue_value *value, char *buffer);
+
+/* an encoding of the item kept with its value, so an item that is read many
+   times is only encoded once. it can be set once, and lives as long as the
+   value does. returns NULL if the item has not been encoded yet */
+const char *queue_value_get_encoded(struct queue_value *value, size_t *length);
+const char *queue_item_get_encoded(struct queue_item *item, size_t *length);
+int queue_item_set_encoded(struct queue_item *item, const char *data,
+                           size_t length);
+
+/* get the offset of an item in a stream, 0 if it is not in a stream */
+unsigned long long queue_item_get_offset(struct queue_item *item);
+
+/* get the receipt of a leased item, used to ack or nack the lease */
+void queue_item_get_receipt(struct queue_item *item,
+                            char receipt[QUEUE_RECEIPT_STR_LEN + 1/*NULL*/]);
 
 /* lock a queue item. this should only be used on items found using queue_peek,
    queue_take does not need to do this as the item is always available if it
@@ -0,0 +1,149 @@
+/*
+  Copyright (c) 2021 Matthew (fkfv).
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#ifndef SHARD_INTERNAL_H
+#define SHARD_INTERNAL_H
+
+#ifndef _WIN32
+#include <sys/types.h>
+#endif
+
+#include <event2/util.h>
+#include "shard.h"
+
+/* header carrying the secret on requests between shards */
+#define SHARD_HEADER "X-Shard"
+
+/* header on the answer to a request that was held too long, asking for the
+   request to be made again, see shard_retry */
+#define SHARD_RETRY_HEADER "X-Shard-Retry"
+
+/* seconds a request between shards can go without progress before it fails.
+   a shard holding a request answers it well within this */
+#define SHARD_FORWARD_TIMEOUT 90
+
+/* connections kept open to each shard between requests, and the
+   milliseconds one is kept for. the other shard closes a connection that has
+   gone without a request for 50 seconds, so one is never reused near then */
+#define SHARD_IDLE 64
+#define SHARD_IDLE_TIMEOUT 20000
+
+/* random bytes in the secret, which is sent as hex */
+#define SHARD_SECRET_LEN 16
+
+/* address the shards listen for each other on */
+#define SHARD_HOST "127.0.0.1"
+
+/* connections waiting to be accepted on the listener of each shard */
+#define SHARD_BACKLOG 128
+
+struct shard_forward {
+  /* connection the request is made on, which is kept for another request
+     once it completes */
+  struct evhttp_connection *connection;
+
+  /* the request, kept so it can be made again when the shard asks */
+  int shard;
+  enum evhttp_cmd_type type;
+  char *uri;
+  struct evkeyvalq headers;
+  struct evbuffer *body;
+
+  void (*cb)(struct evhttp_request *, void *);
+  void *arg;
+};
+
+/* a connection to another shard kept open once its request completed */
+struct shard_idle {
+  struct evhttp_connection *connection;
+
+  /* time it was kept from, from timer_now */
+  unsigned long long since;
+};
+
+struct shard_context {
+  int count;
+  int index;
+
+  /* listener of each shard for the others and the port it is on. only the
+     listener of this shard is kept open once the shards are started */
+  evutil_socket_t *listeners;
+  unsigned short *ports;
+
+  /* connections kept open to each shard, SHARD_IDLE for each of them with
+     the most recent last */
+  struct shard_idle *idle;
+  int *idle_count;
+
+#ifndef _WIN32
+  /* the other shards, if this process started them */
+  pid_t *children;
+
+  /* pipe nothing is written to. only the process that started the shards
+     keeps the write end open, so the others see it close when that process
+     stops, however it stops */
+  int parent[2];
+#endif
+
+  /* waits for the other shards to stop, see shard_has_failed */
+  struct event *watch;
+  int failed;
+
+  /* shared by the shards, as hex */
+  char secret[SHARD_SECRET_LEN * 2 + 1/*NULL*/];
+
+  /* base requests are made on, and the server for the other shards */
+  struct event_base *base;
+  struct evhttp *http;
+};
+
+/* the global context instance */
+extern struct shard_context shard_context_;
+
+/* open a listener on SHARD_HOST on any free port. returns -1 on failure */
+evutil_socket_t shard_listen_(unsigned short *port);
+
+/* event callbacks for the shards started here exiting and for the process
+   that started this one stopping */
+void shard_children_cb_(evutil_socket_t fd, short events, void *arg);
+void shard_parent_cb_(evutil_socket_t fd, short events, void *arg);
+
+/* a connection to a shard, one kept open from an earlier request if there
+   is one. returns NULL on failure */
+struct evhttp_connection *shard_connect_(int shard);
+
+/* keep a connection whose request completed for the next request to the
+   same shard */
+void shard_keep_(int shard, struct evhttp_connection *connection);
+
+/* is a header only about the connection it came on */
+int shard_is_hop_header_(const char *name);
+
+/* make the request of a forward on a connection of its own. returns 0 on
+   failure */
+int shard_forward_send_(struct shard_forward *forward);
+void shard_forward_free_(struct shard_forward *forward);
+
+/* request callback for a forward */
+void shard_forward_done_(struct evhttp_request *response, void *arg);
+
+#endif
@@ -0,0 +1,613 @@
+/*
+  Copyright (c) 2021 Matthew (fkfv).
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+#include <event2/buffer.h>
+#include <openssl/crypto.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shard.h"
+#include "shard-internal.h"
+#include "strcase.h"
+#include "timer.h"
+
+struct shard_context shard_context_;
+
+int shard_prepare(int count)
+{
+#ifdef _WIN32
+  /* shards are copies of the process made with fork */
+  return 0;
+#else
+  unsigned char secret[SHARD_SECRET_LEN];
+  int index;
+
+  shard_context_.count = count;
+  shard_context_.index = 0;
+  shard_context_.parent[0] = -1;
+  shard_context_.parent[1] = -1;
+
+  shard_context_.listeners = calloc(count, sizeof(evutil_socket_t));
+  shard_context_.ports = calloc(count, sizeof(unsigned short));
+  shard_context_.children = calloc(count, sizeof(pid_t));
+  shard_context_.idle = calloc(count * SHARD_IDLE, sizeof(struct shard_idle));
+  shard_context_.idle_count = calloc(count, sizeof(int));
+  if (!shard_context_.listeners || !shard_context_.ports ||
+      !shard_context_.children || !shard_context_.idle ||
+      !shard_context_.idle_count) {
+    goto error;
+  }
+
+  for (index = 0; index < count; index++) {
+    shard_context_.listeners[index] = -1;
+  }
+
+  for (index = 0; index < count; index++) {
+    shard_context_.listeners[index] =
+      shard_listen_(&shard_context_.ports[index]);
+    if (shard_context_.listeners[index] == -1) {
+      goto error;
+    }
+  }
+
+  if (pipe(shard_context_.parent) != 0) {
+    shard_context_.parent[0] = -1;
+    shard_context_.parent[1] = -1;
+    goto error;
+  }
+
+  evutil_secure_rng_get_bytes(secret, SHARD_SECRET_LEN);
+  for (index = 0; index < SHARD_SECRET_LEN; index++) {
+    sprintf(shard_context_.secret + index * 2, "%02x", secret[index]);
+  }
+
+  return 1;
+
+error:
+  shard_shutdown();
+  return 0;
+#endif
+}
+
+int shard_spawn(void)
+{
+#ifdef _WIN32
+  return -1;
+#else
+  pid_t child;
+  int index;
+
+  for (index = 1; index < shard_context_.count; index++) {
+    child = fork();
+    if (child < 0) {
+      shard_shutdown();
+      return -1;
+    }
+
+    /* a shard that was started never stops the ones started after it */
+    if (child == 0) {
+      shard_context_.index = index;
+      free(shard_context_.children);
+      shard_context_.children = NULL;
+      close(shard_context_.parent[1]);
+      shard_context_.parent[1] = -1;
+      break;
+    }
+
+    shard_context_.children[index] = child;
+  }
+
+  if (shard_context_.index == 0) {
+    close(shard_context_.parent[0]);
+    shard_context_.parent[0] = -1;
+  }
+
+  for (index = 0; index < shard_context_.count; index++) {
+    if (index != shard_context_.index) {
+      evutil_closesocket(shard_context_.listeners[index]);
+      shard_context_.listeners[index] = -1;
+    }
+  }
+
+  return shard_context_.index;
+#endif
+}
+
+int shard_startup(struct event_base *base, struct evhttp *http)
+{
+  if (!evhttp_accept_socket(http,
+                            shard_context_.listeners[shard_context_.index])) {
+    /* the server closes the listener from now on */
+    shard_context_.listeners[shard_context_.index] = -1;
+  } else {
+    return 0;
+  }
+
+  shard_context_.base = base;
+  shard_context_.http = http;
+
+#ifndef _WIN32
+  if (shard_context_.children) {
+    shard_context_.watch = evsignal_new(base, SIGCHLD, shard_children_cb_,
+                                        NULL);
+  } else {
+    shard_context_.watch = event_new(base, shard_context_.parent[0], EV_READ,
+                                     shard_parent_cb_, NULL);
+  }
+
+  if (!shard_context_.watch || event_add(shard_context_.watch, NULL) != 0) {
+    return 0;
+  }
+
+  /* a shard that stopped while this one was starting is found straight
+     away */
+  if (shard_context_.children) {
+    event_active(shard_context_.watch, EV_SIGNAL, 1);
+  }
+#endif
+
+  return 1;
+}
+
+void shard_children_cb_(evutil_socket_t fd, short events, void *arg)
+{
+#ifndef _WIN32
+  int index;
+  int status;
+
+  for (index = 1; index < shard_context_.count; index++) {
+    if (shard_context_.children[index] <= 0 ||
+        waitpid(shard_context_.children[index], &status, WNOHANG) !=
+          shard_context_.children[index]) {
+      continue;
+    }
+
+    /* a shard stopped by a signal sent to all of them exits cleanly, and
+       this one is stopping too */
+    shard_context_.children[index] = 0;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      shard_context_.failed = 1;
+    }
+
+    event_base_loopexit(shard_context_.base, NULL);
+  }
+#endif
+}
+
+void shard_parent_cb_(evutil_socket_t fd, short events, void *arg)
+{
+  /* nothing is written, so the pipe is readable only once it is closed */
+  shard_context_.failed = 1;
+  event_base_loopexit(shard_context_.base, NULL);
+}
+
+void shard_shutdown(void)
+{
+  int index;
+
+  if (shard_context_.listeners) {
+    for (index = 0; index < shard_context_.count; index++) {
+      if (shard_context_.listeners[index] != -1) {
+        evutil_closesocket(shard_context_.listeners[index]);
+      }
+    }
+  }
+
+#ifndef _WIN32
+  if (shard_context_.children) {
+    for (index = 1; index < shard_context_.count; index++) {
+      if (shard_context_.children[index] > 0) {
+        kill(shard_context_.children[index], SIGTERM);
+        waitpid(shard_context_.children[index], NULL, 0);
+      }
+    }
+  }
+
+  free(shard_context_.children);
+  shard_context_.children = NULL;
+
+  if (shard_context_.listeners) {
+    for (index = 0; index < 2; index++) {
+      if (shard_context_.parent[index] != -1) {
+        close(shard_context_.parent[index]);
+      }
+    }
+  }
+#endif
+
+  if (shard_context_.watch) {
+    event_free(shard_context_.watch);
+    shard_context_.watch = NULL;
+  }
+
+  if (shard_context_.idle_count) {
+    for (index = 0; index < shard_context_.count; index++) {
+      while (shard_context_.idle_count[index] > 0) {
+        evhttp_connection_free(shard_context_.idle[
+          index * SHARD_IDLE + --shard_context_.idle_count[index]].connection);
+      }
+    }
+  }
+
+  free(shard_context_.idle);
+  free(shard_context_.idle_count);
+  shard_context_.idle = NULL;
+  shard_context_.idle_count = NULL;
+
+  free(shard_context_.listeners);
+  free(shard_context_.ports);
+  shard_context_.listeners = NULL;
+  shard_context_.ports = NULL;
+  shard_context_.base = NULL;
+  shard_context_.http = NULL;
+}
+
+int shard_has_failed(void)
+{
+  return shard_context_.failed;
+}
+
+int shard_get_index(void)
+{
+  return shard_context_.index;
+}
+
+int shard_get_count(void)
+{
+  return shard_context_.count > 1 ? shard_context_.count : 1;
+}
+
+int shard_get_owner(const unsigned char r[QUEUE_UUID_LEN])
+{
+  unsigned long long hash = 0xcbf29ce484222325ULL;
+  size_t index;
+
+  if (shard_context_.count <= 1) {
+    return 0;
+  }
+
+  for (index = 0; index < QUEUE_UUID_LEN; index++) {
+    hash = (hash ^ r[index]) * 0x100000001b3ULL;
+  }
+
+  /* the table of queues in each shard is hashed on the same bytes, so the
+     hash is mixed again and the owner taken from its high bits. otherwise
+     every queue in a shard would land in the same few buckets */
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+
+  return (int)((hash >> 32) % (unsigned long long)shard_context_.count);
+}
+
+char *shard_path(const char *path)
+{
+  char *shard;
+
+  if (shard_context_.count <= 1) {
+    return strdup(path);
+  }
+
+  shard = malloc(strlen(path) + 12/*.index*/ + 1/*NULL*/);
+  if (!shard) {
+    return NULL;
+  }
+
+  sprintf(shard, "%s.%d", path, shard_context_.index);
+  return shard;
+}
+
+int shard_is_internal(struct evhttp_request *request)
+{
+  return shard_context_.http &&
+         evhttp_connection_get_server(
+           evhttp_request_get_connection(request)) == shard_context_.http;
+}
+
+int shard_verify(struct evhttp_request *request)
+{
+  const char *secret;
+
+  if (shard_context_.count <= 1) {
+    return 0;
+  }
+
+  secret = evhttp_find_header(evhttp_request_get_input_headers(request),
+                              SHARD_HEADER);
+  if (!secret || strlen(secret) != SHARD_SECRET_LEN * 2) {
+    return 0;
+  }
+
+  /* the time taken says nothing about how much of the secret matched */
+  return CRYPTO_memcmp(secret, shard_context_.secret,
+                       SHARD_SECRET_LEN * 2) == 0;
+}
+
+void shard_copy_headers(struct evkeyvalq *from, struct evkeyvalq *to)
+{
+  struct evkeyval *header;
+
+  TAILQ_FOREACH(header, from, next) {
+    if (!shard_is_hop_header_(header->key)) {
+      evhttp_add_header(to, header->key, header->value);
+    }
+  }
+}
+
+struct shard_forward *shard_forward(int shard, enum evhttp_cmd_type type,
+                                    const char *uri,
+                                    struct evkeyvalq *headers,
+                                    struct evbuffer *body,
+                                    void (*cb)(struct evhttp_request *,
+                                               void *),
+                                    void *arg)
+{
+  struct shard_forward *forward;
+
+  forward = calloc(1, sizeof(struct shard_forward));
+  if (!forward) {
+    return NULL;
+  }
+
+  forward->shard = shard;
+  forward->type = type;
+  forward->cb = cb;
+  forward->arg = arg;
+  TAILQ_INIT(&forward->headers);
+
+  forward->uri = strdup(uri);
+  forward->body = evbuffer_new();
+  if (!forward->uri || !forward->body) {
+    goto error;
+  }
+
+  if (headers) {
+    shard_copy_headers(headers, &forward->headers);
+  }
+
+  if (body && evbuffer_add_buffer(forward->body, body) != 0) {
+    goto error;
+  }
+
+  if (!shard_forward_send_(forward)) {
+    goto error;
+  }
+
+  return forward;
+
+error:
+  shard_forward_free_(forward);
+  return NULL;
+}
+
+void shard_forward_cancel(struct shard_forward *forward)
+{
+  /* requests still on a connection are freed along with it without calling
+     back */
+  evhttp_connection_free(forward->connection);
+  shard_forward_free_(forward);
+}
+
+void shard_retry(struct evhttp_request *request)
+{
+  evhttp_add_header(evhttp_request_get_output_headers(request),
+                    SHARD_RETRY_HEADER, "1");
+  evhttp_send_reply(request, HTTP_SERVUNAVAIL, "Retry", NULL);
+}
+
+evutil_socket_t shard_listen_(unsigned short *port)
+{
+#ifdef _WIN32
+  return -1;
+#else
+  struct sockaddr_in address;
+  ev_socklen_t length = sizeof(address);
+  evutil_socket_t fd;
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == -1) {
+    return -1;
+  }
+
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = 0;
+
+  if (evutil_make_listen_socket_reuseable(fd) != 0 ||
+      bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+      listen(fd, SHARD_BACKLOG) != 0 ||
+      getsockname(fd, (struct sockaddr *)&address, &length) != 0 ||
+      evutil_make_socket_nonblocking(fd) != 0 ||
+      evutil_make_socket_closeonexec(fd) != 0) {
+    evutil_closesocket(fd);
+    return -1;
+  }
+
+  *port = ntohs(address.sin_port);
+  return fd;
+#endif
+}
+
+int shard_is_hop_header_(const char *name)
+{
+  return !strcasecmp(name, "Connection") ||
+         !strcasecmp(name, "Keep-Alive") ||
+         !strcasecmp(name, "Proxy-Connection") ||
+         !strcasecmp(name, "Transfer-Encoding") ||
+         !strcasecmp(name, "Content-Length") ||
+         !strcasecmp(name, "Upgrade") ||
+         !strcasecmp(name, "TE") ||
+         !strcasecmp(name, "Trailer") ||
+         !strcasecmp(name, "Host") ||
+         !strcasecmp(name, SHARD_HEADER) ||
+         !strcasecmp(name, SHARD_RETRY_HEADER);
+}
+
+struct evhttp_connection *shard_connect_(int shard)
+{
+  struct shard_idle *idle = shard_context_.idle + shard * SHARD_IDLE;
+  int *count = &shard_context_.idle_count[shard];
+  struct evhttp_connection *connection;
+  struct timeval tv;
+
+  if (*count > 0 && timer_now() - idle[*count - 1].since < SHARD_IDLE_TIMEOUT) {
+    return idle[--*count].connection;
+  }
+
+  /* once the most recent connection has been kept too long so have the
+     rest */
+  while (*count > 0) {
+    evhttp_connection_free(idle[--*count].connection);
+  }
+
+  connection = evhttp_connection_base_new(shard_context_.base, NULL,
+                                          SHARD_HOST,
+                                          shard_context_.ports[shard]);
+  if (!connection) {
+    return NULL;
+  }
+
+  /* without a timeout of its own the connection gives up after the default
+     of libevent, which a held request can easily go past */
+  tv.tv_sec = SHARD_FORWARD_TIMEOUT;
+  tv.tv_usec = 0;
+  evhttp_connection_set_timeout_tv(connection, &tv);
+  return connection;
+}
+
+void shard_keep_(int shard, struct evhttp_connection *connection)
+{
+  struct shard_idle *idle = shard_context_.idle + shard * SHARD_IDLE;
+  int *count = &shard_context_.idle_count[shard];
+
+  /* the connection kept the longest makes room */
+  if (*count == SHARD_IDLE) {
+    evhttp_connection_free(idle[0].connection);
+    memmove(idle, idle + 1, (SHARD_IDLE - 1) * sizeof(struct shard_idle));
+    (*count)--;
+  }
+
+  idle[*count].connection = connection;
+  idle[*count].since = timer_now();
+  (*count)++;
+}
+
+int shard_forward_send_(struct shard_forward *forward)
+{
+  struct evhttp_request *request;
+  struct evkeyvalq *output;
+  char length[24];
+
+  forward->connection = shard_connect_(forward->shard);
+  if (!forward->connection) {
+    return 0;
+  }
+
+  request = evhttp_request_new(shard_forward_done_, forward);
+  if (!request) {
+    goto error;
+  }
+
+  /* the body is referenced rather than moved, so it is still there to make
+     the request again */
+  output = evhttp_request_get_output_headers(request);
+  shard_copy_headers(&forward->headers, output);
+  if (evbuffer_add_buffer_reference(evhttp_request_get_output_buffer(request),
+                                    forward->body) != 0) {
+    evhttp_request_free(request);
+    goto error;
+  }
+
+  /* the length is always given, since not every method is expected to have
+     a body */
+  sprintf(length, "%lu", (unsigned long)evbuffer_get_length(forward->body));
+  if (evhttp_add_header(output, "Host", SHARD_HOST) != 0 ||
+      evhttp_add_header(output, "Content-Length", length) != 0 ||
+      evhttp_add_header(output, SHARD_HEADER, shard_context_.secret) != 0) {
+    evhttp_request_free(request);
+    goto error;
+  }
+
+  /* the request belongs to the connection from here, even if it fails */
+  if (evhttp_make_request(forward->connection, request, forward->type,
+                          forward->uri) != 0) {
+    goto error;
+  }
+
+  return 1;
+
+error:
+  evhttp_connection_free(forward->connection);
+  forward->connection = NULL;
+  return 0;
+}
+
+void shard_forward_free_(struct shard_forward *forward)
+{
+  evhttp_clear_headers(&forward->headers);
+  if (forward->body) {
+    evbuffer_free(forward->body);
+  }
+
+  free(forward->uri);
+  free(forward);
+}
+
+void shard_forward_done_(struct evhttp_request *response, void *arg)
+{
+  struct shard_forward *forward = (struct shard_forward *)arg;
+
+  /* a request that failed may still be given, without a response code */
+  if (response && evhttp_request_get_response_code(response) == 0) {
+    response = NULL;
+  }
+
+  /* a connection that failed is connected again by the next request made on
+     it */
+  shard_keep_(forward->shard, forward->connection);
+  forward->connection = NULL;
+
+  /* a request held for too long is made again */
+  if (response && evhttp_find_header(evhttp_request_get_input_headers(response),
+                                     SHARD_RETRY_HEADER)) {
+    if (shard_forward_send_(forward)) {
+      return;
+    }
+
+    response = NULL;
+  }
+
+  forward->cb(response, forward->arg);
+  shard_forward_free_(forward);
+}
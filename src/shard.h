@@ -0,0 +1,106 @@
+/*
+  Copyright (c) 2021 Matthew (fkfv).
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/keyvalq_struct.h>
+#include "queue.h"
+
+/* a request made of another shard, see shard_forward */
+struct shard_forward;
+
+/* split the server into count shards, each a copy of the process with its
+   own event loop and queues so the server can use count cores. the
+   listeners the shards reach each other on are opened here, before any of
+   them are started. returns 0 on failure */
+int shard_prepare(int count);
+
+/* start the other shards as copies of this process. returns the index of the
+   shard the caller is now, 0 in the process that started them, or -1 on
+   failure */
+int shard_spawn(void);
+
+/* serve requests from the other shards with http, which is given the
+   listener of this shard. requests are made of the other shards on base,
+   and its loop is stopped once any other shard stops. returns 0 on failure */
+int shard_startup(struct event_base *base, struct evhttp *http);
+
+/* stop the other shards if this process started them */
+void shard_shutdown(void);
+
+/* was the loop stopped because another shard stopped without being told to.
+   the queues it owns can no longer be reached, so the server is stopped as a
+   whole and can be started again from the snapshots and logs */
+int shard_has_failed(void);
+
+/* the shard this process is and the number of shards, 0 and 1 if the server
+   is not sharded */
+int shard_get_index(void);
+int shard_get_count(void);
+
+/* the shard that owns the queue with a uuid. every request for the queue is
+   served by that shard */
+int shard_get_owner(const unsigned char r[QUEUE_UUID_LEN]);
+
+/* path of a file kept by this shard, with the index of the shard added when
+   there is more than one. returns NULL on failure, the path must be freed */
+char *shard_path(const char *path);
+
+/* did the request come from another shard, on the listener for them */
+int shard_is_internal(struct evhttp_request *request);
+
+/* does the request carry the secret the shards share, which stands in for
+   authentication between them */
+int shard_verify(struct evhttp_request *request);
+
+/* copy the headers of a request or a response being passed on, leaving out
+   the ones that only apply to the connection they came on */
+void shard_copy_headers(struct evkeyvalq *from, struct evkeyvalq *to);
+
+/* make a request of another shard, with the headers and the contents of body
+   if they are not NULL. body is emptied. cb is called with the response once
+   it is complete, or NULL if the shard could not be reached. a request the
+   shard answers with shard_retry is made again without calling back. returns
+   NULL on failure */
+struct shard_forward *shard_forward(int shard, enum evhttp_cmd_type type,
+                                    const char *uri,
+                                    struct evkeyvalq *headers,
+                                    struct evbuffer *body,
+                                    void (*cb)(struct evhttp_request *,
+                                               void *),
+                                    void *arg);
+
+/* give up on a request before it has called back. its connection to the
+   shard is closed */
+void shard_forward_cancel(struct shard_forward *forward);
+
+/* milliseconds a shard holds a request from another shard, such as a want or
+   a put waiting for space, before answering it with shard_retry */
+#define SHARD_HOLD_TIMEOUT 30000
+
+/* answer a held request from another shard, which makes it again */
+void shard_retry(struct evhttp_request *request);
+
+#endif
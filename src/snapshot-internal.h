@@ -0,0 +1,173 @@
+/*
+  Copyright (c) 2021 Matthew (fkfv).
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#ifndef SNAPSHOT_INTERNAL_H
+#define SNAPSHOT_INTERNAL_H
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/types.h>
+#endif
+
+#include <stdio.h>
+#include <event2/event.h>
+#include <event2/util.h>
+#include "snapshot.h"
+#include "queue.h"
+
+/* written at the start of every snapshot */
+#define SNAPSHOT_MAGIC "DQSNAP01"
+#define SNAPSHOT_MAGIC_LEN 8
+
+/* records are padded like they are in the log, so they can be read in place
+   from the mapped snapshot */
+#define SNAPSHOT_ALIGN(length) (((length) + 7) & ~(size_t)7)
+
+/* least milliseconds between progress reports from a snapshot being written
+   in the background */
+#define SNAPSHOT_PROGRESS_INTERVAL 100
+
+/* the snapshot starts with a header, followed by the records of each queue
+   and then the index of the queues. the header is written last, so a
+   snapshot that was not finished is never valid */
+struct snapshot_header {
+  char magic[SNAPSHOT_MAGIC_LEN];
+  unsigned long long epoch;
+  unsigned long long count;
+  unsigned long long index;
+};
+
+/* a queue in the index, and where its records are */
+struct snapshot_queue {
+  char id[QUEUE_UUID_STR_LEN];
+  unsigned long long offset;
+  unsigned long long length;
+};
+
+/* each record starts with the length of the data after it and its type */
+struct snapshot_record {
+  unsigned int length;
+  unsigned int type;
+};
+
+/* sent by the copy of the process writing a snapshot in the background.
+   small enough to be written to a pipe in one go */
+struct snapshot_progress {
+  unsigned long long queues;
+  unsigned long long bytes;
+  unsigned long long cow;
+};
+
+struct snapshot_context {
+  /* the snapshot mapped at startup */
+  const unsigned char *map;
+  size_t map_length;
+#ifdef _WIN32
+  HANDLE mapping;
+#endif
+
+  unsigned long long epoch;
+  const struct snapshot_queue *queues;
+  size_t count;
+
+  /* the snapshot being written, and its path while it is written */
+  FILE *fp;
+  char *path;
+  char *new_path;
+  unsigned long long new_epoch;
+
+  /* index of the snapshot being written, the last entry is the current
+     queue */
+  struct snapshot_queue *index;
+  size_t index_count;
+  size_t index_size;
+
+  /* where the next record is written */
+  unsigned long long offset;
+
+  /* the record last handed out by snapshot_reserve, written once it has been
+     filled in */
+  unsigned char *record;
+  size_t record_length;
+  size_t record_size;
+
+  /* in the copy writing a snapshot in the background, is progress reported
+     and where to, and when it was last reported */
+  int reporting;
+  int report_fd;
+  struct timeval reported;
+
+  /* the snapshot being written in the background, the pipe its progress is
+     read from and the part of a report read so far */
+#ifndef _WIN32
+  pid_t child;
+#endif
+  evutil_socket_t progress_fd;
+  struct event *progress;
+  struct snapshot_progress report;
+  size_t report_length;
+  char *background_path;
+  struct timeval started;
+
+  void (*done)(const char *, int, void *);
+  void *done_arg;
+
+  struct snapshot_stats stats;
+};
+
+/* the global context instance */
+extern struct snapshot_context snapshot_context_;
+
+/* map and unmap a snapshot file. returns 0 on failure */
+int snapshot_map_(const char *path);
+void snapshot_unmap_(void);
+
+/* make a rename in the directory of path last through a crash. returns 0
+   on failure */
+int snapshot_sync_directory_(const char *path);
+
+/* write out the record last handed out. returns 0 on failure */
+int snapshot_write_record_(void);
+
+/* write data to the snapshot being written. returns 0 on failure */
+int snapshot_write_(const void *data, size_t length);
+
+/* report progress from the copy writing a snapshot in the background,
+   unless it was reported recently or force is set */
+void snapshot_report_(int force);
+
+/* bytes of memory the copy writing a snapshot has had to copy, 0 if this is
+   not known */
+unsigned long long snapshot_cow_(void);
+
+/* libevent callback reading progress reports until the copy exits */
+void snapshot_progress_cb_(evutil_socket_t fd, short events, void *arg);
+
+/* wait for the copy writing a snapshot to exit and call its done callback */
+void snapshot_finish_(void);
+
+/* microseconds between two times */
+unsigned long long snapshot_elapsed_(const struct timeval *start,
+                                     const struct timeval *end);
+
+#endif
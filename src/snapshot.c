@@ -0,0 +1,776 @@
+/*
+  Copyright (c) 2021 Matthew (fkfv).
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#ifdef _WIN32
+#include <io.h>
+#define fsync(fd) _commit(fd)
+#define fileno _fileno
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "snapshot.h"
+#include "snapshot-internal.h"
+
+struct snapshot_context snapshot_context_;
+
+int snapshot_open(const char *path)
+{
+  struct snapshot_header header;
+  const struct snapshot_queue *queue;
+  size_t index;
+
+  if (!snapshot_map_(path)) {
+    return 0;
+  }
+
+  /* nothing has been written yet */
+  if (!snapshot_context_.map) {
+    return 1;
+  }
+
+  if (snapshot_context_.map_length < sizeof(struct snapshot_header)) {
+    goto error;
+  }
+
+  memcpy(&header, snapshot_context_.map, sizeof(struct snapshot_header));
+  if (memcmp(header.magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) != 0 ||
+      header.index > snapshot_context_.map_length ||
+      header.count > (snapshot_context_.map_length - header.index) /
+                     sizeof(struct snapshot_queue)) {
+    goto error;
+  }
+
+  snapshot_context_.queues = (const struct snapshot_queue *)
+                             (snapshot_context_.map + header.index);
+  snapshot_context_.count = (size_t)header.count;
+  snapshot_context_.epoch = header.epoch;
+
+  /* only the index is checked here, the records are checked as each queue is
+     loaded so the rest of the snapshot is not touched */
+  for (index = 0; index < snapshot_context_.count; index++) {
+    queue = &snapshot_context_.queues[index];
+    if (queue->offset > header.index ||
+        queue->length > header.index - queue->offset) {
+      goto error;
+    }
+  }
+
+  return 1;
+
+error:
+  snapshot_close();
+  return 0;
+}
+
+void snapshot_close(void)
+{
+  snapshot_unmap_();
+
+  snapshot_context_.queues = NULL;
+  snapshot_context_.count = 0;
+  snapshot_context_.epoch = 0;
+}
+
+unsigned long long snapshot_get_epoch(void)
+{
+  return snapshot_context_.epoch;
+}
+
+size_t snapshot_get_count(void)
+{
+  return snapshot_context_.count;
+}
+
+int snapshot_foreach(int (*cb)(const char *, const struct snapshot_queue *,
+                               void *),
+                     void *arg)
+{
+  char id[QUEUE_UUID_STR_LEN + 1/*NULL*/];
+  size_t index;
+
+  for (index = 0; index < snapshot_context_.count; index++) {
+    memcpy(id, snapshot_context_.queues[index].id, QUEUE_UUID_STR_LEN);
+    id[QUEUE_UUID_STR_LEN] = '\0';
+
+    if (cb(id, &snapshot_context_.queues[index], arg) == 0) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+int snapshot_load(const struct snapshot_queue *queue,
+                  int (*cb)(int, const void *, size_t, void *), void *arg)
+{
+  const unsigned char *records = snapshot_context_.map + queue->offset;
+  struct snapshot_record record;
+  size_t offset;
+
+  for (offset = 0;
+       offset + sizeof(struct snapshot_record) <= queue->length;
+       offset += sizeof(struct snapshot_record) +
+                 SNAPSHOT_ALIGN(record.length)) {
+    memcpy(&record, records + offset, sizeof(struct snapshot_record));
+    if (SNAPSHOT_ALIGN(record.length) > queue->length - offset -
+                                        sizeof(struct snapshot_record)) {
+      return 0;
+    }
+
+    if (!cb((int)record.type, records + offset + sizeof(struct snapshot_record),
+            record.length, arg)) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+int snapshot_begin(const char *path, unsigned long long epoch)
+{
+  struct snapshot_header header;
+
+  snapshot_context_.path = strdup(path);
+  snapshot_context_.new_path = malloc(strlen(path) + 4/*.new*/ + 1/*NULL*/);
+  if (!snapshot_context_.path || !snapshot_context_.new_path) {
+    goto error;
+  }
+
+  sprintf(snapshot_context_.new_path, "%s.new", path);
+
+  snapshot_context_.fp = fopen(snapshot_context_.new_path, "wb");
+  if (!snapshot_context_.fp) {
+    goto error;
+  }
+
+  /* the header is filled in once everything else has been written */
+  memset(&header, 0, sizeof(struct snapshot_header));
+  if (fwrite(&header, sizeof(struct snapshot_header), 1,
+             snapshot_context_.fp) != 1) {
+    goto error;
+  }
+
+  snapshot_context_.offset = sizeof(struct snapshot_header);
+  snapshot_context_.new_epoch = epoch;
+
+  return 1;
+
+error:
+  snapshot_abort();
+  return 0;
+}
+
+int snapshot_add_queue(const char *id)
+{
+  struct snapshot_queue *index;
+  struct snapshot_queue *queue;
+  size_t size;
+
+  if (!snapshot_context_.fp || !snapshot_write_record_()) {
+    return 0;
+  }
+
+  if (snapshot_context_.index_count == snapshot_context_.index_size) {
+    size = snapshot_context_.index_size ? snapshot_context_.index_size * 2 :
+                                          64;
+    index = realloc(snapshot_context_.index,
+                    size * sizeof(struct snapshot_queue));
+    if (!index) {
+      return 0;
+    }
+
+    snapshot_context_.index = index;
+    snapshot_context_.index_size = size;
+  }
+
+  if (snapshot_context_.reporting) {
+    snapshot_report_(0);
+  }
+
+  queue = &snapshot_context_.index[snapshot_context_.index_count++];
+  memset(queue, 0, sizeof(struct snapshot_queue));
+  memcpy(queue->id, id, QUEUE_UUID_STR_LEN);
+  queue->offset = snapshot_context_.offset;
+
+  return 1;
+}
+
+void *snapshot_reserve(int type, size_t length, void *arg)
+{
+  struct snapshot_record record;
+  size_t needed = sizeof(struct snapshot_record) + SNAPSHOT_ALIGN(length);
+  unsigned char *buffer;
+
+  if (!snapshot_context_.fp || snapshot_context_.index_count == 0 ||
+      !snapshot_write_record_()) {
+    return NULL;
+  }
+
+  if (needed > snapshot_context_.record_size) {
+    buffer = realloc(snapshot_context_.record, needed);
+    if (!buffer) {
+      return NULL;
+    }
+
+    snapshot_context_.record = buffer;
+    snapshot_context_.record_size = needed;
+  }
+
+  record.length = (unsigned int)length;
+  record.type = (unsigned int)type;
+  memcpy(snapshot_context_.record, &record, sizeof(struct snapshot_record));
+
+  buffer = snapshot_context_.record + sizeof(struct snapshot_record);
+  memset(buffer + length, 0, SNAPSHOT_ALIGN(length) - length);
+  snapshot_context_.record_length = needed;
+
+  return buffer;
+}
+
+int snapshot_copy(const struct snapshot_queue *queue)
+{
+  if (!snapshot_context_.fp || snapshot_context_.index_count == 0 ||
+      !snapshot_write_record_()) {
+    return 0;
+  }
+
+  return snapshot_write_(snapshot_context_.map + queue->offset,
+                         (size_t)queue->length);
+}
+
+int snapshot_commit(void)
+{
+  struct snapshot_header header;
+  FILE *fp = snapshot_context_.fp;
+
+  if (!fp || !snapshot_write_record_()) {
+    goto error;
+  }
+
+  memset(&header, 0, sizeof(struct snapshot_header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN);
+  header.epoch = snapshot_context_.new_epoch;
+  header.count = snapshot_context_.index_count;
+  header.index = snapshot_context_.offset;
+
+  /* a snapshot with no queues has no index to write */
+  if ((snapshot_context_.index_count > 0 &&
+       fwrite(snapshot_context_.index, sizeof(struct snapshot_queue),
+              snapshot_context_.index_count, fp) !=
+         snapshot_context_.index_count) ||
+      fseek(fp, 0, SEEK_SET) != 0 ||
+      fwrite(&header, sizeof(struct snapshot_header), 1, fp) != 1 ||
+      fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+    goto error;
+  }
+
+  fclose(fp);
+  snapshot_context_.fp = NULL;
+
+  /* windows will not rename over a file that exists or is mapped */
+  snapshot_close();
+#ifdef _WIN32
+  remove(snapshot_context_.path);
+#endif
+
+  /* the log is cut short once this returns, so the rename must not be lost
+     if the system crashes */
+  if (rename(snapshot_context_.new_path, snapshot_context_.path) != 0 ||
+      !snapshot_sync_directory_(snapshot_context_.path)) {
+    goto error;
+  }
+
+  snapshot_abort();
+  return 1;
+
+error:
+  snapshot_abort();
+  return 0;
+}
+
+void snapshot_abort(void)
+{
+  if (snapshot_context_.fp) {
+    fclose(snapshot_context_.fp);
+    snapshot_context_.fp = NULL;
+  }
+
+  /* a finished snapshot has already been moved out of the way */
+  if (snapshot_context_.new_path) {
+    remove(snapshot_context_.new_path);
+  }
+
+  free(snapshot_context_.index);
+  free(snapshot_context_.record);
+  free(snapshot_context_.new_path);
+  free(snapshot_context_.path);
+
+  snapshot_context_.index = NULL;
+  snapshot_context_.index_count = 0;
+  snapshot_context_.index_size = 0;
+  snapshot_context_.record = NULL;
+  snapshot_context_.record_length = 0;
+  snapshot_context_.record_size = 0;
+  snapshot_context_.new_path = NULL;
+  snapshot_context_.path = NULL;
+}
+
+int snapshot_background(struct event_base *base, const char *path,
+                        unsigned long long epoch, size_t count,
+                        int (*write)(void *),
+                        void (*done)(const char *, int, void *), void *arg)
+{
+#ifdef _WIN32
+  /* there is no way to copy the process */
+  return 0;
+#else
+  struct timeval forked;
+  sigset_t signals;
+  int fds[2];
+  int result;
+
+  if (snapshot_context_.progress) {
+    return 0;
+  }
+
+  snapshot_context_.background_path = strdup(path);
+  if (!snapshot_context_.background_path) {
+    return 0;
+  }
+
+  if (pipe(fds) != 0) {
+    goto error;
+  }
+
+  evutil_gettimeofday(&snapshot_context_.started, NULL);
+  snapshot_context_.child = fork();
+  if (snapshot_context_.child < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    goto error;
+  }
+
+  if (snapshot_context_.child == 0) {
+    close(fds[0]);
+
+    /* the handlers of the server only pass a signal on to its loop, which
+       does not run here, so the copy would carry on writing */
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    snapshot_context_.reporting = 1;
+    snapshot_context_.report_fd = fds[1];
+    snapshot_context_.reported = snapshot_context_.started;
+
+    result = snapshot_begin(path, epoch) && write(arg);
+    snapshot_report_(1);
+
+    /* once the snapshot has replaced the old one the copy is never stopped
+       early, so its exit status always says whether it did */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+
+    if (result) {
+      result = snapshot_commit();
+    } else {
+      snapshot_abort();
+    }
+
+    /* nothing the server had buffered is written out again by the copy */
+    _exit(result ? 0 : 1);
+  }
+
+  evutil_gettimeofday(&forked, NULL);
+  close(fds[1]);
+
+  snapshot_context_.progress_fd = fds[0];
+  snapshot_context_.progress = event_new(base, fds[0], EV_READ | EV_PERSIST,
+                                         snapshot_progress_cb_, NULL);
+  if (!snapshot_context_.progress ||
+      event_add(snapshot_context_.progress, NULL) != 0) {
+    /* the copy is stopped and waited for as if it had failed */
+    kill(snapshot_context_.child, SIGTERM);
+    waitpid(snapshot_context_.child, NULL, 0);
+    close(fds[0]);
+
+    if (snapshot_context_.progress) {
+      event_free(snapshot_context_.progress);
+      snapshot_context_.progress = NULL;
+    }
+
+    goto error;
+  }
+
+  snapshot_context_.done = done;
+  snapshot_context_.done_arg = arg;
+  snapshot_context_.report_length = 0;
+
+  snapshot_context_.stats.running = 1;
+  snapshot_context_.stats.total = count;
+  snapshot_context_.stats.queues = 0;
+  snapshot_context_.stats.bytes = 0;
+  snapshot_context_.stats.cow = 0;
+  snapshot_context_.stats.last_fork =
+    snapshot_elapsed_(&snapshot_context_.started, &forked);
+
+  return 1;
+
+error:
+  free(snapshot_context_.background_path);
+  snapshot_context_.background_path = NULL;
+  snapshot_context_.stats.failed++;
+
+  return 0;
+#endif
+}
+
+int snapshot_is_running(void)
+{
+  return snapshot_context_.progress != NULL;
+}
+
+void snapshot_cancel(void)
+{
+  if (!snapshot_context_.progress) {
+    return;
+  }
+
+  /* the copy stops straight away unless it is already replacing the old
+     snapshot, which is waited for. a snapshot written after this must not
+     race it for the same files */
+#ifndef _WIN32
+  kill(snapshot_context_.child, SIGTERM);
+#endif
+  snapshot_finish_();
+}
+
+void snapshot_get_stats(struct snapshot_stats *stats)
+{
+  *stats = snapshot_context_.stats;
+}
+
+int snapshot_map_(const char *path)
+{
+#ifdef _WIN32
+  LARGE_INTEGER size;
+  HANDLE file;
+  void *map;
+
+  file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+                     NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    return GetLastError() == ERROR_FILE_NOT_FOUND;
+  }
+
+  if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+    CloseHandle(file);
+    return 0;
+  }
+
+  snapshot_context_.mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0,
+                                                 0, NULL);
+  CloseHandle(file);
+  if (!snapshot_context_.mapping) {
+    return 0;
+  }
+
+  map = MapViewOfFile(snapshot_context_.mapping, FILE_MAP_READ, 0, 0, 0);
+  if (!map) {
+    CloseHandle(snapshot_context_.mapping);
+    snapshot_context_.mapping = NULL;
+    return 0;
+  }
+
+  snapshot_context_.map_length = (size_t)size.QuadPart;
+#else
+  struct stat st;
+  void *map;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return errno == ENOENT;
+  }
+
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+
+  /* the mapping stays valid once the file is closed */
+  map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return 0;
+  }
+
+  snapshot_context_.map_length = (size_t)st.st_size;
+#endif
+
+  snapshot_context_.map = map;
+  return 1;
+}
+
+int snapshot_sync_directory_(const char *path)
+{
+#ifdef _WIN32
+  /* there is no way to sync a directory */
+  return 1;
+#else
+  const char *slash = strrchr(path, '/');
+  char *directory;
+  size_t length;
+  int result;
+  int fd;
+
+  if (!slash) {
+    directory = strdup(".");
+  } else {
+    length = slash == path ? 1 : (size_t)(slash - path);
+    directory = malloc(length + 1/*NULL*/);
+    if (directory) {
+      memcpy(directory, path, length);
+      directory[length] = '\0';
+    }
+  }
+
+  if (!directory) {
+    return 0;
+  }
+
+  fd = open(directory, O_RDONLY);
+  free(directory);
+  if (fd == -1) {
+    return 0;
+  }
+
+  result = fsync(fd) == 0;
+  close(fd);
+  return result;
+#endif
+}
+
+void snapshot_unmap_(void)
+{
+  if (!snapshot_context_.map) {
+    return;
+  }
+
+#ifdef _WIN32
+  UnmapViewOfFile(snapshot_context_.map);
+  CloseHandle(snapshot_context_.mapping);
+  snapshot_context_.mapping = NULL;
+#else
+  munmap((void *)snapshot_context_.map, snapshot_context_.map_length);
+#endif
+
+  snapshot_context_.map = NULL;
+  snapshot_context_.map_length = 0;
+}
+
+int snapshot_write_record_(void)
+{
+  size_t length = snapshot_context_.record_length;
+
+  if (length == 0) {
+    return 1;
+  }
+
+  snapshot_context_.record_length = 0;
+  return snapshot_write_(snapshot_context_.record, length);
+}
+
+int snapshot_write_(const void *data, size_t length)
+{
+  if (fwrite(data, 1, length, snapshot_context_.fp) != length) {
+    return 0;
+  }
+
+  snapshot_context_.offset += length;
+  snapshot_context_.index[snapshot_context_.index_count - 1].length += length;
+
+  return 1;
+}
+
+void snapshot_report_(int force)
+{
+#ifndef _WIN32
+  struct snapshot_progress report;
+  struct timeval now;
+
+  evutil_gettimeofday(&now, NULL);
+  if (!force && snapshot_elapsed_(&snapshot_context_.reported, &now) <
+                SNAPSHOT_PROGRESS_INTERVAL * 1000) {
+    return;
+  }
+
+  snapshot_context_.reported = now;
+
+  report.queues = snapshot_context_.index_count;
+  report.bytes = snapshot_context_.offset;
+  report.cow = snapshot_cow_();
+
+  /* a report that could not be sent is only missed by the stats */
+  if (write(snapshot_context_.report_fd, &report,
+            sizeof(struct snapshot_progress)) < 0) {
+    snapshot_context_.reporting = 0;
+  }
+#endif
+}
+
+unsigned long long snapshot_cow_(void)
+{
+#ifdef __linux__
+  unsigned long long total = 0;
+  unsigned long long size;
+  char line[256];
+  FILE *fp;
+
+  /* pages shared with the server when the copy was made only become private
+     once one side changes them */
+  fp = fopen("/proc/self/smaps_rollup", "r");
+  if (!fp) {
+    return 0;
+  }
+
+  while (fgets(line, sizeof(line), fp)) {
+    if (sscanf(line, "Private_Dirty: %llu kB", &size) == 1) {
+      total += size * 1024;
+    }
+  }
+
+  fclose(fp);
+  return total;
+#else
+  return 0;
+#endif
+}
+
+void snapshot_progress_cb_(evutil_socket_t fd, short events, void *arg)
+{
+#ifndef _WIN32
+  ssize_t length;
+
+  length = read(fd, (char *)&snapshot_context_.report +
+                    snapshot_context_.report_length,
+                sizeof(struct snapshot_progress) -
+                snapshot_context_.report_length);
+  if (length < 0 && errno == EINTR) {
+    return;
+  }
+
+  /* the copy closes the pipe when it exits */
+  if (length <= 0) {
+    snapshot_finish_();
+    return;
+  }
+
+  snapshot_context_.report_length += (size_t)length;
+  if (snapshot_context_.report_length < sizeof(struct snapshot_progress)) {
+    return;
+  }
+
+  snapshot_context_.report_length = 0;
+  snapshot_context_.stats.queues = (size_t)snapshot_context_.report.queues;
+  snapshot_context_.stats.bytes = snapshot_context_.report.bytes;
+  snapshot_context_.stats.cow = snapshot_context_.report.cow;
+#endif
+}
+
+void snapshot_finish_(void)
+{
+#ifndef _WIN32
+  void (*done)(const char *, int, void *) = snapshot_context_.done;
+  char *path = snapshot_context_.background_path;
+  char *new_path;
+  struct timeval now;
+  int committed;
+  int status;
+
+  while (waitpid(snapshot_context_.child, &status, 0) < 0) {
+    if (errno != EINTR) {
+      status = -1;
+      break;
+    }
+  }
+
+  committed = status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+  event_free(snapshot_context_.progress);
+  snapshot_context_.progress = NULL;
+  close(snapshot_context_.progress_fd);
+
+  /* a copy that was stopped early leaves its snapshot behind */
+  if (!committed) {
+    new_path = malloc(strlen(path) + 4/*.new*/ + 1/*NULL*/);
+    if (new_path) {
+      sprintf(new_path, "%s.new", path);
+      remove(new_path);
+      free(new_path);
+    }
+  }
+
+  evutil_gettimeofday(&now, NULL);
+
+  snapshot_context_.stats.running = 0;
+  snapshot_context_.stats.last_duration =
+    snapshot_elapsed_(&snapshot_context_.started, &now) / 1000;
+  snapshot_context_.stats.last_bytes = snapshot_context_.stats.bytes;
+  snapshot_context_.stats.last_cow = snapshot_context_.stats.cow;
+
+  if (committed) {
+    snapshot_context_.stats.completed++;
+  } else {
+    snapshot_context_.stats.failed++;
+  }
+
+  snapshot_context_.background_path = NULL;
+  snapshot_context_.done = NULL;
+
+  done(path, committed, snapshot_context_.done_arg);
+  free(path);
+#endif
+}
+
+unsigned long long snapshot_elapsed_(const struct timeval *start,
+                                     const struct timeval *end)
+{
+  long long elapsed;
+
+  elapsed = (long long)(end->tv_sec - start->tv_sec) * 1000000 +
+            (long long)(end->tv_usec - start->tv_usec);
+
+  /* the clock can be moved back while the snapshot is written */
+  return elapsed > 0 ? (unsigned long long)elapsed : 0;
+}
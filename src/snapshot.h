@@ -0,0 +1,135 @@
+/*
+  Copyright (c) 2021 Matthew (fkfv).
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <event2/event.h>
+
+/* a copy of every queue written when the server stops, so it can start again
+   without replaying the whole log. the snapshot is mapped into memory when the
+   server starts and each queue is only read from it once it is first used.
+   each queue is stored as the same records the log uses */
+struct snapshot_queue;
+
+struct snapshot_stats {
+  /* is a snapshot being written in the background */
+  int running;
+
+  /* queues in the snapshot being written, how many of them have been written
+     so far, the bytes written and the memory copied since it started */
+  size_t total;
+  size_t queues;
+  unsigned long long bytes;
+  unsigned long long cow;
+
+  /* background snapshots written and those that failed */
+  unsigned long long completed;
+  unsigned long long failed;
+
+  /* for the last background snapshot, microseconds the server stopped for
+     while it was started, milliseconds it took, bytes written and bytes of
+     memory copied because they changed while it was written. memory copied
+     is only measured on linux and is 0 elsewhere */
+  unsigned long long last_fork;
+  unsigned long long last_duration;
+  unsigned long long last_bytes;
+  unsigned long long last_cow;
+};
+
+/* map the snapshot at path. returns 1 if the snapshot was mapped or does not
+   exist and 0 if it is not a valid snapshot */
+int snapshot_open(const char *path);
+
+/* unmap the snapshot. queues still in it can no longer be loaded */
+void snapshot_close(void);
+
+/* epoch of the mapped snapshot, 0 if there is none. each snapshot written has
+   the next epoch, and the log following on from it is started with it */
+unsigned long long snapshot_get_epoch(void);
+
+/* number of queues in the mapped snapshot */
+size_t snapshot_get_count(void);
+
+/* iterate each queue in the mapped snapshot, calling cb with the id of the
+   queue. if one of the callbacks return 0 then iteration will be stopped and
+   the function returns 0, otherwise it returns 1 */
+int snapshot_foreach(int (*cb)(const char *, const struct snapshot_queue *,
+                               void *),
+                     void *arg);
+
+/* read every record of a queue in the mapped snapshot, calling cb for each
+   record. returns 0 if the records are not valid or cb returned 0 */
+int snapshot_load(const struct snapshot_queue *queue,
+                  int (*cb)(int, const void *, size_t, void *), void *arg);
+
+/* start writing a new snapshot with the given epoch next to the snapshot at
+   path. returns 0 on failure */
+int snapshot_begin(const char *path, unsigned long long epoch);
+
+/* start the next queue in the snapshot being written. its records are added
+   with snapshot_reserve or copied from the mapped snapshot with
+   snapshot_copy. returns 0 on failure */
+int snapshot_add_queue(const char *id);
+
+/* add a record of length bytes to the current queue, returning where the
+   record should be written. the returned memory is only valid until the next
+   call. in the form taken by queue_log, arg is not used. returns NULL on
+   failure */
+void *snapshot_reserve(int type, size_t length, void *arg);
+
+/* copy the records of a queue in the mapped snapshot, which has not been
+   loaded, into the current queue. returns 0 on failure */
+int snapshot_copy(const struct snapshot_queue *queue);
+
+/* finish the new snapshot, sync it and move it over the old one. the mapped
+   snapshot is closed first. returns 0 on failure, the old snapshot is kept */
+int snapshot_commit(void);
+
+/* give up on the snapshot being written */
+void snapshot_abort(void);
+
+/* write a snapshot with the given epoch at path in a copy of the process, so
+   the server carries on while it is written. the copy sees memory as it was
+   when the snapshot started, and calls write to add each of the count queues
+   with snapshot_add_queue. done is called from the event loop once the
+   snapshot has been written, with committed set to 1 if it replaced the old
+   one. the mapped snapshot is left alone, it should be opened again once the
+   snapshot is done. not supported on windows. returns 0 on failure or if a
+   snapshot is already being written */
+int snapshot_background(struct event_base *base, const char *path,
+                        unsigned long long epoch, size_t count,
+                        int (*write)(void *),
+                        void (*done)(const char *, int, void *), void *arg);
+
+int snapshot_is_running(void);
+
+/* stop the snapshot being written in the background, calling its done
+   callback. a snapshot that already replaced the old one is kept. this
+   blocks until the copy exits, which is only as long as it takes to sync
+   and rename the snapshot if it had already started to */
+void snapshot_cancel(void);
+
+void snapshot_get_stats(struct snapshot_stats *stats);
+
+#endif
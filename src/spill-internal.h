@@ -0,0 +1,83 @@
+/*
+  Copyright (c) 2021 Matthew (fkfv).
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#ifndef SPILL_INTERNAL_H
+#define SPILL_INTERNAL_H
+
+#include <stdio.h>
+#include "queue-compat.h"
+#include "spill.h"
+
+/* largest a spill file grows to before a new one is started. kept below 2GB
+   so offsets fit in a long everywhere */
+#define SPILL_FILE_SIZE (64L * 1024 * 1024)
+
+struct spill_file {
+  TAILQ_ENTRY(spill_file) next;
+
+  /* set of files this file belongs to */
+  struct spill *owner;
+
+  FILE *fp;
+  char *path;
+
+  /* bytes written so far, new extents are written here */
+  long size;
+
+  /* extents written that have not been read back or released */
+  size_t live;
+  size_t live_bytes;
+};
+
+struct spill {
+  TAILQ_HEAD(sfhead, spill_file) files;
+
+  /* file new extents are written to */
+  struct spill_file *current;
+
+  /* name files are created with, and the number given to the next file */
+  char *name;
+  unsigned int sequence;
+};
+
+struct spill_context {
+  /* directory spill files are created in, NULL if spilling is disabled */
+  char *directory;
+
+  /* files open and the bytes of every live extent */
+  size_t files;
+  size_t bytes;
+
+  /* number of holds on the files being started over */
+  unsigned int holds;
+};
+
+/* the global context instance */
+extern struct spill_context spill_context_;
+
+/* create the next file of a set. returns NULL on failure */
+struct spill_file *spill_file_new_(struct spill *spill);
+
+/* close and delete a file */
+void spill_file_free_(struct spill_file *file);
+
+#endif
@@ -0,0 +1,262 @@
+/*
+  Copyright (c) 2021 Matthew (fkfv).
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spill.h"
+#include "spill-internal.h"
+
+struct spill_context spill_context_;
+
+int spill_startup(const char *directory)
+{
+  spill_context_.directory = strdup(directory);
+  return spill_context_.directory != NULL;
+}
+
+void spill_shutdown(void)
+{
+  free(spill_context_.directory);
+  spill_context_.directory = NULL;
+}
+
+int spill_is_enabled(void)
+{
+  return spill_context_.directory != NULL;
+}
+
+struct spill *spill_new(const char *name)
+{
+  struct spill *spill;
+
+  if (!spill_context_.directory) {
+    return NULL;
+  }
+
+  spill = calloc(1, sizeof(struct spill));
+  if (!spill) {
+    return NULL;
+  }
+
+  spill->name = strdup(name);
+  if (!spill->name) {
+    free(spill);
+    return NULL;
+  }
+
+  TAILQ_INIT(&spill->files);
+  return spill;
+}
+
+void spill_free(struct spill *spill)
+{
+  struct spill_file *file;
+
+  while ((file = TAILQ_FIRST(&spill->files)) != NULL) {
+    spill_file_free_(file);
+  }
+
+  free(spill->name);
+  free(spill);
+}
+
+int spill_write(struct spill *spill, const void *data, size_t length,
+                struct spill_extent *extent)
+{
+  struct spill_file *file = spill->current;
+
+  if (length > SPILL_FILE_SIZE) {
+    return 0;
+  }
+
+  /* a full file is left to be deleted once its extents have been read */
+  if (!file || file->size > SPILL_FILE_SIZE - (long)length) {
+    file = spill_file_new_(spill);
+    if (!file) {
+      return 0;
+    }
+
+    if (spill->current && spill->current->live == 0) {
+      spill_file_free_(spill->current);
+    }
+
+    spill->current = file;
+  }
+
+  if (fseek(file->fp, file->size, SEEK_SET) != 0 ||
+      fwrite(data, 1, length, file->fp) != length ||
+      fflush(file->fp) != 0) {
+    return 0;
+  }
+
+  extent->file = file;
+  extent->offset = file->size;
+  extent->length = length;
+
+  file->size += (long)length;
+  file->live++;
+  file->live_bytes += length;
+  spill_context_.bytes += length;
+
+  return 1;
+}
+
+int spill_read(struct spill_extent *extent, void *data)
+{
+  int result;
+
+  result = spill_peek(extent, data);
+
+  spill_release(extent);
+  return result;
+}
+
+int spill_peek(const struct spill_extent *extent, void *data)
+{
+  FILE *fp = extent->file->fp;
+#ifndef _WIN32
+  ssize_t length;
+  size_t offset;
+
+  /* the file offset is shared with a snapshot being written in the
+     background, so it is left alone */
+  for (offset = 0; offset < extent->length; offset += (size_t)length) {
+    length = pread(fileno(fp), (char *)data + offset, extent->length - offset,
+                   (off_t)extent->offset + (off_t)offset);
+    if (length <= 0) {
+      return 0;
+    }
+  }
+
+  return 1;
+#else
+  return fseek(fp, extent->offset, SEEK_SET) == 0 &&
+         fread(data, 1, extent->length, fp) == extent->length;
+#endif
+}
+
+void spill_release(struct spill_extent *extent)
+{
+  struct spill_file *file = extent->file;
+
+  file->live--;
+  file->live_bytes -= extent->length;
+  spill_context_.bytes -= extent->length;
+  extent->file = NULL;
+
+  if (file->live > 0) {
+    return;
+  }
+
+  /* the file being written is started over instead of making a new one,
+     older files are finished with for good. a file deleted while held can
+     still be read through a copy of it that is already open */
+  if (file == file->owner->current) {
+    if (spill_context_.holds == 0) {
+      file->size = 0;
+    }
+  } else {
+    spill_file_free_(file);
+  }
+}
+
+void spill_hold(int hold)
+{
+  if (hold) {
+    spill_context_.holds++;
+  } else if (spill_context_.holds > 0) {
+    spill_context_.holds--;
+  }
+}
+
+size_t spill_get_files(void)
+{
+  return spill_context_.files;
+}
+
+size_t spill_get_bytes(void)
+{
+  return spill_context_.bytes;
+}
+
+struct spill_file *spill_file_new_(struct spill *spill)
+{
+  struct spill_file *file;
+  size_t length;
+
+  file = calloc(1, sizeof(struct spill_file));
+  if (!file) {
+    return NULL;
+  }
+
+  /* directory + separator + name + separator + 10 digit sequence + .spill */
+  length = strlen(spill_context_.directory) + strlen(spill->name) + 19;
+  file->path = malloc(length + 1/*NULL*/);
+  if (!file->path) {
+    goto error;
+  }
+
+  sprintf(file->path, "%s/%s-%u.spill", spill_context_.directory, spill->name,
+          spill->sequence++);
+
+  file->fp = fopen(file->path, "w+b");
+  if (!file->fp) {
+    goto error;
+  }
+
+  file->owner = spill;
+  TAILQ_INSERT_TAIL(&spill->files, file, next);
+  spill_context_.files++;
+
+  return file;
+
+error:
+  free(file->path);
+  free(file);
+
+  return NULL;
+}
+
+void spill_file_free_(struct spill_file *file)
+{
+  struct spill *spill = file->owner;
+
+  if (spill->current == file) {
+    spill->current = NULL;
+  }
+
+  spill_context_.bytes -= file->live_bytes;
+  spill_context_.files--;
+
+  TAILQ_REMOVE(&spill->files, file, next);
+  fclose(file->fp);
+  remove(file->path);
+  free(file->path);
+  free(file);
+}
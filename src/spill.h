@@ -0,0 +1,80 @@
+/*
+  Copyright (c) 2021 Matthew (fkfv).
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#ifndef SPILL_H
+#define SPILL_H
+
+#include <stddef.h>
+
+/* append-only files on local disk used to hold data that does not fit in
+   memory. data is written in extents, and each extent is read back or released
+   exactly once. a file is reused from the start, or deleted, once every extent
+   written to it is gone */
+struct spill;
+struct spill_file;
+
+/* where an extent was written */
+struct spill_extent {
+  struct spill_file *file;
+  long offset;
+  size_t length;
+};
+
+/* set the directory spill files are created in. spilling is disabled until
+   this has been called. returns 0 on failure */
+int spill_startup(const char *directory);
+void spill_shutdown(void);
+int spill_is_enabled(void);
+
+/* create a set of spill files, named after name. returns NULL on failure */
+struct spill *spill_new(const char *name);
+
+/* close and delete every file. any extents still written are lost */
+void spill_free(struct spill *spill);
+
+/* append data to the current file, starting a new file once it is full.
+   returns 0 on failure */
+int spill_write(struct spill *spill, const void *data, size_t length,
+                struct spill_extent *extent);
+
+/* read an extent into data, which must hold extent->length bytes. the extent
+   is released whether or not the read succeeds. returns 0 on failure */
+int spill_read(struct spill_extent *extent, void *data);
+
+/* read an extent into data without releasing it. returns 0 on failure */
+int spill_peek(const struct spill_extent *extent, void *data);
+
+/* give up an extent without reading it */
+void spill_release(struct spill_extent *extent);
+
+/* while held, a file that was written to is never started over, so extents
+   that have been released can still be read by a snapshot being written in
+   the background. holds are counted, each spill_hold(1) is matched with a
+   spill_hold(0) */
+void spill_hold(int hold);
+
+/* number of spill files open, and the bytes written to them that have not
+   been read back or released */
+size_t spill_get_files(void);
+size_t spill_get_bytes(void);
+
+#endif
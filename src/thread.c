@@ -0,0 +1,174 @@
+/*
+  Copyright (c) 2021 Matthew (fkfv).
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#include "thread.h"
+#include "thread-internal.h"
+
+#ifdef _WIN32
+DWORD WINAPI thread_main_(LPVOID arg)
+#else
+void *thread_main_(void *arg)
+#endif
+{
+  struct thread *thread = arg;
+
+  thread->fn(thread->arg);
+
+#ifdef _WIN32
+  return 0;
+#else
+  return NULL;
+#endif
+}
+
+int thread_start(struct thread *thread, void (*fn)(void *), void *arg)
+{
+  thread->fn = fn;
+  thread->arg = arg;
+
+#ifdef _WIN32
+  thread->handle = CreateThread(NULL, 0, thread_main_, thread, 0, NULL);
+  return thread->handle != NULL;
+#else
+  return pthread_create(&thread->handle, NULL, thread_main_, thread) == 0;
+#endif
+}
+
+void thread_join(struct thread *thread)
+{
+#ifdef _WIN32
+  WaitForSingleObject(thread->handle, INFINITE);
+  CloseHandle(thread->handle);
+#else
+  pthread_join(thread->handle, NULL);
+#endif
+}
+
+int thread_mutex_init(struct thread_mutex *mutex)
+{
+#ifdef _WIN32
+  InitializeSRWLock(&mutex->lock);
+  return 1;
+#else
+  return pthread_mutex_init(&mutex->lock, NULL) == 0;
+#endif
+}
+
+void thread_mutex_free(struct thread_mutex *mutex)
+{
+#ifndef _WIN32
+  pthread_mutex_destroy(&mutex->lock);
+#endif
+}
+
+void thread_mutex_lock(struct thread_mutex *mutex)
+{
+#ifdef _WIN32
+  AcquireSRWLockExclusive(&mutex->lock);
+#else
+  pthread_mutex_lock(&mutex->lock);
+#endif
+}
+
+void thread_mutex_unlock(struct thread_mutex *mutex)
+{
+#ifdef _WIN32
+  ReleaseSRWLockExclusive(&mutex->lock);
+#else
+  pthread_mutex_unlock(&mutex->lock);
+#endif
+}
+
+int thread_cond_init(struct thread_cond *cond)
+{
+#ifdef _WIN32
+  InitializeConditionVariable(&cond->cond);
+  return 1;
+#else
+  return pthread_cond_init(&cond->cond, NULL) == 0;
+#endif
+}
+
+void thread_cond_free(struct thread_cond *cond)
+{
+#ifndef _WIN32
+  pthread_cond_destroy(&cond->cond);
+#endif
+}
+
+void thread_cond_wait(struct thread_cond *cond, struct thread_mutex *mutex)
+{
+#ifdef _WIN32
+  SleepConditionVariableSRW(&cond->cond, &mutex->lock, INFINITE, 0);
+#else
+  pthread_cond_wait(&cond->cond, &mutex->lock);
+#endif
+}
+
+void thread_cond_signal(struct thread_cond *cond)
+{
+#ifdef _WIN32
+  WakeConditionVariable(&cond->cond);
+#else
+  pthread_cond_signal(&cond->cond);
+#endif
+}
+
+void thread_cond_broadcast(struct thread_cond *cond)
+{
+#ifdef _WIN32
+  WakeAllConditionVariable(&cond->cond);
+#else
+  pthread_cond_broadcast(&cond->cond);
+#endif
+}
+
+unsigned long long thread_atomic_load(volatile unsigned long long *value)
+{
+#ifdef _WIN32
+  return (unsigned long long)InterlockedCompareExchange64(
+    (volatile LONG64 *)value, 0, 0);
+#else
+  return __atomic_load_n(value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+void thread_atomic_store(volatile unsigned long long *value,
+                         unsigned long long set)
+{
+#ifdef _WIN32
+  InterlockedExchange64((volatile LONG64 *)value, (LONG64)set);
+#else
+  __atomic_store_n(value, set, __ATOMIC_SEQ_CST);
+#endif
+}
+
+unsigned long long thread_atomic_add(volatile unsigned long long *value,
+                                     unsigned long long add)
+{
+#ifdef _WIN32
+  return (unsigned long long)InterlockedExchangeAdd64(
+    (volatile LONG64 *)value, (LONG64)add) + add;
+#else
+  return __atomic_add_fetch(value, add, __ATOMIC_SEQ_CST);
+#endif
+}
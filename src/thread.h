@@ -0,0 +1,90 @@
+/*
+  Copyright (c) 2021 Matthew (fkfv).
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#ifndef THREAD_H
+#define THREAD_H
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+/* the few threading primitives needed to move blocking work off the event
+   loop, on top of pthreads or windows threads */
+struct thread {
+#ifdef _WIN32
+  HANDLE handle;
+#else
+  pthread_t handle;
+#endif
+
+  void (*fn)(void *);
+  void *arg;
+};
+
+struct thread_mutex {
+#ifdef _WIN32
+  SRWLOCK lock;
+#else
+  pthread_mutex_t lock;
+#endif
+};
+
+struct thread_cond {
+#ifdef _WIN32
+  CONDITION_VARIABLE cond;
+#else
+  pthread_cond_t cond;
+#endif
+};
+
+/* run fn(arg) on a new thread. returns 0 on failure */
+int thread_start(struct thread *thread, void (*fn)(void *), void *arg);
+
+/* wait for a thread to return */
+void thread_join(struct thread *thread);
+
+/* returns 0 on failure */
+int thread_mutex_init(struct thread_mutex *mutex);
+void thread_mutex_free(struct thread_mutex *mutex);
+void thread_mutex_lock(struct thread_mutex *mutex);
+void thread_mutex_unlock(struct thread_mutex *mutex);
+
+/* returns 0 on failure */
+int thread_cond_init(struct thread_cond *cond);
+void thread_cond_free(struct thread_cond *cond);
+
+/* wait on a condition, mutex must be held and is held again on return. the
+   wait may end early, the condition should be checked again */
+void thread_cond_wait(struct thread_cond *cond, struct thread_mutex *mutex);
+void thread_cond_signal(struct thread_cond *cond);
+void thread_cond_broadcast(struct thread_cond *cond);
+
+/* sequentially consistent operations on a counter shared between threads */
+unsigned long long thread_atomic_load(volatile unsigned long long *value);
+void thread_atomic_store(volatile unsigned long long *value,
+                         unsigned long long set);
+unsigned long long thread_atomic_add(volatile unsigned long long *value,
+                                     unsigned long long add);
+
+#endif
@@ -0,0 +1,89 @@
+/*
+  Copyright (c) 2021 Matthew (fkfv).
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#ifndef TIMER_INTERNAL_H
+#define TIMER_INTERNAL_H
+
+#include <event2/event.h>
+#include "queue-compat.h"
+#include "timer.h"
+
+/* milliseconds in each tick of the wheel */
+#define TIMER_TICK 10
+
+/* the wheel is made of TIMER_LEVELS levels of TIMER_SLOTS slots. every slot in
+   a level covers all of the slots in the level below it, so the wheel can
+   schedule up to 2^(TIMER_LEVELS * TIMER_SLOT_BITS) ticks ahead */
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 8
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_SLOT_MASK (TIMER_SLOTS - 1)
+
+/* most callbacks run each time the wheel is advanced. anything left over is
+   run on the next pass through the event loop, so a large number of entries
+   expiring together cannot hold up other events */
+#define TIMER_BUDGET 1024
+
+/* longest delay that can be scheduled, in ticks. longer delays are shortened
+   to this */
+#define TIMER_MAX_TICKS ((1ULL << (TIMER_LEVELS * TIMER_SLOT_BITS)) - 1)
+
+LIST_HEAD(tehead, timer_entry);
+
+struct timer_context {
+  /* libevent timer that advances the wheel while entries are scheduled */
+  struct event_base *base;
+  struct event *event;
+
+  /* next tick to be processed */
+  unsigned long long tick;
+
+  /* number of scheduled entries */
+  size_t count;
+
+  /* expired entries waiting for their callback to be run */
+  struct tehead pending;
+
+  struct tehead wheel[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+/* the global context instance */
+extern struct timer_context timer_context_;
+
+/* place an entry in the slot for its expiry tick */
+void timer_add_(struct timer_entry *entry);
+
+/* move every entry in a slot down to the levels below it. returns the index of
+   the slot, so the next level only needs to cascade when this is 0 */
+int timer_cascade_(int level, int index);
+
+/* process every tick up to the current time, running at most TIMER_BUDGET
+   callbacks. returns 1 if it stopped before catching up */
+int timer_advance_(void);
+
+/* libevent callback for the wheel timer */
+void timer_event_cb_(evutil_socket_t fd, short events, void *arg);
+
+/* make sure the libevent timer is running while there are entries */
+void timer_update_event_(void);
+
+#endif
@@ -0,0 +1,302 @@
+/*
+  Copyright (c) 2021 Matthew (fkfv).
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include <event2/util.h>
+
+#include "timer.h"
+#include "timer-internal.h"
+
+struct timer_context timer_context_;
+
+int timer_startup(struct event_base *base)
+{
+  int level;
+  int index;
+
+  timer_context_.event = event_new(base, -1, EV_PERSIST, timer_event_cb_,
+                                   NULL);
+  if (!timer_context_.event) {
+    return 0;
+  }
+
+  for (level = 0; level < TIMER_LEVELS; level++) {
+    for (index = 0; index < TIMER_SLOTS; index++) {
+      LIST_INIT(&timer_context_.wheel[level][index]);
+    }
+  }
+
+  LIST_INIT(&timer_context_.pending);
+
+  timer_context_.base = base;
+  timer_context_.tick = timer_now() / TIMER_TICK;
+  timer_context_.count = 0;
+
+  return 1;
+}
+
+void timer_shutdown(void)
+{
+  if (timer_context_.event) {
+    event_free(timer_context_.event);
+  }
+
+  timer_context_.event = NULL;
+  timer_context_.base = NULL;
+}
+
+struct event_base *timer_get_base(void)
+{
+  return timer_context_.base;
+}
+
+void timer_entry_init(struct timer_entry *entry,
+                      void (*cb)(struct timer_entry *, void *), void *arg)
+{
+  entry->expires = 0;
+  entry->cb = cb;
+  entry->cbarg = arg;
+  entry->scheduled = 0;
+}
+
+int timer_schedule(struct timer_entry *entry, unsigned long long delay)
+{
+  unsigned long long now;
+  unsigned long long expires;
+
+  if (!timer_context_.event) {
+    return -1;
+  }
+
+  if (entry->scheduled) {
+    LIST_REMOVE(entry, next);
+    timer_context_.count--;
+  }
+
+  now = timer_now();
+
+  /* nothing is waiting so there are no ticks to catch up on */
+  if (timer_context_.count == 0) {
+    timer_context_.tick = now / TIMER_TICK;
+  }
+
+  /* round up so the entry never expires early */
+  if (delay > TIMER_MAX_TICKS * TIMER_TICK) {
+    delay = TIMER_MAX_TICKS * TIMER_TICK;
+  }
+
+  expires = (now + delay + TIMER_TICK - 1) / TIMER_TICK;
+  if (expires > timer_context_.tick + TIMER_MAX_TICKS) {
+    expires = timer_context_.tick + TIMER_MAX_TICKS;
+  }
+
+  entry->expires = expires;
+  entry->scheduled = 1;
+  timer_add_(entry);
+  timer_context_.count++;
+
+  timer_update_event_();
+
+  return 0;
+}
+
+void timer_cancel(struct timer_entry *entry)
+{
+  if (!entry->scheduled) {
+    return;
+  }
+
+  LIST_REMOVE(entry, next);
+  entry->scheduled = 0;
+  timer_context_.count--;
+
+  timer_update_event_();
+}
+
+int timer_is_scheduled(struct timer_entry *entry)
+{
+  return entry->scheduled;
+}
+
+unsigned long long timer_get_remaining(struct timer_entry *entry)
+{
+  unsigned long long now = timer_now();
+
+  if (!entry->scheduled || entry->expires * TIMER_TICK <= now) {
+    return 0;
+  }
+
+  return entry->expires * TIMER_TICK - now;
+}
+
+unsigned long long timer_now(void)
+{
+#ifdef _WIN32
+  return GetTickCount64();
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+unsigned long long timer_unix_now(void)
+{
+  struct timeval tv;
+
+  evutil_gettimeofday(&tv, NULL);
+
+  return (unsigned long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+size_t timer_get_count(void)
+{
+  return timer_context_.count;
+}
+
+void timer_add_(struct timer_entry *entry)
+{
+  unsigned long long expires = entry->expires;
+  unsigned long long delta;
+  int level;
+
+  /* anything overdue goes in the next slot to be processed */
+  if (expires < timer_context_.tick) {
+    expires = timer_context_.tick;
+  }
+
+  delta = expires - timer_context_.tick;
+
+  for (level = 0; level < TIMER_LEVELS - 1; level++) {
+    if (delta < 1ULL << ((level + 1) * TIMER_SLOT_BITS)) {
+      break;
+    }
+  }
+
+  LIST_INSERT_HEAD(&timer_context_.wheel[level][
+                     (expires >> (level * TIMER_SLOT_BITS)) & TIMER_SLOT_MASK],
+                   entry, next);
+}
+
+int timer_cascade_(int level, int index)
+{
+  struct tehead *slot = &timer_context_.wheel[level][index];
+  struct timer_entry *entry;
+
+  while ((entry = LIST_FIRST(slot)) != NULL) {
+    LIST_REMOVE(entry, next);
+    timer_add_(entry);
+  }
+
+  return index;
+}
+
+int timer_advance_(void)
+{
+  unsigned long long now = timer_now() / TIMER_TICK;
+  struct timer_entry *entry;
+  struct tehead *slot;
+  int budget = TIMER_BUDGET;
+  int level;
+  int index;
+
+  while (budget > 0) {
+    entry = LIST_FIRST(&timer_context_.pending);
+    if (entry) {
+      LIST_REMOVE(entry, next);
+      entry->scheduled = 0;
+      timer_context_.count--;
+
+      entry->cb(entry, entry->cbarg);
+      budget--;
+      continue;
+    }
+
+    if (timer_context_.tick > now || timer_context_.count == 0) {
+      break;
+    }
+
+    index = timer_context_.tick & TIMER_SLOT_MASK;
+
+    /* once the lowest level wraps around, pull the entries for the next lap
+       down from the levels above */
+    if (index == 0) {
+      for (level = 1; level < TIMER_LEVELS; level++) {
+        if (timer_cascade_(level, (timer_context_.tick >>
+                                   (level * TIMER_SLOT_BITS)) &
+                                  TIMER_SLOT_MASK) != 0) {
+          break;
+        }
+      }
+    }
+
+    /* entries scheduled from a callback land in a later slot since the tick
+       has already moved on */
+    timer_context_.tick++;
+
+    slot = &timer_context_.wheel[0][index];
+    while ((entry = LIST_FIRST(slot)) != NULL) {
+      LIST_REMOVE(entry, next);
+      LIST_INSERT_HEAD(&timer_context_.pending, entry, next);
+    }
+  }
+
+  return !LIST_EMPTY(&timer_context_.pending) ||
+         (timer_context_.count > 0 && timer_context_.tick <= now);
+}
+
+void timer_event_cb_(evutil_socket_t fd, short events, void *arg)
+{
+  int behind;
+
+  behind = timer_advance_();
+  timer_update_event_();
+
+  /* ran out of budget, carry on after other events have had a chance */
+  if (behind) {
+    event_active(timer_context_.event, EV_TIMEOUT, 0);
+  }
+}
+
+void timer_update_event_(void)
+{
+  struct timeval tv;
+
+  if (!timer_context_.event) {
+    return;
+  }
+
+  if (timer_context_.count == 0) {
+    event_del(timer_context_.event);
+  } else if (!event_pending(timer_context_.event, EV_TIMEOUT, NULL)) {
+    tv.tv_sec = 0;
+    tv.tv_usec = TIMER_TICK * 1000;
+    event_add(timer_context_.event, &tv);
+  }
+}
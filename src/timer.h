@@ -0,0 +1,75 @@
+/*
+  Copyright (c) 2021 Matthew (fkfv).
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <event2/event.h>
+#include "queue-compat.h"
+
+/* a timer on the shared timing wheel. this should be embedded in the structure
+   that needs the timer and set up with timer_entry_init */
+struct timer_entry {
+  LIST_ENTRY(timer_entry) next;
+
+  /* tick the timer expires on */
+  unsigned long long expires;
+
+  /* called once the timer expires. the entry is no longer scheduled when the
+     callback runs, so it can be scheduled again or freed */
+  void (*cb)(struct timer_entry *, void *);
+  void *cbarg;
+
+  /* is the entry currently on the wheel */
+  int scheduled;
+};
+
+/* start the timing wheel on a libevent base. returns 0 on failure */
+int timer_startup(struct event_base *base);
+void timer_shutdown(void);
+
+/* the base the timing wheel was started on */
+struct event_base *timer_get_base(void);
+
+void timer_entry_init(struct timer_entry *entry,
+                      void (*cb)(struct timer_entry *, void *), void *arg);
+
+/* schedule an entry to expire after delay milliseconds, replacing any time it
+   was already scheduled for. returns -1 if the wheel has not been started */
+int timer_schedule(struct timer_entry *entry, unsigned long long delay);
+void timer_cancel(struct timer_entry *entry);
+int timer_is_scheduled(struct timer_entry *entry);
+
+/* milliseconds until a scheduled entry expires, 0 if it is due */
+unsigned long long timer_get_remaining(struct timer_entry *entry);
+
+/* milliseconds from an arbitrary point that never goes backwards */
+unsigned long long timer_now(void);
+
+/* milliseconds since the unix epoch. this can go backwards, so it should only
+   be used for times that have to survive a restart */
+unsigned long long timer_unix_now(void);
+
+/* number of entries currently scheduled */
+size_t timer_get_count(void);
+
+#endif
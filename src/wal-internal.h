@@ -0,0 +1,224 @@
+/*
+  Copyright (c) 2021 Matthew (fkfv).
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#ifndef WAL_INTERNAL_H
+#define WAL_INTERNAL_H
+
+#include <stdio.h>
+#include <event2/event.h>
+#include <event2/util.h>
+#include "queue-compat.h"
+#include "thread.h"
+#include "wal.h"
+
+/* written at the start of every log, followed by the snapshot epoch */
+#define WAL_MAGIC "DQWAL001"
+#define WAL_MAGIC_LEN 8
+
+/* a batch is written early once it grows past this, so writing out a large
+   state does not hold it all in memory */
+#define WAL_BATCH_MAX (1024 * 1024)
+
+/* records are padded so the data handed back by wal_reserve and to the
+   replay callback can be read in place */
+#define WAL_ALIGN(length) (((length) + 7) & ~(size_t)7)
+
+/* batches that can be waiting for the log thread. the event loop only waits
+   for the thread once this many are waiting */
+#define WAL_RING_SIZE 256
+
+/* latencies are counted in buckets of powers of two microseconds */
+#define WAL_HISTOGRAM_BUCKETS 40
+
+/* a batch starts with the length of its records and their checksum. a batch
+   is only replayed if all of it made it to disk */
+struct wal_batch {
+  unsigned int length;
+  unsigned int checksum;
+};
+
+/* each record starts with the length of the data after it and its type */
+struct wal_header {
+  unsigned int length;
+  unsigned int type;
+};
+
+/* a batch handed to the log thread. a job without a buffer only syncs what
+   has been written */
+struct wal_job {
+  unsigned char *buffer;
+  size_t length;
+
+  /* number of the job, and when it was handed over in microseconds */
+  unsigned long long sequence;
+  unsigned long long submitted;
+
+  /* is the log synced once the batch is written */
+  int sync;
+};
+
+struct wal_waiter {
+  TAILQ_ENTRY(wal_waiter) next;
+
+  /* the job that has to reach disk first */
+  unsigned long long sequence;
+
+  void (*cb)(void *);
+  void *arg;
+};
+
+/* each bucket is only added to by one thread */
+struct wal_histogram {
+  volatile unsigned long long buckets[WAL_HISTOGRAM_BUCKETS];
+  volatile unsigned long long max;
+};
+
+struct wal_context {
+  /* event written to at the end of each pass through the event loop, and the
+     timer syncing the log when the interval policy is used */
+  struct event *flush;
+  struct event *sync_timer;
+
+  FILE *fp;
+
+  /* branch written alongside the log while a snapshot is written in the
+     background, NULL if there is none */
+  FILE *branch;
+
+  /* was a batch not written to the branch, it can not be used */
+  int branch_failed;
+
+  /* path of the log, of the new log while it is being filled and of the
+     branch */
+  char *path;
+  char *new_path;
+  char *branch_path;
+
+  enum wal_sync sync;
+  unsigned long long interval;
+
+  /* records waiting to be written, starting with space for the batch */
+  unsigned char *buffer;
+  size_t length;
+  size_t size;
+
+  /* has anything been written since the last sync */
+  int dirty;
+
+  /* the thread writing batches, which sleeps on work once the ring is empty.
+     the event loop waits on idle for it to catch up */
+  struct thread thread;
+  int running;
+  int locks;
+  struct thread_mutex lock;
+  struct thread_cond work;
+  struct thread_cond idle;
+  volatile unsigned long long sleeping;
+  volatile unsigned long long stopping;
+
+  /* jobs from the event loop to the thread. the event loop adds jobs at tail
+     and the thread takes them from head, neither takes a lock */
+  struct wal_job ring[WAL_RING_SIZE];
+  volatile unsigned long long head;
+  volatile unsigned long long tail;
+
+  /* number of the last job handed over, and of the last one that reached
+     disk */
+  unsigned long long sequence;
+  volatile unsigned long long durable;
+
+  /* batches that failed to be written to the log, and how many of them had
+     been seen the last time the thread caught up */
+  volatile unsigned long long errors;
+  unsigned long long errors_seen;
+
+  /* replies waiting for the disk, in the order of the jobs they wait on. the
+     thread writes to wake once a job has reached disk while waiting is set,
+     waking complete on the event loop */
+  TAILQ_HEAD(wwhead, wal_waiter) waiters;
+  volatile unsigned long long waiting;
+  evutil_socket_t wake[2];
+  struct event *complete;
+
+  volatile unsigned long long batches;
+  unsigned long long records;
+  volatile unsigned long long bytes;
+  volatile unsigned long long syncs;
+  volatile unsigned long long failures;
+
+  struct wal_histogram submit;
+  struct wal_histogram commit;
+};
+
+/* the global context instance */
+extern struct wal_context wal_context_;
+
+/* hand the waiting batch to the log thread, which syncs it if the policy
+   asks for it. returns 0 on failure */
+int wal_flush_(void);
+
+/* hand a job to the log thread, waiting for room in the ring if it is
+   full */
+void wal_submit_(const struct wal_job *job);
+
+/* hand over the waiting batch and wait for the log thread to finish every
+   job. the log can be used from the event loop until the next job is handed
+   over. returns 0 if a batch failed to be written since the last time */
+int wal_drain_(void);
+
+/* sync everything written so far, from the log thread or once it has been
+   drained. returns 0 on failure */
+int wal_sync_(void);
+
+/* the log thread, and how it writes a job */
+void wal_thread_(void *arg);
+void wal_write_(struct wal_job *job);
+
+/* libevent callbacks handing over the batch, syncing on the interval and
+   releasing replies once their jobs have reached disk */
+void wal_flush_cb_(evutil_socket_t fd, short events, void *arg);
+void wal_sync_cb_(evutil_socket_t fd, short events, void *arg);
+void wal_complete_cb_(evutil_socket_t fd, short events, void *arg);
+
+/* microseconds from an arbitrary point */
+unsigned long long wal_now_(void);
+
+/* count a latency in a histogram, and read its percentiles */
+void wal_histogram_add_(struct wal_histogram *histogram,
+                        unsigned long long latency);
+void wal_histogram_get_(struct wal_histogram *histogram,
+                        struct wal_latency *latency);
+
+/* open a log at path, writing its header. returns NULL on failure */
+FILE *wal_create_(const char *path, unsigned long long epoch);
+
+/* read the epoch of the log at path. returns 0 if it is not a log */
+int wal_read_epoch_(FILE *fp, unsigned long long *epoch);
+
+/* move a branch left behind by a background snapshot over the log at path if
+   it follows on from epoch, or delete it. returns 0 on failure */
+int wal_recover_(const char *path, unsigned long long epoch);
+
+/* checksum of a batch */
+unsigned int wal_checksum_(const unsigned char *data, size_t length);
+
+#endif
@@ -0,0 +1,930 @@
+/*
+  Copyright (c) 2021 Matthew (fkfv).
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#ifdef _WIN32
+#include <io.h>
+#define fsync(fd) _commit(fd)
+#define fileno _fileno
+#else
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wal.h"
+#include "wal-internal.h"
+#include "strcase.h"
+
+struct wal_context wal_context_;
+
+int wal_startup(struct event_base *base, const char *path,
+                unsigned long long epoch, enum wal_sync sync,
+                unsigned long long interval)
+{
+  wal_context_.path = strdup(path);
+  wal_context_.new_path = malloc(strlen(path) + 4/*.new*/ + 1/*NULL*/);
+  wal_context_.branch_path = malloc(strlen(path) + 5/*.next*/ + 1/*NULL*/);
+  if (!wal_context_.path || !wal_context_.new_path ||
+      !wal_context_.branch_path) {
+    goto error;
+  }
+
+  sprintf(wal_context_.new_path, "%s.new", path);
+  sprintf(wal_context_.branch_path, "%s.next", path);
+
+  if (!thread_mutex_init(&wal_context_.lock)) {
+    goto error;
+  }
+
+  if (!thread_cond_init(&wal_context_.work)) {
+    thread_mutex_free(&wal_context_.lock);
+    goto error;
+  }
+
+  if (!thread_cond_init(&wal_context_.idle)) {
+    thread_cond_free(&wal_context_.work);
+    thread_mutex_free(&wal_context_.lock);
+    goto error;
+  }
+
+  wal_context_.locks = 1;
+  TAILQ_INIT(&wal_context_.waiters);
+
+  /* the log thread wakes the event loop through a socket, the only way to
+     wake it from another thread without libevent's own locking */
+  wal_context_.wake[0] = -1;
+  wal_context_.wake[1] = -1;
+  if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, wal_context_.wake) != 0 ||
+      evutil_make_socket_nonblocking(wal_context_.wake[0]) != 0 ||
+      evutil_make_socket_nonblocking(wal_context_.wake[1]) != 0) {
+    goto error;
+  }
+
+  wal_context_.flush = event_new(base, -1, 0, wal_flush_cb_, NULL);
+  wal_context_.sync_timer = evtimer_new(base, wal_sync_cb_, NULL);
+  wal_context_.complete = event_new(base, wal_context_.wake[0],
+                                    EV_READ | EV_PERSIST, wal_complete_cb_,
+                                    NULL);
+  if (!wal_context_.flush || !wal_context_.sync_timer ||
+      !wal_context_.complete ||
+      event_add(wal_context_.complete, NULL) != 0) {
+    goto error;
+  }
+
+  wal_context_.fp = wal_create_(wal_context_.new_path, epoch);
+  if (!wal_context_.fp) {
+    goto error;
+  }
+
+  wal_context_.sync = sync;
+  wal_context_.interval = interval;
+
+  wal_context_.head = 0;
+  wal_context_.tail = 0;
+  wal_context_.sequence = 0;
+  wal_context_.durable = 0;
+  wal_context_.stopping = 0;
+
+  if (!thread_start(&wal_context_.thread, wal_thread_, NULL)) {
+    goto error;
+  }
+
+  wal_context_.running = 1;
+  return 1;
+
+error:
+  wal_shutdown();
+  return 0;
+}
+
+void wal_shutdown(void)
+{
+  struct wal_waiter *waiter;
+
+  if (wal_context_.running) {
+    wal_drain_();
+
+    thread_mutex_lock(&wal_context_.lock);
+    thread_atomic_store(&wal_context_.stopping, 1);
+    thread_cond_signal(&wal_context_.work);
+    thread_mutex_unlock(&wal_context_.lock);
+
+    thread_join(&wal_context_.thread);
+    wal_context_.running = 0;
+  }
+
+  /* everything has been written, so nothing has to wait any more */
+  if (wal_context_.locks) {
+    while ((waiter = TAILQ_FIRST(&wal_context_.waiters)) != NULL) {
+      TAILQ_REMOVE(&wal_context_.waiters, waiter, next);
+      waiter->cb(waiter->arg);
+      free(waiter);
+    }
+  }
+
+  if (wal_context_.fp) {
+    if (wal_context_.dirty) {
+      wal_sync_();
+    }
+
+    /* the snapshot the branch was for can no longer be finished */
+    wal_branch_abort();
+
+    fclose(wal_context_.fp);
+    wal_context_.fp = NULL;
+  }
+
+  if (wal_context_.flush) {
+    event_free(wal_context_.flush);
+    wal_context_.flush = NULL;
+  }
+
+  if (wal_context_.sync_timer) {
+    event_free(wal_context_.sync_timer);
+    wal_context_.sync_timer = NULL;
+  }
+
+  if (wal_context_.complete) {
+    event_free(wal_context_.complete);
+    wal_context_.complete = NULL;
+  }
+
+  if (wal_context_.locks && wal_context_.wake[0] >= 0) {
+    evutil_closesocket(wal_context_.wake[0]);
+    evutil_closesocket(wal_context_.wake[1]);
+    wal_context_.wake[0] = -1;
+    wal_context_.wake[1] = -1;
+  }
+
+  if (wal_context_.locks) {
+    thread_cond_free(&wal_context_.idle);
+    thread_cond_free(&wal_context_.work);
+    thread_mutex_free(&wal_context_.lock);
+    wal_context_.locks = 0;
+  }
+
+  free(wal_context_.buffer);
+  free(wal_context_.branch_path);
+  free(wal_context_.new_path);
+  free(wal_context_.path);
+
+  wal_context_.buffer = NULL;
+  wal_context_.length = 0;
+  wal_context_.size = 0;
+  wal_context_.branch_path = NULL;
+  wal_context_.new_path = NULL;
+  wal_context_.path = NULL;
+}
+
+int wal_is_enabled(void)
+{
+  return wal_context_.fp != NULL;
+}
+
+int wal_is_durable(void)
+{
+  if (!wal_context_.fp || wal_context_.sync != wal_sync_always) {
+    return 1;
+  }
+
+  return wal_context_.length == 0 &&
+         thread_atomic_load(&wal_context_.durable) >= wal_context_.sequence;
+}
+
+struct wal_waiter *wal_wait(void (*cb)(void *), void *arg)
+{
+  struct wal_waiter *waiter;
+  unsigned long long sequence = wal_context_.sequence;
+
+  if (!wal_context_.fp || wal_context_.sync != wal_sync_always) {
+    return NULL;
+  }
+
+  /* the waiting batch is the next job handed over */
+  if (wal_context_.length > 0) {
+    sequence++;
+  }
+
+  /* the thread only wakes the event loop once it sees waiting set, so the
+     job is checked again after setting it */
+  thread_atomic_store(&wal_context_.waiting, 1);
+  if (thread_atomic_load(&wal_context_.durable) >= sequence) {
+    return NULL;
+  }
+
+  waiter = malloc(sizeof(struct wal_waiter));
+  if (!waiter) {
+    return NULL;
+  }
+
+  waiter->sequence = sequence;
+  waiter->cb = cb;
+  waiter->arg = arg;
+
+  TAILQ_INSERT_TAIL(&wal_context_.waiters, waiter, next);
+  return waiter;
+}
+
+void wal_wait_cancel(struct wal_waiter *waiter)
+{
+  TAILQ_REMOVE(&wal_context_.waiters, waiter, next);
+  free(waiter);
+}
+
+int wal_replace(void)
+{
+  if (!wal_drain_() || !wal_sync_()) {
+    return 0;
+  }
+
+  fclose(wal_context_.fp);
+  wal_context_.fp = NULL;
+
+#ifdef _WIN32
+  /* windows will not rename over an existing file */
+  remove(wal_context_.path);
+#endif
+
+  if (rename(wal_context_.new_path, wal_context_.path) != 0) {
+    return 0;
+  }
+
+  wal_context_.fp = fopen(wal_context_.path, "ab");
+  return wal_context_.fp != NULL;
+}
+
+int wal_branch(unsigned long long epoch)
+{
+  if (!wal_context_.fp || wal_context_.branch) {
+    return 0;
+  }
+
+  /* the thread does not touch the log again until the next job */
+  wal_drain_();
+
+  wal_context_.branch = wal_create_(wal_context_.branch_path, epoch);
+  if (!wal_context_.branch) {
+    return 0;
+  }
+
+  wal_context_.branch_failed = 0;
+  return 1;
+}
+
+int wal_branch_commit(void)
+{
+  if (!wal_context_.branch) {
+    return 0;
+  }
+
+  wal_drain_();
+  if (wal_context_.branch_failed || !wal_sync_()) {
+    return 0;
+  }
+
+#ifdef _WIN32
+  /* windows will not rename over an existing file, or one that is open */
+  fclose(wal_context_.fp);
+  wal_context_.fp = NULL;
+  remove(wal_context_.path);
+#endif
+
+  if (rename(wal_context_.branch_path, wal_context_.path) != 0) {
+    return 0;
+  }
+
+  if (wal_context_.fp) {
+    fclose(wal_context_.fp);
+  }
+
+  wal_context_.fp = wal_context_.branch;
+  wal_context_.branch = NULL;
+
+  return 1;
+}
+
+void wal_branch_abort(void)
+{
+  if (!wal_context_.branch) {
+    return;
+  }
+
+  wal_drain_();
+
+  fclose(wal_context_.branch);
+  wal_context_.branch = NULL;
+
+  remove(wal_context_.branch_path);
+}
+
+int wal_restart(unsigned long long epoch)
+{
+  if (!wal_context_.fp) {
+    return 0;
+  }
+
+  /* the waiting batch is dropped, the thread finishes what it was given */
+  wal_context_.length = 0;
+  wal_branch_abort();
+  wal_drain_();
+
+  fclose(wal_context_.fp);
+  wal_context_.dirty = 0;
+
+  wal_context_.fp = wal_create_(wal_context_.new_path, epoch);
+  return wal_context_.fp != NULL;
+}
+
+void *wal_reserve(enum wal_record type, size_t length)
+{
+  struct wal_header header = {0};
+  unsigned char *buffer;
+  size_t padded = WAL_ALIGN(length);
+  size_t needed;
+
+  if (!wal_context_.fp) {
+    return NULL;
+  }
+
+  /* a large batch is written straight away instead of growing any further */
+  if (wal_context_.length + sizeof(struct wal_header) + padded >
+      WAL_BATCH_MAX && !wal_flush_()) {
+    return NULL;
+  }
+
+  needed = sizeof(struct wal_header) + padded;
+  if (wal_context_.length == 0) {
+    needed += sizeof(struct wal_batch);
+  }
+
+  if (wal_context_.length + needed > wal_context_.size) {
+    buffer = realloc(wal_context_.buffer, wal_context_.length + needed +
+                                          WAL_BATCH_MAX / 16);
+    if (!buffer) {
+      return NULL;
+    }
+
+    wal_context_.buffer = buffer;
+    wal_context_.size = wal_context_.length + needed + WAL_BATCH_MAX / 16;
+  }
+
+  /* the first record of a batch makes sure it gets written */
+  if (wal_context_.length == 0) {
+    wal_context_.length = sizeof(struct wal_batch);
+    event_active(wal_context_.flush, EV_WRITE, 0);
+  }
+
+  header.length = (unsigned int)length;
+  header.type = (unsigned int)type;
+  memcpy(wal_context_.buffer + wal_context_.length, &header,
+         sizeof(struct wal_header));
+
+  buffer = wal_context_.buffer + wal_context_.length +
+           sizeof(struct wal_header);
+  memset(buffer + length, 0, padded - length);
+  wal_context_.length += sizeof(struct wal_header) + padded;
+  wal_context_.records++;
+
+  return buffer;
+}
+
+void *wal_reserve_callback(int type, size_t length, void *arg)
+{
+  return wal_reserve((enum wal_record)type, length);
+}
+
+int wal_replay(const char *path, unsigned long long epoch,
+               int (*cb)(enum wal_record, const void *, size_t, void *),
+               void *arg)
+{
+  struct wal_header header;
+  struct wal_batch batch;
+  unsigned char *buffer = NULL;
+  unsigned char *resized;
+  unsigned long long started;
+  size_t offset;
+  size_t size = 0;
+  FILE *fp;
+  int result = 0;
+
+  if (!wal_recover_(path, epoch)) {
+    return 0;
+  }
+
+  fp = fopen(path, "rb");
+  if (!fp) {
+    /* nothing has been logged yet */
+    return 1;
+  }
+
+  if (!wal_read_epoch_(fp, &started)) {
+    goto cleanup;
+  }
+
+  if (started != epoch) {
+    result = 1;
+    goto cleanup;
+  }
+
+  /* anything after a torn batch was never acknowledged as written */
+  while (fread(&batch, sizeof(struct wal_batch), 1, fp) == 1) {
+    if (batch.length > size) {
+      resized = realloc(buffer, batch.length);
+      if (!resized) {
+        goto cleanup;
+      }
+
+      buffer = resized;
+      size = batch.length;
+    }
+
+    if (fread(buffer, 1, batch.length, fp) != batch.length ||
+        wal_checksum_(buffer, batch.length) != batch.checksum) {
+      break;
+    }
+
+    for (offset = 0;
+         offset + sizeof(struct wal_header) <= batch.length;
+         offset += sizeof(struct wal_header) + WAL_ALIGN(header.length)) {
+      memcpy(&header, buffer + offset, sizeof(struct wal_header));
+      if (WAL_ALIGN(header.length) > batch.length - offset -
+                                     sizeof(struct wal_header)) {
+        goto cleanup;
+      }
+
+      if (!cb((enum wal_record)header.type,
+              buffer + offset + sizeof(struct wal_header), header.length,
+              arg)) {
+        goto cleanup;
+      }
+    }
+  }
+
+  result = 1;
+
+cleanup:
+  free(buffer);
+  fclose(fp);
+
+  return result;
+}
+
+int wal_sync_from_string(const char *name, enum wal_sync *sync)
+{
+  if (!strcasecmp(name, "always")) {
+    *sync = wal_sync_always;
+  } else if (!strcasecmp(name, "interval")) {
+    *sync = wal_sync_interval;
+  } else if (!strcasecmp(name, "never")) {
+    *sync = wal_sync_never;
+  } else {
+    return 0;
+  }
+
+  return 1;
+}
+
+const char *wal_sync_to_string(enum wal_sync sync)
+{
+  switch (sync) {
+  case wal_sync_always:
+    return "always";
+  case wal_sync_interval:
+    return "interval";
+  default:
+    return "never";
+  }
+}
+
+void wal_get_stats(struct wal_stats *stats)
+{
+  stats->sync = wal_context_.sync;
+  stats->batches = thread_atomic_load(&wal_context_.batches);
+  stats->records = wal_context_.records;
+  stats->bytes = thread_atomic_load(&wal_context_.bytes);
+  stats->syncs = thread_atomic_load(&wal_context_.syncs);
+  stats->failures = thread_atomic_load(&wal_context_.failures);
+
+  wal_histogram_get_(&wal_context_.submit, &stats->submit);
+  wal_histogram_get_(&wal_context_.commit, &stats->commit);
+}
+
+int wal_flush_(void)
+{
+  struct wal_batch batch;
+  struct wal_job job;
+  struct timeval tv;
+
+  if (wal_context_.length == 0) {
+    return 1;
+  }
+
+  job.submitted = wal_now_();
+
+  batch.length = (unsigned int)(wal_context_.length -
+                                sizeof(struct wal_batch));
+  batch.checksum = wal_checksum_(wal_context_.buffer +
+                                 sizeof(struct wal_batch), batch.length);
+  memcpy(wal_context_.buffer, &batch, sizeof(struct wal_batch));
+
+  /* the thread frees the buffer once it has been written, the next batch is
+     started in a new one */
+  job.buffer = wal_context_.buffer;
+  job.length = wal_context_.length;
+  job.sequence = ++wal_context_.sequence;
+  job.sync = wal_context_.sync == wal_sync_always;
+
+  wal_context_.buffer = NULL;
+  wal_context_.length = 0;
+  wal_context_.size = 0;
+
+  wal_submit_(&job);
+  wal_histogram_add_(&wal_context_.submit, wal_now_() - job.submitted);
+
+  if (wal_context_.sync == wal_sync_interval &&
+      !evtimer_pending(wal_context_.sync_timer, NULL)) {
+    tv.tv_sec = (long)(wal_context_.interval / 1000);
+    tv.tv_usec = (long)(wal_context_.interval % 1000) * 1000;
+    evtimer_add(wal_context_.sync_timer, &tv);
+  }
+
+  return 1;
+}
+
+void wal_submit_(const struct wal_job *job)
+{
+  unsigned long long tail = wal_context_.tail;
+
+  /* the ring only fills up if the disk can not keep up */
+  if (tail - thread_atomic_load(&wal_context_.head) == WAL_RING_SIZE) {
+    thread_mutex_lock(&wal_context_.lock);
+    while (tail - thread_atomic_load(&wal_context_.head) == WAL_RING_SIZE) {
+      thread_cond_wait(&wal_context_.idle, &wal_context_.lock);
+    }
+    thread_mutex_unlock(&wal_context_.lock);
+  }
+
+  wal_context_.ring[tail % WAL_RING_SIZE] = *job;
+  thread_atomic_store(&wal_context_.tail, tail + 1);
+
+  /* the thread sets sleeping before it looks at the ring for the last time,
+     so either it sees the job or it is woken here */
+  if (thread_atomic_load(&wal_context_.sleeping)) {
+    thread_mutex_lock(&wal_context_.lock);
+    thread_cond_signal(&wal_context_.work);
+    thread_mutex_unlock(&wal_context_.lock);
+  }
+}
+
+int wal_drain_(void)
+{
+  unsigned long long errors;
+
+  wal_flush_();
+
+  thread_mutex_lock(&wal_context_.lock);
+  while (thread_atomic_load(&wal_context_.head) != wal_context_.tail) {
+    thread_cond_wait(&wal_context_.idle, &wal_context_.lock);
+  }
+  thread_mutex_unlock(&wal_context_.lock);
+
+  errors = thread_atomic_load(&wal_context_.errors);
+  if (errors != wal_context_.errors_seen) {
+    wal_context_.errors_seen = errors;
+    return 0;
+  }
+
+  return 1;
+}
+
+int wal_sync_(void)
+{
+  if (fsync(fileno(wal_context_.fp)) != 0) {
+    thread_atomic_add(&wal_context_.failures, 1);
+    return 0;
+  }
+
+  if (wal_context_.branch && !wal_context_.branch_failed &&
+      fsync(fileno(wal_context_.branch)) != 0) {
+    thread_atomic_add(&wal_context_.failures, 1);
+    wal_context_.branch_failed = 1;
+  }
+
+  thread_atomic_add(&wal_context_.syncs, 1);
+  wal_context_.dirty = 0;
+  return 1;
+}
+
+void wal_thread_(void *arg)
+{
+  unsigned long long head = thread_atomic_load(&wal_context_.head);
+  unsigned long long tail;
+
+  for (;;) {
+    tail = thread_atomic_load(&wal_context_.tail);
+    if (head == tail) {
+      thread_mutex_lock(&wal_context_.lock);
+      thread_atomic_store(&wal_context_.sleeping, 1);
+      while (thread_atomic_load(&wal_context_.tail) == head &&
+             !thread_atomic_load(&wal_context_.stopping)) {
+        thread_cond_wait(&wal_context_.work, &wal_context_.lock);
+      }
+      thread_atomic_store(&wal_context_.sleeping, 0);
+      thread_mutex_unlock(&wal_context_.lock);
+
+      /* the event loop drains the ring before stopping the thread */
+      if (thread_atomic_load(&wal_context_.tail) == head) {
+        return;
+      }
+
+      continue;
+    }
+
+    /* every job waiting is written before anyone is told about them */
+    while (head != tail) {
+      wal_write_(&wal_context_.ring[head % WAL_RING_SIZE]);
+      thread_atomic_store(&wal_context_.head, ++head);
+    }
+
+    thread_mutex_lock(&wal_context_.lock);
+    thread_cond_broadcast(&wal_context_.idle);
+    thread_mutex_unlock(&wal_context_.lock);
+
+    if (thread_atomic_load(&wal_context_.waiting)) {
+      send(wal_context_.wake[1], "", 1, 0);
+    }
+  }
+}
+
+void wal_write_(struct wal_job *job)
+{
+  /* the batch is dropped either way, there is no way to take back the
+     changes it records */
+  if (job->buffer) {
+    if (fwrite(job->buffer, 1, job->length,
+               wal_context_.fp) != job->length ||
+        fflush(wal_context_.fp) != 0) {
+      thread_atomic_add(&wal_context_.failures, 1);
+      thread_atomic_add(&wal_context_.errors, 1);
+    } else {
+      thread_atomic_add(&wal_context_.batches, 1);
+      thread_atomic_add(&wal_context_.bytes, job->length);
+      wal_context_.dirty = 1;
+    }
+
+    /* a branch missing a batch would lose it once it replaced the log */
+    if (wal_context_.branch && !wal_context_.branch_failed &&
+        (fwrite(job->buffer, 1, job->length,
+                wal_context_.branch) != job->length ||
+         fflush(wal_context_.branch) != 0)) {
+      thread_atomic_add(&wal_context_.failures, 1);
+      wal_context_.branch_failed = 1;
+    }
+
+    free(job->buffer);
+    job->buffer = NULL;
+  }
+
+  if (job->sync && wal_context_.dirty && !wal_sync_()) {
+    thread_atomic_add(&wal_context_.errors, 1);
+  }
+
+  if (job->submitted) {
+    wal_histogram_add_(&wal_context_.commit, wal_now_() - job->submitted);
+  }
+
+  thread_atomic_store(&wal_context_.durable, job->sequence);
+}
+
+void wal_flush_cb_(evutil_socket_t fd, short events, void *arg)
+{
+  wal_flush_();
+}
+
+void wal_sync_cb_(evutil_socket_t fd, short events, void *arg)
+{
+  struct wal_job job = {0};
+
+  if (wal_context_.fp) {
+    job.sequence = ++wal_context_.sequence;
+    job.sync = 1;
+    wal_submit_(&job);
+  }
+}
+
+void wal_complete_cb_(evutil_socket_t fd, short events, void *arg)
+{
+  struct wal_waiter *waiter;
+  unsigned long long durable;
+  char buffer[64];
+
+  while (recv(fd, buffer, sizeof(buffer), 0) > 0) {
+  }
+
+  /* a reply can wait again or stop another from waiting, so the first one is
+     looked at each time */
+  durable = thread_atomic_load(&wal_context_.durable);
+  while ((waiter = TAILQ_FIRST(&wal_context_.waiters)) != NULL &&
+         waiter->sequence <= durable) {
+    TAILQ_REMOVE(&wal_context_.waiters, waiter, next);
+    waiter->cb(waiter->arg);
+    free(waiter);
+  }
+
+  if (TAILQ_EMPTY(&wal_context_.waiters)) {
+    thread_atomic_store(&wal_context_.waiting, 0);
+  }
+}
+
+unsigned long long wal_now_(void)
+{
+#ifdef _WIN32
+  LARGE_INTEGER frequency;
+  LARGE_INTEGER counter;
+
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+
+  return (unsigned long long)(counter.QuadPart / frequency.QuadPart) *
+           1000000 +
+         (unsigned long long)(counter.QuadPart % frequency.QuadPart) *
+           1000000 / (unsigned long long)frequency.QuadPart;
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+void wal_histogram_add_(struct wal_histogram *histogram,
+                        unsigned long long latency)
+{
+  size_t bucket = 0;
+
+  /* bucket n holds latencies below 2^n microseconds */
+  while (bucket < WAL_HISTOGRAM_BUCKETS - 1 &&
+         latency >= (1ULL << bucket)) {
+    bucket++;
+  }
+
+  thread_atomic_add(&histogram->buckets[bucket], 1);
+  if (latency > thread_atomic_load(&histogram->max)) {
+    thread_atomic_store(&histogram->max, latency);
+  }
+}
+
+void wal_histogram_get_(struct wal_histogram *histogram,
+                        struct wal_latency *latency)
+{
+  unsigned long long counts[WAL_HISTOGRAM_BUCKETS];
+  unsigned long long seen = 0;
+  size_t bucket;
+
+  latency->count = 0;
+  for (bucket = 0; bucket < WAL_HISTOGRAM_BUCKETS; bucket++) {
+    counts[bucket] = thread_atomic_load(&histogram->buckets[bucket]);
+    latency->count += counts[bucket];
+  }
+
+  latency->p50 = 0;
+  latency->p99 = 0;
+  latency->p999 = 0;
+  latency->max = thread_atomic_load(&histogram->max);
+
+  /* each percentile is the top of the bucket it falls in */
+  for (bucket = 0; bucket < WAL_HISTOGRAM_BUCKETS; bucket++) {
+    seen += counts[bucket];
+    if (!latency->p50 && seen * 100 >= latency->count * 50) {
+      latency->p50 = 1ULL << bucket;
+    }
+
+    if (!latency->p99 && seen * 100 >= latency->count * 99) {
+      latency->p99 = 1ULL << bucket;
+    }
+
+    if (!latency->p999 && seen * 1000 >= latency->count * 999) {
+      latency->p999 = 1ULL << bucket;
+    }
+  }
+
+  /* the top of the last bucket can be well past anything counted in it */
+  if (latency->p50 > latency->max) {
+    latency->p50 = latency->max;
+  }
+
+  if (latency->p99 > latency->max) {
+    latency->p99 = latency->max;
+  }
+
+  if (latency->p999 > latency->max) {
+    latency->p999 = latency->max;
+  }
+}
+
+unsigned int wal_checksum_(const unsigned char *data, size_t length)
+{
+  unsigned int hash = 2166136261u;
+  size_t index;
+
+  /* fnv-1a, enough to catch a batch that was only partly written */
+  for (index = 0; index < length; index++) {
+    hash ^= data[index];
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+FILE *wal_create_(const char *path, unsigned long long epoch)
+{
+  FILE *fp;
+
+  fp = fopen(path, "wb");
+  if (!fp) {
+    return NULL;
+  }
+
+  if (fwrite(WAL_MAGIC, 1, WAL_MAGIC_LEN, fp) != WAL_MAGIC_LEN ||
+      fwrite(&epoch, sizeof(unsigned long long), 1, fp) != 1 ||
+      fflush(fp) != 0) {
+    fclose(fp);
+    return NULL;
+  }
+
+  return fp;
+}
+
+int wal_read_epoch_(FILE *fp, unsigned long long *epoch)
+{
+  char magic[WAL_MAGIC_LEN];
+
+  return fread(magic, 1, WAL_MAGIC_LEN, fp) == WAL_MAGIC_LEN &&
+         memcmp(magic, WAL_MAGIC, WAL_MAGIC_LEN) == 0 &&
+         fread(epoch, sizeof(unsigned long long), 1, fp) == 1;
+}
+
+int wal_recover_(const char *path, unsigned long long epoch)
+{
+  unsigned long long started;
+  char *branch_path;
+  FILE *fp;
+  int valid;
+  int result = 0;
+
+  branch_path = malloc(strlen(path) + 5/*.next*/ + 1/*NULL*/);
+  if (!branch_path) {
+    return 0;
+  }
+
+  sprintf(branch_path, "%s.next", path);
+
+  fp = fopen(branch_path, "rb");
+  if (!fp) {
+    /* no background snapshot was being written */
+    result = 1;
+    goto cleanup;
+  }
+
+  valid = wal_read_epoch_(fp, &started);
+  fclose(fp);
+
+  /* the snapshot was written before the branch replaced the log, which
+     follows on from the snapshot before it */
+  if (valid && started == epoch) {
+#ifdef _WIN32
+    remove(path);
+#endif
+    result = rename(branch_path, path) == 0;
+  } else {
+    result = remove(branch_path) == 0;
+  }
+
+cleanup:
+  free(branch_path);
+  return result;
+}
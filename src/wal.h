@@ -0,0 +1,156 @@
+/*
+  Copyright (c) 2021 Matthew (fkfv).
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#ifndef WAL_H
+#define WAL_H
+
+#include <stddef.h>
+#include <event2/event.h>
+
+/* when the log is flushed to disk */
+enum wal_sync {
+  wal_sync_always,   /* after every batch is written */
+  wal_sync_interval, /* at most once every interval milliseconds */
+  wal_sync_never     /* whenever the operating system decides to */
+};
+
+/* types of record in the log */
+enum wal_record {
+  wal_record_queue_new = 1, /* a queue was created */
+  wal_record_queue_free,    /* a queue was deleted */
+  wal_record_settings,      /* the type, ttl or limits of a queue changed */
+  wal_record_put,           /* an item was added to a queue */
+  wal_record_remove,        /* an item left a queue for good */
+  wal_record_consumer       /* a stream consumer moved to a new offset */
+};
+
+/* a reply waiting for the log to reach disk */
+struct wal_waiter;
+
+/* latency percentiles in microseconds. percentiles are rounded up to a power
+   of two */
+struct wal_latency {
+  unsigned long long count;
+  unsigned long long p50;
+  unsigned long long p99;
+  unsigned long long p999;
+  unsigned long long max;
+};
+
+struct wal_stats {
+  enum wal_sync sync;
+
+  /* batches, records and bytes written, and the number of times the log was
+     synced */
+  unsigned long long batches;
+  unsigned long long records;
+  unsigned long long bytes;
+  unsigned long long syncs;
+
+  /* batches that could not be written or synced */
+  unsigned long long failures;
+
+  /* time the event loop spent handing each batch to the log thread, and the
+     time from then until the batch was on disk */
+  struct wal_latency submit;
+  struct wal_latency commit;
+};
+
+/* start a new log next to the log at path. records are appended to the new
+   log, which should be filled with the current state and then swapped in with
+   wal_replace. batches are written and synced on a thread of their own, so
+   the event loop never waits for the disk. epoch is the epoch of the snapshot the log follows on from, 0
+   if there is no snapshot. returns 0 on failure */
+int wal_startup(struct event_base *base, const char *path,
+                unsigned long long epoch, enum wal_sync sync,
+                unsigned long long interval);
+
+/* write out anything still waiting, sync and close the log. nothing is
+   logged after this */
+void wal_shutdown(void);
+
+int wal_is_enabled(void);
+
+/* has everything logged so far reached disk. always true unless the always
+   sync policy is used, other policies do not promise anything is on disk */
+int wal_is_durable(void);
+
+/* call cb from the event loop once everything logged so far has reached
+   disk, or failed to. returns NULL if there is nothing to wait for or it
+   could not be waited for, in which case cb is never called */
+struct wal_waiter *wal_wait(void (*cb)(void *), void *arg);
+
+/* stop waiting, cb is not called */
+void wal_wait_cancel(struct wal_waiter *waiter);
+
+/* sync the new log and move it over the old one. returns 0 on failure */
+int wal_replace(void);
+
+/* start a branch of the log for a snapshot with the given epoch that is
+   being written in the background. the waiting batch is written out first,
+   so the snapshot holds everything logged so far, and each batch after it is
+   written to both the log and the branch. returns 0 on failure or if a
+   branch has already been started */
+int wal_branch(unsigned long long epoch);
+
+/* the snapshot was written, move the branch over the log and carry on with
+   it. returns 0 on failure, the branch is still written to */
+int wal_branch_commit(void);
+
+/* the snapshot was not written, delete the branch */
+void wal_branch_abort(void);
+
+/* start a new log following on from the snapshot with the given epoch,
+   dropping anything not yet written. the new log should be filled with the
+   current state and then swapped in with wal_replace. used when a snapshot
+   was written but its branch could not be moved over the log. returns 0 on
+   failure */
+int wal_restart(unsigned long long epoch);
+
+/* add a record of length bytes to the batch for this pass through the event
+   loop, returning where the record should be written. the batch is written in
+   one go once the current callbacks have finished. the returned memory is
+   only valid until the next call. returns NULL on failure */
+void *wal_reserve(enum wal_record type, size_t length);
+
+/* wal_reserve in the form taken by queue_log, arg is not used */
+void *wal_reserve_callback(int type, size_t length, void *arg);
+
+/* read every complete batch in the log at path, calling cb for each record.
+   a batch that was only partly written is ignored along with anything after
+   it. a log that follows on from a different snapshot epoch is skipped, the
+   snapshot was written after it and already holds its changes. a branch
+   left behind by a background snapshot is moved over the log first if the
+   snapshot was written, and deleted if it was not. returns 1 if the log does
+   not exist and 0 if it could not be read or cb returned 0 */
+int wal_replay(const char *path, unsigned long long epoch,
+               int (*cb)(enum wal_record, const void *, size_t, void *),
+               void *arg);
+
+/* convert a sync policy to and from its name. wal_sync_from_string returns 0
+   if the name is not a policy */
+int wal_sync_from_string(const char *name, enum wal_sync *sync);
+const char *wal_sync_to_string(enum wal_sync sync);
+
+void wal_get_stats(struct wal_stats *stats);
+
+#endif
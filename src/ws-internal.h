@@ -60,6 +60,9 @@ struct evws_connection {
   /* address of connected server */
   char *address;
   ev_uint16_t port;
+
+  /* data attached by the user of the connection */
+  void *data;
 };
 
 struct evws {
@@ -110,9 +113,17 @@ void evws_connection_send_(struct evws_connection *conn,
                            ev_uint8_t opcode, const ev_uint8_t *message,
                            size_t length);
 
+/* mark the connection as closed and let the server know */
+void evws_close_(struct bufferevent *bev, void *user);
+
 /* indicate to other socket that we would like to close */
 void evws_connection_send_close_(struct evws_connection *conn);
 
+/* write the header of an unmasked frame straight to the connection, returns
+   0 on failure */
+int evws_connection_frame_(struct evws_connection *conn, ev_uint8_t opcode,
+                           size_t length);
+
 /* create a new evws_connection from an evhttp_connection. this will mean that
    the socket associated with the evhttp_connection no longer supports the http
    protocol. */
@@ -307,6 +307,30 @@ void evws_connection_send_binary(struct evws_connection *conn,
   evws_connection_send_(conn, WSLAY_BINARY_FRAME, data, len);
 }
 
+void evws_connection_send_reference(struct evws_connection *conn,
+                                    const void *data, size_t len,
+                                    evbuffer_ref_cleanup_cb cleanup,
+                                    void *arg)
+{
+  struct evbuffer *output;
+
+  /* frames can only be written around wslay once it has written everything it
+     had queued, otherwise they would be interleaved */
+  if (!conn->active || wslay_event_get_close_sent(conn->wslay) ||
+      wslay_event_get_queued_msg_count(conn->wslay) != 0) {
+    evws_connection_send_(conn, WSLAY_BINARY_FRAME, data, len);
+    cleanup(data, len, arg);
+    return;
+  }
+
+  output = bufferevent_get_output(conn->buffer);
+  if (!evws_connection_frame_(conn, WSLAY_BINARY_FRAME, len) ||
+      evbuffer_add_reference(output, data, len, cleanup, arg) != 0) {
+    cleanup(data, len, arg);
+    evws_close_(NULL, conn);
+  }
+}
+
 void evws_connection_free(struct evws_connection *conn)
 {
   struct evws_message *message;
@@ -343,6 +367,16 @@ int evws_connection_is_active(struct evws_connection *conn)
   return conn->active;
 }
 
+void evws_connection_set_data(struct evws_connection *conn, void *data)
+{
+  conn->data = data;
+}
+
+void *evws_connection_get_data(struct evws_connection *conn)
+{
+  return conn->data;
+}
+
 void evws_message_free(struct evws_message *msg)
 {
   TAILQ_REMOVE(&msg->evcon->messages, msg, next);
@@ -600,6 +634,35 @@ void evws_connection_send_(struct evws_connection *conn,
   evws_connection_write_(conn);
 }
 
+int evws_connection_frame_(struct evws_connection *conn, ev_uint8_t opcode,
+                           size_t length)
+{
+  ev_uint8_t header[10];
+  size_t size;
+  size_t index;
+
+  /* a server never masks its frames, so the payload follows the header as
+     it is */
+  header[0] = 0x80/*FIN*/ | opcode;
+  if (length < 126) {
+    header[1] = (ev_uint8_t)length;
+    size = 2;
+  } else if (length <= 0xffff) {
+    header[1] = 126;
+    header[2] = (ev_uint8_t)(length >> 8);
+    header[3] = (ev_uint8_t)length;
+    size = 4;
+  } else {
+    header[1] = 127;
+    for (index = 0; index < 8; index++) {
+      header[2 + index] = (ev_uint8_t)((ev_uint64_t)length >> (56 - 8 * index));
+    }
+    size = 10;
+  }
+
+  return bufferevent_write(conn->buffer, header, size) == 0;
+}
+
 void evws_connection_send_close_(struct evws_connection *conn)
 {
   if (!conn->active) {
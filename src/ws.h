@@ -23,6 +23,7 @@
 #ifndef WS_H
 #define WS_H
 
+#include <event2/buffer.h>
 #include <event2/http.h>
 #include <wslay/wslay.h>
 
@@ -108,6 +109,21 @@ void evws_connection_send(struct evws_connection *conn, const char *text);
 void evws_connection_send_binary(struct evws_connection *conn,
                                 const unsigned char *data, size_t len);
 
+/**
+ * Send data over the websocket as a binary frame without copying it. The data
+ * is referenced by the output buffer of the connection and cleanup is called
+ * once it has been written or the connection is freed. If the frame cannot be
+ * sent by reference the data is copied and cleanup is called straight away.
+ *
+ * @param conn an evws_connection that has been established and is ready to
+ *   exchange frames
+ * @param cleanup called with data, len and arg once the data is not needed
+ */
+void evws_connection_send_reference(struct evws_connection *conn,
+                                    const void *data, size_t len,
+                                    evbuffer_ref_cleanup_cb cleanup,
+                                    void *arg);
+
 void evws_connection_free(struct evws_connection *conn);
 
 void evws_connection_get_peer(struct evws_connection *conn,
@@ -115,6 +131,13 @@ void evws_connection_get_peer(struct evws_connection *conn,
 
 int evws_connection_is_active(struct evws_connection *conn);
 
+/**
+ * Attach a pointer of the caller's own to a connection, which is NULL until
+ * it is set. The data is not touched when the connection is freed.
+ */
+void evws_connection_set_data(struct evws_connection *conn, void *data);
+void *evws_connection_get_data(struct evws_connection *conn);
+
 void evws_message_free(struct evws_message *msg);
 
 struct evws_connection *evws_message_get_connection(struct evws_message *msg);